@@ -27,6 +27,83 @@ extern "C" {
 #define FS_VERITY_HASH_ALG_SHA256       1
 #define FS_VERITY_HASH_ALG_SHA512       2
 
+/*
+ * Implementations of the hash algorithms.  LIBFSVERITY_HASH_IMPL_AUTO chooses
+ * whichever implementation is expected to be fastest.
+ * LIBFSVERITY_HASH_IMPL_AF_ALG uses the Linux kernel's crypto API, and is only
+ * available on Linux.
+ */
+#define LIBFSVERITY_HASH_IMPL_AUTO	0
+#define LIBFSVERITY_HASH_IMPL_OPENSSL	1
+#define LIBFSVERITY_HASH_IMPL_BUILTIN	2
+#define LIBFSVERITY_HASH_IMPL_AF_ALG	3
+
+/*
+ * libfsverity_pread_fn_t - callback that provides a file's data at an offset
+ * @fd: the user-provided "file descriptor" (opaque to library)
+ * @buf: buffer into which to read the chunk of the file's data
+ * @count: number of bytes to read in this chunk
+ * @offset: offset in bytes of the chunk within the file
+ *
+ * Must return 0 on success (all 'count' bytes read), or a negative errno value
+ * on failure.  When libfsverity_merkle_tree_params::num_threads is greater
+ * than 1, this may be called concurrently from multiple threads.
+ */
+typedef int (*libfsverity_pread_fn_t)(void *fd, void *buf, size_t count,
+				      uint64_t offset);
+
+/*
+ * libfsverity_splice_fn_t - callback that transfers a file's data to a pipe
+ * @fd: the user-provided "file descriptor" (opaque to library)
+ * @pipe_fd: the write end of a pipe, to which the data must be written
+ * @count: number of bytes to transfer in this chunk
+ * @offset: offset in bytes of the chunk within the file
+ *
+ * This is like libfsverity_pread_fn_t, but it writes the data to a pipe rather
+ * than to a buffer, so that the data can be passed to the kernel's crypto API
+ * without being copied into userspace, e.g. by using splice().  The pipe always
+ * has room for @count bytes.  Must return 0 on success (all 'count' bytes
+ * transferred), or a negative errno value on failure.  Like the pread_fn, this
+ * may be called concurrently from multiple threads.
+ */
+typedef int (*libfsverity_splice_fn_t)(void *fd, int pipe_fd, size_t count,
+				       uint64_t offset);
+
+/*
+ * libfsverity_zero_range_fn_t - callback that finds data known to be zero
+ * @fd: the user-provided "file descriptor" (opaque to library)
+ * @offset: offset in bytes at which to start looking
+ * @start_ret: returns the start of the first range at or after @offset that is
+ *	       known to contain only zeroes, e.g. a hole in a sparse file
+ * @end_ret: returns the end of that range
+ *
+ * If there is no such range, both *@start_ret and *@end_ret must be set to the
+ * file size.  The ranges don't need to be block-aligned, and it's fine not to
+ * report some zeroes.  Must return 0 on success, or a negative errno value on
+ * failure.  Like the pread_fn, this may be called concurrently from multiple
+ * threads.
+ */
+typedef int (*libfsverity_zero_range_fn_t)(void *fd, uint64_t offset,
+					   uint64_t *start_ret,
+					   uint64_t *end_ret);
+
+/**
+ * struct libfsverity_memo_stats - statistics of the repeated block memo
+ * @lookups: the number of blocks that were looked up in the memo.  Blocks of
+ *	     all-zero subtrees aren't looked up, as they are handled separately.
+ * @hits: the number of blocks whose hash was taken from the memo
+ * @mismatches: the number of blocks whose fingerprint matched a block in the
+ *		memo, but whose contents didn't
+ *
+ * The hit rate, @hits / @lookups, tells whether the memo is worthwhile for a
+ * given kind of file.
+ */
+struct libfsverity_memo_stats {
+	uint64_t lookups;
+	uint64_t hits;
+	uint64_t mismatches;
+};
+
 /**
  * struct libfsverity_merkle_tree_params - properties of a file's Merkle tree
  *
@@ -58,8 +135,67 @@ struct libfsverity_merkle_tree_params {
 	/** @salt: pointer to the salt, or NULL if unsalted */
 	const uint8_t *salt;
 
+	/**
+	 * @num_threads: the number of threads to use to compute the Merkle
+	 * tree, or 0 or 1 to use only the calling thread.  Values greater than
+	 * 1 require @pread_fn, except with libfsverity_compute_digest_buffer().
+	 * The result doesn't depend on the number of threads, but when using
+	 * multiple threads the @metadata_callbacks may be called from threads
+	 * other than the calling thread (though never concurrently), and the
+	 * Merkle tree blocks are reported in a different order.  Small files
+	 * are always processed using one thread.
+	 */
+	uint32_t num_threads;
+
+	/**
+	 * @hash_impl: the implementation of the hash algorithm to use, as a
+	 * LIBFSVERITY_HASH_IMPL_* value.  0 (LIBFSVERITY_HASH_IMPL_AUTO) is
+	 * recommended.  The result doesn't depend on the implementation.
+	 */
+	uint32_t hash_impl;
+
+	/**
+	 * @read_chunk_size: if nonzero, read the file's data in chunks of about
+	 * this many bytes, and hash the blocks from each chunk.  The size is
+	 * rounded down to a multiple of @block_size, but it's at least
+	 * @block_size.  1 MiB to 8 MiB works well, as it greatly reduces the
+	 * number of read_fn or pread_fn calls.  If 0, read_fn and pread_fn are
+	 * asked for at most one Merkle tree block's worth of data at a time,
+	 * like in older versions of libfsverity.
+	 */
+	uint32_t read_chunk_size;
+
+	/**
+	 * @flat_hash_algorithm: if nonzero, one of FS_VERITY_HASH_ALG_*.  Then
+	 * libfsverity_compute_digest() and libfsverity_compute_digest_buffer()
+	 * also compute a conventional hash of the file's whole contents using
+	 * this algorithm, e.g. the one that sha256sum prints, from the same
+	 * pass over the data, and write it to @flat_hash.  The data must then
+	 * be hashed in order, so libfsverity_compute_digest() uses only the
+	 * calling thread and doesn't use @splice_fn.
+	 * libfsverity_compute_digests() supports this too, but the other
+	 * functions that take merkle_tree_params don't and fail with -EINVAL.
+	 */
+	uint32_t flat_hash_algorithm;
+
+	/**
+	 * @memo_size: if nonzero, libfsverity_compute_digest() and
+	 * libfsverity_compute_digest_buffer() remember the hashes of blocks
+	 * that occur repeatedly, using at most about this many bytes of
+	 * memory, so that repeats of them don't need to be hashed again.
+	 * This helps with files that contain many copies of the same nonzero
+	 * blocks, such as firmware images or preformatted filesystem images,
+	 * but it slows down the hashing of other files somewhat.  A block is
+	 * remembered after its second occurrence, and the memo only reuses a
+	 * hash after comparing the whole block, so the result is always the
+	 * same.  With multiple threads, the memory is divided among them.
+	 * libfsverity_compute_digests() supports this too, but the other
+	 * functions that take merkle_tree_params don't and fail with -EINVAL.
+	 */
+	uint64_t memo_size;
+
 	/** @reserved1: must be 0 */
-	uint64_t reserved1[8];
+	uint64_t reserved1[5];
 
 	/**
 	 * @metadata_callbacks: if non-NULL, this gives a set of callback
@@ -71,8 +207,62 @@ struct libfsverity_merkle_tree_params {
 	 */
 	const struct libfsverity_metadata_callbacks *metadata_callbacks;
 
+	/**
+	 * @pread_fn: if non-NULL, a function that reads the file's data at a
+	 * given offset, using the same "file descriptor" as the read_fn passed
+	 * to libfsverity_compute_digest().  This is required when @num_threads
+	 * is greater than 1 or @zero_range_fn is given.  Otherwise it is used
+	 * only if read_fn is NULL.
+	 */
+	libfsverity_pread_fn_t pread_fn;
+
+	/**
+	 * @splice_fn: if non-NULL and @hash_impl is
+	 * LIBFSVERITY_HASH_IMPL_AF_ALG, a function that libfsverity uses
+	 * instead of reading the file's data, in order to pass the data to the
+	 * kernel without copying it.  It uses the same "file descriptor" as
+	 * @pread_fn.
+	 */
+	libfsverity_splice_fn_t splice_fn;
+
+	/**
+	 * @openssl_libctx: if non-NULL, the OSSL_LIB_CTX from which OpenSSL
+	 * hash implementations are fetched, e.g. to use a particular provider.
+	 * This makes LIBFSVERITY_HASH_IMPL_AUTO always choose OpenSSL.  This
+	 * requires OpenSSL 3.0 or later; otherwise libfsverity_compute_digest()
+	 * fails with -EOPNOTSUPP.  The context must stay valid until
+	 * libfsverity_compute_digest() returns.
+	 */
+	void *openssl_libctx;
+
+	/**
+	 * @zero_range_fn: if non-NULL, a function that tells libfsverity which
+	 * parts of the file are known to be zero, e.g. the holes of a sparse
+	 * file.  Those parts aren't read, and their Merkle tree blocks are
+	 * filled in from precomputed hashes, so that the cost of computing the
+	 * digest depends on the amount of nonzero data rather than on the file
+	 * size (unless @metadata_callbacks are given, as all the tree blocks
+	 * must still be reported).  This requires @pread_fn, which is then
+	 * used instead of read_fn.  It uses the same "file descriptor" as
+	 * @pread_fn.  libfsverity_compute_digest_buffer() ignores it.
+	 */
+	libfsverity_zero_range_fn_t zero_range_fn;
+
+	/**
+	 * @flat_hash: if @flat_hash_algorithm is nonzero, the buffer to which
+	 * the flat hash is written.  It must have room for the digest size of
+	 * @flat_hash_algorithm, as given by libfsverity_get_digest_size().
+	 */
+	uint8_t *flat_hash;
+
+	/**
+	 * @memo_stats: if non-NULL and @memo_size is nonzero, the statistics
+	 * of the memo are added to this
+	 */
+	struct libfsverity_memo_stats *memo_stats;
+
 	/** @reserved2: must be 0 */
-	uintptr_t reserved2[7];
+	uintptr_t reserved2[1];
 };
 
 struct libfsverity_digest {
@@ -168,15 +358,17 @@ typedef int (*libfsverity_read_fn_t)(void *fd, void *buf, size_t count);
  *          A fs-verity file digest is the hash of a file's fsverity_descriptor.
  *          Not to be confused with a traditional file digest computed over the
  *          entire file, or with the bare fsverity_descriptor::root_hash.
- * @fd: context that will be passed to @read_fn
- * @read_fn: a function that will read the data of the file
+ * @fd: context that will be passed to @read_fn or @params->pread_fn
+ * @read_fn: a function that will read the data of the file sequentially.  This
+ *	     may be NULL if @params->pread_fn is given.
  * @params: Pointer to the Merkle tree parameters
  * @digest_ret: Pointer to pointer for computed digest.
  *
  * Returns:
  * * 0 for success, -EINVAL for invalid input arguments, -ENOMEM if libfsverity
- *   failed to allocate memory, or an error returned by @read_fn or by one of
- *   the @params->metadata_callbacks.
+ *   failed to allocate memory, -EOPNOTSUPP if @params->hash_impl isn't
+ *   available, or an error returned by @read_fn or by one of the
+ *   @params->metadata_callbacks.
  * * digest_ret returns a pointer to the digest on success. The digest object
  *   is allocated by libfsverity and must be freed by the caller using free().
  */
@@ -185,6 +377,515 @@ libfsverity_compute_digest(void *fd, libfsverity_read_fn_t read_fn,
 			   const struct libfsverity_merkle_tree_params *params,
 			   struct libfsverity_digest **digest_ret);
 
+/**
+ * libfsverity_compute_digest_buffer() - Compute digest of in-memory file data
+ * @data: the file's data, @params->file_size bytes long.  This may be NULL if
+ *	  the file is empty.
+ * @params: Pointer to the Merkle tree parameters
+ * @digest_ret: Pointer to pointer for computed digest.
+ *
+ * Like libfsverity_compute_digest(), but for a file whose data is already in
+ * memory, e.g. because it was mmap()ed.  The data blocks are hashed directly
+ * from @data rather than being copied first.  @params->pread_fn and
+ * @params->splice_fn are ignored, and @params->num_threads doesn't require
+ * @params->pread_fn.
+ *
+ * Returns: See libfsverity_compute_digest().
+ */
+int
+libfsverity_compute_digest_buffer(const void *data,
+				  const struct libfsverity_merkle_tree_params *params,
+				  struct libfsverity_digest **digest_ret);
+
+/**
+ * struct libfsverity_range - A range of bytes within a file
+ * @offset: offset of the first byte of the range
+ * @length: length of the range in bytes
+ */
+struct libfsverity_range {
+	uint64_t offset;
+	uint64_t length;
+};
+
+/**
+ * libfsverity_update_merkle_tree() - Update a Merkle tree after data changed
+ * @fd: context that will be passed to @params->pread_fn
+ * @params: Pointer to the Merkle tree parameters.  @params->pread_fn is
+ *	    required.  @params->num_threads, read_chunk_size, splice_fn, and
+ *	    zero_range_fn are ignored.
+ * @changed: the ranges of the file's data that were overwritten since @tree
+ *	     was computed.  They may be in any order and may overlap.
+ * @num_changed: number of entries in @changed
+ * @tree: the file's Merkle tree from before the data was overwritten, in the
+ *	  format in which @params->metadata_callbacks->merkle_tree_block
+ *	  reports it (which is also the format FS_IOC_READ_VERITY_METADATA
+ *	  uses).  It is updated in place.
+ * @tree_size: size of @tree in bytes
+ * @digest_ret: Pointer to pointer for computed digest.
+ *
+ * Bring the Merkle tree of a file up to date after some of the file's data was
+ * overwritten, and compute the file's new digest.  Only the changed data blocks
+ * and the tree blocks above them are rehashed, so the cost is proportional to
+ * the amount of changed data times the height of the tree rather than to the
+ * file size.  The file size must not have changed, and the parts of @tree that
+ * cover unchanged data are assumed to be correct.
+ *
+ * If @params->metadata_callbacks is given, ->merkle_tree_size is called with
+ * @tree_size, ->merkle_tree_block is called for each block of @tree that was
+ * rewritten, and ->descriptor is called with the new fs-verity descriptor.
+ *
+ * Return: 0 on success, -EINVAL for invalid arguments (including a @tree_size
+ *	   that doesn't match @params->file_size and a range that extends beyond
+ *	   the end of the file), -ENOMEM if out of memory, -EOPNOTSUPP if
+ *	   @params->hash_impl isn't available, or an error returned by
+ *	   @params->pread_fn or by one of the @params->metadata_callbacks.  On
+ *	   success, *@digest_ret must be freed using free().
+ */
+int
+libfsverity_update_merkle_tree(void *fd,
+			       const struct libfsverity_merkle_tree_params *params,
+			       const struct libfsverity_range *changed,
+			       size_t num_changed,
+			       uint8_t *tree, size_t tree_size,
+			       struct libfsverity_digest **digest_ret);
+
+struct libfsverity_partial_tree;
+
+/**
+ * libfsverity_partial_tree_new() - Start computing the digest of a growing file
+ * @params: Pointer to the Merkle tree parameters.  Only @params->version,
+ *	    hash_algorithm, block_size, salt_size, salt, hash_impl, and
+ *	    openssl_libctx are used.
+ * @ptree_ret: Pointer to pointer for the new partial tree
+ *
+ * Create the partial Merkle tree of an empty file, for computing the digests of
+ * a file that only ever grows by having data appended to it.  Append the data
+ * with libfsverity_partial_tree_append(), and get the digest of the data so far
+ * with libfsverity_partial_tree_digest() whenever it's needed.  The partial
+ * tree only holds the blocks of each tree level that are still incomplete, so
+ * the cost of keeping the digest up to date is proportional to the amount of
+ * data appended rather than to the file size.  It can be saved with
+ * libfsverity_partial_tree_save() and loaded again by a later process.
+ *
+ * Return: 0 on success, -EINVAL for invalid arguments, -ENOMEM if out of
+ *	   memory, or -EOPNOTSUPP if @params->hash_impl isn't available.
+ */
+int
+libfsverity_partial_tree_new(const struct libfsverity_merkle_tree_params *params,
+			     struct libfsverity_partial_tree **ptree_ret);
+
+/**
+ * libfsverity_partial_tree_append() - Append data to a partial tree
+ * @ptree: the partial tree
+ * @data: the data that was appended to the file
+ * @size: size of @data in bytes.  It needn't be a multiple of the block size.
+ *
+ * If this fails, @ptree can only be freed.
+ *
+ * Return: 0 on success, -EINVAL for invalid arguments, -ENOMEM if out of
+ *	   memory, or -EFBIG if the file became too large.
+ */
+int libfsverity_partial_tree_append(struct libfsverity_partial_tree *ptree,
+				    const void *data, size_t size);
+
+/**
+ * libfsverity_partial_tree_data_size() - Get the amount of data in a partial tree
+ * @ptree: the partial tree, or NULL
+ *
+ * Return: the total size of the data that has been appended, i.e. the file
+ *	   size that libfsverity_partial_tree_digest() computes the digest for,
+ *	   or 0 if @ptree is NULL
+ */
+uint64_t
+libfsverity_partial_tree_data_size(const struct libfsverity_partial_tree *ptree);
+
+/**
+ * libfsverity_partial_tree_digest() - Compute the digest of a partial tree's data
+ * @ptree: the partial tree
+ * @digest_ret: Pointer to pointer for computed digest
+ *
+ * Compute the digest of the file as of the data appended so far, i.e. the same
+ * digest that libfsverity_compute_digest() would compute for it.  @ptree isn't
+ * changed, so more data can be appended afterwards.
+ *
+ * Return: 0 on success, -EINVAL for invalid arguments, or -ENOMEM if out of
+ *	   memory.  On success, *@digest_ret must be freed using free().
+ */
+int libfsverity_partial_tree_digest(struct libfsverity_partial_tree *ptree,
+				    struct libfsverity_digest **digest_ret);
+
+/**
+ * libfsverity_partial_tree_save() - Serialize a partial tree
+ * @ptree: the partial tree
+ * @state_ret: Pointer to pointer for the saved state, which must be freed
+ *	       using free()
+ * @state_size_ret: Pointer to the size of the saved state in bytes
+ *
+ * The saved state is at most a few blocks per tree level.  It includes a hash
+ * of itself, so that libfsverity_partial_tree_load() can detect corruption.
+ *
+ * Return: 0 on success, -EINVAL for invalid arguments, or -ENOMEM if out of
+ *	   memory.
+ */
+int libfsverity_partial_tree_save(struct libfsverity_partial_tree *ptree,
+				  uint8_t **state_ret, size_t *state_size_ret);
+
+/**
+ * libfsverity_partial_tree_load() - Load a partial tree saved earlier
+ * @params: Pointer to the Merkle tree parameters, which must be the same as the
+ *	    ones the partial tree was created with, except that
+ *	    @params->hash_impl and openssl_libctx may differ
+ * @state: the state from libfsverity_partial_tree_save()
+ * @state_size: size of @state in bytes
+ * @ptree_ret: Pointer to pointer for the loaded partial tree
+ *
+ * Return: 0 on success, -EINVAL for invalid arguments (including parameters
+ *	   that don't match the saved state), -EBADMSG if @state is invalid or
+ *	   corrupt, -ENOMEM if out of memory, or -EOPNOTSUPP if
+ *	   @params->hash_impl isn't available.
+ */
+int
+libfsverity_partial_tree_load(const struct libfsverity_merkle_tree_params *params,
+			      const uint8_t *state, size_t state_size,
+			      struct libfsverity_partial_tree **ptree_ret);
+
+/**
+ * libfsverity_partial_tree_free() - Free a partial tree
+ * @ptree: the partial tree to free, or NULL
+ */
+void libfsverity_partial_tree_free(struct libfsverity_partial_tree *ptree);
+
+struct libfsverity_digest_ctx;
+
+/*
+ * A value of libfsverity_merkle_tree_params::file_size that tells
+ * libfsverity_digest_ctx_new() that the size of the data isn't known in advance
+ */
+#define LIBFSVERITY_FILE_SIZE_UNKNOWN	UINT64_MAX
+
+/**
+ * libfsverity_digest_ctx_new() - Start computing a digest from pushed data
+ * @params: Pointer to the Merkle tree parameters.  @params->file_size must be
+ *	    the total size of the data that will be given, or
+ *	    LIBFSVERITY_FILE_SIZE_UNKNOWN.  @params->pread_fn, splice_fn,
+ *	    zero_range_fn, read_chunk_size, and num_threads are ignored.
+ * @ctx_ret: Pointer to pointer for the new digest context
+ *
+ * Like libfsverity_compute_digest(), but rather than the library pulling the
+ * file's data through a read function, the caller pushes the data using
+ * libfsverity_digest_ctx_update() as it becomes available, then gets the digest
+ * using libfsverity_digest_ctx_final().  This lets a program that generates the
+ * data compute its digest inline.  @params->metadata_callbacks are supported;
+ * ->merkle_tree_size is called by this function, ->merkle_tree_block as the
+ * tree blocks are completed, and ->descriptor by
+ * libfsverity_digest_ctx_final(), so they must stay valid until then.
+ *
+ * If @params->file_size is LIBFSVERITY_FILE_SIZE_UNKNOWN, e.g. because the data
+ * is coming from a pipe, the data size is however much data was given when
+ * libfsverity_digest_ctx_final() is called.  The shape of the Merkle tree
+ * isn't known until then, so all the metadata callbacks are called by
+ * libfsverity_digest_ctx_final(), and if ->merkle_tree_block is given, the
+ * tree blocks (but not the data) are kept in memory until then.
+ *
+ * Return: 0 on success, -EINVAL for invalid arguments, -ENOMEM if out of
+ *	   memory, -EOPNOTSUPP if @params->hash_impl isn't available, or an
+ *	   error returned by @params->metadata_callbacks->merkle_tree_size.
+ */
+int
+libfsverity_digest_ctx_new(const struct libfsverity_merkle_tree_params *params,
+			   struct libfsverity_digest_ctx **ctx_ret);
+
+/**
+ * libfsverity_digest_ctx_update() - Give more of the data to a digest context
+ * @ctx: the digest context
+ * @data: the next part of the file's data
+ * @size: size of @data in bytes.  It needn't be a multiple of the block size,
+ *	  but in total, no more than @params->file_size bytes may be given
+ *	  unless the size is LIBFSVERITY_FILE_SIZE_UNKNOWN.
+ *
+ * If this fails, @ctx can only be freed.
+ *
+ * Return: 0 on success, -EINVAL for invalid arguments, -ENOMEM if out of
+ *	   memory, -EFBIG if the data became too large for the Merkle tree, or
+ *	   an error returned by @params->metadata_callbacks->merkle_tree_block.
+ */
+int libfsverity_digest_ctx_update(struct libfsverity_digest_ctx *ctx,
+				  const void *data, size_t size);
+
+/**
+ * libfsverity_digest_ctx_final() - Finish computing a digest from pushed data
+ * @ctx: the digest context, to which exactly @params->file_size bytes of data
+ *	 must have been given, unless it was LIBFSVERITY_FILE_SIZE_UNKNOWN
+ * @digest_ret: Pointer to pointer for computed digest
+ *
+ * After this, @ctx can only be freed.
+ *
+ * Return: 0 on success, -EINVAL for invalid arguments, -ENOMEM if out of
+ *	   memory, or an error returned by one of the
+ *	   @params->metadata_callbacks.  On success, *@digest_ret must be freed
+ *	   using free().
+ */
+int libfsverity_digest_ctx_final(struct libfsverity_digest_ctx *ctx,
+				 struct libfsverity_digest **digest_ret);
+
+/**
+ * libfsverity_digest_ctx_free() - Free a digest context
+ * @ctx: the digest context to free, or NULL
+ */
+void libfsverity_digest_ctx_free(struct libfsverity_digest_ctx *ctx);
+
+/**
+ * libfsverity_compute_digest_multi() - Compute a file's digests for several parameter sets
+ * @fd: context that will be passed to @read_fn or @params[0].pread_fn
+ * @read_fn: a function that will read the data of the file sequentially.  This
+ *	     may be NULL if @params[0].pread_fn is given, in which case that is
+ *	     used to read the file sequentially.
+ * @params: array of @num_params Merkle tree parameter sets, e.g. for different
+ *	    hash algorithms or block sizes.  They must all have the same
+ *	    file_size.  num_threads, zero_range_fn, and splice_fn are ignored,
+ *	    as is pread_fn in all but the first set.  read_chunk_size in the
+ *	    first set gives the size of the reads, with a default of 256 KiB.
+ * @num_params: the number of parameter sets
+ * @digests: array of @num_params pointers which on success are set to the
+ *	     file's digest for each parameter set.  Each must be freed using
+ *	     free().
+ *
+ * This gives the same results as calling libfsverity_compute_digest() once for
+ * each parameter set, but reads the file only once: each chunk of data that is
+ * read is passed to a separate tree builder for each parameter set.  So the
+ * I/O cost is the same no matter how many digests are computed.  The metadata
+ * callbacks of each parameter set are supported.
+ *
+ * Return: 0 on success, -EINVAL for invalid arguments, -ENOMEM if out of
+ *	   memory, or an error returned by @read_fn, @params[0].pread_fn, or
+ *	   one of the metadata callbacks
+ */
+int
+libfsverity_compute_digest_multi(void *fd, libfsverity_read_fn_t read_fn,
+				 const struct libfsverity_merkle_tree_params *params,
+				 size_t num_params,
+				 struct libfsverity_digest **digests);
+
+struct libfsverity_hasher;
+
+/**
+ * libfsverity_hasher_new() - Create a context for digesting many files
+ * @params: Pointer to the Merkle tree parameters to use for every file.
+ *	    @params->file_size, num_threads, and zero_range_fn are ignored.
+ * @hasher_ret: Pointer to pointer for the new hasher
+ *
+ * Computing a digest with libfsverity_compute_digest() involves setting up a
+ * hash context and allocating buffers, which dominates the time taken for small
+ * files.  A hasher does that just once, then computes the digests of any number
+ * of files with libfsverity_hasher_digest() or
+ * libfsverity_hasher_digest_buffer().  Once its buffers have grown large enough
+ * for the largest file, these don't allocate any memory.  A file that is no
+ * larger than one block takes a faster path that hashes just its one block.
+ *
+ * A hasher may only be used by one thread at a time.  If
+ * @params->metadata_callbacks is given, it is used for every file.
+ *
+ * Return: 0 on success, -EINVAL for invalid arguments, -ENOMEM if out of
+ *	   memory, or -EOPNOTSUPP if @params->hash_impl isn't available.
+ */
+int
+libfsverity_hasher_new(const struct libfsverity_merkle_tree_params *params,
+		       struct libfsverity_hasher **hasher_ret);
+
+/**
+ * libfsverity_hasher_digest() - Compute a file's digest using a hasher
+ * @hasher: the hasher
+ * @fd: context that will be passed to @read_fn or the hasher's pread_fn
+ * @read_fn: a function that will read the data of the file sequentially.  This
+ *	     may be NULL if the hasher was created with a pread_fn.
+ * @file_size: the size of the file in bytes
+ * @digest: buffer for the file's fs-verity digest, with room for
+ *	    libfsverity_get_digest_size() bytes for the hasher's hash algorithm
+ *
+ * If this fails, the hasher can still be used for other files, except after a
+ * failure to splice data to LIBFSVERITY_HASH_IMPL_AF_ALG.
+ *
+ * Return: 0 on success, -EINVAL for invalid arguments, -ENOMEM if out of
+ *	   memory, or an error returned by @read_fn, the hasher's pread_fn, or
+ *	   one of the hasher's metadata callbacks.
+ */
+int libfsverity_hasher_digest(struct libfsverity_hasher *hasher,
+			      void *fd, libfsverity_read_fn_t read_fn,
+			      uint64_t file_size, uint8_t *digest);
+
+/**
+ * libfsverity_hasher_digest_buffer() - Compute the digest of in-memory file data
+ * @hasher: the hasher
+ * @data: the file's data, @file_size bytes long.  This may be NULL if the file
+ *	  is empty.
+ * @file_size: the size of the file in bytes
+ * @digest: buffer for the file's fs-verity digest, as for
+ *	    libfsverity_hasher_digest()
+ *
+ * Return: See libfsverity_hasher_digest().
+ */
+int libfsverity_hasher_digest_buffer(struct libfsverity_hasher *hasher,
+				     const void *data, uint64_t file_size,
+				     uint8_t *digest);
+
+/**
+ * libfsverity_hasher_digest_buffers() - Compute the digests of many small files
+ * @hasher: the hasher
+ * @data: the data of each file.  An entry may be NULL if the file is empty.
+ * @file_sizes: the size of each file in bytes
+ * @num_files: the number of files
+ * @digests: buffer for the files' fs-verity digests, with room for @num_files
+ *	     times libfsverity_get_digest_size() bytes for the hasher's hash
+ *	     algorithm.  The digests are stored one after another.
+ *
+ * This gives the same results as calling libfsverity_hasher_digest_buffer() on
+ * each file, but is faster for small files.  Files whose Merkle tree has at most
+ * one level (for example files of at most 512 KiB, with SHA-256 and 4096-byte
+ * blocks) are processed in groups: the data blocks of all the files in a group
+ * are hashed together, then their Merkle tree blocks, then their descriptors.
+ * That way the multi-buffer implementation of the hash algorithm, which hashes
+ * several blocks at once, gets used even when each file is only a block or two
+ * long.  Larger files are processed one at a time, as are all files if the
+ * hasher has metadata callbacks.
+ *
+ * Return: 0 on success, -EINVAL for invalid arguments, -ENOMEM if out of
+ *	   memory, or an error returned by one of the hasher's metadata
+ *	   callbacks.  On failure, some of the digests may not have been computed.
+ */
+int libfsverity_hasher_digest_buffers(struct libfsverity_hasher *hasher,
+				      const void *const data[],
+				      const uint64_t file_sizes[],
+				      size_t num_files, uint8_t *digests);
+
+/**
+ * libfsverity_hasher_free() - Free a hasher
+ * @hasher: the hasher to free, or NULL
+ */
+void libfsverity_hasher_free(struct libfsverity_hasher *hasher);
+
+/**
+ * struct libfsverity_digest_job - a job for libfsverity_compute_digests()
+ */
+struct libfsverity_digest_job {
+	/**
+	 * @fd: context that will be passed to @read_fn or
+	 * @params->pread_fn
+	 */
+	void *fd;
+
+	/**
+	 * @read_fn: a function that will read the data of the file
+	 * sequentially.  This may be NULL if @params->pread_fn is given.
+	 */
+	libfsverity_read_fn_t read_fn;
+
+	/**
+	 * @params: the Merkle tree parameters for the file.  Jobs may use
+	 * different parameters.  @params->num_threads is ignored.
+	 */
+	const struct libfsverity_merkle_tree_params *params;
+
+	/**
+	 * @digest: set to the file's digest on success, which must be freed
+	 * using free(); otherwise NULL
+	 */
+	struct libfsverity_digest *digest;
+
+	/**
+	 * @err: set to 0 on success, otherwise to the error that
+	 * libfsverity_compute_digest() would have returned for the file
+	 */
+	int err;
+};
+
+/**
+ * libfsverity_compute_digests() - Compute the digests of many files
+ * @jobs: the files whose digests to compute
+ * @num_jobs: the number of files
+ * @num_workers: the number of threads to use, including the calling thread, or
+ *		 0 to use only the calling thread
+ *
+ * This gives the same results as calling libfsverity_compute_digest() on each
+ * file, but the files are processed concurrently by a pool of worker threads.
+ * Each worker has its own queue of jobs, and a worker that runs out of work
+ * steals jobs from the others, so that a few large files don't hold up the
+ * rest.  A file of at least 16 MiB whose @params->pread_fn is given is split
+ * into parts that each cover a whole subtree of the Merkle tree, and those are
+ * processed concurrently too.  Workers also reuse their hash contexts and
+ * buffers from one file to the next when the files' parameters allow it.  A
+ * job that sets @params->memo_size or @params->flat_hash_algorithm is never
+ * split, and its worker computes it just like libfsverity_compute_digest()
+ * with @params->num_threads set to 1.
+ *
+ * The callbacks given for different jobs may be called concurrently, including
+ * @params->pread_fn for different parts of the same file.  The metadata
+ * callbacks of any one job are never called concurrently, but for a file that
+ * is split, its Merkle tree blocks are reported in a different order.
+ *
+ * Return: 0 if the jobs were run, with the result of each job in its @err and
+ *	   @digest fields; -EINVAL if @jobs is NULL; or -ENOMEM if out of memory
+ *	   before any jobs were run.
+ */
+int libfsverity_compute_digests(struct libfsverity_digest_job *jobs,
+				size_t num_jobs, uint32_t num_workers);
+
+struct libfsverity_async_reader;
+
+/**
+ * libfsverity_async_reader_new() - Start reading a file asynchronously
+ * @fd: file descriptor to read from.  It must stay open until the reader is
+ *	freed, but it isn't closed by libfsverity.
+ * @file_size: number of bytes to read, starting at offset 0
+ * @queue_depth: maximum number of reads to keep in flight, or 0 for a default.
+ *		 The maximum is 256.
+ * @buffer_size: size of each read in bytes, or 0 for a default.  This is
+ *		 rounded up to a multiple of 4096.  The maximum is 64 MiB.
+ * @reader_ret: Pointer to pointer for the new reader
+ *
+ * Create a reader that reads the file sequentially, keeping up to @queue_depth
+ * reads ahead of its user so that the I/O overlaps with hashing.  On Linux this
+ * uses io_uring; if io_uring isn't available, the reader falls back to plain
+ * synchronous reads.  To compute a digest with it, pass the reader as the @fd
+ * and libfsverity_async_read() as the @read_fn of libfsverity_compute_digest().
+ *
+ * Return: 0 on success, -EINVAL for invalid arguments, -ENOMEM if out of
+ *	   memory, or -EOPNOTSUPP on platforms that don't support this.
+ */
+int
+libfsverity_async_reader_new(int fd, uint64_t file_size, uint32_t queue_depth,
+			     uint32_t buffer_size,
+			     struct libfsverity_async_reader **reader_ret);
+
+/**
+ * libfsverity_async_read() - Read the next data from an asynchronous reader
+ * @reader: a struct libfsverity_async_reader
+ * @buf: buffer into which to read the next chunk of the file's data
+ * @count: number of bytes to read in this chunk
+ *
+ * This matches libfsverity_read_fn_t.
+ *
+ * Return: 0 on success, or a negative errno value on failure.
+ */
+int libfsverity_async_read(void *reader, void *buf, size_t count);
+
+/**
+ * libfsverity_async_reader_is_async() - Check whether a reader uses io_uring
+ * @reader: the reader
+ *
+ * Return: 1 if @reader reads asynchronously, or 0 if it fell back to
+ *	   synchronous reads.
+ */
+int libfsverity_async_reader_is_async(
+		const struct libfsverity_async_reader *reader);
+
+/**
+ * libfsverity_async_reader_free() - Free an asynchronous reader
+ * @reader: the reader to free, or NULL
+ *
+ * Any reads still in flight are waited for first.
+ */
+void libfsverity_async_reader_free(struct libfsverity_async_reader *reader);
+
 /**
  * libfsverity_sign_digest() - Sign a file for built-in signature verification
  *	    Sign a file digest in a way that is compatible with the Linux
@@ -271,6 +972,42 @@ int libfsverity_get_digest_size(uint32_t alg_num);
  */
 const char *libfsverity_get_hash_name(uint32_t alg_num);
 
+/**
+ * libfsverity_find_hash_impl_by_name() - Find hash implementation by name
+ * @name: Pointer to name of hash implementation, e.g. "openssl"
+ *
+ * Return: The hash implementation number (one of LIBFSVERITY_HASH_IMPL_*), or
+ *	   -1 if not found.
+ */
+int libfsverity_find_hash_impl_by_name(const char *name);
+
+/**
+ * libfsverity_get_hash_impl_name() - Get name of hash implementation by number
+ * @impl: Number of hash implementation
+ *
+ * Return: The name of the hash implementation, or NULL if it is unknown.
+ */
+const char *libfsverity_get_hash_impl_name(uint32_t impl);
+
+/**
+ * libfsverity_benchmark_hash_impl() - Measure the speed of a hash implementation
+ * @alg_num: Number of hash algorithm
+ * @impl: Number of hash implementation
+ * @block_size: Merkle tree block size whose hashing should be measured
+ * @bytes_per_sec_ret: Pointer to the measured speed in bytes per second
+ *
+ * Repeatedly hash in-memory data the same way that libfsverity_compute_digest()
+ * hashes data blocks, and measure how fast that is.  This takes about 0.1
+ * seconds.  It can be used to choose the best hash implementation for the
+ * system.
+ *
+ * Return: 0 on success, -EINVAL for invalid arguments, -EOPNOTSUPP if the hash
+ *	   implementation isn't available, or another negative errno value.
+ */
+int libfsverity_benchmark_hash_impl(uint32_t alg_num, uint32_t impl,
+				    uint32_t block_size,
+				    uint64_t *bytes_per_sec_ret);
+
 /**
  * libfsverity_set_error_callback() - Set callback to handle error messages
  * @cb: the callback function.
@@ -0,0 +1,508 @@
+// SPDX-License-Identifier: MIT
+/*
+ * Implementation of libfsverity_async_reader, which reads a file sequentially
+ * ahead of its user, using io_uring when possible.
+ *
+ * Copyright 2026 Google LLC
+ *
+ * Use of this source code is governed by an MIT-style
+ * license that can be found in the LICENSE file or at
+ * https://opensource.org/licenses/MIT.
+ */
+
+#include "lib_private.h"
+
+#include <stdlib.h>
+#include <string.h>
+
+#ifdef _WIN32
+
+LIBEXPORT int
+libfsverity_async_reader_new(int fd __attribute__((unused)),
+			     u64 file_size __attribute__((unused)),
+			     u32 queue_depth __attribute__((unused)),
+			     u32 buffer_size __attribute__((unused)),
+			     struct libfsverity_async_reader **reader_ret
+				__attribute__((unused)))
+{
+	libfsverity_error_msg("asynchronous reads are unsupported on Windows");
+	return -EOPNOTSUPP;
+}
+
+LIBEXPORT int
+libfsverity_async_read(void *reader __attribute__((unused)),
+		       void *buf __attribute__((unused)),
+		       size_t count __attribute__((unused)))
+{
+	return -EOPNOTSUPP;
+}
+
+LIBEXPORT int
+libfsverity_async_reader_is_async(
+		const struct libfsverity_async_reader *r __attribute__((unused)))
+{
+	return 0;
+}
+
+LIBEXPORT void
+libfsverity_async_reader_free(
+		struct libfsverity_async_reader *r __attribute__((unused)))
+{
+}
+
+#else /* _WIN32 */
+
+#include <unistd.h>
+#ifdef __linux__
+#  include <linux/io_uring.h>
+#  include <sys/mman.h>
+#  include <sys/syscall.h>
+#  include <sys/uio.h>
+#  ifdef __NR_io_uring_setup
+#    define HAVE_IO_URING 1
+#  endif
+#endif
+
+#define ASYNC_READ_DEFAULT_QUEUE_DEPTH	8
+#define ASYNC_READ_MAX_QUEUE_DEPTH	256
+#define ASYNC_READ_DEFAULT_BUFFER_SIZE	(512 * 1024)
+#define ASYNC_READ_MAX_BUFFER_SIZE	(64 * 1024 * 1024)
+
+/*
+ * The buffers are aligned and sized to this, so that they also work for files
+ * opened with O_DIRECT.
+ */
+#define ASYNC_READ_ALIGNMENT		4096
+
+/*
+ * A buffer and the read into it.  Slot i is used for reads i, i + queue_depth,
+ * i + 2 * queue_depth, etc., so the data is consumed from the slots in order.
+ */
+struct async_read_slot {
+	u8 *buf;
+#ifdef HAVE_IO_URING
+	struct iovec iov;	/* for IORING_OP_READV */
+#endif
+	u64 offset;		/* file offset of buf[0] */
+	u32 len;		/* bytes requested, or 0 if the slot is unused */
+	u32 filled;		/* bytes read so far */
+	bool in_flight;
+	bool eof;		/* the file ended before len bytes were read */
+	int err;		/* error reading into this slot, if any */
+};
+
+struct libfsverity_async_reader {
+	int fd;
+	u64 file_size;
+	u64 pos;		/* offset of the next byte to return */
+	u64 next_offset;	/* offset of the next read to start */
+	u32 queue_depth;
+	u32 buffer_size;
+	u8 *buffers;
+	struct async_read_slot *slots;
+	u32 head;		/* index of the slot that contains pos */
+
+	/* io_uring state; ring_fd is -1 when reading synchronously */
+	int ring_fd;
+#ifdef HAVE_IO_URING
+	bool fixed_buffers;	/* buffers were registered with the ring */
+	void *sq_ring;
+	size_t sq_ring_size;
+	void *cq_ring;
+	size_t cq_ring_size;
+	struct io_uring_sqe *sqes;
+	size_t sqes_size;
+	u32 *sq_tail;
+	u32 sq_mask;
+	u32 *sq_array;
+	u32 *cq_head;
+	u32 *cq_tail;
+	u32 cq_mask;
+	struct io_uring_cqe *cqes;
+#endif
+};
+
+#ifdef HAVE_IO_URING
+
+static int io_uring_setup(u32 entries, struct io_uring_params *p)
+{
+	return syscall(__NR_io_uring_setup, entries, p);
+}
+
+static int io_uring_enter(int ring_fd, u32 to_submit, u32 min_complete,
+			  u32 flags)
+{
+	int ret;
+
+	do {
+		ret = syscall(__NR_io_uring_enter, ring_fd, to_submit,
+			      min_complete, flags, NULL, 0);
+	} while (ret < 0 && errno == EINTR);
+	return ret;
+}
+
+static int io_uring_register(int ring_fd, u32 opcode, const void *arg,
+			     u32 nr_args)
+{
+	return syscall(__NR_io_uring_register, ring_fd, opcode, arg, nr_args);
+}
+
+/*
+ * Set up the io_uring.  On failure, the caller falls back to synchronous reads,
+ * so this just returns false.
+ */
+static bool setup_io_uring(struct libfsverity_async_reader *r)
+{
+	struct io_uring_params p = {};
+	struct iovec *iovs;
+	u32 i;
+	int ret;
+
+	r->ring_fd = io_uring_setup(r->queue_depth, &p);
+	if (r->ring_fd < 0)
+		return false;
+
+	r->sq_ring_size = p.sq_off.array + p.sq_entries * sizeof(u32);
+	r->cq_ring_size = p.cq_off.cqes +
+			  p.cq_entries * sizeof(struct io_uring_cqe);
+#ifdef IORING_FEAT_SINGLE_MMAP
+	if (p.features & IORING_FEAT_SINGLE_MMAP) {
+		r->sq_ring_size = max(r->sq_ring_size, r->cq_ring_size);
+		r->cq_ring_size = 0;
+	}
+#endif
+	r->sq_ring = mmap(NULL, r->sq_ring_size, PROT_READ | PROT_WRITE,
+			  MAP_SHARED | MAP_POPULATE, r->ring_fd,
+			  IORING_OFF_SQ_RING);
+	if (r->sq_ring == MAP_FAILED) {
+		r->sq_ring = NULL;
+		return false;
+	}
+	if (r->cq_ring_size) {
+		r->cq_ring = mmap(NULL, r->cq_ring_size, PROT_READ | PROT_WRITE,
+				  MAP_SHARED | MAP_POPULATE, r->ring_fd,
+				  IORING_OFF_CQ_RING);
+		if (r->cq_ring == MAP_FAILED) {
+			r->cq_ring = NULL;
+			return false;
+		}
+	} else {
+		r->cq_ring = r->sq_ring;
+	}
+	r->sqes_size = p.sq_entries * sizeof(struct io_uring_sqe);
+	r->sqes = mmap(NULL, r->sqes_size, PROT_READ | PROT_WRITE,
+		       MAP_SHARED | MAP_POPULATE, r->ring_fd, IORING_OFF_SQES);
+	if (r->sqes == MAP_FAILED) {
+		r->sqes = NULL;
+		return false;
+	}
+
+	r->sq_tail = (void *)((u8 *)r->sq_ring + p.sq_off.tail);
+	r->sq_mask = *(u32 *)((u8 *)r->sq_ring + p.sq_off.ring_mask);
+	r->sq_array = (void *)((u8 *)r->sq_ring + p.sq_off.array);
+	r->cq_head = (void *)((u8 *)r->cq_ring + p.cq_off.head);
+	r->cq_tail = (void *)((u8 *)r->cq_ring + p.cq_off.tail);
+	r->cq_mask = *(u32 *)((u8 *)r->cq_ring + p.cq_off.ring_mask);
+	r->cqes = (void *)((u8 *)r->cq_ring + p.cq_off.cqes);
+
+	/*
+	 * Registering the buffers saves mapping them for every read.  It can
+	 * fail, e.g. due to RLIMIT_MEMLOCK, in which case use normal reads.
+	 */
+	iovs = libfsverity_zalloc(r->queue_depth * sizeof(*iovs));
+	if (!iovs)
+		return false;
+	for (i = 0; i < r->queue_depth; i++) {
+		iovs[i].iov_base = r->slots[i].buf;
+		iovs[i].iov_len = r->buffer_size;
+	}
+	ret = io_uring_register(r->ring_fd, IORING_REGISTER_BUFFERS, iovs,
+				r->queue_depth);
+	r->fixed_buffers = (ret == 0);
+	free(iovs);
+	return true;
+}
+
+/* Start reading the rest of the data for the slot @i. */
+static int submit_read(struct libfsverity_async_reader *r, u32 i)
+{
+	struct async_read_slot *slot = &r->slots[i];
+	u32 tail = *r->sq_tail;
+	u32 idx = tail & r->sq_mask;
+	struct io_uring_sqe *sqe = &r->sqes[idx];
+
+	memset(sqe, 0, sizeof(*sqe));
+	if (r->fixed_buffers) {
+		sqe->opcode = IORING_OP_READ_FIXED;
+		sqe->addr = (uintptr_t)&slot->buf[slot->filled];
+		sqe->len = slot->len - slot->filled;
+		sqe->buf_index = i;
+	} else {
+		slot->iov.iov_base = &slot->buf[slot->filled];
+		slot->iov.iov_len = slot->len - slot->filled;
+		sqe->opcode = IORING_OP_READV;
+		sqe->addr = (uintptr_t)&slot->iov;
+		sqe->len = 1;
+	}
+	sqe->fd = r->fd;
+	sqe->off = slot->offset + slot->filled;
+	sqe->user_data = i;
+	r->sq_array[idx] = idx;
+	__atomic_store_n(r->sq_tail, tail + 1, __ATOMIC_RELEASE);
+
+	slot->in_flight = true;
+	if (io_uring_enter(r->ring_fd, 1, 0, 0) != 1) {
+		int err = -errno;
+
+		libfsverity_error_msg("failed to submit read to io_uring: %s",
+				      strerror(errno));
+		slot->in_flight = false;
+		slot->err = err;
+		return err;
+	}
+	return 0;
+}
+
+/*
+ * Process the completed reads, first waiting for at least one if @wait is true.
+ */
+static int reap_completions(struct libfsverity_async_reader *r, bool wait)
+{
+	u32 head = *r->cq_head;
+	u32 tail = __atomic_load_n(r->cq_tail, __ATOMIC_ACQUIRE);
+	int err = 0;
+
+	if (head == tail && wait) {
+		if (io_uring_enter(r->ring_fd, 0, 1,
+				   IORING_ENTER_GETEVENTS) < 0) {
+			err = -errno;
+			libfsverity_error_msg("failed to wait for io_uring: %s",
+					      strerror(errno));
+			return err;
+		}
+		tail = __atomic_load_n(r->cq_tail, __ATOMIC_ACQUIRE);
+	}
+	for (; head != tail; head++) {
+		const struct io_uring_cqe *cqe = &r->cqes[head & r->cq_mask];
+		struct async_read_slot *slot = &r->slots[cqe->user_data];
+
+		slot->in_flight = false;
+		if (cqe->res < 0) {
+			slot->err = cqe->res;
+		} else if (cqe->res == 0) {
+			slot->eof = true;
+			slot->err = -EIO;
+		} else {
+			slot->filled += cqe->res;
+			/* Continue a short read. */
+			if (slot->filled < slot->len) {
+				int e = submit_read(r, cqe->user_data);
+
+				if (e && !err)
+					err = e;
+			}
+		}
+	}
+	__atomic_store_n(r->cq_head, head, __ATOMIC_RELEASE);
+	return err;
+}
+
+static void teardown_io_uring(struct libfsverity_async_reader *r)
+{
+	u32 i;
+
+	/* Don't free the buffers while the kernel could still write to them. */
+	for (i = 0; i < r->queue_depth; i++) {
+		while (r->slots[i].in_flight) {
+			if (reap_completions(r, true) != 0)
+				break;
+		}
+	}
+	if (r->sqes)
+		munmap(r->sqes, r->sqes_size);
+	if (r->cq_ring && r->cq_ring != r->sq_ring)
+		munmap(r->cq_ring, r->cq_ring_size);
+	if (r->sq_ring)
+		munmap(r->sq_ring, r->sq_ring_size);
+	if (r->ring_fd >= 0)
+		close(r->ring_fd);
+	r->ring_fd = -1;
+}
+
+/* Start the next read into the slot @i, if the file has more data to read. */
+static int start_next_read(struct libfsverity_async_reader *r, u32 i)
+{
+	struct async_read_slot *slot = &r->slots[i];
+
+	slot->offset = r->next_offset;
+	slot->len = min(r->file_size - r->next_offset, (u64)r->buffer_size);
+	slot->filled = 0;
+	slot->eof = false;
+	slot->err = 0;
+	r->next_offset += slot->len;
+	if (slot->len)
+		return submit_read(r, i);
+	return 0;
+}
+#endif /* HAVE_IO_URING */
+
+LIBEXPORT int
+libfsverity_async_reader_new(int fd, u64 file_size, u32 queue_depth,
+			     u32 buffer_size,
+			     struct libfsverity_async_reader **reader_ret)
+{
+	struct libfsverity_async_reader *r;
+	u32 i;
+	int err;
+
+	if (fd < 0 || !reader_ret ||
+	    queue_depth > ASYNC_READ_MAX_QUEUE_DEPTH ||
+	    buffer_size > ASYNC_READ_MAX_BUFFER_SIZE) {
+		libfsverity_error_msg("invalid arguments to async_reader_new");
+		return -EINVAL;
+	}
+	r = libfsverity_zalloc(sizeof(*r));
+	if (!r)
+		return -ENOMEM;
+	r->fd = fd;
+	r->file_size = file_size;
+	r->queue_depth = queue_depth ?: ASYNC_READ_DEFAULT_QUEUE_DEPTH;
+	r->buffer_size = buffer_size ?: ASYNC_READ_DEFAULT_BUFFER_SIZE;
+	r->buffer_size = (r->buffer_size + ASYNC_READ_ALIGNMENT - 1) &
+			 ~(ASYNC_READ_ALIGNMENT - 1);
+	r->ring_fd = -1;
+
+	/* Don't allocate more buffer space than the file needs. */
+	r->queue_depth = min((u64)r->queue_depth,
+			     max(DIV_ROUND_UP(file_size, r->buffer_size),
+				 (u64)1));
+
+	err = -ENOMEM;
+	r->slots = libfsverity_zalloc(r->queue_depth * sizeof(r->slots[0]));
+	if (!r->slots)
+		goto err;
+	if (posix_memalign((void **)&r->buffers, ASYNC_READ_ALIGNMENT,
+			   (size_t)r->queue_depth * r->buffer_size) != 0) {
+		r->buffers = NULL;
+		libfsverity_error_msg("out of memory");
+		goto err;
+	}
+	for (i = 0; i < r->queue_depth; i++)
+		r->slots[i].buf = &r->buffers[(size_t)i * r->buffer_size];
+
+#ifdef HAVE_IO_URING
+	/* If io_uring is unavailable, fall back to synchronous reads. */
+	if (!setup_io_uring(r))
+		teardown_io_uring(r);
+	if (r->ring_fd >= 0) {
+		for (i = 0; i < r->queue_depth; i++) {
+			err = start_next_read(r, i);
+			if (err)
+				goto err;
+		}
+	}
+#endif
+	*reader_ret = r;
+	return 0;
+
+err:
+	libfsverity_async_reader_free(r);
+	return err;
+}
+
+/* Read synchronously, for when io_uring isn't available. */
+static int sync_read(struct libfsverity_async_reader *r, void *buf,
+		     size_t count)
+{
+	while (count) {
+		ssize_t n = pread(r->fd, buf, min(count, (size_t)INT32_MAX),
+				  r->pos);
+
+		if (n < 0) {
+			int err = -errno;
+
+			libfsverity_error_msg("error reading file: %s",
+					      strerror(errno));
+			return err;
+		}
+		if (n == 0) {
+			libfsverity_error_msg("unexpected end-of-file");
+			return -EIO;
+		}
+		buf = (u8 *)buf + n;
+		count -= n;
+		r->pos += n;
+	}
+	return 0;
+}
+
+LIBEXPORT int
+libfsverity_async_read(void *reader, void *buf, size_t count)
+{
+	struct libfsverity_async_reader *r = reader;
+
+	if (count > r->file_size - r->pos) {
+		libfsverity_error_msg("read past the end of the data");
+		return -EINVAL;
+	}
+	if (r->ring_fd < 0)
+		return sync_read(r, buf, count);
+#ifdef HAVE_IO_URING
+	while (count) {
+		struct async_read_slot *slot = &r->slots[r->head];
+		size_t n;
+		int err;
+
+		/* Short reads are continued, so this waits for all data. */
+		while (slot->in_flight) {
+			err = reap_completions(r, true);
+			if (err)
+				return err;
+		}
+		/* Use any data read before an error, e.g. before EOF. */
+		n = min(count, (size_t)(slot->offset + slot->filled - r->pos));
+		if (n == 0) {
+			if (slot->eof) {
+				libfsverity_error_msg("unexpected end-of-file");
+				return -EIO;
+			}
+			libfsverity_error_msg("error reading file: %s",
+					      strerror(-slot->err));
+			return slot->err;
+		}
+		memcpy(buf, &slot->buf[r->pos - slot->offset], n);
+		buf = (u8 *)buf + n;
+		count -= n;
+		r->pos += n;
+		if (r->pos == slot->offset + slot->len) {
+			err = start_next_read(r, r->head);
+			if (err)
+				return err;
+			r->head = (r->head + 1) % r->queue_depth;
+		}
+	}
+#endif
+	return 0;
+}
+
+LIBEXPORT int
+libfsverity_async_reader_is_async(const struct libfsverity_async_reader *r)
+{
+	return r->ring_fd >= 0;
+}
+
+LIBEXPORT void
+libfsverity_async_reader_free(struct libfsverity_async_reader *r)
+{
+	if (!r)
+		return;
+#ifdef HAVE_IO_URING
+	if (r->ring_fd >= 0)
+		teardown_io_uring(r);
+#endif
+	free(r->buffers);
+	free(r->slots);
+	free(r);
+}
+
+#endif /* !_WIN32 */
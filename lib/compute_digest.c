@@ -12,41 +12,164 @@
 
 #include "lib_private.h"
 
+#include <inttypes.h>
+#include <pthread.h>
 #include <stdlib.h>
 #include <string.h>
+#include <time.h>
 
 #define FS_VERITY_MAX_LEVELS	64
 
+/*
+ * When computing a Merkle tree using multiple threads, the data is divided into
+ * chunks which each cover exactly one block at some level of the tree.  Use at
+ * least this many chunks per thread when possible, so that the work stays
+ * evenly balanced even if some threads run slower than others.
+ */
+#define MIN_CHUNKS_PER_THREAD	8
+
+/*
+ * The number of blocks that are buffered at each level of the tree before
+ * being hashed together.  Hashing many blocks at once allows the hash
+ * algorithm's multi-buffer implementation (if any) to be used.  It also means
+ * that the indirect calls into the hash implementation happen once per batch
+ * rather than once per block, so the time is spent almost entirely in the
+ * compression function.  (Versions of the data block loop specialized for
+ * particular hash algorithms and block sizes were tried, and they weren't
+ * measurably faster.)
+ */
+#define HASH_BATCH_BLOCKS	16
+
 struct block_buffer {
 	u32 filled;
 	u8 *data;
 };
 
+/* The completed blocks of one level of a Merkle tree, in order */
+struct saved_level {
+	u8 *data;
+	size_t size;
+	size_t capacity;
+};
+
+/* The properties of the Merkle tree being computed, shared by all threads */
+struct merkle_tree {
+	const struct fsverity_hash_alg *alg;
+	u64 file_size;
+	u32 block_size;
+	u32 hashes_per_block;
+	const u8 *salt;		/* zero-padded to a multiple of alg->block_size */
+	u32 salt_size;
+	int num_levels;
+	/*
+	 * The starting block of each level, using the convention where the root
+	 * level is first, i.e. the convention used by
+	 * FS_IOC_READ_VERITY_METADATA.
+	 */
+	u64 level_start[FS_VERITY_MAX_LEVELS];
+	const struct libfsverity_metadata_callbacks *metadata_cbs;
+	/* If non-NULL, serializes the calls to ->merkle_tree_block() */
+	pthread_mutex_t *cbs_lock;
+	/* The memory for each tree_builder's block memo, or 0 for none */
+	u64 memo_size;
+	/* If non-NULL, the statistics of the block memos are added to this */
+	struct libfsverity_memo_stats *memo_stats;
+};
+
+/* The source of the file's data */
+struct data_source {
+	const u8 *buf;		/* if non-NULL, the file's data is in memory */
+	void *fd;
+	libfsverity_read_fn_t read_fn;
+	libfsverity_pread_fn_t pread_fn;
+	libfsverity_splice_fn_t splice_fn;
+	libfsverity_zero_range_fn_t zero_range_fn;
+	u32 read_chunk_size;	/* if nonzero, read this much at a time */
+	/* If non-NULL, all the data is also fed to this hash, in order */
+	struct hash_ctx *flat_hash;
+};
+
 /*
- * Hash a block, writing the result to the next level's pending block buffer.
+ * The in-progress state of hashing the data blocks and tree levels
+ * [0, top_level) of some subtree-aligned range of a file.  buffers[-1] holds
+ * the pending data blocks, and buffers[level] holds the pending blocks of each
+ * tree level, up to HASH_BATCH_BLOCKS at a time.  The hashes of the blocks at
+ * level top_level - 1 are appended to buffers[top_level], whose data is
+ * supplied by the caller, unless the builder is growable.
  */
-static void hash_one_block(struct hash_ctx *hash, struct block_buffer *cur,
-			   u32 block_size, const u8 *salt, u32 salt_size)
-{
-	struct block_buffer *next = cur + 1;
-
-	/* Zero-pad the block if it's shorter than block_size. */
-	memset(&cur->data[cur->filled], 0, block_size - cur->filled);
+struct tree_builder {
+	const struct merkle_tree *tree;
+	struct hash_ctx *hash;
+	int top_level;
+	/*
+	 * If true, the size of the data isn't known in advance.  buffers[]
+	 * are all allocated by the builder, and top_level is raised whenever
+	 * a second hash is appended to buffers[top_level], so that
+	 * buffers[top_level] holds the root hash once the lower levels have
+	 * been finished.
+	 */
+	bool growable;
+	struct block_buffer _buffers[1 + FS_VERITY_MAX_LEVELS + 1];
+	struct block_buffer *buffers;
+	/* The index within its level of the first pending block at each level */
+	u64 next_index[FS_VERITY_MAX_LEVELS];
+	/*
+	 * Buffer for reading data in chunks, allocated when first needed and
+	 * grown when a larger chunk size is used later
+	 */
+	u8 *read_buf;
+	u32 read_buf_size;
+	/*
+	 * zero_hashes[0] is the hash of an all-zero data block, and
+	 * zero_hashes[level + 1] is the hash of a block at @level that contains
+	 * only zero_hashes[level], i.e. of the top block of an all-zero subtree.
+	 * Each one is computed the first time it is needed.
+	 */
+	u8 zero_hashes[FS_VERITY_MAX_LEVELS + 1][FS_VERITY_MAX_DIGEST_SIZE];
+	bool zero_hash_known[FS_VERITY_MAX_LEVELS + 1];
+	/* A block for building zero-subtree blocks, allocated when needed */
+	u8 *zero_block;
+	/*
+	 * If non-NULL, the completed tree blocks are saved here, indexed by
+	 * level, rather than being reported to the metadata callbacks.  This is
+	 * for growable builders, where the position of each block in the tree
+	 * isn't known until the size of the data is.
+	 */
+	struct saved_level *saved_levels;
+	/* If non-NULL, the hashes of repeated blocks are remembered here */
+	struct block_memo *memo;
+};
 
-	libfsverity_hash_init(hash);
-	libfsverity_hash_update(hash, salt, salt_size);
-	libfsverity_hash_update(hash, cur->data, block_size);
-	libfsverity_hash_final(hash, &next->data[next->filled]);
+static int read_data(const struct data_source *src, void *buf, size_t count,
+		     u64 offset)
+{
+	int err;
 
-	next->filled += hash->alg->digest_size;
-	cur->filled = 0;
+	if (src->read_fn)
+		err = src->read_fn(src->fd, buf, count);
+	else
+		err = src->pread_fn(src->fd, buf, count, offset);
+	if (err)
+		libfsverity_error_msg("error reading file");
+	else if (src->flat_hash)
+		libfsverity_hash_update(src->flat_hash, buf, count);
+	return err;
 }
 
-static bool block_is_full(const struct block_buffer *block, u32 block_size,
-			  struct hash_ctx *hash)
+/*
+ * Feed @size zero bytes to the flat hash, for data that wasn't read because
+ * src->zero_range_fn said that it is zero.
+ */
+static void update_flat_hash_zeroes(const struct data_source *src, u64 size)
 {
-	/* Would the next hash put us over the limit? */
-	return block->filled + hash->alg->digest_size > block_size;
+	static const u8 zeroes[4096];
+
+	while (size) {
+		size_t n = min(size, (u64)sizeof(zeroes));
+
+		libfsverity_hash_update(src->flat_hash, zeroes, n);
+		size -= n;
+	}
 }
 
 static int report_merkle_tree_size(const struct libfsverity_metadata_callbacks *cbs,
@@ -63,21 +186,26 @@ static int report_merkle_tree_size(const struct libfsverity_metadata_callbacks *
 	return 0;
 }
 
-static int report_merkle_tree_block(const struct libfsverity_metadata_callbacks *cbs,
-				    const struct block_buffer *block,
-				    u32 block_size, u64 *level_offset)
+static int report_merkle_tree_block(const struct merkle_tree *tree,
+				    const u8 *block, int level, u64 index)
 {
+	const struct libfsverity_metadata_callbacks *cbs = tree->metadata_cbs;
 
 	if (cbs && cbs->merkle_tree_block) {
-		int err = cbs->merkle_tree_block(cbs->ctx, block->data,
-						 block_size,
-						 *level_offset * block_size);
+		u64 offset = (tree->level_start[level] + index) *
+			     tree->block_size;
+		int err;
 
+		if (tree->cbs_lock)
+			pthread_mutex_lock(tree->cbs_lock);
+		err = cbs->merkle_tree_block(cbs->ctx, block,
+					     tree->block_size, offset);
+		if (tree->cbs_lock)
+			pthread_mutex_unlock(tree->cbs_lock);
 		if (err) {
 			libfsverity_error_msg("error processing Merkle tree block");
 			return err;
 		}
-		(*level_offset)++;
 	}
 	return 0;
 }
@@ -97,236 +225,3614 @@ static int report_descriptor(const struct libfsverity_metadata_callbacks *cbs,
 }
 
 /*
- * Compute the file's Merkle tree root hash using the given hash algorithm,
- * block size, and salt.
+ * A memo of the hashes of blocks that occur repeatedly, for files that contain
+ * many copies of the same blocks.  It's a direct-mapped table indexed by a
+ * fingerprint of the blocks.  A block is only stored once its fingerprint has
+ * been seen twice in a row in its slot, so that blocks that occur only once,
+ * usually the vast majority, don't cost a copy or evict the repeated ones.  The
+ * fingerprint isn't cryptographically secure, so a hash is only reused after
+ * comparing the whole block.
  */
-static int compute_root_hash(void *fd, libfsverity_read_fn_t read_fn,
-			     u64 file_size, struct hash_ctx *hash,
-			     u32 block_size, const u8 *salt, u32 salt_size,
-			     const struct libfsverity_metadata_callbacks *metadata_cbs,
-			     u8 *root_hash)
+struct memo_entry {
+	u64 fingerprint;	/* the fingerprint of the stored block */
+	u64 candidate;		/* the fingerprint last seen, if not stored */
+	bool valid;		/* a block is stored */
+	u8 hash[FS_VERITY_MAX_DIGEST_SIZE];
+};
+
+struct block_memo {
+	struct memo_entry *entries;
+	u8 *blocks;		/* the stored block of entries[i] is block i */
+	u32 num_entries;	/* a power of 2 */
+	u32 block_size;
+	u32 digest_size;
+	struct libfsverity_memo_stats stats;
+};
+
+/* The result of looking up a block that wasn't in the memo */
+struct memo_probe {
+	u64 fingerprint;
+	bool store;		/* store the block once it has been hashed */
+};
+
+static inline u64 rol64(u64 v, int n)
 {
-	const u32 hashes_per_block = block_size / hash->alg->digest_size;
-	const u32 padded_salt_size = roundup(salt_size, hash->alg->block_size);
-	u8 *padded_salt = NULL;
-	u64 blocks;
-	int num_levels = 0;
-	int level;
-	u64 level_offset[FS_VERITY_MAX_LEVELS];
-	struct block_buffer _buffers[1 + FS_VERITY_MAX_LEVELS + 1] = {};
-	struct block_buffer *buffers = &_buffers[1];
-	u64 offset;
-	int err = 0;
+	return (v << n) | (v >> (64 - n));
+}
 
-	/* Root hash of empty file is all 0's */
-	if (file_size == 0) {
-		memset(root_hash, 0, hash->alg->digest_size);
-		return report_merkle_tree_size(metadata_cbs, 0);
-	}
+/*
+ * Compute a 64-bit fingerprint of a block, whose size must be a multiple of 32
+ * bytes.  This is much faster than the real hash, but it's only good for
+ * telling blocks apart, not for proving that they are the same.
+ */
+static u64 block_fingerprint(const u8 *block, u32 size)
+{
+	const u64 k = 0x9E3779B97F4A7C15;
+	u64 h[4] = { 0, 1, 2, 3 };
+	u64 w[4];
+	u64 v;
+	u32 i;
+	int j;
 
-	if (salt_size != 0) {
-		padded_salt = libfsverity_zalloc(padded_salt_size);
-		if (!padded_salt)
-			return -ENOMEM;
-		memcpy(padded_salt, salt, salt_size);
+	for (i = 0; i < size; i += sizeof(w)) {
+		memcpy(w, &block[i], sizeof(w));
+		for (j = 0; j < 4; j++)
+			h[j] = rol64((h[j] ^ w[j]) * k, 31);
 	}
+	v = h[0] ^ rol64(h[1], 16) ^ rol64(h[2], 32) ^ rol64(h[3], 48);
+	v ^= v >> 33;
+	v *= 0xFF51AFD7ED558CCD;
+	v ^= v >> 33;
+	v *= 0xC4CEB9FE1A85EC53;
+	v ^= v >> 33;
+	return v;
+}
 
-	/* Compute number of levels and the number of blocks in each level. */
-	blocks = DIV_ROUND_UP(file_size, block_size);
-	while (blocks > 1)  {
-		if (WARN_ON(num_levels >= FS_VERITY_MAX_LEVELS)) {
-			err = -EINVAL;
-			goto out;
-		}
-		blocks = DIV_ROUND_UP(blocks, hashes_per_block);
-		/*
-		 * Temporarily use level_offset[] to store the number of blocks
-		 * in each level.  It will be overwritten later.
-		 */
-		level_offset[num_levels++] = blocks;
+/*
+ * Allocate a memo that uses at most about @memo_size bytes, or set *@memo_ret
+ * to NULL if @memo_size is too small to be useful.  There is no point in having
+ * more entries than the data has blocks.
+ */
+static int memo_alloc(const struct merkle_tree *tree, u64 memo_size,
+		      struct block_memo **memo_ret)
+{
+	const u64 entry_cost = tree->block_size + sizeof(struct memo_entry);
+	u64 max_entries = min(memo_size / entry_cost,
+			      DIV_ROUND_UP(tree->file_size, tree->block_size));
+	u32 num_entries = 1;
+	struct block_memo *memo;
+
+	*memo_ret = NULL;
+	if (max_entries < 2)
+		return 0;
+	while ((u64)num_entries * 2 <= max_entries && num_entries < (1U << 30))
+		num_entries *= 2;
+
+	memo = libfsverity_zalloc(sizeof(*memo));
+	if (!memo)
+		return -ENOMEM;
+	memo->entries = libfsverity_zalloc(num_entries *
+					   sizeof(memo->entries[0]));
+	memo->blocks = libfsverity_malloc((size_t)num_entries *
+					  tree->block_size);
+	if (!memo->entries || !memo->blocks) {
+		free(memo->entries);
+		free(memo->blocks);
+		free(memo);
+		return -ENOMEM;
 	}
+	memo->num_entries = num_entries;
+	memo->block_size = tree->block_size;
+	memo->digest_size = tree->alg->digest_size;
+	*memo_ret = memo;
+	return 0;
+}
 
-	/*
-	 * Compute the starting block of each level, using the convention where
-	 * the root level is first, i.e. the convention used by
-	 * FS_IOC_READ_VERITY_METADATA.  At the same time, compute the total
-	 * size of the Merkle tree.  These values are only needed for the
-	 * metadata callbacks (if they were given), as the hash computation
-	 * itself doesn't prescribe an ordering of the levels and doesn't
-	 * prescribe any special meaning to the total size of the Merkle tree.
-	 */
-	offset = 0;
-	for (level = num_levels - 1; level >= 0; level--) {
-		blocks = level_offset[level];
-		level_offset[level] = offset;
-		offset += blocks;
+/* Free @memo, adding its statistics to @stats if it is non-NULL. */
+static void memo_free(struct block_memo *memo,
+		      struct libfsverity_memo_stats *stats)
+{
+	if (!memo)
+		return;
+	if (stats) {
+		/* Other threads may be adding their statistics too. */
+		__atomic_fetch_add(&stats->lookups, memo->stats.lookups,
+				   __ATOMIC_RELAXED);
+		__atomic_fetch_add(&stats->hits, memo->stats.hits,
+				   __ATOMIC_RELAXED);
+		__atomic_fetch_add(&stats->mismatches, memo->stats.mismatches,
+				   __ATOMIC_RELAXED);
 	}
-	err = report_merkle_tree_size(metadata_cbs, offset * block_size);
-	if (err)
-		goto out;
+	free(memo->entries);
+	free(memo->blocks);
+	free(memo);
+}
 
-	/*
-	 * Allocate the block buffers.  Buffer "-1" is for data blocks.
-	 * Buffers 0 <= level < num_levels are for the actual tree levels.
-	 * Buffer 'num_levels' is for the root hash.
-	 */
-	for (level = -1; level < num_levels; level++) {
-		buffers[level].data = libfsverity_zalloc(block_size);
-		if (!buffers[level].data) {
-			err = -ENOMEM;
-			goto out;
+/*
+ * Look up @block in @memo.  If it's there, copy its hash to @hash and return
+ * true.  Otherwise fill in @probe for memo_store().
+ */
+static bool memo_lookup(struct block_memo *memo, const u8 *block,
+			struct memo_probe *probe, u8 *hash)
+{
+	const u64 fingerprint = block_fingerprint(block, memo->block_size);
+	const u32 i = fingerprint & (memo->num_entries - 1);
+	struct memo_entry *e = &memo->entries[i];
+
+	memo->stats.lookups++;
+	probe->fingerprint = fingerprint;
+	probe->store = false;
+	if (e->valid && e->fingerprint == fingerprint) {
+		if (memcmp(&memo->blocks[(size_t)i * memo->block_size], block,
+			   memo->block_size) == 0) {
+			memcpy(hash, e->hash, memo->digest_size);
+			memo->stats.hits++;
+			return true;
 		}
+		memo->stats.mismatches++;
+		return false;
 	}
-	buffers[num_levels].data = root_hash;
+	if (e->candidate == fingerprint)
+		probe->store = true;
+	else
+		e->candidate = fingerprint;
+	return false;
+}
 
-	/* Hash each data block, also hashing the tree blocks as they fill up */
-	for (offset = 0; offset < file_size; offset += block_size) {
-		buffers[-1].filled = min(block_size, file_size - offset);
+/* Store @block and its @hash in @memo, if memo_lookup() said to. */
+static void memo_store(struct block_memo *memo, const u8 *block,
+		       const struct memo_probe *probe, const u8 *hash)
+{
+	const u32 i = probe->fingerprint & (memo->num_entries - 1);
+	struct memo_entry *e = &memo->entries[i];
 
-		err = read_fn(fd, buffers[-1].data, buffers[-1].filled);
-		if (err) {
-			libfsverity_error_msg("error reading file");
-			goto out;
-		}
+	/* A copy earlier in the same batch may have been stored already. */
+	if (!probe->store || (e->valid && e->fingerprint == probe->fingerprint))
+		return;
+	memcpy(&memo->blocks[(size_t)i * memo->block_size], block,
+	       memo->block_size);
+	memcpy(e->hash, hash, memo->digest_size);
+	e->fingerprint = probe->fingerprint;
+	e->valid = true;
+}
 
-		hash_one_block(hash, &buffers[-1], block_size,
-			       padded_salt, padded_salt_size);
-		for (level = 0; level < num_levels; level++) {
-			if (!block_is_full(&buffers[level], block_size, hash))
-				break;
-			hash_one_block(hash, &buffers[level], block_size,
-				       padded_salt, padded_salt_size);
-			err = report_merkle_tree_block(metadata_cbs,
-						       &buffers[level],
-						       block_size,
-						       &level_offset[level]);
-			if (err)
-				goto out;
-		}
-	}
-	/* Finish all nonempty pending tree blocks */
-	for (level = 0; level < num_levels; level++) {
-		if (buffers[level].filled != 0) {
-			hash_one_block(hash, &buffers[level], block_size,
-				       padded_salt, padded_salt_size);
-			err = report_merkle_tree_block(metadata_cbs,
-						       &buffers[level],
-						       block_size,
-						       &level_offset[level]);
-			if (err)
-				goto out;
-		}
-	}
+static int tree_builder_init(struct tree_builder *b,
+			     const struct merkle_tree *tree,
+			     struct hash_ctx *hash, int top_level)
+{
+	int level;
 
-	/* Root hash was filled by the last call to hash_one_block() */
-	if (WARN_ON(buffers[num_levels].filled != hash->alg->digest_size)) {
-		err = -EINVAL;
-		goto out;
+	memset(b, 0, sizeof(*b));
+	b->tree = tree;
+	b->hash = hash;
+	b->top_level = top_level;
+	b->buffers = &b->_buffers[1];
+	for (level = -1; level < top_level; level++) {
+		b->buffers[level].data =
+			libfsverity_zalloc(HASH_BATCH_BLOCKS * tree->block_size);
+		if (!b->buffers[level].data)
+			return -ENOMEM;
 	}
-	err = 0;
-out:
-	for (level = -1; level < num_levels; level++)
-		free(buffers[level].data);
-	free(padded_salt);
-	return err;
+	return 0;
 }
 
-LIBEXPORT int
-libfsverity_compute_digest(void *fd, libfsverity_read_fn_t read_fn,
-			   const struct libfsverity_merkle_tree_params *params,
-			   struct libfsverity_digest **digest_ret)
+/* Initialize a growable tree_builder, for data of unknown size. */
+static int tree_builder_init_growable(struct tree_builder *b,
+				      const struct merkle_tree *tree,
+				      struct hash_ctx *hash)
 {
-	u32 alg_num;
-	u32 block_size;
-	const struct fsverity_hash_alg *hash_alg;
-	struct hash_ctx *hash = NULL;
-	struct libfsverity_digest *digest;
-	struct fsverity_descriptor desc;
-	int err;
+	int err = tree_builder_init(b, tree, hash, 0);
 
-	if (!read_fn || !params || !digest_ret) {
-		libfsverity_error_msg("missing required parameters for compute_digest");
-		return -EINVAL;
-	}
-	if (params->version != 1) {
-		libfsverity_error_msg("unsupported version (%u)",
-				      params->version);
-		return -EINVAL;
-	}
+	if (err)
+		return err;
+	b->growable = true;
+	b->buffers[0].data =
+		libfsverity_zalloc(HASH_BATCH_BLOCKS * tree->block_size);
+	if (!b->buffers[0].data)
+		return -ENOMEM;
+	return 0;
+}
 
-	alg_num = params->hash_algorithm ?: FS_VERITY_HASH_ALG_DEFAULT;
-	block_size = params->block_size ?: FS_VERITY_BLOCK_SIZE_DEFAULT;
+/* Give a tree_builder a block memo, if tree->memo_size asks for one. */
+static int tree_builder_init_memo(struct tree_builder *b)
+{
+	return memo_alloc(b->tree, b->tree->memo_size, &b->memo);
+}
 
-	if (!is_power_of_2(block_size)) {
-		libfsverity_error_msg("unsupported block size (%u)",
-				      block_size);
-		return -EINVAL;
+static void tree_builder_destroy(struct tree_builder *b)
+{
+	int level;
+
+	for (level = -1; level < b->top_level; level++)
+		free(b->buffers[level].data);
+	if (b->growable)
+		free(b->buffers[b->top_level].data);
+	free(b->read_buf);
+	free(b->zero_block);
+	memo_free(b->memo, b->tree->memo_stats);
+}
+
+/*
+ * Start a new range of data blocks, beginning at data block @first_block.  The
+ * hashes of the level top_level - 1 blocks will be appended to @out.
+ */
+static void tree_builder_start(struct tree_builder *b, u64 first_block, u8 *out)
+{
+	u64 blocks_per_entry = 1;
+	int level;
+
+	for (level = 0; level < b->top_level; level++) {
+		blocks_per_entry *= b->tree->hashes_per_block;
+		b->next_index[level] = first_block / blocks_per_entry;
 	}
-	if (params->salt_size > sizeof(desc.salt)) {
-		libfsverity_error_msg("unsupported salt size (%u)",
-				      params->salt_size);
-		return -EINVAL;
+	b->buffers[b->top_level].data = out;
+	b->buffers[b->top_level].filled = 0;
+}
+
+/* Make a growable tree_builder's current top level an ordinary level. */
+static int tree_builder_grow(struct tree_builder *b)
+{
+	u8 *data;
+
+	if (b->top_level + 1 > FS_VERITY_MAX_LEVELS) {
+		libfsverity_error_msg("file is too large for the Merkle tree");
+		return -EFBIG;
 	}
-	if (params->salt_size && !params->salt) {
-		libfsverity_error_msg("salt_size specified, but salt is NULL");
-		return -EINVAL;
+	data = libfsverity_zalloc(HASH_BATCH_BLOCKS * b->tree->block_size);
+	if (!data)
+		return -ENOMEM;
+	b->top_level++;
+	b->buffers[b->top_level].data = data;
+	b->buffers[b->top_level].filled = 0;
+	return 0;
+}
+
+/*
+ * Copy the state of a growable tree_builder, so that the copy can be finished
+ * without disturbing the original.
+ */
+static int tree_builder_clone(struct tree_builder *dst,
+			      const struct tree_builder *src)
+{
+	const size_t buf_size = HASH_BATCH_BLOCKS * src->tree->block_size;
+	int level;
+
+	*dst = *src;
+	dst->buffers = &dst->_buffers[1];
+	dst->read_buf = NULL;
+	dst->read_buf_size = 0;
+	dst->zero_block = NULL;
+	dst->memo = NULL;
+	for (level = -1; level <= src->top_level; level++)
+		dst->buffers[level].data = NULL;
+	for (level = -1; level <= src->top_level; level++) {
+		dst->buffers[level].data = libfsverity_malloc(buf_size);
+		if (!dst->buffers[level].data)
+			return -ENOMEM;
+		memcpy(dst->buffers[level].data, src->buffers[level].data,
+		       src->buffers[level].filled);
 	}
-	if (!libfsverity_mem_is_zeroed(params->reserved1,
-				       sizeof(params->reserved1)) ||
-	    !libfsverity_mem_is_zeroed(params->reserved2,
-				       sizeof(params->reserved2))) {
-		libfsverity_error_msg("reserved bits set in merkle_tree_params");
-		return -EINVAL;
+	return 0;
+}
+
+static int append_hash(struct tree_builder *b, int level, const u8 *hash);
+
+/*
+ * Is @block at @level (-1 for data blocks) the same as the blocks at that level
+ * of an all-zero subtree?
+ */
+static bool is_zero_subtree_block(const struct tree_builder *b, int level,
+				  const u8 *block)
+{
+	const u32 block_size = b->tree->block_size;
+	const u32 digest_size = b->tree->alg->digest_size;
+	u32 i;
+
+	if (level < 0)
+		return libfsverity_mem_is_zeroed(block, block_size);
+	if (!b->zero_hash_known[level])
+		return false;
+	for (i = 0; i < block_size; i += digest_size) {
+		if (memcmp(&block[i], b->zero_hashes[level], digest_size) != 0)
+			return false;
 	}
+	return true;
+}
 
-	hash_alg = libfsverity_find_hash_alg_by_num(alg_num);
-	if (!hash_alg) {
-		libfsverity_error_msg("unknown hash algorithm: %u", alg_num);
-		return -EINVAL;
+/*
+ * Get the hash of @block at @level without hashing it, if possible.  Blocks of
+ * all-zero subtrees, which are common in disk images, get their hashes from
+ * zero_hashes[], and repeated blocks get them from the memo if there is one.
+ * If this returns false and there is a memo, @probe is filled in.
+ */
+static bool find_block_hash(struct tree_builder *b, int level, const u8 *block,
+			    struct memo_probe *probe, u8 *hash)
+{
+	if (is_zero_subtree_block(b, level, block)) {
+		if (!b->zero_hash_known[level + 1]) {
+			libfsverity_hash_mb(b->hash, block, b->tree->block_size,
+					    1, b->zero_hashes[level + 1]);
+			b->zero_hash_known[level + 1] = true;
+		}
+		memcpy(hash, b->zero_hashes[level + 1],
+		       b->tree->alg->digest_size);
+		return true;
 	}
+	return b->memo && memo_lookup(b->memo, block, probe, hash);
+}
 
-	if (block_size < 2 * hash_alg->digest_size) {
-		libfsverity_error_msg("block size (%u) too small for hash algorithm %s",
-				      block_size, hash_alg->name);
-		return -EINVAL;
+/*
+ * Hash @n blocks at @level (-1 for data blocks).  The blocks whose hashes
+ * find_block_hash() can't supply are hashed in runs, so that the multi-buffer
+ * hashing still applies.
+ */
+static void hash_blocks(struct tree_builder *b, int level, const u8 *blocks,
+			u32 n, u8 *hashes)
+{
+	const u32 block_size = b->tree->block_size;
+	const u32 digest_size = b->tree->alg->digest_size;
+	struct memo_probe probes[HASH_BATCH_BLOCKS];
+	u32 i = 0, j, k;
+
+	while (i < n) {
+		for (j = i; j < n; j++) {
+			if (find_block_hash(b, level, &blocks[j * block_size],
+					    &probes[j],
+					    &hashes[j * digest_size]))
+				break;
+		}
+		if (j > i) {
+			libfsverity_hash_mb(b->hash, &blocks[i * block_size],
+					    block_size, j - i,
+					    &hashes[i * digest_size]);
+			for (k = i; b->memo && k < j; k++)
+				memo_store(b->memo, &blocks[k * block_size],
+					   &probes[k],
+					   &hashes[k * digest_size]);
+		}
+		i = j + 1;
 	}
+}
 
-	hash = hash_alg->create_ctx(hash_alg);
-	if (!hash)
-		return -ENOMEM;
+/* Append a completed tree block to @level. */
+static int save_tree_block(struct saved_level *level, const u8 *block,
+			   u32 block_size)
+{
+	if (level->size + block_size > level->capacity) {
+		size_t capacity = max(2 * level->capacity,
+				      (size_t)HASH_BATCH_BLOCKS * block_size);
+		u8 *data = libfsverity_realloc(level->data, capacity);
 
-	memset(&desc, 0, sizeof(desc));
-	desc.version = 1;
-	desc.hash_algorithm = alg_num;
-	desc.log_blocksize = ilog2(block_size);
-	desc.data_size = cpu_to_le64(params->file_size);
-	if (params->salt_size != 0) {
-		memcpy(desc.salt, params->salt, params->salt_size);
-		desc.salt_size = params->salt_size;
+		if (!data)
+			return -ENOMEM;
+		level->data = data;
+		level->capacity = capacity;
 	}
+	memcpy(&level->data[level->size], block, block_size);
+	level->size += block_size;
+	return 0;
+}
 
-	err = compute_root_hash(fd, read_fn, params->file_size, hash,
-				block_size, params->salt, params->salt_size,
-				params->metadata_callbacks, desc.root_hash);
-	if (err)
-		goto out;
+/*
+ * Hash the pending blocks at @level, zero-padding the last one if it's shorter
+ * than block_size.  Report the tree blocks, and append their hashes to the next
+ * level.
+ */
+static int hash_pending_blocks(struct tree_builder *b, int level)
+{
+	const struct merkle_tree *tree = b->tree;
+	const u32 block_size = tree->block_size;
+	const u32 digest_size = tree->alg->digest_size;
+	struct block_buffer *buf = &b->buffers[level];
+	u32 n = DIV_ROUND_UP(buf->filled, block_size);
+	u8 hashes[HASH_BATCH_BLOCKS * FS_VERITY_MAX_DIGEST_SIZE];
+	u32 i;
+	int err;
 
-	err = report_descriptor(params->metadata_callbacks,
-				&desc, sizeof(desc));
-	if (err)
-		goto out;
+	memset(&buf->data[buf->filled], 0, n * block_size - buf->filled);
+	hash_blocks(b, level, buf->data, n, hashes);
+	buf->filled = 0;
 
-	digest = libfsverity_zalloc(sizeof(*digest) + hash_alg->digest_size);
-	if (!digest) {
-		err = -ENOMEM;
-		goto out;
+	for (i = 0; i < n; i++) {
+		if (level >= 0 && b->saved_levels) {
+			err = save_tree_block(&b->saved_levels[level],
+					      &buf->data[i * block_size],
+					      block_size);
+			b->next_index[level]++;
+			if (err)
+				return err;
+		} else if (level >= 0) {
+			err = report_merkle_tree_block(tree,
+						       &buf->data[i * block_size],
+						       level,
+						       b->next_index[level]++);
+			if (err)
+				return err;
+		}
+		err = append_hash(b, level + 1, &hashes[i * digest_size]);
+		if (err)
+			return err;
 	}
-	digest->digest_algorithm = alg_num;
-	digest->digest_size = hash_alg->digest_size;
-	libfsverity_hash_full(hash, &desc, sizeof(desc), digest->digest);
-	*digest_ret = digest;
-	err = 0;
-out:
-	libfsverity_free_hash_ctx(hash);
+	return 0;
+}
+
+/*
+ * Append a hash to the pending blocks at @level, hashing them if that fills the
+ * last one.
+ */
+static int append_hash(struct tree_builder *b, int level, const u8 *hash)
+{
+	const u32 digest_size = b->tree->alg->digest_size;
+	struct block_buffer *buf = &b->buffers[level];
+	int err;
+
+	if (level == b->top_level && b->growable && buf->filled) {
+		err = tree_builder_grow(b);
+		if (err)
+			return err;
+	}
+	memcpy(&buf->data[buf->filled], hash, digest_size);
+	buf->filled += digest_size;
+	if (level < b->top_level &&
+	    buf->filled == HASH_BATCH_BLOCKS * b->tree->block_size)
+		return hash_pending_blocks(b, level);
+	return 0;
+}
+
+/* Hash all nonempty pending blocks at levels [level, top_level). */
+static int finish_pending_blocks(struct tree_builder *b, int level)
+{
+	int err;
+
+	for (; level < b->top_level; level++) {
+		if (b->buffers[level].filled != 0) {
+			err = hash_pending_blocks(b, level);
+			if (err)
+				return err;
+		}
+	}
+	return 0;
+}
+
+/*
+ * Hash the @size bytes of data at @data, which start at a block boundary, and
+ * append their hashes to level 0.  The full blocks are hashed directly from
+ * @data.  A partial last block is copied to the pending data blocks, so that
+ * it can be padded; it must be the file's last block.
+ */
+static int hash_data_in_place(struct tree_builder *b, const u8 *data,
+			      size_t size)
+{
+	const u32 block_size = b->tree->block_size;
+	const u32 digest_size = b->tree->alg->digest_size;
+	struct block_buffer *data_buf = &b->buffers[-1];
+	u8 hashes[HASH_BATCH_BLOCKS * FS_VERITY_MAX_DIGEST_SIZE];
+	u32 i, n;
+	int err;
+
+	while (size >= block_size) {
+		n = min(size / block_size, (size_t)HASH_BATCH_BLOCKS);
+		hash_blocks(b, -1, data, n, hashes);
+		for (i = 0; i < n; i++) {
+			err = append_hash(b, 0, &hashes[i * digest_size]);
+			if (err)
+				return err;
+		}
+		data += (size_t)n * block_size;
+		size -= (size_t)n * block_size;
+	}
+	if (size) {
+		memcpy(&data_buf->data[data_buf->filled], data, size);
+		data_buf->filled += size;
+	}
+	return 0;
+}
+
+/*
+ * Append @size bytes to the data blocks.  The data needn't start or end on a
+ * block boundary.  Whole batches of blocks are hashed directly from @data when
+ * possible; the rest is copied to the pending data blocks, which are hashed
+ * once HASH_BATCH_BLOCKS of them have been filled.
+ */
+static int append_data(struct tree_builder *b, const u8 *data, size_t size)
+{
+	const size_t batch_size = HASH_BATCH_BLOCKS * b->tree->block_size;
+	struct block_buffer *data_buf = &b->buffers[-1];
+	size_t n;
+	int err;
+
+	while (size) {
+		if (data_buf->filled == 0 && size >= batch_size) {
+			n = size - size % batch_size;
+			err = hash_data_in_place(b, data, n);
+		} else {
+			n = min(size, batch_size - data_buf->filled);
+			memcpy(&data_buf->data[data_buf->filled], data, n);
+			data_buf->filled += n;
+			err = 0;
+			if (data_buf->filled == batch_size)
+				err = hash_pending_blocks(b, -1);
+		}
+		if (err)
+			return err;
+		data += n;
+		size -= n;
+	}
+	return 0;
+}
+
+/*
+ * Like hash_data_range(), but let the hash implementation get the data of each
+ * block itself using src->splice_fn, so that the data doesn't need to be copied
+ * through userspace.
+ */
+static int hash_data_blocks_spliced(struct tree_builder *b,
+				    const struct data_source *src,
+				    u64 offset, u64 end)
+{
+	const u32 block_size = b->tree->block_size;
+	u8 digest[FS_VERITY_MAX_DIGEST_SIZE];
+	int err;
+
+	for (; offset < end; offset += block_size) {
+		err = libfsverity_hash_prefixed_spliced(b->hash, src->splice_fn,
+							src->fd, offset,
+							min(block_size,
+							    end - offset),
+							block_size, digest);
+		if (err)
+			return err;
+		err = append_hash(b, 0, digest);
+		if (err)
+			return err;
+	}
+	return 0;
+}
+
+/*
+ * Hash the file's data in [offset, end), appending the hashes of the data
+ * blocks to level 0.  @offset must be block-aligned, and so must @end unless it
+ * is the end of the file.  The data blocks may be left pending.
+ */
+static int hash_data_range(struct tree_builder *b,
+			   const struct data_source *src, u64 offset, u64 end)
+{
+	const struct merkle_tree *tree = b->tree;
+	const u32 block_size = tree->block_size;
+	struct block_buffer *data_buf = &b->buffers[-1];
+	int err;
+
+	if (src->buf)
+		return hash_data_in_place(b, &src->buf[offset], end - offset);
+
+	if (src->splice_fn && b->hash->hash_prefixed_spliced)
+		return hash_data_blocks_spliced(b, src, offset, end);
+
+	if (src->read_chunk_size) {
+		/*
+		 * Read many blocks at a time, then hash them from the chunk.
+		 * The chunk size is a multiple of the block size, so only the
+		 * file's last block can be partial.
+		 */
+		const u32 chunk_size = max(src->read_chunk_size &
+					   ~(block_size - 1), block_size);
+
+		if (b->read_buf_size < chunk_size) {
+			free(b->read_buf);
+			b->read_buf_size = 0;
+			b->read_buf = libfsverity_zalloc(chunk_size);
+			if (!b->read_buf)
+				return -ENOMEM;
+			b->read_buf_size = chunk_size;
+		}
+		while (offset < end) {
+			u32 count = min(end - offset, (u64)chunk_size);
+
+			err = read_data(src, b->read_buf, count, offset);
+			if (err)
+				return err;
+			err = hash_data_in_place(b, b->read_buf, count);
+			if (err)
+				return err;
+			offset += count;
+		}
+		return 0;
+	}
+
+	/*
+	 * Otherwise read one block at a time, directly into the pending data
+	 * blocks.  This is the behavior that callers have always gotten.
+	 */
+	for (; offset < end; offset += block_size) {
+		u32 count = min(block_size, end - offset);
+
+		err = read_data(src, &data_buf->data[data_buf->filled], count,
+				offset);
+		if (err)
+			return err;
+		data_buf->filled += count;
+
+		if (data_buf->filled == HASH_BATCH_BLOCKS * block_size) {
+			err = hash_pending_blocks(b, -1);
+			if (err)
+				return err;
+		}
+	}
+	return 0;
+}
+
+/* Compute zero_hashes[0] through zero_hashes[@level], if not already known. */
+static int get_zero_hashes(struct tree_builder *b, int level)
+{
+	const u32 block_size = b->tree->block_size;
+	const u32 digest_size = b->tree->alg->digest_size;
+	int l;
+	u32 i;
+
+	if (!b->zero_block) {
+		b->zero_block = libfsverity_zalloc(block_size);
+		if (!b->zero_block)
+			return -ENOMEM;
+	}
+	for (l = 0; l <= level; l++) {
+		if (b->zero_hash_known[l])
+			continue;
+		if (l == 0) {
+			memset(b->zero_block, 0, block_size);
+		} else {
+			for (i = 0; i < block_size; i += digest_size)
+				memcpy(&b->zero_block[i], b->zero_hashes[l - 1],
+				       digest_size);
+		}
+		libfsverity_hash_mb(b->hash, b->zero_block, block_size, 1,
+				    b->zero_hashes[l]);
+		b->zero_hash_known[l] = true;
+	}
+	return 0;
+}
+
+/* Report @count blocks at @level of all-zero subtrees. */
+static int report_zero_blocks(struct tree_builder *b, int level, u64 count)
+{
+	const struct merkle_tree *tree = b->tree;
+	const u32 digest_size = tree->alg->digest_size;
+	u32 i;
+	int err;
+
+	if (!tree->metadata_cbs || !tree->metadata_cbs->merkle_tree_block) {
+		b->next_index[level] += count;
+		return 0;
+	}
+	for (i = 0; i < tree->block_size; i += digest_size)
+		memcpy(&b->zero_block[i], b->zero_hashes[level], digest_size);
+	for (; count; count--) {
+		err = report_merkle_tree_block(tree, b->zero_block, level,
+					       b->next_index[level]++);
+		if (err)
+			return err;
+	}
+	return 0;
+}
+
+/*
+ * Append @count blocks of all-zero subtrees at @level (-1 for data blocks),
+ * i.e. append zero_hashes[level + 1] to level + 1 @count times.  The whole
+ * blocks at level + 1 that this produces are handled recursively, so this
+ * takes time proportional to the number of tree levels rather than to @count,
+ * unless the tree blocks are being reported.  The pending blocks at @level, if
+ * any, must be whole blocks.
+ */
+static int append_zero_blocks(struct tree_builder *b, int level, u64 count)
+{
+	const u32 block_size = b->tree->block_size;
+	const u32 hashes_per_block = b->tree->hashes_per_block;
+	struct block_buffer *next = &b->buffers[level + 1];
+	const u8 *zero_hash = b->zero_hashes[level + 1];
+	u64 n;
+	int err;
+
+	if (count == 0)
+		return 0;
+	if (b->buffers[level].filled) {
+		err = hash_pending_blocks(b, level);
+		if (err)
+			return err;
+	}
+	err = get_zero_hashes(b, level + 1);
+	if (err)
+		return err;
+
+	/* Complete the partial block at level + 1, if there is one. */
+	while (count && (level + 1 == b->top_level ||
+			 next->filled % block_size != 0)) {
+		err = append_hash(b, level + 1, zero_hash);
+		if (err)
+			return err;
+		count--;
+	}
+
+	/* Append whole zero-subtree blocks at level + 1. */
+	n = count / hashes_per_block;
+	if (n) {
+		if (next->filled) {
+			err = hash_pending_blocks(b, level + 1);
+			if (err)
+				return err;
+		}
+		err = report_zero_blocks(b, level + 1, n);
+		if (err)
+			return err;
+		err = append_zero_blocks(b, level + 1, n);
+		if (err)
+			return err;
+		count -= n * hashes_per_block;
+	}
+
+	for (; count; count--) {
+		err = append_hash(b, level + 1, zero_hash);
+		if (err)
+			return err;
+	}
+	return 0;
+}
+
+/*
+ * Use src->zero_range_fn to find the first run of data blocks in [block,
+ * end_block) that are known to be zero.  If there is none, return end_block as
+ * both the start and end of the run.
+ */
+static int find_zero_blocks(const struct merkle_tree *tree,
+			    const struct data_source *src, u64 block,
+			    u64 end_block, u64 *start_ret, u64 *end_ret)
+{
+	const u32 block_size = tree->block_size;
+	u64 offset = block * block_size;
+
+	*start_ret = *end_ret = end_block;
+	while (offset < tree->file_size) {
+		u64 start, end;
+		int err;
+
+		err = src->zero_range_fn(src->fd, offset, &start, &end);
+		if (err) {
+			libfsverity_error_msg("error finding zeroes in file");
+			return err;
+		}
+		if (start < offset || end < start) {
+			libfsverity_error_msg("zero_range_fn returned an invalid range");
+			return -EINVAL;
+		}
+		if (start >= tree->file_size || end == start)
+			break;
+		/* The zero padding of the last block counts as zeroes. */
+		if (end >= tree->file_size)
+			end = roundup(tree->file_size, block_size);
+		if (DIV_ROUND_UP(start, block_size) >= end_block)
+			break;
+		if (end / block_size > DIV_ROUND_UP(start, block_size)) {
+			*start_ret = DIV_ROUND_UP(start, block_size);
+			*end_ret = min(end / block_size, end_block);
+			break;
+		}
+		/* The range doesn't contain a whole block; keep looking. */
+		offset = end;
+	}
+	return 0;
+}
+
+/*
+ * Hash the data blocks [first_block, first_block + num_blocks) of the file,
+ * along with the tree blocks at levels [0, top_level) that cover them.  The
+ * range must start on a boundary of the level top_level - 1 blocks, and it
+ * must end on such a boundary too unless it extends to the end of the file.
+ * Data that src->zero_range_fn says is zero isn't read.
+ */
+static int hash_data_blocks(struct tree_builder *b,
+			    const struct data_source *src,
+			    u64 first_block, u64 num_blocks)
+{
+	const struct merkle_tree *tree = b->tree;
+	const u32 block_size = tree->block_size;
+	const u64 end_block = min(first_block + num_blocks,
+				  DIV_ROUND_UP(tree->file_size, block_size));
+	u64 block = first_block;
+	u64 zero_start = end_block, zero_end = end_block;
+	int err;
+
+	while (block < end_block) {
+		if (src->zero_range_fn) {
+			err = find_zero_blocks(tree, src, block, end_block,
+					       &zero_start, &zero_end);
+			if (err)
+				return err;
+		}
+		err = hash_data_range(b, src, block * block_size,
+				      min(tree->file_size,
+					  zero_start * block_size));
+		if (err)
+			return err;
+		err = append_zero_blocks(b, -1, zero_end - zero_start);
+		if (err)
+			return err;
+		if (src->flat_hash && zero_end > zero_start)
+			update_flat_hash_zeroes(src,
+					min(tree->file_size,
+					    zero_end * block_size) -
+					zero_start * block_size);
+		block = zero_end;
+	}
+	return finish_pending_blocks(b, -1);
+}
+
+/* The state of a multithreaded Merkle tree computation */
+struct parallel_ctx {
+	const struct merkle_tree *tree;
+	const struct data_source *src;
+	/* The implementation and OpenSSL library context for the threads */
+	u32 hash_impl;
+	void *openssl_libctx;
+	int chunk_levels;	/* tree levels computed within each chunk */
+	u64 blocks_per_chunk;	/* data blocks per chunk */
+	u64 num_chunks;
+	u64 next_chunk;		/* next chunk to claim, accessed atomically */
+	u8 *chunk_hashes;	/* the hash of each chunk's top block */
+	int err;		/* first error that occurred, if any */
+};
+
+/*
+ * Claim and hash chunks until there are none left.  Each chunk is hashed
+ * independently, leaving the hash of its single level chunk_levels - 1 block
+ * in chunk_hashes.
+ */
+static void *hash_chunks(void *_ctx)
+{
+	struct parallel_ctx *ctx = _ctx;
+	const struct merkle_tree *tree = ctx->tree;
+	struct hash_ctx *hash;
+	struct tree_builder b;
+	u64 chunk;
+	int err;
+
+	err = libfsverity_create_hash_ctx(tree->alg, ctx->hash_impl,
+					  ctx->openssl_libctx, &hash);
+	if (err)
+		goto out;
+	libfsverity_hash_set_prefix(hash, tree->salt, tree->salt_size);
+	err = tree_builder_init(&b, tree, hash, ctx->chunk_levels);
+	if (err)
+		goto out_destroy;
+	err = tree_builder_init_memo(&b);
+	if (err)
+		goto out_destroy;
+
+	while (!__atomic_load_n(&ctx->err, __ATOMIC_RELAXED)) {
+		chunk = __atomic_fetch_add(&ctx->next_chunk, 1,
+					   __ATOMIC_RELAXED);
+		if (chunk >= ctx->num_chunks)
+			break;
+		tree_builder_start(&b, chunk * ctx->blocks_per_chunk,
+				   &ctx->chunk_hashes[chunk *
+						      tree->alg->digest_size]);
+		err = hash_data_blocks(&b, ctx->src,
+				       chunk * ctx->blocks_per_chunk,
+				       ctx->blocks_per_chunk);
+		if (!err)
+			err = libfsverity_hash_error(hash);
+		if (err)
+			break;
+	}
+out_destroy:
+	tree_builder_destroy(&b);
+	libfsverity_free_hash_ctx(hash);
+out:
+	if (err) {
+		int zero = 0;
+
+		__atomic_compare_exchange_n(&ctx->err, &zero, err, false,
+					    __ATOMIC_RELAXED, __ATOMIC_RELAXED);
+	}
+	return NULL;
+}
+
+/*
+ * Choose how many tree levels each chunk should cover for a multithreaded
+ * computation, or return 0 if the file is too small to be worth splitting.
+ * Larger chunks leave less work for the final single-threaded pass over the
+ * upper tree levels, but there must still be enough chunks to go around.
+ */
+static int choose_chunk_levels(const struct merkle_tree *tree, u32 num_threads)
+{
+	u64 data_blocks = DIV_ROUND_UP(tree->file_size, tree->block_size);
+	u64 blocks_per_chunk = 1;
+	int chunk_levels = 0;
+
+	while (chunk_levels + 1 < tree->num_levels) {
+		u64 n = blocks_per_chunk * tree->hashes_per_block;
+
+		if (DIV_ROUND_UP(data_blocks, n) <
+		    (u64)num_threads * MIN_CHUNKS_PER_THREAD && chunk_levels)
+			break;
+		blocks_per_chunk = n;
+		chunk_levels++;
+	}
+	if (DIV_ROUND_UP(data_blocks, blocks_per_chunk) < 2)
+		return 0;
+	return chunk_levels;
+}
+
+/*
+ * Compute the Merkle tree using multiple threads.  The data is divided into
+ * chunks which each cover one block at level chunk_levels - 1; the worker
+ * threads hash the chunks independently, then the calling thread hashes the
+ * resulting chunk hashes to compute the remaining levels of the tree.  The
+ * tree blocks and root hash are identical to the single-threaded case.
+ */
+static int compute_root_hash_parallel(struct merkle_tree *tree,
+				      const struct data_source *src,
+				      struct hash_ctx *hash, u32 num_threads,
+				      int chunk_levels, u8 *root_hash)
+{
+	const u32 digest_size = tree->alg->digest_size;
+	struct parallel_ctx ctx = {
+		.tree = tree,
+		.src = src,
+		.hash_impl = hash->impl,
+		.openssl_libctx = hash->openssl_libctx,
+		.chunk_levels = chunk_levels,
+	};
+	pthread_mutex_t cbs_lock = PTHREAD_MUTEX_INITIALIZER;
+	pthread_t *threads;
+	u32 num_started = 0;
+	struct tree_builder b;
+	u64 chunk;
+	int level;
+	int err;
+
+	ctx.blocks_per_chunk = 1;
+	for (level = 0; level < chunk_levels; level++)
+		ctx.blocks_per_chunk *= tree->hashes_per_block;
+	ctx.num_chunks = DIV_ROUND_UP(DIV_ROUND_UP(tree->file_size,
+						   tree->block_size),
+				      ctx.blocks_per_chunk);
+	num_threads = min((u64)num_threads, ctx.num_chunks);
+	/* Each thread gets its own memo, so divide the memory among them. */
+	tree->memo_size /= num_threads;
+
+	ctx.chunk_hashes = libfsverity_zalloc(ctx.num_chunks * digest_size);
+	threads = libfsverity_zalloc(num_threads * sizeof(threads[0]));
+	err = tree_builder_init(&b, tree, hash, tree->num_levels);
+	if (!ctx.chunk_hashes || !threads || err) {
+		err = -ENOMEM;
+		goto out;
+	}
+
+	tree->cbs_lock = &cbs_lock;
+	/*
+	 * The calling thread is one of the workers.  If some threads can't be
+	 * created, just continue with fewer.
+	 */
+	while (num_started + 1 < num_threads &&
+	       pthread_create(&threads[num_started], NULL, hash_chunks,
+			      &ctx) == 0)
+		num_started++;
+	hash_chunks(&ctx);
+	while (num_started)
+		pthread_join(threads[--num_started], NULL);
+	tree->cbs_lock = NULL;
+
+	err = ctx.err;
+	if (err)
+		goto out;
+
+	/* Hash the remaining levels, starting with the chunk hashes. */
+	tree_builder_start(&b, 0, root_hash);
+	for (chunk = 0; chunk < ctx.num_chunks; chunk++) {
+		err = append_hash(&b, chunk_levels,
+				  &ctx.chunk_hashes[chunk * digest_size]);
+		if (err)
+			goto out;
+	}
+	err = finish_pending_blocks(&b, chunk_levels);
+	if (err)
+		goto out;
+
+	/* Root hash was filled by the last call to hash_pending_blocks() */
+	if (WARN_ON(b.buffers[tree->num_levels].filled != digest_size))
+		err = -EINVAL;
+out:
+	tree_builder_destroy(&b);
+	free(threads);
+	free(ctx.chunk_hashes);
+	return err;
+}
+
+/*
+ * Compute the number of levels of the Merkle tree and the starting block of
+ * each level, and return the total number of blocks in the tree.
+ */
+static int compute_tree_geometry(struct merkle_tree *tree,
+				 u64 *tree_blocks_ret)
+{
+	u64 blocks = DIV_ROUND_UP(tree->file_size, tree->block_size);
+	u64 offset;
+	int level;
+
+	tree->num_levels = 0;
+	while (blocks > 1)  {
+		if (WARN_ON(tree->num_levels >= FS_VERITY_MAX_LEVELS))
+			return -EINVAL;
+		blocks = DIV_ROUND_UP(blocks, tree->hashes_per_block);
+		/*
+		 * Temporarily use level_start[] to store the number of blocks
+		 * in each level.  It will be overwritten later.
+		 */
+		tree->level_start[tree->num_levels++] = blocks;
+	}
+
+	/*
+	 * Compute the starting block of each level, using the convention where
+	 * the root level is first, i.e. the convention used by
+	 * FS_IOC_READ_VERITY_METADATA.  At the same time, compute the total
+	 * size of the Merkle tree.  These values are only needed for the
+	 * metadata callbacks (if they were given) and for updating an existing
+	 * tree, as the hash computation itself doesn't prescribe an ordering of
+	 * the levels and doesn't prescribe any special meaning to the total
+	 * size of the Merkle tree.
+	 */
+	offset = 0;
+	for (level = tree->num_levels - 1; level >= 0; level--) {
+		blocks = tree->level_start[level];
+		tree->level_start[level] = offset;
+		offset += blocks;
+	}
+	*tree_blocks_ret = offset;
+	return 0;
+}
+
+/*
+ * Compute the file's Merkle tree root hash using the given hash algorithm,
+ * block size, and salt.  If @memo_size is nonzero, the hashes of repeated
+ * blocks are remembered using up to about that much memory, and the memo's
+ * statistics are added to @memo_stats if it is non-NULL.
+ */
+static int compute_root_hash(const struct data_source *src, u64 file_size,
+			     struct hash_ctx *hash, u32 block_size,
+			     const u8 *salt, u32 salt_size, u32 num_threads,
+			     const struct libfsverity_metadata_callbacks *metadata_cbs,
+			     u64 memo_size,
+			     struct libfsverity_memo_stats *memo_stats,
+			     u8 *root_hash)
+{
+	struct merkle_tree tree = {
+		.alg = hash->alg,
+		.file_size = file_size,
+		.block_size = block_size,
+		.hashes_per_block = block_size / hash->alg->digest_size,
+		.salt_size = roundup(salt_size, hash->alg->block_size),
+		.metadata_cbs = metadata_cbs,
+		.memo_size = memo_size,
+		.memo_stats = memo_stats,
+	};
+	u8 *padded_salt = NULL;
+	u64 tree_blocks;
+	int chunk_levels;
+	struct tree_builder b;
+	int err = 0;
+
+	/* Root hash of empty file is all 0's */
+	if (file_size == 0) {
+		memset(root_hash, 0, hash->alg->digest_size);
+		return report_merkle_tree_size(metadata_cbs, 0);
+	}
+
+	if (salt_size != 0) {
+		padded_salt = libfsverity_zalloc(tree.salt_size);
+		if (!padded_salt)
+			return -ENOMEM;
+		memcpy(padded_salt, salt, salt_size);
+		tree.salt = padded_salt;
+	}
+	/* Every block's hash starts from the state after the padded salt. */
+	libfsverity_hash_set_prefix(hash, tree.salt, tree.salt_size);
+
+	err = compute_tree_geometry(&tree, &tree_blocks);
+	if (err)
+		goto out;
+	err = report_merkle_tree_size(metadata_cbs, tree_blocks * block_size);
+	if (err)
+		goto out;
+
+	if (num_threads > 1) {
+		chunk_levels = choose_chunk_levels(&tree, num_threads);
+		if (chunk_levels) {
+			struct data_source psrc = {
+				.buf = src->buf,
+				.fd = src->fd,
+				.pread_fn = src->pread_fn,
+				.splice_fn = src->splice_fn,
+				.zero_range_fn = src->zero_range_fn,
+				.read_chunk_size = src->read_chunk_size,
+			};
+
+			err = compute_root_hash_parallel(&tree, &psrc, hash,
+							 num_threads,
+							 chunk_levels,
+							 root_hash);
+			goto out;
+		}
+	}
+
+	/*
+	 * Allocate the block buffers.  Buffer "-1" is for data blocks.
+	 * Buffers 0 <= level < num_levels are for the actual tree levels.
+	 * Buffer 'num_levels' is for the root hash.
+	 */
+	err = tree_builder_init(&b, &tree, hash, tree.num_levels);
+	if (err)
+		goto out_destroy;
+	err = tree_builder_init_memo(&b);
+	if (err)
+		goto out_destroy;
+	tree_builder_start(&b, 0, root_hash);
+
+	/* Hash each data block, also hashing the tree blocks as they fill up */
+	err = hash_data_blocks(&b, src, 0, DIV_ROUND_UP(file_size, block_size));
+	if (err)
+		goto out_destroy;
+
+	/* Root hash was filled by the last call to hash_pending_blocks() */
+	if (WARN_ON(b.buffers[tree.num_levels].filled !=
+		    hash->alg->digest_size)) {
+		err = -EINVAL;
+		goto out_destroy;
+	}
+	err = 0;
+out_destroy:
+	tree_builder_destroy(&b);
+out:
+	free(padded_salt);
+	return err;
+}
+
+/*
+ * Validate the Merkle tree parameters, and get the hash algorithm and block
+ * size that they specify.
+ */
+static int check_tree_params(const struct libfsverity_merkle_tree_params *params,
+			     bool for_compute_digest,
+			     const struct fsverity_hash_alg **alg_ret,
+			     u32 *block_size_ret)
+{
+	u32 alg_num;
+	u32 block_size;
+	const struct fsverity_hash_alg *hash_alg;
+
+	if (params->version != 1) {
+		libfsverity_error_msg("unsupported version (%u)",
+				      params->version);
+		return -EINVAL;
+	}
+
+	alg_num = params->hash_algorithm ?: FS_VERITY_HASH_ALG_DEFAULT;
+	block_size = params->block_size ?: FS_VERITY_BLOCK_SIZE_DEFAULT;
+
+	if (!is_power_of_2(block_size)) {
+		libfsverity_error_msg("unsupported block size (%u)",
+				      block_size);
+		return -EINVAL;
+	}
+	if (params->salt_size > FS_VERITY_MAX_SALT_SIZE) {
+		libfsverity_error_msg("unsupported salt size (%u)",
+				      params->salt_size);
+		return -EINVAL;
+	}
+	if (params->salt_size && !params->salt) {
+		libfsverity_error_msg("salt_size specified, but salt is NULL");
+		return -EINVAL;
+	}
+	if (!libfsverity_mem_is_zeroed(params->reserved1,
+				       sizeof(params->reserved1)) ||
+	    !libfsverity_mem_is_zeroed(params->reserved2,
+				       sizeof(params->reserved2))) {
+		libfsverity_error_msg("reserved bits set in merkle_tree_params");
+		return -EINVAL;
+	}
+	if (params->memo_size && !for_compute_digest) {
+		libfsverity_error_msg("memo_size isn't supported by this function");
+		return -EINVAL;
+	}
+	if (params->flat_hash_algorithm) {
+		if (!for_compute_digest) {
+			libfsverity_error_msg("flat_hash_algorithm isn't supported by this function");
+			return -EINVAL;
+		}
+		if (!libfsverity_find_hash_alg_by_num(
+					params->flat_hash_algorithm)) {
+			libfsverity_error_msg("unknown flat hash algorithm: %u",
+					      params->flat_hash_algorithm);
+			return -EINVAL;
+		}
+		if (!params->flat_hash) {
+			libfsverity_error_msg("flat_hash_algorithm specified, but flat_hash is NULL");
+			return -EINVAL;
+		}
+	}
+
+	hash_alg = libfsverity_find_hash_alg_by_num(alg_num);
+	if (!hash_alg) {
+		libfsverity_error_msg("unknown hash algorithm: %u", alg_num);
+		return -EINVAL;
+	}
+
+	if (block_size < 2 * hash_alg->digest_size) {
+		libfsverity_error_msg("block size (%u) too small for hash algorithm %s",
+				      block_size, hash_alg->name);
+		return -EINVAL;
+	}
+	*alg_ret = hash_alg;
+	*block_size_ret = block_size;
+	return 0;
+}
+
+/* Fill in the fs-verity descriptor, except for the root hash. */
+static void init_descriptor(struct fsverity_descriptor *desc,
+			    const struct libfsverity_merkle_tree_params *params,
+			    u32 block_size)
+{
+	memset(desc, 0, sizeof(*desc));
+	desc->version = 1;
+	desc->hash_algorithm = params->hash_algorithm ?:
+			       FS_VERITY_HASH_ALG_DEFAULT;
+	desc->log_blocksize = ilog2(block_size);
+	desc->data_size = cpu_to_le64(params->file_size);
+	if (params->salt_size != 0) {
+		memcpy(desc->salt, params->salt, params->salt_size);
+		desc->salt_size = params->salt_size;
+	}
+}
+
+/*
+ * Report the completed fs-verity descriptor to the metadata callbacks, then
+ * hash it to get the file digest.
+ */
+static int finish_digest(struct hash_ctx *hash,
+			 const struct fsverity_descriptor *desc,
+			 const struct libfsverity_metadata_callbacks *metadata_cbs,
+			 struct libfsverity_digest **digest_ret)
+{
+	struct libfsverity_digest *digest;
+	int err;
+
+	/* Don't report a root hash that wasn't computed correctly. */
+	err = libfsverity_hash_error(hash);
+	if (err)
+		return err;
+	err = report_descriptor(metadata_cbs, desc, sizeof(*desc));
+	if (err)
+		return err;
+
+	digest = libfsverity_zalloc(sizeof(*digest) + hash->alg->digest_size);
+	if (!digest)
+		return -ENOMEM;
+	digest->digest_algorithm = desc->hash_algorithm;
+	digest->digest_size = hash->alg->digest_size;
+	libfsverity_hash_full(hash, desc, sizeof(*desc), digest->digest);
+	err = libfsverity_hash_error(hash);
+	if (err) {
+		free(digest);
+		return err;
+	}
+	*digest_ret = digest;
+	return 0;
+}
+
+static int compute_digest(const struct data_source *src,
+			  const struct libfsverity_merkle_tree_params *params,
+			  struct libfsverity_digest **digest_ret)
+{
+	const struct fsverity_hash_alg *hash_alg;
+	u32 block_size;
+	u32 num_threads = params->num_threads;
+	struct hash_ctx *hash = NULL;
+	struct hash_ctx *flat_hash = NULL;
+	struct data_source memo_src;
+	struct data_source flat_src;
+	struct fsverity_descriptor desc;
+	int err;
+
+	err = check_tree_params(params, true, &hash_alg, &block_size);
+	if (err)
+		return err;
+
+	err = libfsverity_create_hash_ctx(hash_alg, params->hash_impl,
+					  params->openssl_libctx, &hash);
+	if (err)
+		return err;
+
+	if (params->memo_size && src->splice_fn) {
+		/* The memo needs the data blocks to be in memory. */
+		memo_src = *src;
+		memo_src.splice_fn = NULL;
+		src = &memo_src;
+	}
+
+	if (params->flat_hash_algorithm) {
+		err = libfsverity_create_hash_ctx(
+			libfsverity_find_hash_alg_by_num(
+					params->flat_hash_algorithm),
+			params->hash_impl, params->openssl_libctx, &flat_hash);
+		if (err)
+			goto out;
+		libfsverity_hash_init(flat_hash);
+		if (!src->buf) {
+			/*
+			 * Hash the data as it is read.  This needs the data to
+			 * be read in order, and into memory.
+			 */
+			flat_src = *src;
+			flat_src.flat_hash = flat_hash;
+			flat_src.splice_fn = NULL;
+			src = &flat_src;
+			num_threads = 1;
+		}
+	}
+
+	init_descriptor(&desc, params, block_size);
+	err = compute_root_hash(src, params->file_size, hash, block_size,
+				params->salt, params->salt_size,
+				num_threads, params->metadata_callbacks,
+				params->memo_size, params->memo_stats,
+				desc.root_hash);
+	if (err)
+		goto out;
+
+	err = finish_digest(hash, &desc, params->metadata_callbacks,
+			    digest_ret);
+	if (err)
+		goto out;
+
+	if (flat_hash) {
+		if (src->buf && params->file_size)
+			libfsverity_hash_update(flat_hash, src->buf,
+						params->file_size);
+		libfsverity_hash_final(flat_hash, params->flat_hash);
+		err = libfsverity_hash_error(flat_hash);
+		if (err) {
+			free(*digest_ret);
+			*digest_ret = NULL;
+		}
+	}
+out:
+	libfsverity_free_hash_ctx(flat_hash);
+	libfsverity_free_hash_ctx(hash);
+	return err;
+}
+
+/*
+ * Set up the source of a file's data that is read using @read_fn or
+ * @params->pread_fn, after checking that the needed functions were given.
+ */
+static int init_file_source(struct data_source *src, void *fd,
+			    libfsverity_read_fn_t read_fn,
+			    const struct libfsverity_merkle_tree_params *params)
+{
+	memset(src, 0, sizeof(*src));
+	src->fd = fd;
+	src->read_fn = read_fn;
+	if (!read_fn && !params->pread_fn) {
+		libfsverity_error_msg("missing required parameters for compute_digest");
+		return -EINVAL;
+	}
+	if (params->zero_range_fn) {
+		if (!params->pread_fn) {
+			libfsverity_error_msg("zero_range_fn requires pread_fn");
+			return -EINVAL;
+		}
+		/* Data is skipped, so it can't be read sequentially. */
+		src->read_fn = NULL;
+		src->zero_range_fn = params->zero_range_fn;
+	}
+	src->pread_fn = params->pread_fn;
+	src->splice_fn = params->splice_fn;
+	src->read_chunk_size = params->read_chunk_size;
+	return 0;
+}
+
+LIBEXPORT int
+libfsverity_compute_digest(void *fd, libfsverity_read_fn_t read_fn,
+			   const struct libfsverity_merkle_tree_params *params,
+			   struct libfsverity_digest **digest_ret)
+{
+	struct data_source src;
+	int err;
+
+	if (!params || !digest_ret) {
+		libfsverity_error_msg("missing required parameters for compute_digest");
+		return -EINVAL;
+	}
+	if (params->num_threads > 1 && !params->pread_fn) {
+		libfsverity_error_msg("num_threads > 1 requires pread_fn");
+		return -EINVAL;
+	}
+	err = init_file_source(&src, fd, read_fn, params);
+	if (err)
+		return err;
+	return compute_digest(&src, params, digest_ret);
+}
+
+LIBEXPORT int
+libfsverity_compute_digest_buffer(const void *data,
+				  const struct libfsverity_merkle_tree_params *params,
+				  struct libfsverity_digest **digest_ret)
+{
+	const struct data_source src = { .buf = data };
+
+	if (!params || !digest_ret || (!data && params->file_size)) {
+		libfsverity_error_msg("missing required parameters for compute_digest_buffer");
+		return -EINVAL;
+	}
+	return compute_digest(&src, params, digest_ret);
+}
+
+/* A range of block indices [start, end) within one level of a Merkle tree */
+struct block_range {
+	u64 start;
+	u64 end;
+};
+
+static int cmp_block_ranges(const void *_a, const void *_b)
+{
+	const struct block_range *a = _a, *b = _b;
+
+	if (a->start != b->start)
+		return a->start < b->start ? -1 : 1;
+	return 0;
+}
+
+/*
+ * Merge the sorted block ranges @ranges that overlap or are adjacent, and
+ * return the new number of ranges.
+ */
+static size_t merge_block_ranges(struct block_range *ranges, size_t n)
+{
+	size_t i, j = 0;
+
+	for (i = 0; i < n; i++) {
+		if (j != 0 && ranges[i].start <= ranges[j - 1].end)
+			ranges[j - 1].end = max(ranges[j - 1].end,
+						ranges[i].end);
+		else
+			ranges[j++] = ranges[i];
+	}
+	return j;
+}
+
+/*
+ * Convert the byte ranges @changed of the file's data to a sorted list of
+ * non-overlapping ranges of data block indices.
+ */
+static int get_changed_data_blocks(const struct merkle_tree *tree,
+				   const struct libfsverity_range *changed,
+				   size_t num_changed,
+				   struct block_range **ranges_ret,
+				   size_t *num_ranges_ret)
+{
+	struct block_range *ranges;
+	size_t i, n = 0;
+
+	ranges = libfsverity_malloc(max(num_changed, (size_t)1) *
+				    sizeof(ranges[0]));
+	if (!ranges)
+		return -ENOMEM;
+	for (i = 0; i < num_changed; i++) {
+		const struct libfsverity_range *r = &changed[i];
+
+		if (r->offset > tree->file_size ||
+		    r->length > tree->file_size - r->offset) {
+			libfsverity_error_msg("changed range %" PRIu64 "+%" PRIu64 " is beyond the end of the file",
+					      r->offset, r->length);
+			free(ranges);
+			return -EINVAL;
+		}
+		if (r->length == 0)
+			continue;
+		ranges[n].start = r->offset / tree->block_size;
+		ranges[n].end = DIV_ROUND_UP(r->offset + r->length,
+					     tree->block_size);
+		n++;
+	}
+	/*
+	 * The root hash of a file that is one block or smaller is the hash of
+	 * its only data block, so always rehash that block.
+	 */
+	if (tree->num_levels == 0) {
+		ranges[0].start = 0;
+		ranges[0].end = 1;
+		n = 1;
+	}
+	qsort(ranges, n, sizeof(ranges[0]), cmp_block_ranges);
+	*ranges_ret = ranges;
+	*num_ranges_ret = merge_block_ranges(ranges, n);
+	return 0;
+}
+
+/*
+ * Replace the block ranges @ranges at some level with the ranges of the blocks
+ * at the next level up that contain their hashes, and return the new number of
+ * ranges.
+ */
+static size_t get_parent_block_ranges(const struct merkle_tree *tree,
+				      struct block_range *ranges, size_t n)
+{
+	size_t i;
+
+	for (i = 0; i < n; i++) {
+		ranges[i].start /= tree->hashes_per_block;
+		ranges[i].end = DIV_ROUND_UP(ranges[i].end,
+					     tree->hashes_per_block);
+	}
+	return merge_block_ranges(ranges, n);
+}
+
+/*
+ * Get the location of the hash of the block @index at @level - 1 (where level
+ * -1 is the data blocks): either within the parent block in @tree_buf, or
+ * @root_hash if there is no parent block.
+ */
+static u8 *get_hash_location(const struct merkle_tree *tree, u8 *tree_buf,
+			     int level, u64 index, u8 *root_hash)
+{
+	u64 parent;
+
+	if (level == tree->num_levels)
+		return root_hash;
+	parent = tree->level_start[level] + index / tree->hashes_per_block;
+	return &tree_buf[parent * tree->block_size +
+			 (index % tree->hashes_per_block) *
+			 tree->alg->digest_size];
+}
+
+/* Rehash the data blocks @ranges, storing the hashes in the tree. */
+static int rehash_data_blocks(const struct merkle_tree *tree,
+			      struct hash_ctx *hash, void *fd,
+			      libfsverity_pread_fn_t pread_fn,
+			      const struct block_range *ranges, size_t n,
+			      u8 *tree_buf, u8 *root_hash)
+{
+	const u32 block_size = tree->block_size;
+	const u32 digest_size = tree->alg->digest_size;
+	u8 hashes[HASH_BATCH_BLOCKS * FS_VERITY_MAX_DIGEST_SIZE];
+	u8 *buf;
+	size_t i;
+	int err = 0;
+
+	buf = libfsverity_malloc((size_t)HASH_BATCH_BLOCKS * block_size);
+	if (!buf)
+		return -ENOMEM;
+	for (i = 0; i < n; i++) {
+		u64 index = ranges[i].start;
+
+		while (index < ranges[i].end) {
+			u64 count = min(ranges[i].end - index,
+					(u64)HASH_BATCH_BLOCKS);
+			u64 offset = index * block_size;
+			size_t size = min(count * block_size,
+					  tree->file_size - offset);
+			u64 j;
+
+			err = pread_fn(fd, buf, size, offset);
+			if (err) {
+				libfsverity_error_msg("error reading file");
+				goto out;
+			}
+			memset(&buf[size], 0, count * block_size - size);
+			libfsverity_hash_mb(hash, buf, block_size, count,
+					    hashes);
+			for (j = 0; j < count; j++)
+				memcpy(get_hash_location(tree, tree_buf, 0,
+							 index + j, root_hash),
+				       &hashes[j * digest_size], digest_size);
+			index += count;
+		}
+	}
+out:
+	free(buf);
+	return err;
+}
+
+/*
+ * Rehash the blocks @ranges at @level, storing the hashes in the next level up
+ * and reporting the blocks to the metadata callbacks.
+ */
+static int rehash_tree_blocks(const struct merkle_tree *tree,
+			      struct hash_ctx *hash, int level,
+			      const struct block_range *ranges, size_t n,
+			      u8 *tree_buf, u8 *root_hash)
+{
+	const u32 block_size = tree->block_size;
+	const u32 digest_size = tree->alg->digest_size;
+	u8 hashes[HASH_BATCH_BLOCKS * FS_VERITY_MAX_DIGEST_SIZE];
+	size_t i;
+	int err;
+
+	for (i = 0; i < n; i++) {
+		u64 index = ranges[i].start;
+
+		while (index < ranges[i].end) {
+			u64 count = min(ranges[i].end - index,
+					(u64)HASH_BATCH_BLOCKS);
+			const u8 *blocks = &tree_buf[(tree->level_start[level] +
+						      index) * block_size];
+			u64 j;
+
+			libfsverity_hash_mb(hash, blocks, block_size, count,
+					    hashes);
+			for (j = 0; j < count; j++) {
+				err = report_merkle_tree_block(tree,
+							&blocks[j * block_size],
+							level, index + j);
+				if (err)
+					return err;
+				memcpy(get_hash_location(tree, tree_buf,
+							 level + 1, index + j,
+							 root_hash),
+				       &hashes[j * digest_size], digest_size);
+			}
+			index += count;
+		}
+	}
+	return 0;
+}
+
+/*
+ * Update the file's Merkle tree @tree_buf in place after the data @changed has
+ * changed, and compute the new root hash.
+ */
+static int update_root_hash(void *fd,
+			    const struct libfsverity_merkle_tree_params *params,
+			    struct hash_ctx *hash, u32 block_size,
+			    const struct libfsverity_range *changed,
+			    size_t num_changed, u8 *tree_buf, size_t tree_size,
+			    u8 *root_hash)
+{
+	struct merkle_tree tree = {
+		.alg = hash->alg,
+		.file_size = params->file_size,
+		.block_size = block_size,
+		.hashes_per_block = block_size / hash->alg->digest_size,
+		.salt_size = roundup(params->salt_size, hash->alg->block_size),
+		.metadata_cbs = params->metadata_callbacks,
+	};
+	u8 *padded_salt = NULL;
+	u64 tree_blocks;
+	struct block_range *ranges = NULL;
+	size_t n;
+	int level;
+	int err;
+
+	err = compute_tree_geometry(&tree, &tree_blocks);
+	if (err)
+		return err;
+	if (tree_blocks * block_size != tree_size) {
+		libfsverity_error_msg("Merkle tree size (%zu) doesn't match the file size (%" PRIu64 ")",
+				      tree_size, params->file_size);
+		return -EINVAL;
+	}
+	err = get_changed_data_blocks(&tree, changed, num_changed,
+				      &ranges, &n);
+	if (err)
+		return err;
+	err = report_merkle_tree_size(tree.metadata_cbs, tree_size);
+	if (err)
+		goto out;
+
+	/* Root hash of empty file is all 0's */
+	if (params->file_size == 0) {
+		memset(root_hash, 0, hash->alg->digest_size);
+		goto out;
+	}
+
+	if (params->salt_size != 0) {
+		padded_salt = libfsverity_zalloc(tree.salt_size);
+		if (!padded_salt) {
+			err = -ENOMEM;
+			goto out;
+		}
+		memcpy(padded_salt, params->salt, params->salt_size);
+		tree.salt = padded_salt;
+	}
+	libfsverity_hash_set_prefix(hash, tree.salt, tree.salt_size);
+
+	err = rehash_data_blocks(&tree, hash, fd, params->pread_fn, ranges, n,
+				 tree_buf, root_hash);
+	if (err)
+		goto out;
+
+	/*
+	 * Rehash the blocks that contain the changed hashes, level by level.
+	 * The top level always has exactly one block, whose hash is the root
+	 * hash, so always rehash it even if no data changed.
+	 */
+	for (level = 0; level < tree.num_levels; level++) {
+		n = get_parent_block_ranges(&tree, ranges, n);
+		if (level == tree.num_levels - 1) {
+			ranges[0].start = 0;
+			ranges[0].end = 1;
+			n = 1;
+		}
+		err = rehash_tree_blocks(&tree, hash, level, ranges, n,
+					 tree_buf, root_hash);
+		if (err)
+			goto out;
+	}
+out:
+	free(ranges);
+	free(padded_salt);
+	return err;
+}
+
+LIBEXPORT int
+libfsverity_update_merkle_tree(void *fd,
+			       const struct libfsverity_merkle_tree_params *params,
+			       const struct libfsverity_range *changed,
+			       size_t num_changed,
+			       uint8_t *tree, size_t tree_size,
+			       struct libfsverity_digest **digest_ret)
+{
+	const struct fsverity_hash_alg *hash_alg;
+	u32 block_size;
+	struct hash_ctx *hash = NULL;
+	struct fsverity_descriptor desc;
+	int err;
+
+	if (!params || !digest_ret || !params->pread_fn ||
+	    (!changed && num_changed) || (!tree && tree_size)) {
+		libfsverity_error_msg("missing required parameters for update_merkle_tree");
+		return -EINVAL;
+	}
+
+	err = check_tree_params(params, false, &hash_alg, &block_size);
+	if (err)
+		return err;
+
+	err = libfsverity_create_hash_ctx(hash_alg, params->hash_impl,
+					  params->openssl_libctx, &hash);
+	if (err)
+		return err;
+
+	init_descriptor(&desc, params, block_size);
+	err = update_root_hash(fd, params, hash, block_size, changed,
+			       num_changed, tree, tree_size, desc.root_hash);
+	if (err)
+		goto out;
+
+	err = finish_digest(hash, &desc, params->metadata_callbacks,
+			    digest_ret);
+out:
+	libfsverity_free_hash_ctx(hash);
+	return err;
+}
+
+/* A Merkle tree that is being computed incrementally as data is appended */
+struct libfsverity_partial_tree {
+	struct merkle_tree tree;
+	struct hash_ctx *hash;
+	u8 *padded_salt;
+	/* The descriptor, except for data_size and root_hash */
+	struct fsverity_descriptor desc;
+	u64 data_size;
+	struct tree_builder b;
+};
+
+#define PARTIAL_TREE_MAGIC		"FSVPTREE"
+#define PARTIAL_TREE_FORMAT_VERSION	1
+
+/*
+ * The format of a saved partial tree.  All integers are little endian.  The
+ * header is followed by a partial_tree_level for each level from -1 (the data
+ * blocks) through top_level, each followed by that level's pending data, and
+ * finally by the hash of everything before it, using the tree's hash algorithm.
+ */
+struct partial_tree_header {
+	char magic[8];			/* PARTIAL_TREE_MAGIC */
+	__le32 format_version;		/* PARTIAL_TREE_FORMAT_VERSION */
+	u8 hash_algorithm;
+	u8 log_blocksize;
+	u8 salt_size;
+	u8 top_level;
+	__le64 data_size;
+	u8 salt[FS_VERITY_MAX_SALT_SIZE];
+};
+
+struct partial_tree_level {
+	__le64 next_index;		/* number of blocks already hashed */
+	__le32 filled;			/* number of bytes pending */
+	__le32 reserved;
+};
+
+/* Create an empty partial tree. */
+static int partial_tree_create(const struct libfsverity_merkle_tree_params *params,
+			       struct libfsverity_partial_tree **ptree_ret)
+{
+	const struct fsverity_hash_alg *hash_alg;
+	u32 block_size;
+	struct libfsverity_partial_tree *ptree;
+	int err;
+
+	err = check_tree_params(params, false, &hash_alg, &block_size);
+	if (err)
+		return err;
+
+	ptree = libfsverity_zalloc(sizeof(*ptree));
+	if (!ptree)
+		return -ENOMEM;
+	ptree->tree.alg = hash_alg;
+	ptree->tree.block_size = block_size;
+	ptree->tree.hashes_per_block = block_size / hash_alg->digest_size;
+	ptree->tree.salt_size = roundup(params->salt_size,
+					hash_alg->block_size);
+	init_descriptor(&ptree->desc, params, block_size);
+	err = tree_builder_init_growable(&ptree->b, &ptree->tree, NULL);
+	if (err)
+		goto err;
+
+	if (params->salt_size != 0) {
+		ptree->padded_salt = libfsverity_zalloc(ptree->tree.salt_size);
+		if (!ptree->padded_salt) {
+			err = -ENOMEM;
+			goto err;
+		}
+		memcpy(ptree->padded_salt, params->salt, params->salt_size);
+		ptree->tree.salt = ptree->padded_salt;
+	}
+	err = libfsverity_create_hash_ctx(hash_alg, params->hash_impl,
+					  params->openssl_libctx, &ptree->hash);
+	if (err)
+		goto err;
+	libfsverity_hash_set_prefix(ptree->hash, ptree->tree.salt,
+				    ptree->tree.salt_size);
+	ptree->b.hash = ptree->hash;
+	*ptree_ret = ptree;
+	return 0;
+
+err:
+	libfsverity_partial_tree_free(ptree);
+	return err;
+}
+
+LIBEXPORT int
+libfsverity_partial_tree_new(const struct libfsverity_merkle_tree_params *params,
+			     struct libfsverity_partial_tree **ptree_ret)
+{
+	if (!params || !ptree_ret) {
+		libfsverity_error_msg("missing required parameters for partial_tree_new");
+		return -EINVAL;
+	}
+	return partial_tree_create(params, ptree_ret);
+}
+
+LIBEXPORT int
+libfsverity_partial_tree_append(struct libfsverity_partial_tree *ptree,
+				const void *data, size_t size)
+{
+	int err;
+
+	if (!ptree || (!data && size)) {
+		libfsverity_error_msg("missing required parameters for partial_tree_append");
+		return -EINVAL;
+	}
+	err = append_data(&ptree->b, data, size);
+	if (err)
+		return err;
+	ptree->data_size += size;
+	return 0;
+}
+
+LIBEXPORT uint64_t
+libfsverity_partial_tree_data_size(const struct libfsverity_partial_tree *ptree)
+{
+	if (!ptree)
+		return 0;
+	return ptree->data_size;
+}
+
+/*
+ * Hash the whole blocks that are pending at each level, leaving only the
+ * partial blocks pending.  This keeps repeated calls to
+ * libfsverity_partial_tree_digest() from hashing the same blocks each time.
+ */
+static int hash_whole_pending_blocks(struct tree_builder *b)
+{
+	const u32 block_size = b->tree->block_size;
+	int level;
+	int err;
+
+	for (level = -1; level < b->top_level; level++) {
+		struct block_buffer *buf = &b->buffers[level];
+		u32 partial = buf->filled % block_size;
+		u32 whole = buf->filled - partial;
+
+		if (whole == 0)
+			continue;
+		buf->filled = whole;
+		err = hash_pending_blocks(b, level);
+		if (err)
+			return err;
+		memmove(buf->data, &buf->data[whole], partial);
+		buf->filled = partial;
+	}
+	return 0;
+}
+
+LIBEXPORT int
+libfsverity_partial_tree_digest(struct libfsverity_partial_tree *ptree,
+				struct libfsverity_digest **digest_ret)
+{
+	struct fsverity_descriptor desc;
+	struct tree_builder b;
+	int err;
+
+	if (!ptree || !digest_ret) {
+		libfsverity_error_msg("missing required parameters for partial_tree_digest");
+		return -EINVAL;
+	}
+	desc = ptree->desc;
+	desc.data_size = cpu_to_le64(ptree->data_size);
+
+	/* Root hash of empty file is all 0's */
+	if (ptree->data_size != 0) {
+		err = hash_whole_pending_blocks(&ptree->b);
+		if (err)
+			return err;
+		/* Finish a copy of the tree, so that more data can be added. */
+		err = tree_builder_clone(&b, &ptree->b);
+		if (!err)
+			err = finish_pending_blocks(&b, -1);
+		if (!err && WARN_ON(b.buffers[b.top_level].filled !=
+				    ptree->tree.alg->digest_size))
+			err = -EINVAL;
+		if (!err)
+			memcpy(desc.root_hash, b.buffers[b.top_level].data,
+			       ptree->tree.alg->digest_size);
+		tree_builder_destroy(&b);
+		if (err)
+			return err;
+	}
+	return finish_digest(ptree->hash, &desc, NULL, digest_ret);
+}
+
+LIBEXPORT int
+libfsverity_partial_tree_save(struct libfsverity_partial_tree *ptree,
+			      uint8_t **state_ret, size_t *state_size_ret)
+{
+	const struct tree_builder *b;
+	struct partial_tree_header hdr;
+	struct partial_tree_level lvl;
+	size_t size;
+	u8 *state, *p;
+	int level;
+	int err;
+
+	if (!ptree || !state_ret || !state_size_ret) {
+		libfsverity_error_msg("missing required parameters for partial_tree_save");
+		return -EINVAL;
+	}
+	b = &ptree->b;
+
+	size = sizeof(hdr) + ptree->tree.alg->digest_size;
+	for (level = -1; level <= b->top_level; level++)
+		size += sizeof(lvl) + b->buffers[level].filled;
+	state = libfsverity_zalloc(size);
+	if (!state)
+		return -ENOMEM;
+
+	memset(&hdr, 0, sizeof(hdr));
+	memcpy(hdr.magic, PARTIAL_TREE_MAGIC, sizeof(hdr.magic));
+	hdr.format_version = cpu_to_le32(PARTIAL_TREE_FORMAT_VERSION);
+	hdr.hash_algorithm = ptree->desc.hash_algorithm;
+	hdr.log_blocksize = ptree->desc.log_blocksize;
+	hdr.salt_size = ptree->desc.salt_size;
+	hdr.top_level = b->top_level;
+	hdr.data_size = cpu_to_le64(ptree->data_size);
+	memcpy(hdr.salt, ptree->desc.salt, sizeof(hdr.salt));
+	memcpy(state, &hdr, sizeof(hdr));
+	p = state + sizeof(hdr);
+
+	for (level = -1; level <= b->top_level; level++) {
+		const struct block_buffer *buf = &b->buffers[level];
+
+		memset(&lvl, 0, sizeof(lvl));
+		if (level < 0)
+			lvl.next_index = cpu_to_le64((ptree->data_size -
+						      buf->filled) /
+						     ptree->tree.block_size);
+		else if (level < b->top_level)
+			lvl.next_index = cpu_to_le64(b->next_index[level]);
+		lvl.filled = cpu_to_le32(buf->filled);
+		memcpy(p, &lvl, sizeof(lvl));
+		p += sizeof(lvl);
+		memcpy(p, buf->data, buf->filled);
+		p += buf->filled;
+	}
+	libfsverity_hash_full(ptree->hash, state, p - state, p);
+	/* This also catches errors in hashing the data appended so far. */
+	err = libfsverity_hash_error(ptree->hash);
+	if (err) {
+		free(state);
+		return err;
+	}
+
+	*state_ret = state;
+	*state_size_ret = size;
+	return 0;
+}
+
+/*
+ * Load the pending blocks and block counts of each level from a saved partial
+ * tree, checking that they are consistent with each other.
+ */
+static int load_partial_tree_levels(struct libfsverity_partial_tree *ptree,
+				    const struct partial_tree_header *hdr,
+				    const u8 *p, const u8 *end)
+{
+	const u32 block_size = ptree->tree.block_size;
+	const u32 digest_size = ptree->tree.alg->digest_size;
+	struct tree_builder *b = &ptree->b;
+	/* The number of bytes that have been appended to the current level */
+	u64 expected = le64_to_cpu(hdr->data_size);
+	struct partial_tree_level lvl;
+	int level;
+	int err;
+
+	if (hdr->top_level >= FS_VERITY_MAX_LEVELS)
+		return -EBADMSG;
+	for (level = -1; level <= hdr->top_level; level++) {
+		u64 next_index;
+		u32 filled;
+
+		if (end - p < (ptrdiff_t)sizeof(lvl))
+			return -EBADMSG;
+		memcpy(&lvl, p, sizeof(lvl));
+		p += sizeof(lvl);
+		next_index = le64_to_cpu(lvl.next_index);
+		filled = le32_to_cpu(lvl.filled);
+
+		if (level < hdr->top_level ?
+		    filled >= HASH_BATCH_BLOCKS * block_size :
+		    filled > digest_size || next_index != 0)
+			return -EBADMSG;
+		if (level >= 0 && filled % digest_size != 0)
+			return -EBADMSG;
+		if (next_index > expected / block_size ||
+		    next_index * block_size + filled != expected)
+			return -EBADMSG;
+		if (end - p < (ptrdiff_t)filled)
+			return -EBADMSG;
+
+		if (level > b->top_level) {
+			err = tree_builder_grow(b);
+			if (err)
+				return err;
+		}
+		memcpy(b->buffers[level].data, p, filled);
+		b->buffers[level].filled = filled;
+		if (level >= 0)
+			b->next_index[level] = next_index;
+		p += filled;
+		expected = next_index * digest_size;
+	}
+	if (p != end)
+		return -EBADMSG;
+	ptree->data_size = le64_to_cpu(hdr->data_size);
+	return 0;
+}
+
+LIBEXPORT int
+libfsverity_partial_tree_load(const struct libfsverity_merkle_tree_params *params,
+			      const uint8_t *state, size_t state_size,
+			      struct libfsverity_partial_tree **ptree_ret)
+{
+	struct libfsverity_partial_tree *ptree;
+	struct partial_tree_header hdr;
+	u8 hash[FS_VERITY_MAX_DIGEST_SIZE];
+	u32 digest_size;
+	int err;
+
+	if (!params || !state || !ptree_ret) {
+		libfsverity_error_msg("missing required parameters for partial_tree_load");
+		return -EINVAL;
+	}
+	err = partial_tree_create(params, &ptree);
+	if (err)
+		return err;
+	digest_size = ptree->tree.alg->digest_size;
+
+	err = -EBADMSG;
+	if (state_size < sizeof(hdr) + digest_size)
+		goto bad_state;
+	memcpy(&hdr, state, sizeof(hdr));
+	if (memcmp(hdr.magic, PARTIAL_TREE_MAGIC, sizeof(hdr.magic)) != 0 ||
+	    le32_to_cpu(hdr.format_version) != PARTIAL_TREE_FORMAT_VERSION)
+		goto bad_state;
+	if (hdr.hash_algorithm != ptree->desc.hash_algorithm ||
+	    hdr.log_blocksize != ptree->desc.log_blocksize ||
+	    hdr.salt_size != ptree->desc.salt_size ||
+	    memcmp(hdr.salt, ptree->desc.salt, sizeof(hdr.salt)) != 0) {
+		libfsverity_error_msg("saved partial tree doesn't match the Merkle tree parameters");
+		err = -EINVAL;
+		goto out_err;
+	}
+	libfsverity_hash_full(ptree->hash, state, state_size - digest_size,
+			      hash);
+	err = libfsverity_hash_error(ptree->hash);
+	if (err)
+		goto out_err;
+	err = -EBADMSG;
+	if (memcmp(hash, &state[state_size - digest_size], digest_size) != 0)
+		goto bad_state;
+	err = load_partial_tree_levels(ptree, &hdr, state + sizeof(hdr),
+				       state + state_size - digest_size);
+	if (err == -EBADMSG)
+		goto bad_state;
+	if (err)
+		goto out_err;
+	*ptree_ret = ptree;
+	return 0;
+
+bad_state:
+	libfsverity_error_msg("saved partial tree is invalid or corrupt");
+out_err:
+	libfsverity_partial_tree_free(ptree);
+	return err;
+}
+
+LIBEXPORT void
+libfsverity_partial_tree_free(struct libfsverity_partial_tree *ptree)
+{
+	if (!ptree)
+		return;
+	tree_builder_destroy(&ptree->b);
+	libfsverity_free_hash_ctx(ptree->hash);
+	free(ptree->padded_salt);
+	free(ptree);
+}
+
+/* A digest computation whose data is pushed by the caller */
+struct libfsverity_digest_ctx {
+	struct merkle_tree tree;
+	struct hash_ctx *hash;
+	u8 *padded_salt;
+	/* The descriptor, filled in except for the root hash until finished */
+	struct fsverity_descriptor desc;
+	u64 data_size;
+	/* If false, the builder is growable and tree.file_size is set last */
+	bool size_known;
+	bool finished;
+	struct tree_builder b;
+	/* The tree blocks to report once the size is known, if needed */
+	struct saved_level *saved_levels;
+};
+
+LIBEXPORT int
+libfsverity_digest_ctx_new(const struct libfsverity_merkle_tree_params *params,
+			   struct libfsverity_digest_ctx **ctx_ret)
+{
+	const struct fsverity_hash_alg *hash_alg;
+	u32 block_size;
+	struct libfsverity_digest_ctx *ctx;
+	const struct libfsverity_metadata_callbacks *cbs;
+	u64 tree_blocks = 0;
+	int err;
+
+	if (!params || !ctx_ret) {
+		libfsverity_error_msg("missing required parameters for digest_ctx_new");
+		return -EINVAL;
+	}
+	err = check_tree_params(params, false, &hash_alg, &block_size);
+	if (err)
+		return err;
+	cbs = params->metadata_callbacks;
+
+	ctx = libfsverity_zalloc(sizeof(*ctx));
+	if (!ctx)
+		return -ENOMEM;
+	ctx->tree.alg = hash_alg;
+	ctx->tree.block_size = block_size;
+	ctx->tree.hashes_per_block = block_size / hash_alg->digest_size;
+	ctx->tree.salt_size = roundup(params->salt_size, hash_alg->block_size);
+	ctx->tree.metadata_cbs = cbs;
+	ctx->size_known = (params->file_size != LIBFSVERITY_FILE_SIZE_UNKNOWN);
+	if (ctx->size_known) {
+		ctx->tree.file_size = params->file_size;
+		err = compute_tree_geometry(&ctx->tree, &tree_blocks);
+		if (err) {
+			free(ctx);
+			return err;
+		}
+		err = tree_builder_init(&ctx->b, &ctx->tree, NULL,
+					ctx->tree.num_levels);
+		if (err)
+			goto err;
+		tree_builder_start(&ctx->b, 0, ctx->desc.root_hash);
+	} else {
+		err = tree_builder_init_growable(&ctx->b, &ctx->tree, NULL);
+		if (err)
+			goto err;
+		if (cbs && cbs->merkle_tree_block) {
+			ctx->saved_levels = libfsverity_zalloc(
+				FS_VERITY_MAX_LEVELS *
+				sizeof(ctx->saved_levels[0]));
+			if (!ctx->saved_levels) {
+				err = -ENOMEM;
+				goto err;
+			}
+			ctx->b.saved_levels = ctx->saved_levels;
+		}
+	}
+	init_descriptor(&ctx->desc, params, block_size);
+
+	if (params->salt_size != 0) {
+		ctx->padded_salt = libfsverity_zalloc(ctx->tree.salt_size);
+		if (!ctx->padded_salt) {
+			err = -ENOMEM;
+			goto err;
+		}
+		memcpy(ctx->padded_salt, params->salt, params->salt_size);
+		ctx->tree.salt = ctx->padded_salt;
+	}
+	err = libfsverity_create_hash_ctx(hash_alg, params->hash_impl,
+					  params->openssl_libctx, &ctx->hash);
+	if (err)
+		goto err;
+	libfsverity_hash_set_prefix(ctx->hash, ctx->tree.salt,
+				    ctx->tree.salt_size);
+	ctx->b.hash = ctx->hash;
+
+	if (ctx->size_known) {
+		err = report_merkle_tree_size(cbs, tree_blocks * block_size);
+		if (err)
+			goto err;
+	}
+	*ctx_ret = ctx;
+	return 0;
+
+err:
+	libfsverity_digest_ctx_free(ctx);
+	return err;
+}
+
+LIBEXPORT int
+libfsverity_digest_ctx_update(struct libfsverity_digest_ctx *ctx,
+			      const void *data, size_t size)
+{
+	int err;
+
+	if (!ctx || (!data && size)) {
+		libfsverity_error_msg("missing required parameters for digest_ctx_update");
+		return -EINVAL;
+	}
+	if (ctx->finished) {
+		libfsverity_error_msg("digest_ctx_update called after digest_ctx_final");
+		return -EINVAL;
+	}
+	if (ctx->size_known && size > ctx->tree.file_size - ctx->data_size) {
+		libfsverity_error_msg("more data was given than file_size");
+		return -EINVAL;
+	}
+	err = append_data(&ctx->b, data, size);
+	if (err)
+		return err;
+	ctx->data_size += size;
+	return 0;
+}
+
+/*
+ * Finish the Merkle tree of a digest context whose data size wasn't known in
+ * advance.  Now that it is, fill in the rest of the descriptor and report the
+ * saved tree blocks to the metadata callbacks.
+ */
+static int finish_growable_tree(struct libfsverity_digest_ctx *ctx)
+{
+	struct merkle_tree *tree = &ctx->tree;
+	struct tree_builder *b = &ctx->b;
+	const u32 block_size = tree->block_size;
+	const u32 digest_size = tree->alg->digest_size;
+	u64 tree_blocks, end, i;
+	int level;
+	int err;
+
+	tree->file_size = ctx->data_size;
+	ctx->desc.data_size = cpu_to_le64(ctx->data_size);
+	if (ctx->data_size != 0) {
+		err = finish_pending_blocks(b, -1);
+		if (err)
+			return err;
+		if (WARN_ON(b->buffers[b->top_level].filled != digest_size))
+			return -EINVAL;
+		memcpy(ctx->desc.root_hash, b->buffers[b->top_level].data,
+		       digest_size);
+	}
+
+	err = compute_tree_geometry(tree, &tree_blocks);
+	if (err)
+		return err;
+	if (WARN_ON(tree->num_levels != b->top_level))
+		return -EINVAL;
+	err = report_merkle_tree_size(tree->metadata_cbs,
+				      tree_blocks * block_size);
+	if (err || !ctx->saved_levels)
+		return err;
+
+	/* Report the blocks in order, starting with the root level. */
+	end = tree_blocks;
+	for (level = 0; level < tree->num_levels; level++) {
+		const struct saved_level *saved = &ctx->saved_levels[level];
+		u64 blocks = end - tree->level_start[level];
+
+		if (WARN_ON(saved->size != blocks * block_size))
+			return -EINVAL;
+		end = tree->level_start[level];
+	}
+	for (level = tree->num_levels - 1; level >= 0; level--) {
+		const struct saved_level *saved = &ctx->saved_levels[level];
+
+		for (i = 0; i < saved->size / block_size; i++) {
+			err = report_merkle_tree_block(tree,
+						&saved->data[i * block_size],
+						level, i);
+			if (err)
+				return err;
+		}
+	}
+	return 0;
+}
+
+LIBEXPORT int
+libfsverity_digest_ctx_final(struct libfsverity_digest_ctx *ctx,
+			     struct libfsverity_digest **digest_ret)
+{
+	int err;
+
+	if (!ctx || !digest_ret) {
+		libfsverity_error_msg("missing required parameters for digest_ctx_final");
+		return -EINVAL;
+	}
+	if (ctx->finished) {
+		libfsverity_error_msg("digest_ctx_final called twice");
+		return -EINVAL;
+	}
+	if (ctx->size_known && ctx->data_size != ctx->tree.file_size) {
+		libfsverity_error_msg("less data was given than file_size");
+		return -EINVAL;
+	}
+	ctx->finished = true;
+
+	/* Root hash of empty file is all 0's */
+	if (!ctx->size_known) {
+		err = finish_growable_tree(ctx);
+		if (err)
+			return err;
+	} else if (ctx->tree.file_size != 0) {
+		err = finish_pending_blocks(&ctx->b, -1);
+		if (err)
+			return err;
+		/* Root hash was filled by the last hash_pending_blocks() */
+		if (WARN_ON(ctx->b.buffers[ctx->tree.num_levels].filled !=
+			    ctx->tree.alg->digest_size))
+			return -EINVAL;
+	}
+	return finish_digest(ctx->hash, &ctx->desc, ctx->tree.metadata_cbs,
+			     digest_ret);
+}
+
+LIBEXPORT void
+libfsverity_digest_ctx_free(struct libfsverity_digest_ctx *ctx)
+{
+	int level;
+
+	if (!ctx)
+		return;
+	tree_builder_destroy(&ctx->b);
+	if (ctx->saved_levels) {
+		for (level = 0; level < FS_VERITY_MAX_LEVELS; level++)
+			free(ctx->saved_levels[level].data);
+		free(ctx->saved_levels);
+	}
+	libfsverity_free_hash_ctx(ctx->hash);
+	free(ctx->padded_salt);
+	free(ctx);
+}
+
+/*
+ * The size of the chunks that libfsverity_compute_digest_multi() reads, by
+ * default.  This is small enough for each chunk to still be in the CPU cache
+ * when the last tree builder gets to it.
+ */
+#define MULTI_READ_CHUNK_SIZE	(256U << 10)
+
+LIBEXPORT int
+libfsverity_compute_digest_multi(void *fd, libfsverity_read_fn_t read_fn,
+				 const struct libfsverity_merkle_tree_params *params,
+				 size_t num_params,
+				 struct libfsverity_digest **digests)
+{
+	struct libfsverity_digest_ctx **ctxs = NULL;
+	u64 file_size, offset;
+	u32 chunk_size;
+	u8 *buf = NULL;
+	size_t i;
+	int err;
+
+	if (!params || num_params == 0 || !digests ||
+	    (!read_fn && !params[0].pread_fn)) {
+		libfsverity_error_msg("missing required parameters for compute_digest_multi");
+		return -EINVAL;
+	}
+	file_size = params[0].file_size;
+	for (i = 0; i < num_params; i++) {
+		if (params[i].file_size != file_size ||
+		    file_size == LIBFSVERITY_FILE_SIZE_UNKNOWN) {
+			libfsverity_error_msg("all parameter sets must have the same known file size");
+			return -EINVAL;
+		}
+	}
+	chunk_size = params[0].read_chunk_size ?: MULTI_READ_CHUNK_SIZE;
+
+	ctxs = libfsverity_zalloc(num_params * sizeof(ctxs[0]));
+	buf = libfsverity_malloc(min(file_size, (u64)chunk_size));
+	if (!ctxs || (!buf && file_size)) {
+		err = -ENOMEM;
+		goto out;
+	}
+	for (i = 0; i < num_params; i++) {
+		err = libfsverity_digest_ctx_new(&params[i], &ctxs[i]);
+		if (err)
+			goto out;
+	}
+
+	/* Read each chunk once, and feed it to every tree builder. */
+	for (offset = 0; offset < file_size; offset += chunk_size) {
+		u32 count = min(file_size - offset, (u64)chunk_size);
+
+		if (read_fn)
+			err = read_fn(fd, buf, count);
+		else
+			err = params[0].pread_fn(fd, buf, count, offset);
+		if (err)
+			goto out;
+		for (i = 0; i < num_params; i++) {
+			err = libfsverity_digest_ctx_update(ctxs[i], buf,
+							    count);
+			if (err)
+				goto out;
+		}
+	}
+
+	for (i = 0; i < num_params; i++) {
+		err = libfsverity_digest_ctx_final(ctxs[i], &digests[i]);
+		if (err) {
+			while (i)
+				free(digests[--i]);
+			goto out;
+		}
+	}
+	err = 0;
+out:
+	if (ctxs) {
+		for (i = 0; i < num_params; i++)
+			libfsverity_digest_ctx_free(ctxs[i]);
+	}
+	free(ctxs);
+	free(buf);
+	return err;
+}
+
+/*
+ * A context for computing the digests of many files that use the same Merkle
+ * tree parameters.  Everything that doesn't depend on the file is set up just
+ * once, and the buffers are kept from one file to the next.
+ */
+struct libfsverity_hasher {
+	struct merkle_tree tree;
+	struct hash_ctx *hash;
+	u8 *padded_salt;
+	/* The descriptor, except for data_size and root_hash */
+	struct fsverity_descriptor desc;
+	libfsverity_pread_fn_t pread_fn;
+	libfsverity_splice_fn_t splice_fn;
+	u32 read_chunk_size;
+	struct tree_builder b;
+	/*
+	 * The buffers for the pending blocks of levels -1 through num_bufs - 2,
+	 * allocated as larger files need them.  bufs[0] is also used by the
+	 * single-block case.
+	 */
+	u8 *bufs[1 + FS_VERITY_MAX_LEVELS];
+	int num_bufs;
+	/* The buffers for libfsverity_hasher_digest_buffers(), if allocated */
+	struct mb_group *group;
+};
+
+LIBEXPORT int
+libfsverity_hasher_new(const struct libfsverity_merkle_tree_params *params,
+		       struct libfsverity_hasher **hasher_ret)
+{
+	const struct fsverity_hash_alg *hash_alg;
+	u32 block_size;
+	struct libfsverity_hasher *h;
+	int err;
+
+	if (!params || !hasher_ret) {
+		libfsverity_error_msg("missing required parameters for hasher_new");
+		return -EINVAL;
+	}
+	err = check_tree_params(params, false, &hash_alg, &block_size);
+	if (err)
+		return err;
+
+	h = libfsverity_zalloc(sizeof(*h));
+	if (!h)
+		return -ENOMEM;
+	h->tree.alg = hash_alg;
+	h->tree.block_size = block_size;
+	h->tree.hashes_per_block = block_size / hash_alg->digest_size;
+	h->tree.salt_size = roundup(params->salt_size, hash_alg->block_size);
+	h->tree.metadata_cbs = params->metadata_callbacks;
+	init_descriptor(&h->desc, params, block_size);
+	h->pread_fn = params->pread_fn;
+	h->splice_fn = params->splice_fn;
+	h->read_chunk_size = params->read_chunk_size;
+
+	if (params->salt_size != 0) {
+		h->padded_salt = libfsverity_zalloc(h->tree.salt_size);
+		if (!h->padded_salt) {
+			err = -ENOMEM;
+			goto err;
+		}
+		memcpy(h->padded_salt, params->salt, params->salt_size);
+		h->tree.salt = h->padded_salt;
+	}
+	err = libfsverity_create_hash_ctx(hash_alg, params->hash_impl,
+					  params->openssl_libctx, &h->hash);
+	if (err)
+		goto err;
+	libfsverity_hash_set_prefix(h->hash, h->tree.salt, h->tree.salt_size);
+
+	/* The builder's buffers are assigned for each file. */
+	h->b.tree = &h->tree;
+	h->b.hash = h->hash;
+	h->b.buffers = &h->b._buffers[1];
+	*hasher_ret = h;
+	return 0;
+
+err:
+	libfsverity_hasher_free(h);
+	return err;
+}
+
+/* Make sure that the buffers for levels -1 through @top_level - 1 exist. */
+static int hasher_alloc_buffers(struct libfsverity_hasher *h, int top_level)
+{
+	while (h->num_bufs < top_level + 1) {
+		h->bufs[h->num_bufs] = libfsverity_malloc(HASH_BATCH_BLOCKS *
+							  h->tree.block_size);
+		if (!h->bufs[h->num_bufs])
+			return -ENOMEM;
+		h->num_bufs++;
+	}
+	return 0;
+}
+
+/*
+ * Compute the root hash of a file that is no larger than one block.  This is
+ * just the hash of its only data block, so the tree builder isn't needed.
+ */
+static int hasher_hash_single_block(struct libfsverity_hasher *h,
+				    const struct data_source *src,
+				    u8 *root_hash)
+{
+	const u32 block_size = h->tree.block_size;
+	const size_t count = h->tree.file_size;
+	u8 *block;
+	int err;
+
+	if (src->buf && count == block_size) {
+		libfsverity_hash_prefixed(h->hash, src->buf, block_size,
+					  root_hash);
+		return 0;
+	}
+	err = hasher_alloc_buffers(h, 0);
+	if (err)
+		return err;
+	block = h->bufs[0];
+	if (src->buf) {
+		memcpy(block, src->buf, count);
+	} else {
+		err = read_data(src, block, count, 0);
+		if (err)
+			return err;
+	}
+	memset(&block[count], 0, block_size - count);
+	libfsverity_hash_prefixed(h->hash, block, block_size, root_hash);
+	return 0;
+}
+
+/*
+ * Point the hasher's tree builder at @tree, which must have the same hash
+ * algorithm, block size, and salt as the hasher, and start computing levels
+ * [0, top_level) beginning at data block @first_block.  The hashes of the level
+ * top_level - 1 blocks will be appended to @out.
+ */
+static int hasher_start_builder(struct libfsverity_hasher *h,
+				const struct merkle_tree *tree, int top_level,
+				u64 first_block, u8 *out)
+{
+	struct tree_builder *b = &h->b;
+	int level;
+	int err;
+
+	err = hasher_alloc_buffers(h, top_level);
+	if (err)
+		return err;
+	b->tree = tree;
+	b->top_level = top_level;
+	for (level = -1; level < top_level; level++) {
+		b->buffers[level].data = h->bufs[level + 1];
+		b->buffers[level].filled = 0;
+	}
+	tree_builder_start(b, first_block, out);
+	return 0;
+}
+
+/* Compute the root hash of a file that is larger than one block. */
+static int hasher_hash_blocks(struct libfsverity_hasher *h,
+			      const struct data_source *src, u8 *root_hash)
+{
+	struct tree_builder *b = &h->b;
+	int err;
+
+	err = hasher_start_builder(h, &h->tree, h->tree.num_levels, 0,
+				   root_hash);
+	if (err)
+		return err;
+	err = hash_data_blocks(b, src, 0, DIV_ROUND_UP(h->tree.file_size,
+						       h->tree.block_size));
+	if (err)
+		return err;
+	/* Root hash was filled by the last call to hash_pending_blocks() */
+	if (WARN_ON(b->buffers[b->top_level].filled !=
+		    h->tree.alg->digest_size))
+		return -EINVAL;
+	return 0;
+}
+
+static int hasher_digest(struct libfsverity_hasher *h,
+			 const struct data_source *src, u64 file_size,
+			 u8 *digest)
+{
+	struct fsverity_descriptor *desc = &h->desc;
+	u64 tree_blocks;
+	int err;
+
+	h->tree.file_size = file_size;
+	err = compute_tree_geometry(&h->tree, &tree_blocks);
+	if (err)
+		return err;
+	err = report_merkle_tree_size(h->tree.metadata_cbs,
+				      tree_blocks * h->tree.block_size);
+	if (err)
+		return err;
+
+	desc->data_size = cpu_to_le64(file_size);
+	memset(desc->root_hash, 0, sizeof(desc->root_hash));
+	if (h->tree.num_levels != 0)
+		err = hasher_hash_blocks(h, src, desc->root_hash);
+	else if (file_size != 0)
+		err = hasher_hash_single_block(h, src, desc->root_hash);
+	/* else the root hash of an empty file is all 0's */
+	if (err)
+		return err;
+
+	/* Don't report a root hash that wasn't computed correctly. */
+	err = libfsverity_hash_error(h->hash);
+	if (err)
+		return err;
+	err = report_descriptor(h->tree.metadata_cbs, desc, sizeof(*desc));
+	if (err)
+		return err;
+	libfsverity_hash_full(h->hash, desc, sizeof(*desc), digest);
+	return libfsverity_hash_error(h->hash);
+}
+
+LIBEXPORT int
+libfsverity_hasher_digest(struct libfsverity_hasher *hasher,
+			  void *fd, libfsverity_read_fn_t read_fn,
+			  uint64_t file_size, uint8_t *digest)
+{
+	struct data_source src = { .fd = fd, .read_fn = read_fn };
+
+	if (!hasher || !digest || (!read_fn && !hasher->pread_fn)) {
+		libfsverity_error_msg("missing required parameters for hasher_digest");
+		return -EINVAL;
+	}
+	src.pread_fn = hasher->pread_fn;
+	src.splice_fn = hasher->splice_fn;
+	src.read_chunk_size = hasher->read_chunk_size;
+	libfsverity_hash_clear_error(hasher->hash);
+	return hasher_digest(hasher, &src, file_size, digest);
+}
+
+LIBEXPORT int
+libfsverity_hasher_digest_buffer(struct libfsverity_hasher *hasher,
+				 const void *data, uint64_t file_size,
+				 uint8_t *digest)
+{
+	const struct data_source src = { .buf = data };
+
+	if (!hasher || !digest || (!data && file_size)) {
+		libfsverity_error_msg("missing required parameters for hasher_digest_buffer");
+		return -EINVAL;
+	}
+	libfsverity_hash_clear_error(hasher->hash);
+	return hasher_digest(hasher, &src, file_size, digest);
+}
+
+/*
+ * The maximum number of files whose digests libfsverity_hasher_digest_buffers()
+ * computes together
+ */
+#define MB_GROUP_FILES		64
+
+/*
+ * The state of computing the digests of a group of small files together.  The
+ * data blocks of all the files are hashed together, HASH_BATCH_BLOCKS at a
+ * time, so that the multi-buffer hashing applies even when each file has just
+ * one block.  Then the level 0 tree blocks of the files that have more than
+ * one block are hashed together, and finally the descriptors.
+ */
+struct mb_group {
+	struct fsverity_descriptor descs[MB_GROUP_FILES];
+	/* The level 0 tree block of each file that has more than one block */
+	u8 *tree_blocks;
+	/* The file that each of tree_blocks belongs to */
+	u8 tree_block_owners[MB_GROUP_FILES];
+	int num_tree_blocks;
+	/* The data blocks waiting to be hashed, and where their hashes go */
+	u8 *data_blocks;
+	u8 *data_hash_dests[HASH_BATCH_BLOCKS];
+	int num_data_blocks;
+	/* Where each file's digest goes */
+	u8 *digest_dests[MB_GROUP_FILES];
+	int num_files;
+	/* Scratch space for the hashes of up to MB_GROUP_FILES blocks */
+	u8 hashes[MB_GROUP_FILES * FS_VERITY_MAX_DIGEST_SIZE];
+};
+
+static int hasher_alloc_group(struct libfsverity_hasher *h)
+{
+	struct mb_group *group;
+
+	if (h->group)
+		return 0;
+	group = libfsverity_zalloc(sizeof(*group));
+	if (!group)
+		return -ENOMEM;
+	group->tree_blocks = libfsverity_malloc(MB_GROUP_FILES *
+						h->tree.block_size);
+	group->data_blocks = libfsverity_malloc(HASH_BATCH_BLOCKS *
+						h->tree.block_size);
+	if (!group->tree_blocks || !group->data_blocks) {
+		free(group->tree_blocks);
+		free(group->data_blocks);
+		free(group);
+		return -ENOMEM;
+	}
+	h->group = group;
+	return 0;
+}
+
+/* Hash the pending data blocks of the group. */
+static void hash_group_data_blocks(struct libfsverity_hasher *h)
+{
+	struct mb_group *group = h->group;
+	const u32 digest_size = h->tree.alg->digest_size;
+	int i;
+
+	libfsverity_hash_mb(h->hash, group->data_blocks, h->tree.block_size,
+			    group->num_data_blocks, group->hashes);
+	for (i = 0; i < group->num_data_blocks; i++)
+		memcpy(group->data_hash_dests[i],
+		       &group->hashes[i * digest_size], digest_size);
+	group->num_data_blocks = 0;
+}
+
+/*
+ * Add a file to the group.  The file must have at most hashes_per_block data
+ * blocks, so that its Merkle tree has at most one level.  Its data blocks are
+ * queued for hashing, and if it has more than one, its level 0 tree block will
+ * be filled in with their hashes.
+ */
+static void add_file_to_group(struct libfsverity_hasher *h, const u8 *data,
+			      u64 file_size, u8 *digest)
+{
+	struct mb_group *group = h->group;
+	const u32 block_size = h->tree.block_size;
+	const u32 digest_size = h->tree.alg->digest_size;
+	struct fsverity_descriptor *desc = &group->descs[group->num_files];
+	const u64 num_blocks = DIV_ROUND_UP(file_size, block_size);
+	u8 *dest = desc->root_hash;
+	u64 i;
+
+	*desc = h->desc;
+	desc->data_size = cpu_to_le64(file_size);
+	memset(desc->root_hash, 0, sizeof(desc->root_hash));
+	if (num_blocks > 1) {
+		dest = &group->tree_blocks[group->num_tree_blocks * block_size];
+		memset(dest, 0, block_size);
+		group->tree_block_owners[group->num_tree_blocks++] =
+			group->num_files;
+	}
+	group->digest_dests[group->num_files++] = digest;
+
+	for (i = 0; i < num_blocks; i++) {
+		const size_t count = min(file_size - i * block_size,
+					 (u64)block_size);
+		u8 *block = &group->data_blocks[group->num_data_blocks *
+						block_size];
+
+		memcpy(block, &data[i * block_size], count);
+		memset(&block[count], 0, block_size - count);
+		group->data_hash_dests[group->num_data_blocks++] =
+			&dest[i * digest_size];
+		if (group->num_data_blocks == HASH_BATCH_BLOCKS)
+			hash_group_data_blocks(h);
+	}
+}
+
+/* Finish computing the digests of the files in the group. */
+static void finish_group(struct libfsverity_hasher *h)
+{
+	struct mb_group *group = h->group;
+	const u32 digest_size = h->tree.alg->digest_size;
+	int i;
+
+	hash_group_data_blocks(h);
+
+	libfsverity_hash_mb(h->hash, group->tree_blocks, h->tree.block_size,
+			    group->num_tree_blocks, group->hashes);
+	for (i = 0; i < group->num_tree_blocks; i++)
+		memcpy(group->descs[group->tree_block_owners[i]].root_hash,
+		       &group->hashes[i * digest_size], digest_size);
+	group->num_tree_blocks = 0;
+
+	libfsverity_hash_full_mb(h->hash, (const u8 *)group->descs,
+				 sizeof(group->descs[0]), group->num_files,
+				 group->hashes);
+	for (i = 0; i < group->num_files; i++)
+		memcpy(group->digest_dests[i], &group->hashes[i * digest_size],
+		       digest_size);
+	group->num_files = 0;
+}
+
+LIBEXPORT int
+libfsverity_hasher_digest_buffers(struct libfsverity_hasher *hasher,
+				  const void *const data[],
+				  const uint64_t file_sizes[], size_t num_files,
+				  uint8_t *digests)
+{
+	size_t i;
+	int err;
+
+	if (!hasher || (num_files && (!data || !file_sizes || !digests))) {
+		libfsverity_error_msg("missing required parameters for hasher_digest_buffers");
+		return -EINVAL;
+	}
+	for (i = 0; i < num_files; i++) {
+		if (!data[i] && file_sizes[i]) {
+			libfsverity_error_msg("missing required parameters for hasher_digest_buffers");
+			return -EINVAL;
+		}
+	}
+
+	libfsverity_hash_clear_error(hasher->hash);
+
+	/*
+	 * The metadata callbacks expect each file's metadata to be reported
+	 * together, so with them, just digest the files one at a time.
+	 */
+	if (!hasher->tree.metadata_cbs) {
+		err = hasher_alloc_group(hasher);
+		if (err)
+			return err;
+	}
+
+	for (i = 0; i < num_files; i++) {
+		u8 *digest = &digests[i * hasher->tree.alg->digest_size];
+		const struct data_source src = { .buf = data[i] };
+
+		if (!hasher->tree.metadata_cbs &&
+		    file_sizes[i] <= (u64)hasher->tree.block_size *
+				     hasher->tree.hashes_per_block) {
+			add_file_to_group(hasher, data[i], file_sizes[i],
+					  digest);
+			if (hasher->group->num_files == MB_GROUP_FILES)
+				finish_group(hasher);
+			continue;
+		}
+		/* This file is large enough to benefit on its own. */
+		err = hasher_digest(hasher, &src, file_sizes[i], digest);
+		if (err)
+			goto out;
+	}
+	err = 0;
+out:
+	if (hasher->group && hasher->group->num_files)
+		finish_group(hasher);
+	if (!err)
+		err = libfsverity_hash_error(hasher->hash);
+	return err;
+}
+
+LIBEXPORT void
+libfsverity_hasher_free(struct libfsverity_hasher *hasher)
+{
+	int i;
+
+	if (!hasher)
+		return;
+	for (i = 0; i < hasher->num_bufs; i++)
+		free(hasher->bufs[i]);
+	if (hasher->group) {
+		free(hasher->group->tree_blocks);
+		free(hasher->group->data_blocks);
+		free(hasher->group);
+	}
+	free(hasher->b.read_buf);
+	free(hasher->b.zero_block);
+	libfsverity_free_hash_ctx(hasher->hash);
+	free(hasher->padded_salt);
+	free(hasher);
+}
+
+/*
+ * libfsverity_compute_digests() splits files that are at least this large into
+ * chunks that can be hashed by different workers.
+ */
+#define MIN_SPLIT_FILE_SIZE	(16 << 20)
+
+/* A batch_task::chunk value meaning that the task is a whole job */
+#define BATCH_WHOLE_JOB		UINT64_MAX
+
+/* A unit of work for libfsverity_compute_digests() */
+struct batch_task {
+	size_t job;	/* index into batch_ctx::jobs */
+	u64 chunk;	/* chunk of the split job, or BATCH_WHOLE_JOB */
+};
+
+/*
+ * A worker's queue of tasks, as a ring buffer.  The worker takes tasks from the
+ * back, while other workers steal them from the front.  Each task takes much
+ * longer to run than the lock is held, so a plain mutex is good enough.
+ */
+struct task_deque {
+	pthread_mutex_t lock;
+	struct batch_task *tasks;
+	size_t head;
+	size_t count;
+	size_t capacity;
+};
+
+/* The state of a job that was split into chunks */
+struct split_job {
+	/*
+	 * The job's Merkle tree.  The salt isn't needed, as the hash contexts
+	 * of the workers' hashers already start from the salted state.
+	 */
+	struct merkle_tree tree;
+	struct data_source src;
+	int chunk_levels;	/* tree levels computed within each chunk */
+	u64 blocks_per_chunk;	/* data blocks per chunk */
+	u64 num_chunks;
+	u8 *chunk_hashes;	/* the hash of each chunk's top block */
+	u64 chunks_left;	/* chunks not yet hashed, accessed atomically */
+	int err;		/* first error that occurred, if any */
+	pthread_mutex_t cbs_lock;
+};
+
+struct batch_worker;
+
+struct batch_ctx {
+	struct libfsverity_digest_job *jobs;
+	size_t num_jobs;
+	struct split_job **splits;	/* the state of each split job */
+	struct batch_worker *workers;
+	u32 num_workers;
+	u64 pending;		/* tasks not yet done, accessed atomically */
+	/*
+	 * Idle workers wait on idle_cond until work_gen changes, which happens
+	 * whenever tasks are queued after the start or pending reaches 0.
+	 * work_gen is changed with idle_lock held and read atomically.
+	 */
+	pthread_mutex_t idle_lock;
+	pthread_cond_t idle_cond;
+	u64 work_gen;
+};
+
+struct batch_worker {
+	struct batch_ctx *ctx;
+	u32 id;
+	struct task_deque deque;
+	/* The hasher for the parameters of the most recent task, if any */
+	struct libfsverity_hasher *hasher;
+	pthread_t thread;
+};
+
+/* Make room for @n more tasks.  The caller must hold the lock. */
+static int deque_reserve(struct task_deque *dq, size_t n)
+{
+	struct batch_task *tasks;
+	size_t capacity = max(dq->capacity, (size_t)16);
+	size_t i;
+
+	while (capacity - dq->count < n)
+		capacity *= 2;
+	if (capacity == dq->capacity)
+		return 0;
+	tasks = libfsverity_malloc(capacity * sizeof(tasks[0]));
+	if (!tasks)
+		return -ENOMEM;
+	for (i = 0; i < dq->count; i++)
+		tasks[i] = dq->tasks[(dq->head + i) % dq->capacity];
+	free(dq->tasks);
+	dq->tasks = tasks;
+	dq->head = 0;
+	dq->capacity = capacity;
+	return 0;
+}
+
+/* Add @n tasks to the back of the queue, or none if out of memory. */
+static int deque_push(struct task_deque *dq, const struct batch_task *tasks,
+		      size_t n)
+{
+	size_t i;
+	int err;
+
+	pthread_mutex_lock(&dq->lock);
+	err = deque_reserve(dq, n);
+	if (!err) {
+		for (i = 0; i < n; i++) {
+			dq->tasks[(dq->head + dq->count) % dq->capacity] =
+				tasks[i];
+			dq->count++;
+		}
+	}
+	pthread_mutex_unlock(&dq->lock);
+	return err;
+}
+
+/* Take the task at the back of the queue, if any. */
+static bool deque_pop(struct task_deque *dq, struct batch_task *task)
+{
+	bool found = false;
+
+	pthread_mutex_lock(&dq->lock);
+	if (dq->count) {
+		dq->count--;
+		*task = dq->tasks[(dq->head + dq->count) % dq->capacity];
+		found = true;
+	}
+	pthread_mutex_unlock(&dq->lock);
+	return found;
+}
+
+/* Take the task at the front of the queue, if any. */
+static bool deque_steal(struct task_deque *dq, struct batch_task *task)
+{
+	bool found = false;
+
+	pthread_mutex_lock(&dq->lock);
+	if (dq->count) {
+		*task = dq->tasks[dq->head];
+		dq->head = (dq->head + 1) % dq->capacity;
+		dq->count--;
+		found = true;
+	}
+	pthread_mutex_unlock(&dq->lock);
+	return found;
+}
+
+/* Wake up the idle workers, as there may be new tasks or no more tasks. */
+static void batch_wake_workers(struct batch_ctx *ctx)
+{
+	pthread_mutex_lock(&ctx->idle_lock);
+	__atomic_add_fetch(&ctx->work_gen, 1, __ATOMIC_RELAXED);
+	pthread_cond_broadcast(&ctx->idle_cond);
+	pthread_mutex_unlock(&ctx->idle_lock);
+}
+
+/*
+ * Wait until there may be new tasks to take, or until all tasks are done, in
+ * which case return false.  @gen is the value of work_gen from before the
+ * caller last found no tasks.
+ */
+static bool batch_wait_for_work(struct batch_ctx *ctx, u64 gen)
+{
+	bool more;
+
+	pthread_mutex_lock(&ctx->idle_lock);
+	while (__atomic_load_n(&ctx->work_gen, __ATOMIC_RELAXED) == gen &&
+	       __atomic_load_n(&ctx->pending, __ATOMIC_ACQUIRE) != 0)
+		pthread_cond_wait(&ctx->idle_cond, &ctx->idle_lock);
+	more = __atomic_load_n(&ctx->pending, __ATOMIC_ACQUIRE) != 0;
+	pthread_mutex_unlock(&ctx->idle_lock);
+	return more;
+}
+
+/* Check whether @h computes digests using the Merkle tree parameters @params. */
+static bool hasher_matches_params(const struct libfsverity_hasher *h,
+				  const struct libfsverity_merkle_tree_params *params,
+				  u32 block_size)
+{
+	const struct fsverity_descriptor *desc = &h->desc;
+
+	return desc->hash_algorithm == (params->hash_algorithm ?:
+					FS_VERITY_HASH_ALG_DEFAULT) &&
+	       h->tree.block_size == block_size &&
+	       desc->salt_size == params->salt_size &&
+	       !memcmp(desc->salt, params->salt ?: desc->salt,
+		       params->salt_size) &&
+	       h->hash->impl == params->hash_impl &&
+	       h->hash->openssl_libctx == params->openssl_libctx;
+}
+
+/*
+ * Get a hasher for the Merkle tree parameters @params, reusing the worker's
+ * current one if it uses the same parameters.
+ */
+static int get_worker_hasher(struct batch_worker *w,
+			     const struct libfsverity_merkle_tree_params *params,
+			     struct libfsverity_hasher **hasher_ret)
+{
+	const struct fsverity_hash_alg *hash_alg;
+	u32 block_size;
+	int err;
+
+	err = check_tree_params(params, false, &hash_alg, &block_size);
+	if (err)
+		return err;
+	if (!w->hasher || !hasher_matches_params(w->hasher, params,
+						 block_size)) {
+		libfsverity_hasher_free(w->hasher);
+		w->hasher = NULL;
+		err = libfsverity_hasher_new(params, &w->hasher);
+		if (err)
+			return err;
+	}
+	w->hasher->tree.metadata_cbs = params->metadata_callbacks;
+	/* Each task starts afresh, so an earlier task's error doesn't matter. */
+	libfsverity_hash_clear_error(w->hasher->hash);
+	*hasher_ret = w->hasher;
+	return 0;
+}
+
+/*
+ * Try to split the job that uses the hasher @h into chunks which each cover
+ * one block at level chunk_levels - 1 of the Merkle tree, and queue them on the
+ * worker's queue.  Return 1 if the job was split, 0 if it isn't worth splitting
+ * (or the memory to split it couldn't be allocated), or a negative errno value
+ * if the job failed.
+ */
+static int split_job(struct batch_worker *w, size_t job_idx,
+		     struct libfsverity_hasher *h, const struct data_source *src)
+{
+	struct batch_ctx *ctx = w->ctx;
+	const struct libfsverity_merkle_tree_params *params =
+		ctx->jobs[job_idx].params;
+	struct split_job *split;
+	struct batch_task *tasks = NULL;
+	u64 tree_blocks;
+	u64 chunk;
+	int level;
+	int err;
+
+	if (ctx->num_workers < 2 || !src->pread_fn ||
+	    params->file_size < MIN_SPLIT_FILE_SIZE)
+		return 0;
+
+	split = libfsverity_zalloc(sizeof(*split));
+	if (!split)
+		return 0;
+	split->tree = h->tree;
+	split->tree.file_size = params->file_size;
+	split->tree.salt = NULL;
+	err = compute_tree_geometry(&split->tree, &tree_blocks);
+	if (err)
+		goto out;
+	split->chunk_levels = choose_chunk_levels(&split->tree,
+						  ctx->num_workers);
+	if (!split->chunk_levels)
+		goto out;
+	split->blocks_per_chunk = 1;
+	for (level = 0; level < split->chunk_levels; level++)
+		split->blocks_per_chunk *= split->tree.hashes_per_block;
+	split->num_chunks = DIV_ROUND_UP(DIV_ROUND_UP(params->file_size,
+						      split->tree.block_size),
+					 split->blocks_per_chunk);
+	split->chunk_hashes = libfsverity_zalloc(split->num_chunks *
+						 split->tree.alg->digest_size);
+	tasks = libfsverity_malloc(split->num_chunks * sizeof(tasks[0]));
+	if (!split->chunk_hashes || !tasks)
+		goto out;
+	split->src = *src;
+	split->src.read_fn = NULL;
+	split->chunks_left = split->num_chunks;
+	pthread_mutex_init(&split->cbs_lock, NULL);
+	split->tree.cbs_lock = &split->cbs_lock;
+
+	err = report_merkle_tree_size(params->metadata_callbacks,
+				      tree_blocks * split->tree.block_size);
+	if (err)
+		goto out_destroy_lock;
+
+	for (chunk = 0; chunk < split->num_chunks; chunk++) {
+		tasks[chunk].job = job_idx;
+		tasks[chunk].chunk = chunk;
+	}
+	ctx->splits[job_idx] = split;
+	/*
+	 * Count the chunks as pending before they can be stolen, so that the
+	 * count can't reach zero while this job is still being split.
+	 */
+	__atomic_add_fetch(&ctx->pending, split->num_chunks, __ATOMIC_RELAXED);
+	if (deque_push(&w->deque, tasks, split->num_chunks) != 0) {
+		__atomic_sub_fetch(&ctx->pending, split->num_chunks,
+				   __ATOMIC_RELAXED);
+		ctx->splits[job_idx] = NULL;
+		err = 0;
+		goto out_destroy_lock;
+	}
+	batch_wake_workers(ctx);
+	free(tasks);
+	return 1;
+
+out_destroy_lock:
+	pthread_mutex_destroy(&split->cbs_lock);
+out:
+	free(tasks);
+	free(split->chunk_hashes);
+	free(split);
+	return err;
+}
+
+/*
+ * Compute a job's digest, unless it gets split into chunks instead.  Return 1
+ * if it was split, otherwise 0 or a negative errno value.
+ */
+static int try_whole_job(struct batch_worker *w, size_t job_idx)
+{
+	struct libfsverity_digest_job *job = &w->ctx->jobs[job_idx];
+	const struct libfsverity_merkle_tree_params *params = job->params;
+	struct libfsverity_hasher *h;
+	struct libfsverity_digest *digest;
+	struct data_source src;
+	int err;
+
+	if (!params) {
+		libfsverity_error_msg("missing required parameters for compute_digests");
+		return -EINVAL;
+	}
+	err = init_file_source(&src, job->fd, job->read_fn, params);
+	if (err)
+		return err;
+	if (params->memo_size || params->flat_hash_algorithm) {
+		/*
+		 * The hasher doesn't support these, and the job can't be split
+		 * anyway, so compute the digest on its own in this thread.
+		 */
+		struct libfsverity_merkle_tree_params one_thread = *params;
+
+		one_thread.num_threads = 1;
+		return compute_digest(&src, &one_thread, &job->digest);
+	}
+	err = get_worker_hasher(w, params, &h);
+	if (err)
+		return err;
+	err = split_job(w, job_idx, h, &src);
+	if (err)
+		return err;
+
+	digest = libfsverity_zalloc(sizeof(*digest) +
+				    h->tree.alg->digest_size);
+	if (!digest)
+		return -ENOMEM;
+	digest->digest_algorithm = h->desc.hash_algorithm;
+	digest->digest_size = h->tree.alg->digest_size;
+	err = hasher_digest(h, &src, params->file_size, digest->digest);
+	if (err) {
+		free(digest);
+		return err;
+	}
+	job->digest = digest;
+	return 0;
+}
+
+/* Hash the upper levels of a split job's Merkle tree, and get its digest. */
+static int finish_split_job(struct libfsverity_hasher *h,
+			    struct libfsverity_digest_job *job,
+			    const struct split_job *split)
+{
+	const u32 digest_size = split->tree.alg->digest_size;
+	struct tree_builder *b = &h->b;
+	struct fsverity_descriptor desc;
+	u64 chunk;
+	int err;
+
+	init_descriptor(&desc, job->params, split->tree.block_size);
+	err = hasher_start_builder(h, &split->tree, split->tree.num_levels, 0,
+				   desc.root_hash);
+	if (err)
+		return err;
+	for (chunk = 0; chunk < split->num_chunks; chunk++) {
+		err = append_hash(b, split->chunk_levels,
+				  &split->chunk_hashes[chunk * digest_size]);
+		if (err)
+			return err;
+	}
+	err = finish_pending_blocks(b, split->chunk_levels);
+	if (err)
+		return err;
+	/* Root hash was filled by the last call to hash_pending_blocks() */
+	if (WARN_ON(b->buffers[b->top_level].filled != digest_size))
+		return -EINVAL;
+	return finish_digest(h->hash, &desc, job->params->metadata_callbacks,
+			     &job->digest);
+}
+
+static void run_whole_job(struct batch_worker *w, size_t job_idx)
+{
+	int err = try_whole_job(w, job_idx);
+
+	/* A split job's result is set by the worker that finishes it. */
+	if (err != 1)
+		w->ctx->jobs[job_idx].err = err;
+}
+
+/*
+ * Hash one chunk of a split job.  The worker that hashes the last chunk to
+ * finish also finishes the job.
+ */
+static void run_chunk(struct batch_worker *w, size_t job_idx, u64 chunk)
+{
+	struct libfsverity_digest_job *job = &w->ctx->jobs[job_idx];
+	struct split_job *split = w->ctx->splits[job_idx];
+	struct libfsverity_hasher *h;
+	u64 first_block = chunk * split->blocks_per_chunk;
+	int err;
+
+	/* After an error, the rest of the chunks are just skipped. */
+	if (__atomic_load_n(&split->err, __ATOMIC_RELAXED))
+		goto out;
+	err = get_worker_hasher(w, job->params, &h);
+	if (err)
+		goto out_err;
+	err = hasher_start_builder(h, &split->tree, split->chunk_levels,
+				   first_block,
+				   &split->chunk_hashes[chunk *
+						split->tree.alg->digest_size]);
+	if (err)
+		goto out_err;
+	err = hash_data_blocks(&h->b, &split->src, first_block,
+			       split->blocks_per_chunk);
+	if (!err)
+		err = libfsverity_hash_error(h->hash);
+out_err:
+	if (err) {
+		int zero = 0;
+
+		__atomic_compare_exchange_n(&split->err, &zero, err, false,
+					    __ATOMIC_RELAXED, __ATOMIC_RELAXED);
+	}
+out:
+	if (__atomic_sub_fetch(&split->chunks_left, 1, __ATOMIC_ACQ_REL) != 0)
+		return;
+
+	err = split->err;
+	if (!err) {
+		err = get_worker_hasher(w, job->params, &h);
+		if (!err)
+			err = finish_split_job(h, job, split);
+	}
+	job->err = err;
+	w->ctx->splits[job_idx] = NULL;
+	pthread_mutex_destroy(&split->cbs_lock);
+	free(split->chunk_hashes);
+	free(split);
+}
+
+/* Run tasks, stealing them from the other workers when out of work. */
+static void *batch_worker_main(void *_w)
+{
+	struct batch_worker *w = _w;
+	struct batch_ctx *ctx = w->ctx;
+	struct batch_task task;
+	u64 gen;
+	u32 i;
+
+	for (;;) {
+		bool found;
+
+		gen = __atomic_load_n(&ctx->work_gen, __ATOMIC_RELAXED);
+		found = deque_pop(&w->deque, &task);
+		for (i = 1; !found && i < ctx->num_workers; i++)
+			found = deque_steal(&ctx->workers[(w->id + i) %
+							  ctx->num_workers].deque,
+					    &task);
+		if (!found) {
+			/*
+			 * The remaining tasks are all running.  Sleep until
+			 * one of them queues the chunks of a split job, or
+			 * until they are all done.
+			 */
+			if (!batch_wait_for_work(ctx, gen))
+				break;
+			continue;
+		}
+		if (task.chunk == BATCH_WHOLE_JOB)
+			run_whole_job(w, task.job);
+		else
+			run_chunk(w, task.job, task.chunk);
+		if (__atomic_sub_fetch(&ctx->pending, 1, __ATOMIC_ACQ_REL) == 0)
+			batch_wake_workers(ctx);
+	}
+	return NULL;
+}
+
+LIBEXPORT int
+libfsverity_compute_digests(struct libfsverity_digest_job *jobs,
+			    size_t num_jobs, uint32_t num_workers)
+{
+	struct batch_ctx ctx = {
+		.jobs = jobs,
+		.num_jobs = num_jobs,
+		.num_workers = max(num_workers, 1U),
+		.idle_lock = PTHREAD_MUTEX_INITIALIZER,
+		.idle_cond = PTHREAD_COND_INITIALIZER,
+	};
+	struct batch_task task;
+	u32 num_running;
+	size_t i;
+	u32 w;
+	int err = 0;
+
+	if (!jobs && num_jobs) {
+		libfsverity_error_msg("missing required parameters for compute_digests");
+		return -EINVAL;
+	}
+	if (num_jobs == 0)
+		return 0;
+	/* More workers than jobs are only useful for splitting large files. */
+	ctx.num_workers = min((u64)ctx.num_workers, (u64)num_jobs * 1024);
+
+	ctx.splits = libfsverity_zalloc(num_jobs * sizeof(ctx.splits[0]));
+	ctx.workers = libfsverity_zalloc(ctx.num_workers *
+					 sizeof(ctx.workers[0]));
+	if (!ctx.splits || !ctx.workers) {
+		err = -ENOMEM;
+		goto out;
+	}
+	for (w = 0; w < ctx.num_workers; w++) {
+		ctx.workers[w].ctx = &ctx;
+		ctx.workers[w].id = w;
+		pthread_mutex_init(&ctx.workers[w].deque.lock, NULL);
+	}
+
+	/* Deal out the jobs round-robin. */
+	for (i = 0; i < num_jobs; i++) {
+		jobs[i].digest = NULL;
+		jobs[i].err = 0;
+		task.job = i;
+		task.chunk = BATCH_WHOLE_JOB;
+		err = deque_push(&ctx.workers[i % ctx.num_workers].deque,
+				 &task, 1);
+		if (err)
+			goto out;
+	}
+	ctx.pending = num_jobs;
+
+	/*
+	 * The calling thread is one of the workers.  If some threads can't be
+	 * created, just continue with fewer; the jobs queued for the missing
+	 * workers get stolen by the others.
+	 */
+	num_running = 1;
+	while (num_running < ctx.num_workers &&
+	       pthread_create(&ctx.workers[num_running].thread, NULL,
+			      batch_worker_main,
+			      &ctx.workers[num_running]) == 0)
+		num_running++;
+	batch_worker_main(&ctx.workers[0]);
+	for (w = 1; w < num_running; w++)
+		pthread_join(ctx.workers[w].thread, NULL);
+out:
+	if (ctx.workers) {
+		for (w = 0; w < ctx.num_workers; w++) {
+			libfsverity_hasher_free(ctx.workers[w].hasher);
+			free(ctx.workers[w].deque.tasks);
+			pthread_mutex_destroy(&ctx.workers[w].deque.lock);
+		}
+	}
+	free(ctx.workers);
+	free(ctx.splits);
+	pthread_cond_destroy(&ctx.idle_cond);
+	pthread_mutex_destroy(&ctx.idle_lock);
+	return err;
+}
+
+/* The approximate time that libfsverity_benchmark_hash_impl() runs for */
+#define BENCHMARK_NSECS		100000000
+
+static u64 get_time_ns(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (u64)ts.tv_sec * 1000000000 + ts.tv_nsec;
+}
+
+LIBEXPORT int
+libfsverity_benchmark_hash_impl(u32 alg_num, u32 impl, u32 block_size,
+				u64 *bytes_per_sec_ret)
+{
+	const struct fsverity_hash_alg *hash_alg;
+	struct hash_ctx *hash;
+	u8 hashes[HASH_BATCH_BLOCKS * FS_VERITY_MAX_DIGEST_SIZE];
+	u8 *data;
+	u64 start, elapsed;
+	u64 bytes = 0;
+	size_t i;
+	int err;
+
+	if (!bytes_per_sec_ret) {
+		libfsverity_error_msg("missing required parameters for benchmark_hash_impl");
+		return -EINVAL;
+	}
+	hash_alg = libfsverity_find_hash_alg_by_num(alg_num);
+	if (!hash_alg) {
+		libfsverity_error_msg("unknown hash algorithm: %u", alg_num);
+		return -EINVAL;
+	}
+	if (!is_power_of_2(block_size) ||
+	    block_size < 2 * hash_alg->digest_size) {
+		libfsverity_error_msg("unsupported block size (%u)",
+				      block_size);
+		return -EINVAL;
+	}
+
+	data = libfsverity_zalloc((size_t)HASH_BATCH_BLOCKS * block_size);
+	if (!data)
+		return -ENOMEM;
+	for (i = 0; i < (size_t)HASH_BATCH_BLOCKS * block_size; i++)
+		data[i] = i * 113;
+
+	err = libfsverity_create_hash_ctx(hash_alg, impl, NULL, &hash);
+	if (err)
+		goto out;
+
+	start = get_time_ns();
+	do {
+		libfsverity_hash_mb(hash, data, block_size, HASH_BATCH_BLOCKS,
+				    hashes);
+		bytes += (u64)HASH_BATCH_BLOCKS * block_size;
+		elapsed = get_time_ns() - start;
+	} while (elapsed < BENCHMARK_NSECS &&
+		 !libfsverity_hash_error(hash));
+
+	err = libfsverity_hash_error(hash);
+	if (!err)
+		*bytes_per_sec_ret = (u64)((double)bytes * 1000000000 /
+					   elapsed);
+	libfsverity_free_hash_ctx(hash);
+out:
+	free(data);
 	return err;
 }
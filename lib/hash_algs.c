@@ -11,16 +11,33 @@
 
 #include "lib_private.h"
 
+#ifndef FSVERITY_NO_OPENSSL_HASHING
 #include <openssl/evp.h>
+#endif
 #include <stdlib.h>
 #include <string.h>
+#ifdef __linux__
+#include <fcntl.h>
+#include <linux/if_alg.h>
+#include <sys/socket.h>
+#include <sys/uio.h>
+#include <unistd.h>
+#endif
 
 /* ========== libcrypto (OpenSSL) wrappers ========== */
 
+#ifndef FSVERITY_NO_OPENSSL_HASHING
+
+#if OPENSSL_VERSION_NUMBER >= 0x30000000L && !defined(OPENSSL_IS_BORINGSSL)
+#  define HAVE_OPENSSL_LIBCTX 1
+#endif
+
 struct openssl_hash_ctx {
 	struct hash_ctx base;	/* must be first */
 	EVP_MD_CTX *md_ctx;
+	EVP_MD_CTX *prefix_ctx;	/* state after hashing the prefix */
 	const EVP_MD *md;
+	EVP_MD *owned_md;	/* md, if it must be freed with the ctx */
 };
 
 static void openssl_digest_init(struct hash_ctx *_ctx)
@@ -51,6 +68,33 @@ static void openssl_digest_final(struct hash_ctx *_ctx, u8 *digest)
 	BUG_ON(ret != 1);
 }
 
+static void openssl_digest_save_prefix(struct hash_ctx *_ctx,
+				       const u8 *prefix, size_t size)
+{
+	struct openssl_hash_ctx *ctx = (void *)_ctx;
+	int ret;
+
+	ret = EVP_DigestInit_ex(ctx->prefix_ctx, ctx->md, NULL);
+	BUG_ON(ret != 1);
+	ret = EVP_DigestUpdate(ctx->prefix_ctx, prefix, size);
+	BUG_ON(ret != 1);
+}
+
+static void openssl_digest_hash_prefixed(struct hash_ctx *_ctx,
+					 const void *data, size_t size,
+					 u8 *digest)
+{
+	struct openssl_hash_ctx *ctx = (void *)_ctx;
+	int ret;
+
+	ret = EVP_MD_CTX_copy_ex(ctx->md_ctx, ctx->prefix_ctx);
+	BUG_ON(ret != 1);
+	ret = EVP_DigestUpdate(ctx->md_ctx, data, size);
+	BUG_ON(ret != 1);
+	ret = EVP_DigestFinal_ex(ctx->md_ctx, digest, NULL);
+	BUG_ON(ret != 1);
+}
+
 static void openssl_digest_ctx_free(struct hash_ctx *_ctx)
 {
 	struct openssl_hash_ctx *ctx = (void *)_ctx;
@@ -61,22 +105,70 @@ static void openssl_digest_ctx_free(struct hash_ctx *_ctx)
 	 * with older OpenSSL versions.
 	 */
 	EVP_MD_CTX_destroy(ctx->md_ctx);
+	EVP_MD_CTX_destroy(ctx->prefix_ctx);
+#ifdef HAVE_OPENSSL_LIBCTX
+	EVP_MD_free(ctx->owned_md);
+#endif
 	free(ctx);
 }
 
-static struct hash_ctx *
-openssl_digest_ctx_create(const struct fsverity_hash_alg *alg, const EVP_MD *md)
+#ifdef HAVE_OPENSSL_LIBCTX
+/*
+ * In OpenSSL 3, EVP_sha256() and EVP_sha512() return placeholder EVP_MDs, so
+ * each EVP_DigestInit_ex() with one has to look up the implementation in the
+ * providers again.  Avoid that by fetching the implementation explicitly.
+ *
+ * Implementations fetched from the default library context are cached in
+ * *@cached_md for the lifetime of the process.  Ones fetched from a caller's
+ * library context are returned in *@owned_md_ret instead, to be freed with the
+ * hash_ctx; they can't be cached, since the caller may free the context.
+ */
+static const EVP_MD *openssl_fetch_md(OSSL_LIB_CTX *libctx, const char *name,
+				      EVP_MD **cached_md,
+				      EVP_MD **owned_md_ret)
+{
+	EVP_MD *md, *expected = NULL;
+
+	if (libctx) {
+		md = EVP_MD_fetch(libctx, name, NULL);
+		*owned_md_ret = md;
+		return md;
+	}
+	md = __atomic_load_n(cached_md, __ATOMIC_ACQUIRE);
+	if (md)
+		return md;
+	md = EVP_MD_fetch(NULL, name, NULL);
+	if (md && !__atomic_compare_exchange_n(cached_md, &expected, md, false,
+					       __ATOMIC_ACQ_REL,
+					       __ATOMIC_ACQUIRE)) {
+		/* Another thread cached the same implementation first. */
+		EVP_MD_free(md);
+		md = expected;
+	}
+	return md;
+}
+#endif /* HAVE_OPENSSL_LIBCTX */
+
+/*
+ * Create a hash_ctx that uses @md.  If @owned_md is non-NULL, it is the same as
+ * @md, and ownership of it is transferred to the hash_ctx.
+ */
+static int openssl_digest_ctx_create(const struct fsverity_hash_alg *alg,
+				     const EVP_MD *md, EVP_MD *owned_md,
+				     struct hash_ctx **ctx_ret)
 {
 	struct openssl_hash_ctx *ctx;
 
 	ctx = libfsverity_zalloc(sizeof(*ctx));
 	if (!ctx)
-		return NULL;
+		goto err_free_md;
 
 	ctx->base.alg = alg;
 	ctx->base.init = openssl_digest_init;
 	ctx->base.update = openssl_digest_update;
 	ctx->base.final = openssl_digest_final;
+	ctx->base.save_prefix = openssl_digest_save_prefix;
+	ctx->base.hash_prefixed = openssl_digest_hash_prefixed;
 	ctx->base.free = openssl_digest_ctx_free;
 	/*
 	 * OpenSSL 1.1.0 renamed EVP_MD_CTX_create() to EVP_MD_CTX_new() but
@@ -84,36 +176,606 @@ openssl_digest_ctx_create(const struct fsverity_hash_alg *alg, const EVP_MD *md)
 	 * with older OpenSSL versions.
 	 */
 	ctx->md_ctx = EVP_MD_CTX_create();
-	if (!ctx->md_ctx) {
+	ctx->prefix_ctx = EVP_MD_CTX_create();
+	if (!ctx->md_ctx || !ctx->prefix_ctx) {
 		libfsverity_error_msg("failed to allocate EVP_MD_CTX");
-		goto err1;
+		goto err;
 	}
 
 	ctx->md = md;
-	if (WARN_ON(EVP_MD_size(md) != alg->digest_size))
-		goto err2;
+	ctx->owned_md = owned_md;
+	if (WARN_ON(EVP_MD_size(md) != alg->digest_size)) {
+		openssl_digest_ctx_free(&ctx->base);
+		return -EINVAL;
+	}
 
-	return &ctx->base;
+	/* Start with an empty prefix. */
+	openssl_digest_save_prefix(&ctx->base, NULL, 0);
+	*ctx_ret = &ctx->base;
+	return 0;
 
-err2:
-	EVP_MD_CTX_destroy(ctx->md_ctx);
-err1:
+err:
+	openssl_digest_ctx_free(&ctx->base);
+	return -ENOMEM;
+
+err_free_md:
+#ifdef HAVE_OPENSSL_LIBCTX
+	EVP_MD_free(owned_md);
+#endif
+	return -ENOMEM;
+}
+
+#ifdef HAVE_OPENSSL_LIBCTX
+/* Create a hash_ctx for the OpenSSL digest named @name. */
+static int openssl_fetched_ctx_create(const struct fsverity_hash_alg *alg,
+				      OSSL_LIB_CTX *libctx, const char *name,
+				      EVP_MD **cached_md,
+				      struct hash_ctx **ctx_ret)
+{
+	EVP_MD *owned_md = NULL;
+	const EVP_MD *md = openssl_fetch_md(libctx, name, cached_md, &owned_md);
+
+	if (!md) {
+		libfsverity_error_msg("%s is unavailable in OpenSSL", name);
+		return -EOPNOTSUPP;
+	}
+	return openssl_digest_ctx_create(alg, md, owned_md, ctx_ret);
+}
+#endif
+
+/*
+ * Without library context support, @libctx is always NULL here, since
+ * libfsverity_create_hash_ctx() rejects anything else.
+ */
+
+static int openssl_sha256_ctx_create(const struct fsverity_hash_alg *alg,
+				     void *libctx __attribute__((unused)),
+				     struct hash_ctx **ctx_ret)
+{
+#ifdef HAVE_OPENSSL_LIBCTX
+	static EVP_MD *cached_md;
+
+	return openssl_fetched_ctx_create(alg, libctx, "SHA256", &cached_md,
+					  ctx_ret);
+#else
+	return openssl_digest_ctx_create(alg, EVP_sha256(), NULL, ctx_ret);
+#endif
+}
+
+static int openssl_sha512_ctx_create(const struct fsverity_hash_alg *alg,
+				     void *libctx __attribute__((unused)),
+				     struct hash_ctx **ctx_ret)
+{
+#ifdef HAVE_OPENSSL_LIBCTX
+	static EVP_MD *cached_md;
+
+	return openssl_fetched_ctx_create(alg, libctx, "SHA512", &cached_md,
+					  ctx_ret);
+#else
+	return openssl_digest_ctx_create(alg, EVP_sha512(), NULL, ctx_ret);
+#endif
+}
+#endif /* !FSVERITY_NO_OPENSSL_HASHING */
+
+/* ========== Built-in implementation wrappers ========== */
+
+struct sha256_hash_ctx {
+	struct hash_ctx base;	/* must be first */
+	struct sha256_state state;
+	struct sha256_state prefix_state;
+};
+
+static void builtin_sha256_init(struct hash_ctx *_ctx)
+{
+	struct sha256_hash_ctx *ctx = (void *)_ctx;
+
+	libfsverity_sha256_init(&ctx->state);
+}
+
+static void builtin_sha256_update(struct hash_ctx *_ctx,
+				  const void *data, size_t size)
+{
+	struct sha256_hash_ctx *ctx = (void *)_ctx;
+
+	libfsverity_sha256_update(&ctx->state, data, size);
+}
+
+static void builtin_sha256_final(struct hash_ctx *_ctx, u8 *digest)
+{
+	struct sha256_hash_ctx *ctx = (void *)_ctx;
+
+	libfsverity_sha256_final(&ctx->state, digest);
+}
+
+static void builtin_sha256_save_prefix(struct hash_ctx *_ctx,
+				       const u8 *prefix, size_t size)
+{
+	struct sha256_hash_ctx *ctx = (void *)_ctx;
+
+	libfsverity_sha256_init(&ctx->prefix_state);
+	libfsverity_sha256_update(&ctx->prefix_state, prefix, size);
+}
+
+static void builtin_sha256_hash_prefixed(struct hash_ctx *_ctx,
+					 const void *data, size_t size,
+					 u8 *digest)
+{
+	struct sha256_hash_ctx *ctx = (void *)_ctx;
+
+	ctx->state = ctx->prefix_state;
+	libfsverity_sha256_update(&ctx->state, data, size);
+	libfsverity_sha256_final(&ctx->state, digest);
+}
+
+struct sha512_hash_ctx {
+	struct hash_ctx base;	/* must be first */
+	struct sha512_state state;
+	struct sha512_state prefix_state;
+};
+
+static void builtin_sha512_init(struct hash_ctx *_ctx)
+{
+	struct sha512_hash_ctx *ctx = (void *)_ctx;
+
+	libfsverity_sha512_init(&ctx->state);
+}
+
+static void builtin_sha512_update(struct hash_ctx *_ctx,
+				  const void *data, size_t size)
+{
+	struct sha512_hash_ctx *ctx = (void *)_ctx;
+
+	libfsverity_sha512_update(&ctx->state, data, size);
+}
+
+static void builtin_sha512_final(struct hash_ctx *_ctx, u8 *digest)
+{
+	struct sha512_hash_ctx *ctx = (void *)_ctx;
+
+	libfsverity_sha512_final(&ctx->state, digest);
+}
+
+static void builtin_sha512_save_prefix(struct hash_ctx *_ctx,
+				       const u8 *prefix, size_t size)
+{
+	struct sha512_hash_ctx *ctx = (void *)_ctx;
+
+	libfsverity_sha512_init(&ctx->prefix_state);
+	libfsverity_sha512_update(&ctx->prefix_state, prefix, size);
+}
+
+static void builtin_sha512_hash_prefixed(struct hash_ctx *_ctx,
+					 const void *data, size_t size,
+					 u8 *digest)
+{
+	struct sha512_hash_ctx *ctx = (void *)_ctx;
+
+	ctx->state = ctx->prefix_state;
+	libfsverity_sha512_update(&ctx->state, data, size);
+	libfsverity_sha512_final(&ctx->state, digest);
+}
+
+static void builtin_hash_ctx_free(struct hash_ctx *ctx)
+{
 	free(ctx);
-	return NULL;
 }
 
-static struct hash_ctx *create_sha256_ctx(const struct fsverity_hash_alg *alg)
+static int builtin_sha256_ctx_create(const struct fsverity_hash_alg *alg,
+				     void *libctx __attribute__((unused)),
+				     struct hash_ctx **ctx_ret)
+{
+	struct sha256_hash_ctx *ctx;
+
+	ctx = libfsverity_zalloc(sizeof(*ctx));
+	if (!ctx)
+		return -ENOMEM;
+
+	ctx->base.alg = alg;
+	ctx->base.init = builtin_sha256_init;
+	ctx->base.update = builtin_sha256_update;
+	ctx->base.final = builtin_sha256_final;
+	ctx->base.save_prefix = builtin_sha256_save_prefix;
+	ctx->base.hash_prefixed = builtin_sha256_hash_prefixed;
+	ctx->base.free = builtin_hash_ctx_free;
+	builtin_sha256_save_prefix(&ctx->base, NULL, 0);
+	*ctx_ret = &ctx->base;
+	return 0;
+}
+
+static int builtin_sha512_ctx_create(const struct fsverity_hash_alg *alg,
+				     void *libctx __attribute__((unused)),
+				     struct hash_ctx **ctx_ret)
+{
+	struct sha512_hash_ctx *ctx;
+
+	ctx = libfsverity_zalloc(sizeof(*ctx));
+	if (!ctx)
+		return -ENOMEM;
+
+	ctx->base.alg = alg;
+	ctx->base.init = builtin_sha512_init;
+	ctx->base.update = builtin_sha512_update;
+	ctx->base.final = builtin_sha512_final;
+	ctx->base.save_prefix = builtin_sha512_save_prefix;
+	ctx->base.hash_prefixed = builtin_sha512_hash_prefixed;
+	ctx->base.free = builtin_hash_ctx_free;
+	builtin_sha512_save_prefix(&ctx->base, NULL, 0);
+	*ctx_ret = &ctx->base;
+	return 0;
+}
+
+/* ========== Linux kernel crypto API (AF_ALG) wrappers ========== */
+
+#ifdef __linux__
+
+/*
+ * The maximum amount of file data to splice into the pipe at once.  This fits
+ * in a pipe with the default capacity of 16 pages even when it isn't page
+ * aligned, so the splice_fn never blocks waiting for the pipe to be drained.
+ */
+#define AF_ALG_SPLICE_CHUNK_SIZE	32768
+
+struct af_alg_hash_ctx {
+	struct hash_ctx base;	/* must be first */
+	int tfm_fd;		/* socket bound to the hash algorithm */
+	int op_fd;		/* socket for hashing messages */
+	int pipe_fds[2];	/* for splicing data into op_fd, once needed */
+};
+
+/* Send data to be hashed.  The message is finished unless @more is true. */
+static int af_alg_send(struct af_alg_hash_ctx *ctx, const struct iovec *iov,
+		       int iovcnt, bool more)
+{
+	struct msghdr msg = {
+		.msg_iov = (struct iovec *)iov,
+		.msg_iovlen = iovcnt,
+	};
+	size_t total = 0;
+	ssize_t ret;
+	int i;
+
+	for (i = 0; i < iovcnt; i++)
+		total += iov[i].iov_len;
+	ret = sendmsg(ctx->op_fd, &msg, more ? MSG_MORE : 0);
+	if (ret < 0) {
+		int err = -errno;
+
+		libfsverity_error_msg("failed to send data to AF_ALG socket: %s",
+				      strerror(errno));
+		return err;
+	}
+	if ((size_t)ret != total) {
+		libfsverity_error_msg("short write to AF_ALG socket");
+		return -EIO;
+	}
+	return 0;
+}
+
+/*
+ * Read the digest of the current message.  The socket then starts a new
+ * message, whether the last data was sent with MSG_MORE or not.
+ */
+static int af_alg_read_digest(struct af_alg_hash_ctx *ctx, u8 *digest)
+{
+	ssize_t ret = read(ctx->op_fd, digest, ctx->base.alg->digest_size);
+
+	if (ret < 0) {
+		int err = -errno;
+
+		libfsverity_error_msg("failed to read digest from AF_ALG socket: %s",
+				      strerror(errno));
+		return err;
+	}
+	if (ret != ctx->base.alg->digest_size) {
+		libfsverity_error_msg("short read from AF_ALG socket");
+		return -EIO;
+	}
+	return 0;
+}
+
+/*
+ * Recover from a failure partway through a message.  The operation socket may
+ * hold part of the message and the pipe may hold unspliced data, so replace
+ * both; the pipe is recreated when next needed.  If the new socket can't be
+ * created, the later operations fail too.  Returns @err.
+ */
+static int af_alg_reset(struct af_alg_hash_ctx *ctx, int err)
+{
+	if (ctx->pipe_fds[0] >= 0) {
+		close(ctx->pipe_fds[0]);
+		close(ctx->pipe_fds[1]);
+		ctx->pipe_fds[0] = ctx->pipe_fds[1] = -1;
+	}
+	if (ctx->op_fd >= 0)
+		close(ctx->op_fd);
+	ctx->op_fd = accept4(ctx->tfm_fd, NULL, NULL, SOCK_CLOEXEC);
+	return err;
+}
+
+/* Like af_alg_reset(), but for operations that can't return the error. */
+static void af_alg_set_error(struct af_alg_hash_ctx *ctx, int err)
+{
+	af_alg_reset(ctx, err);
+	if (!ctx->base.err)
+		ctx->base.err = err;
+}
+
+static void af_alg_init(struct hash_ctx *_ctx __attribute__((unused)))
+{
+	/* The socket is already at the start of a new message. */
+}
+
+static void af_alg_update(struct hash_ctx *_ctx, const void *data, size_t size)
+{
+	struct af_alg_hash_ctx *ctx = (void *)_ctx;
+	struct iovec iov = { .iov_base = (void *)data, .iov_len = size };
+	int err = af_alg_send(ctx, &iov, 1, true);
+
+	if (err)
+		af_alg_set_error(ctx, err);
+}
+
+static void af_alg_final(struct hash_ctx *_ctx, u8 *digest)
+{
+	struct af_alg_hash_ctx *ctx = (void *)_ctx;
+	int err = af_alg_read_digest(ctx, digest);
+
+	if (err) {
+		memset(digest, 0, ctx->base.alg->digest_size);
+		af_alg_set_error(ctx, err);
+	}
+}
+
+/*
+ * The kernel can clone a hash state by accept()ing on the operation socket, but
+ * that and closing the clone would take more time than just hashing the prefix
+ * again, which can be sent in the same system call as the message.
+ */
+static void af_alg_save_prefix(struct hash_ctx *_ctx __attribute__((unused)),
+			       const u8 *prefix __attribute__((unused)),
+			       size_t size __attribute__((unused)))
+{
+}
+
+static void af_alg_hash_prefixed(struct hash_ctx *_ctx, const void *data,
+				 size_t size, u8 *digest)
+{
+	struct af_alg_hash_ctx *ctx = (void *)_ctx;
+	const struct iovec iov[2] = {
+		{ .iov_base = (void *)ctx->base.prefix,
+		  .iov_len = ctx->base.prefix_size },
+		{ .iov_base = (void *)data, .iov_len = size },
+	};
+
+	int err;
+
+	err = af_alg_send(ctx, iov, 2, false);
+	if (!err)
+		err = af_alg_read_digest(ctx, digest);
+	if (err) {
+		memset(digest, 0, ctx->base.alg->digest_size);
+		af_alg_set_error(ctx, err);
+	}
+}
+
+static int af_alg_hash_prefixed_spliced(struct hash_ctx *_ctx,
+					libfsverity_splice_fn_t splice_fn,
+					void *fd, u64 offset, size_t count,
+					size_t size, u8 *digest)
+{
+	static const u8 zeroes[4096];
+	struct af_alg_hash_ctx *ctx = (void *)_ctx;
+	struct iovec iov = {
+		.iov_base = (void *)ctx->base.prefix,
+		.iov_len = ctx->base.prefix_size,
+	};
+	ssize_t ret;
+	size_t n;
+	int err;
+
+	if (ctx->pipe_fds[0] < 0 && pipe2(ctx->pipe_fds, O_CLOEXEC) != 0) {
+		err = -errno;
+		libfsverity_error_msg("failed to create pipe: %s",
+				      strerror(errno));
+		return err;
+	}
+
+	err = af_alg_send(ctx, &iov, 1, true);
+	if (err)
+		return af_alg_reset(ctx, err);
+
+	size -= count;
+	while (count) {
+		n = min(count, (size_t)AF_ALG_SPLICE_CHUNK_SIZE);
+		err = splice_fn(fd, ctx->pipe_fds[1], n, offset);
+		if (err) {
+			libfsverity_error_msg("error reading file");
+			return af_alg_reset(ctx, err);
+		}
+		offset += n;
+		count -= n;
+		while (n) {
+			ret = splice(ctx->pipe_fds[0], NULL, ctx->op_fd, NULL,
+				     n, SPLICE_F_MORE);
+			if (ret <= 0) {
+				err = ret ? -errno : -EIO;
+				libfsverity_error_msg("failed to splice data to AF_ALG socket: %s",
+						      strerror(-err));
+				return af_alg_reset(ctx, err);
+			}
+			n -= ret;
+		}
+	}
+
+	/* Zero-pad the data to the requested size. */
+	while (size) {
+		iov.iov_base = (void *)zeroes;
+		iov.iov_len = min(size, sizeof(zeroes));
+		err = af_alg_send(ctx, &iov, 1, true);
+		if (err)
+			return af_alg_reset(ctx, err);
+		size -= iov.iov_len;
+	}
+
+	err = af_alg_read_digest(ctx, digest);
+	if (err)
+		return af_alg_reset(ctx, err);
+	return 0;
+}
+
+static void af_alg_hash_ctx_free(struct hash_ctx *_ctx)
+{
+	struct af_alg_hash_ctx *ctx = (void *)_ctx;
+
+	if (ctx->pipe_fds[0] >= 0) {
+		close(ctx->pipe_fds[0]);
+		close(ctx->pipe_fds[1]);
+	}
+	if (ctx->op_fd >= 0)
+		close(ctx->op_fd);
+	if (ctx->tfm_fd >= 0)
+		close(ctx->tfm_fd);
+	free(ctx);
+}
+
+static int af_alg_ctx_create(const struct fsverity_hash_alg *alg,
+			     void *libctx __attribute__((unused)),
+			     struct hash_ctx **ctx_ret)
+{
+	struct sockaddr_alg addr = {
+		.salg_family = AF_ALG,
+		.salg_type = "hash",
+	};
+	struct af_alg_hash_ctx *ctx;
+	int err;
+
+	ctx = libfsverity_zalloc(sizeof(*ctx));
+	if (!ctx)
+		return -ENOMEM;
+
+	ctx->base.alg = alg;
+	ctx->base.init = af_alg_init;
+	ctx->base.update = af_alg_update;
+	ctx->base.final = af_alg_final;
+	ctx->base.save_prefix = af_alg_save_prefix;
+	ctx->base.hash_prefixed = af_alg_hash_prefixed;
+	ctx->base.hash_prefixed_spliced = af_alg_hash_prefixed_spliced;
+	ctx->base.free = af_alg_hash_ctx_free;
+	ctx->op_fd = -1;
+	ctx->pipe_fds[0] = ctx->pipe_fds[1] = -1;
+
+	ctx->tfm_fd = socket(AF_ALG, SOCK_SEQPACKET | SOCK_CLOEXEC, 0);
+	if (ctx->tfm_fd < 0) {
+		err = errno == EAFNOSUPPORT ? -EOPNOTSUPP : -errno;
+		libfsverity_error_msg("failed to create AF_ALG socket: %s",
+				      strerror(errno));
+		goto err;
+	}
+	strncpy((char *)addr.salg_name, alg->name, sizeof(addr.salg_name) - 1);
+	if (bind(ctx->tfm_fd, (struct sockaddr *)&addr, sizeof(addr)) != 0) {
+		err = errno == ENOENT ? -EOPNOTSUPP : -errno;
+		libfsverity_error_msg("failed to bind AF_ALG socket to %s: %s",
+				      alg->name, strerror(errno));
+		goto err;
+	}
+	ctx->op_fd = accept4(ctx->tfm_fd, NULL, NULL, SOCK_CLOEXEC);
+	if (ctx->op_fd < 0) {
+		err = -errno;
+		libfsverity_error_msg("failed to accept AF_ALG socket: %s",
+				      strerror(errno));
+		goto err;
+	}
+	*ctx_ret = &ctx->base;
+	return 0;
+
+err:
+	af_alg_hash_ctx_free(&ctx->base);
+	return err;
+}
+#endif /* __linux__ */
+
+/* ========== Automatic implementation selection ========== */
+
+/*
+ * Use the built-in implementations when they use dedicated CPU instructions,
+ * or when OpenSSL isn't being used for hashing at all.  Otherwise OpenSSL's
+ * assembly code is faster than the built-in portable C code.  A caller that
+ * supplies an OpenSSL library context gets OpenSSL regardless, since it likely
+ * wants a particular provider, e.g. a FIPS provider.
+ */
+
+static int create_sha256_ctx(const struct fsverity_hash_alg *alg,
+			     void *libctx, struct hash_ctx **ctx_ret)
 {
-	return openssl_digest_ctx_create(alg, EVP_sha256());
+#ifndef FSVERITY_NO_OPENSSL_HASHING
+	if (libctx || !libfsverity_sha256_is_accelerated())
+		return openssl_sha256_ctx_create(alg, libctx, ctx_ret);
+#endif
+	return builtin_sha256_ctx_create(alg, libctx, ctx_ret);
 }
 
-static struct hash_ctx *create_sha512_ctx(const struct fsverity_hash_alg *alg)
+static int create_sha512_ctx(const struct fsverity_hash_alg *alg,
+			     void *libctx, struct hash_ctx **ctx_ret)
 {
-	return openssl_digest_ctx_create(alg, EVP_sha512());
+	/* The built-in SHA-512 code isn't accelerated yet. */
+#ifndef FSVERITY_NO_OPENSSL_HASHING
+	return openssl_sha512_ctx_create(alg, libctx, ctx_ret);
+#else
+	return builtin_sha512_ctx_create(alg, libctx, ctx_ret);
+#endif
 }
 
 /* ========== Hash utilities ========== */
 
+static const char * const hash_impl_names[LIBFSVERITY_NUM_HASH_IMPLS] = {
+	[LIBFSVERITY_HASH_IMPL_AUTO] = "auto",
+	[LIBFSVERITY_HASH_IMPL_OPENSSL] = "openssl",
+	[LIBFSVERITY_HASH_IMPL_BUILTIN] = "builtin",
+	[LIBFSVERITY_HASH_IMPL_AF_ALG] = "af_alg",
+};
+
+/*
+ * Create a hash context for the given algorithm using the given implementation,
+ * and the given OpenSSL library context if it's non-NULL.  Returns -EINVAL if
+ * the implementation is unknown, or -EOPNOTSUPP if it isn't available.
+ */
+int libfsverity_create_hash_ctx(const struct fsverity_hash_alg *alg, u32 impl,
+				void *openssl_libctx, struct hash_ctx **ctx_ret)
+{
+	struct hash_ctx *ctx;
+	int err;
+
+	if (impl >= LIBFSVERITY_NUM_HASH_IMPLS) {
+		libfsverity_error_msg("unknown hash implementation: %u", impl);
+		return -EINVAL;
+	}
+	if (!alg->create_ctx[impl]) {
+		libfsverity_error_msg("hash implementation %s is unavailable",
+				      hash_impl_names[impl]);
+		return -EOPNOTSUPP;
+	}
+#ifndef HAVE_OPENSSL_LIBCTX
+	if (openssl_libctx) {
+		libfsverity_error_msg("OpenSSL library contexts are unsupported");
+		return -EOPNOTSUPP;
+	}
+#endif
+	err = alg->create_ctx[impl](alg, openssl_libctx, &ctx);
+	if (err)
+		return err;
+	ctx->impl = impl;
+	ctx->openssl_libctx = openssl_libctx;
+	/*
+	 * The multi-buffer code is part of the built-in implementation, which
+	 * a caller's OpenSSL library context rules out.
+	 */
+	if (impl == LIBFSVERITY_HASH_IMPL_BUILTIN ||
+	    (impl == LIBFSVERITY_HASH_IMPL_AUTO && !openssl_libctx))
+		ctx->hash_mb = alg->hash_mb;
+	*ctx_ret = ctx;
+	return 0;
+}
+
 void libfsverity_hash_init(struct hash_ctx *ctx)
 {
 	ctx->init(ctx);
@@ -139,6 +801,104 @@ void libfsverity_hash_full(struct hash_ctx *ctx, const void *data, size_t size,
 	libfsverity_hash_final(ctx, digest);
 }
 
+/*
+ * Set the prefix that libfsverity_hash_prefixed() and libfsverity_hash_mb()
+ * prepend to each message.  The prefix is hashed just once, here, and the
+ * resulting state is reused for each message.  @prefix must remain valid until
+ * the prefix is changed or the context is freed.
+ */
+void libfsverity_hash_set_prefix(struct hash_ctx *ctx, const u8 *prefix,
+				 size_t size)
+{
+	ctx->prefix = prefix;
+	ctx->prefix_size = size;
+	ctx->save_prefix(ctx, prefix, size);
+	/*
+	 * The multi-buffer code is separate from ->save_prefix(), which may be
+	 * OpenSSL's, so it gets its own copy of the state.
+	 */
+	if (ctx->hash_mb && size % ctx->alg->block_size == 0)
+		ctx->alg->mb_prefix_state(prefix, size, ctx->mb_prefix_state);
+}
+
+/* Hash the prefix followed by @data. */
+void libfsverity_hash_prefixed(struct hash_ctx *ctx, const void *data,
+			       size_t size, u8 *digest)
+{
+	ctx->hash_prefixed(ctx, data, size, digest);
+}
+
+/*
+ * Hash the @n messages prefix || @data[i * @size ... (i + 1) * @size - 1],
+ * writing the digests to @out.  This uses the algorithm's multi-buffer
+ * implementation for as many of the messages as it can handle, which is much
+ * faster than hashing the messages one at a time when it is available.
+ */
+void libfsverity_hash_mb(struct hash_ctx *ctx, const u8 *data, size_t size,
+			 size_t n, u8 *out)
+{
+	size_t i = 0;
+
+	if (ctx->hash_mb)
+		i = ctx->hash_mb(ctx->prefix_size ? ctx->mb_prefix_state : NULL,
+				 ctx->prefix_size, data, size, n, out);
+	for (; i < n; i++)
+		libfsverity_hash_prefixed(ctx, &data[i * size], size,
+					  &out[i * ctx->alg->digest_size]);
+}
+
+/*
+ * Like libfsverity_hash_mb(), but hash the messages without the prefix, as
+ * libfsverity_hash_full() does.  @size must be a multiple of the hash
+ * algorithm's block size for the multi-buffer implementation to be used.
+ */
+void libfsverity_hash_full_mb(struct hash_ctx *ctx, const u8 *data,
+			      size_t size, size_t n, u8 *out)
+{
+	size_t i = 0;
+
+	if (ctx->hash_mb)
+		i = ctx->hash_mb(NULL, 0, data, size, n, out);
+	for (; i < n; i++)
+		libfsverity_hash_full(ctx, &data[i * size], size,
+				      &out[i * ctx->alg->digest_size]);
+}
+
+/*
+ * Hash the prefix followed by @count bytes of the file at @offset, zero-padded
+ * to @size bytes, getting the file's data using @splice_fn.  The context must
+ * support ->hash_prefixed_spliced().  It stays usable after a failure.
+ */
+int libfsverity_hash_prefixed_spliced(struct hash_ctx *ctx,
+				      libfsverity_splice_fn_t splice_fn,
+				      void *fd, u64 offset, size_t count,
+				      size_t size, u8 *digest)
+{
+	return ctx->hash_prefixed_spliced(ctx, splice_fn, fd, offset, count,
+					  size, digest);
+}
+
+/*
+ * Get the first error that occurred in an operation on @ctx that can't return
+ * one, such as libfsverity_hash_prefixed() with AF_ALG, or 0 if none did.  The
+ * digests computed since then aren't valid, so a computation must check this
+ * before it uses them.  The error stays set until it is cleared.
+ */
+int libfsverity_hash_error(const struct hash_ctx *ctx)
+{
+	return ctx->err;
+}
+
+/*
+ * Clear the error of @ctx.  The context itself is still usable after an error,
+ * so this is for starting a computation that doesn't depend on any digests
+ * that were computed before.
+ */
+void libfsverity_hash_clear_error(struct hash_ctx *ctx)
+{
+	ctx->err = 0;
+}
+
 void libfsverity_free_hash_ctx(struct hash_ctx *ctx)
 {
 	if (ctx)
@@ -152,13 +912,39 @@ static const struct fsverity_hash_alg fsverity_hash_algs[] = {
 		.name = "sha256",
 		.digest_size = 32,
 		.block_size = 64,
-		.create_ctx = create_sha256_ctx,
+		.create_ctx = {
+			[LIBFSVERITY_HASH_IMPL_AUTO] = create_sha256_ctx,
+#ifndef FSVERITY_NO_OPENSSL_HASHING
+			[LIBFSVERITY_HASH_IMPL_OPENSSL] =
+				openssl_sha256_ctx_create,
+#endif
+			[LIBFSVERITY_HASH_IMPL_BUILTIN] =
+				builtin_sha256_ctx_create,
+#ifdef __linux__
+			[LIBFSVERITY_HASH_IMPL_AF_ALG] = af_alg_ctx_create,
+#endif
+		},
+		.hash_mb = libfsverity_sha256_mb,
+		.mb_prefix_state = libfsverity_sha256_mb_prefix_state,
 	},
 	[FS_VERITY_HASH_ALG_SHA512] = {
 		.name = "sha512",
 		.digest_size = 64,
 		.block_size = 128,
-		.create_ctx = create_sha512_ctx,
+		.create_ctx = {
+			[LIBFSVERITY_HASH_IMPL_AUTO] = create_sha512_ctx,
+#ifndef FSVERITY_NO_OPENSSL_HASHING
+			[LIBFSVERITY_HASH_IMPL_OPENSSL] =
+				openssl_sha512_ctx_create,
+#endif
+			[LIBFSVERITY_HASH_IMPL_BUILTIN] =
+				builtin_sha512_ctx_create,
+#ifdef __linux__
+			[LIBFSVERITY_HASH_IMPL_AF_ALG] = af_alg_ctx_create,
+#endif
+		},
+		.hash_mb = libfsverity_sha512_mb,
+		.mb_prefix_state = libfsverity_sha512_mb_prefix_state,
 	},
 };
 
@@ -204,3 +990,26 @@ libfsverity_get_hash_name(u32 alg_num)
 
 	return alg ? alg->name : NULL;
 }
+
+LIBEXPORT int
+libfsverity_find_hash_impl_by_name(const char *name)
+{
+	int i;
+
+	if (!name)
+		return -1;
+
+	for (i = 0; i < ARRAY_SIZE(hash_impl_names); i++) {
+		if (!strcmp(name, hash_impl_names[i]))
+			return i;
+	}
+	return -1;
+}
+
+LIBEXPORT const char *
+libfsverity_get_hash_impl_name(u32 impl)
+{
+	if (impl < ARRAY_SIZE(hash_impl_names))
+		return hash_impl_names[impl];
+	return NULL;
+}
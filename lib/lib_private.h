@@ -25,36 +25,155 @@
 /* The block size that libfsverity assumes when none is specified */
 #define FS_VERITY_BLOCK_SIZE_DEFAULT	4096
 
+/* The largest digest size among all hash algorithms supported by fs-verity */
+#define FS_VERITY_MAX_DIGEST_SIZE	64
+
+/* The largest salt that fits in the fs-verity descriptor */
+#define FS_VERITY_MAX_SALT_SIZE		32
+
 /* hash_algs.c */
 
+#define LIBFSVERITY_NUM_HASH_IMPLS	(LIBFSVERITY_HASH_IMPL_AF_ALG + 1)
+
+struct hash_ctx;
+
 struct fsverity_hash_alg {
 	const char *name;
 	unsigned int digest_size;
 	unsigned int block_size;
-	struct hash_ctx *(*create_ctx)(const struct fsverity_hash_alg *alg);
+	/*
+	 * The functions that create a hash_ctx using each implementation, or
+	 * NULL for implementations that weren't compiled in.  The function for
+	 * LIBFSVERITY_HASH_IMPL_AUTO chooses one of the other implementations.
+	 */
+	int (*create_ctx[LIBFSVERITY_NUM_HASH_IMPLS])(
+			const struct fsverity_hash_alg *alg,
+			void *openssl_libctx, struct hash_ctx **ctx_ret);
+	/*
+	 * Optional: hash multiple equal-length messages that share a common
+	 * prefix, in parallel.  The hashing starts from @prefix_state, the
+	 * chaining value after the @prefix_size bytes of the prefix as computed
+	 * by ->mb_prefix_state(), or from the IV if @prefix_state is NULL.
+	 * Returns the number of messages hashed, which may be fewer than
+	 * requested (even 0); the rest are left to the caller.  Both
+	 * @prefix_size and @size must be multiples of @block_size, otherwise
+	 * this may hash nothing.
+	 */
+	size_t (*hash_mb)(const void *prefix_state, size_t prefix_size,
+			  const u8 *data, size_t size, size_t n, u8 *out);
+	/*
+	 * With ->hash_mb: compute the chaining value after hashing @prefix,
+	 * whose @size must be a multiple of @block_size.  @state has room for
+	 * FS_VERITY_MAX_DIGEST_SIZE bytes.
+	 */
+	void (*mb_prefix_state)(const u8 *prefix, size_t size, void *state);
 };
 
 const struct fsverity_hash_alg *libfsverity_find_hash_alg_by_num(u32 alg_num);
 
 struct hash_ctx {
 	const struct fsverity_hash_alg *alg;
+	u32 impl;		/* the LIBFSVERITY_HASH_IMPL_* requested */
+	void *openssl_libctx;	/* the OSSL_LIB_CTX requested, if any */
+	/* The multi-buffer function to use, or NULL if none */
+	size_t (*hash_mb)(const void *prefix_state, size_t prefix_size,
+			  const u8 *data, size_t size, size_t n, u8 *out);
+	/* The prefix set by libfsverity_hash_set_prefix() */
+	const u8 *prefix;
+	size_t prefix_size;
+	/* With ->hash_mb, the chaining value after hashing the prefix */
+	u64 mb_prefix_state[FS_VERITY_MAX_DIGEST_SIZE / sizeof(u64)];
+	/*
+	 * The first error from an operation that can't return one, or 0.  See
+	 * libfsverity_hash_error().
+	 */
+	int err;
 	void (*init)(struct hash_ctx *ctx);
 	void (*update)(struct hash_ctx *ctx, const void *data, size_t size);
 	void (*final)(struct hash_ctx *ctx, u8 *out);
+	/* Save the state after hashing @prefix, for ->hash_prefixed() */
+	void (*save_prefix)(struct hash_ctx *ctx, const u8 *prefix,
+			    size_t size);
+	/* Hash the saved prefix followed by @data, starting from saved state */
+	void (*hash_prefixed)(struct hash_ctx *ctx, const void *data,
+			      size_t size, u8 *out);
+	/*
+	 * Optional: like ->hash_prefixed(), but get the data by splicing
+	 * @count bytes of the file at @offset using @splice_fn, then append
+	 * zeroes to make the data @size bytes long.
+	 */
+	int (*hash_prefixed_spliced)(struct hash_ctx *ctx,
+				     libfsverity_splice_fn_t splice_fn,
+				     void *fd, u64 offset, size_t count,
+				     size_t size, u8 *out);
 	void (*free)(struct hash_ctx *ctx);
 };
 
+int libfsverity_create_hash_ctx(const struct fsverity_hash_alg *alg, u32 impl,
+				void *openssl_libctx, struct hash_ctx **ctx_ret);
+
 void libfsverity_hash_init(struct hash_ctx *ctx);
 void libfsverity_hash_update(struct hash_ctx *ctx, const void *data,
 			     size_t size);
 void libfsverity_hash_final(struct hash_ctx *ctx, u8 *digest);
 void libfsverity_hash_full(struct hash_ctx *ctx, const void *data, size_t size,
 			   u8 *digest);
+void libfsverity_hash_set_prefix(struct hash_ctx *ctx, const u8 *prefix,
+				 size_t size);
+void libfsverity_hash_prefixed(struct hash_ctx *ctx, const void *data,
+			       size_t size, u8 *digest);
+void libfsverity_hash_mb(struct hash_ctx *ctx, const u8 *data, size_t size,
+			 size_t n, u8 *out);
+void libfsverity_hash_full_mb(struct hash_ctx *ctx, const u8 *data,
+			      size_t size, size_t n, u8 *out);
+int libfsverity_hash_prefixed_spliced(struct hash_ctx *ctx,
+				      libfsverity_splice_fn_t splice_fn,
+				      void *fd, u64 offset, size_t count,
+				      size_t size, u8 *digest);
+int libfsverity_hash_error(const struct hash_ctx *ctx);
+void libfsverity_hash_clear_error(struct hash_ctx *ctx);
 void libfsverity_free_hash_ctx(struct hash_ctx *ctx);
 
+/* sha2.c */
+
+#define SHA256_BLOCK_SIZE	64
+#define SHA512_BLOCK_SIZE	128
+
+struct sha256_state {
+	u32 h[8];
+	u64 count;
+	u8 buf[SHA256_BLOCK_SIZE];
+};
+
+struct sha512_state {
+	u64 h[8];
+	u64 count;
+	u8 buf[SHA512_BLOCK_SIZE];
+};
+
+bool libfsverity_sha256_is_accelerated(void);
+void libfsverity_sha256_init(struct sha256_state *st);
+void libfsverity_sha256_update(struct sha256_state *st, const void *data,
+			       size_t size);
+void libfsverity_sha256_final(struct sha256_state *st, u8 *out);
+void libfsverity_sha512_init(struct sha512_state *st);
+void libfsverity_sha512_update(struct sha512_state *st, const void *data,
+			       size_t size);
+void libfsverity_sha512_final(struct sha512_state *st, u8 *out);
+size_t libfsverity_sha256_mb(const void *prefix_state, size_t prefix_size,
+			     const u8 *data, size_t size, size_t n, u8 *out);
+size_t libfsverity_sha512_mb(const void *prefix_state, size_t prefix_size,
+			     const u8 *data, size_t size, size_t n, u8 *out);
+void libfsverity_sha256_mb_prefix_state(const u8 *prefix, size_t size,
+					void *state);
+void libfsverity_sha512_mb_prefix_state(const u8 *prefix, size_t size,
+					void *state);
+
 /* utils.c */
 
+void *libfsverity_malloc(size_t size);
 void *libfsverity_zalloc(size_t size);
+void *libfsverity_realloc(void *p, size_t size);
 void *libfsverity_memdup(const void *mem, size_t size);
 
 __cold void
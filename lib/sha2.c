@@ -0,0 +1,640 @@
+// SPDX-License-Identifier: MIT
+/*
+ * Built-in SHA-256 and SHA-512 implementations
+ *
+ * Copyright 2026 Google LLC
+ *
+ * Use of this source code is governed by an MIT-style
+ * license that can be found in the LICENSE file or at
+ * https://opensource.org/licenses/MIT.
+ */
+
+#include "lib_private.h"
+
+#include <string.h>
+
+static inline u32 get_unaligned_be32(const u8 *p)
+{
+	return ((u32)p[0] << 24) | ((u32)p[1] << 16) | ((u32)p[2] << 8) | p[3];
+}
+
+static inline u64 get_unaligned_be64(const u8 *p)
+{
+	return ((u64)get_unaligned_be32(p) << 32) | get_unaligned_be32(p + 4);
+}
+
+static inline void put_unaligned_be32(u32 v, u8 *p)
+{
+	p[0] = v >> 24;
+	p[1] = v >> 16;
+	p[2] = v >> 8;
+	p[3] = v;
+}
+
+static inline void put_unaligned_be64(u64 v, u8 *p)
+{
+	put_unaligned_be32(v >> 32, p);
+	put_unaligned_be32(v, p + 4);
+}
+
+/* ========== Constants ========== */
+
+static const u32 sha256_iv[8] = {
+	0x6a09e667, 0xbb67ae85, 0x3c6ef372, 0xa54ff53a,
+	0x510e527f, 0x9b05688c, 0x1f83d9ab, 0x5be0cd19,
+};
+
+static const u32 sha256_round_consts[64] = {
+	0x428a2f98, 0x71374491, 0xb5c0fbcf, 0xe9b5dba5,
+	0x3956c25b, 0x59f111f1, 0x923f82a4, 0xab1c5ed5,
+	0xd807aa98, 0x12835b01, 0x243185be, 0x550c7dc3,
+	0x72be5d74, 0x80deb1fe, 0x9bdc06a7, 0xc19bf174,
+	0xe49b69c1, 0xefbe4786, 0x0fc19dc6, 0x240ca1cc,
+	0x2de92c6f, 0x4a7484aa, 0x5cb0a9dc, 0x76f988da,
+	0x983e5152, 0xa831c66d, 0xb00327c8, 0xbf597fc7,
+	0xc6e00bf3, 0xd5a79147, 0x06ca6351, 0x14292967,
+	0x27b70a85, 0x2e1b2138, 0x4d2c6dfc, 0x53380d13,
+	0x650a7354, 0x766a0abb, 0x81c2c92e, 0x92722c85,
+	0xa2bfe8a1, 0xa81a664b, 0xc24b8b70, 0xc76c51a3,
+	0xd192e819, 0xd6990624, 0xf40e3585, 0x106aa070,
+	0x19a4c116, 0x1e376c08, 0x2748774c, 0x34b0bcb5,
+	0x391c0cb3, 0x4ed8aa4a, 0x5b9cca4f, 0x682e6ff3,
+	0x748f82ee, 0x78a5636f, 0x84c87814, 0x8cc70208,
+	0x90befffa, 0xa4506ceb, 0xbef9a3f7, 0xc67178f2,
+};
+
+static const u64 sha512_iv[8] = {
+	0x6a09e667f3bcc908, 0xbb67ae8584caa73b,
+	0x3c6ef372fe94f82b, 0xa54ff53a5f1d36f1,
+	0x510e527fade682d1, 0x9b05688c2b3e6c1f,
+	0x1f83d9abfb41bd6b, 0x5be0cd19137e2179,
+};
+
+static const u64 sha512_round_consts[80] = {
+	0x428a2f98d728ae22, 0x7137449123ef65cd,
+	0xb5c0fbcfec4d3b2f, 0xe9b5dba58189dbbc,
+	0x3956c25bf348b538, 0x59f111f1b605d019,
+	0x923f82a4af194f9b, 0xab1c5ed5da6d8118,
+	0xd807aa98a3030242, 0x12835b0145706fbe,
+	0x243185be4ee4b28c, 0x550c7dc3d5ffb4e2,
+	0x72be5d74f27b896f, 0x80deb1fe3b1696b1,
+	0x9bdc06a725c71235, 0xc19bf174cf692694,
+	0xe49b69c19ef14ad2, 0xefbe4786384f25e3,
+	0x0fc19dc68b8cd5b5, 0x240ca1cc77ac9c65,
+	0x2de92c6f592b0275, 0x4a7484aa6ea6e483,
+	0x5cb0a9dcbd41fbd4, 0x76f988da831153b5,
+	0x983e5152ee66dfab, 0xa831c66d2db43210,
+	0xb00327c898fb213f, 0xbf597fc7beef0ee4,
+	0xc6e00bf33da88fc2, 0xd5a79147930aa725,
+	0x06ca6351e003826f, 0x142929670a0e6e70,
+	0x27b70a8546d22ffc, 0x2e1b21385c26c926,
+	0x4d2c6dfc5ac42aed, 0x53380d139d95b3df,
+	0x650a73548baf63de, 0x766a0abb3c77b2a8,
+	0x81c2c92e47edaee6, 0x92722c851482353b,
+	0xa2bfe8a14cf10364, 0xa81a664bbc423001,
+	0xc24b8b70d0f89791, 0xc76c51a30654be30,
+	0xd192e819d6ef5218, 0xd69906245565a910,
+	0xf40e35855771202a, 0x106aa07032bbd1b8,
+	0x19a4c116b8d2d0c8, 0x1e376c085141ab53,
+	0x2748774cdf8eeb99, 0x34b0bcb5e19b48a8,
+	0x391c0cb3c5c95a63, 0x4ed8aa4ae3418acb,
+	0x5b9cca4f7763e373, 0x682e6ff3d6b2b8a3,
+	0x748f82ee5defb2fc, 0x78a5636f43172f60,
+	0x84c87814a1f0ab72, 0x8cc702081a6439ec,
+	0x90befffa23631e28, 0xa4506cebde82bde9,
+	0xbef9a3f7b2c67915, 0xc67178f2e372532b,
+	0xca273eceea26619c, 0xd186b8c721c0c207,
+	0xeada7dd6cde0eb1e, 0xf57d4f7fee6ed178,
+	0x06f067aa72176fba, 0x0a637dc5a2c898a6,
+	0x113f9804bef90dae, 0x1b710b35131c471b,
+	0x28db77f523047d84, 0x32caab7b40c72493,
+	0x3c9ebe0a15c9bebc, 0x431d67c49c100d4c,
+	0x4cc5d4becb3e42b6, 0x597f299cfc657e2a,
+	0x5fcb6fab3ad6faec, 0x6c44198c4a475817,
+};
+
+/* ========== CPU feature detection ========== */
+
+#if defined(__x86_64__) || defined(__i386__)
+#include <cpuid.h>
+
+#define X86_CPU_FEATURE_AVX2		0x1
+#define X86_CPU_FEATURE_AVX512BW	0x2
+#define X86_CPU_FEATURE_SHA		0x4
+#define X86_CPU_FEATURES_KNOWN		0x80000000
+
+static u32 x86_cpu_features;
+
+static u64 read_xcr0(void)
+{
+	u32 lo, hi;
+
+	__asm__("xgetbv" : "=a" (lo), "=d" (hi) : "c" (0));
+	return ((u64)hi << 32) | lo;
+}
+
+static u32 get_x86_cpu_features(void)
+{
+	u32 features = __atomic_load_n(&x86_cpu_features, __ATOMIC_RELAXED);
+	u32 eax, ebx, ecx, edx;
+	u64 xcr0 = 0;
+
+	if (features & X86_CPU_FEATURES_KNOWN)
+		return features;
+
+	features = X86_CPU_FEATURES_KNOWN;
+	if (!__get_cpuid(1, &eax, &ebx, &ecx, &edx))
+		goto out;
+	/* Check whether the OS saves the AVX and AVX-512 registers. */
+	if (ecx & bit_OSXSAVE)
+		xcr0 = read_xcr0();
+	if (!__get_cpuid_count(7, 0, &eax, &ebx, &ecx, &edx))
+		goto out;
+	if ((ebx & bit_AVX2) && (xcr0 & 0x6) == 0x6)
+		features |= X86_CPU_FEATURE_AVX2;
+	if ((ebx & bit_AVX512F) && (ebx & bit_AVX512BW) &&
+	    (xcr0 & 0xe6) == 0xe6)
+		features |= X86_CPU_FEATURE_AVX512BW;
+	if (ebx & bit_SHA)
+		features |= X86_CPU_FEATURE_SHA;
+out:
+	__atomic_store_n(&x86_cpu_features, features, __ATOMIC_RELAXED);
+	return features;
+}
+#endif /* x86 */
+
+/* ========== Generic block functions ========== */
+
+static inline u32 ror32(u32 x, int n)
+{
+	return (x >> n) | (x << (32 - n));
+}
+
+static inline u64 ror64(u64 x, int n)
+{
+	return (x >> n) | (x << (64 - n));
+}
+
+#define SHA2_CH(x, y, z)	((((y) ^ (z)) & (x)) ^ (z))
+#define SHA2_MAJ(x, y, z)	(((x) & (y)) | (((x) | (y)) & (z)))
+
+/*
+ * One round of SHA-256 or SHA-512.  Instead of moving the state variables
+ * around, the callers rotate which variables are passed as which arguments.
+ */
+#define SHA256_ROUND(a, b, c, d, e, f, g, h, i)				\
+do {									\
+	u32 t1 = h + (ror32(e, 6) ^ ror32(e, 11) ^ ror32(e, 25)) +	\
+		 SHA2_CH(e, f, g) + sha256_round_consts[i] + w[i];	\
+									\
+	d += t1;							\
+	h = t1 + (ror32(a, 2) ^ ror32(a, 13) ^ ror32(a, 22)) +		\
+	    SHA2_MAJ(a, b, c);						\
+} while (0)
+
+#define SHA512_ROUND(a, b, c, d, e, f, g, h, i)				\
+do {									\
+	u64 t1 = h + (ror64(e, 14) ^ ror64(e, 18) ^ ror64(e, 41)) +	\
+		 SHA2_CH(e, f, g) + sha512_round_consts[i] + w[i];	\
+									\
+	d += t1;							\
+	h = t1 + (ror64(a, 28) ^ ror64(a, 34) ^ ror64(a, 39)) +		\
+	    SHA2_MAJ(a, b, c);						\
+} while (0)
+
+#define SHA2_8ROUNDS(ROUND, i)						\
+do {									\
+	ROUND(a, b, c, d, e, f, g, hh, (i) + 0);			\
+	ROUND(hh, a, b, c, d, e, f, g, (i) + 1);			\
+	ROUND(g, hh, a, b, c, d, e, f, (i) + 2);			\
+	ROUND(f, g, hh, a, b, c, d, e, (i) + 3);			\
+	ROUND(e, f, g, hh, a, b, c, d, (i) + 4);			\
+	ROUND(d, e, f, g, hh, a, b, c, (i) + 5);			\
+	ROUND(c, d, e, f, g, hh, a, b, (i) + 6);			\
+	ROUND(b, c, d, e, f, g, hh, a, (i) + 7);			\
+} while (0)
+
+static void sha256_blocks_generic(u32 h[8], const u8 *data, size_t nblocks)
+{
+	u32 w[64];
+	int i;
+
+	do {
+		u32 a = h[0], b = h[1], c = h[2], d = h[3];
+		u32 e = h[4], f = h[5], g = h[6], hh = h[7];
+
+		for (i = 0; i < 16; i++)
+			w[i] = get_unaligned_be32(&data[4 * i]);
+		for (; i < 64; i++)
+			w[i] = w[i - 16] + w[i - 7] +
+			       (ror32(w[i - 15], 7) ^ ror32(w[i - 15], 18) ^
+				(w[i - 15] >> 3)) +
+			       (ror32(w[i - 2], 17) ^ ror32(w[i - 2], 19) ^
+				(w[i - 2] >> 10));
+		for (i = 0; i < 64; i += 8)
+			SHA2_8ROUNDS(SHA256_ROUND, i);
+		h[0] += a;
+		h[1] += b;
+		h[2] += c;
+		h[3] += d;
+		h[4] += e;
+		h[5] += f;
+		h[6] += g;
+		h[7] += hh;
+		data += SHA256_BLOCK_SIZE;
+	} while (--nblocks);
+}
+
+static void sha512_blocks_generic(u64 h[8], const u8 *data, size_t nblocks)
+{
+	u64 w[80];
+	int i;
+
+	do {
+		u64 a = h[0], b = h[1], c = h[2], d = h[3];
+		u64 e = h[4], f = h[5], g = h[6], hh = h[7];
+
+		for (i = 0; i < 16; i++)
+			w[i] = get_unaligned_be64(&data[8 * i]);
+		for (; i < 80; i++)
+			w[i] = w[i - 16] + w[i - 7] +
+			       (ror64(w[i - 15], 1) ^ ror64(w[i - 15], 8) ^
+				(w[i - 15] >> 7)) +
+			       (ror64(w[i - 2], 19) ^ ror64(w[i - 2], 61) ^
+				(w[i - 2] >> 6));
+		for (i = 0; i < 80; i += 8)
+			SHA2_8ROUNDS(SHA512_ROUND, i);
+		h[0] += a;
+		h[1] += b;
+		h[2] += c;
+		h[3] += d;
+		h[4] += e;
+		h[5] += f;
+		h[6] += g;
+		h[7] += hh;
+		data += SHA512_BLOCK_SIZE;
+	} while (--nblocks);
+}
+
+/* ========== x86 SHA extensions ========== */
+
+#if defined(__x86_64__) || defined(__i386__)
+#include <immintrin.h>
+
+/*
+ * Do 4 rounds of SHA-256 using message words m0, loading m0 from the data first
+ * if it's one of the first 16 words.  Interleaved with this, continue the
+ * message schedule: finish computing the words m1 using m0 and m3, and start
+ * computing the words m3 using m0.
+ */
+#define SHA256_NI_4ROUNDS(i, m0, m1, m2, m3)				\
+do {									\
+	__m128i msg;							\
+									\
+	if ((i) < 16) {							\
+		m0 = _mm_loadu_si128((const __m128i *)&data[4 * (i)]);	\
+		m0 = _mm_shuffle_epi8(m0, bswap_mask);			\
+	}								\
+	msg = _mm_add_epi32(m0, _mm_loadu_si128(			\
+			(const __m128i *)&sha256_round_consts[i]));	\
+	state1 = _mm_sha256rnds2_epu32(state1, state0, msg);		\
+	if ((i) >= 12 && (i) < 60) {					\
+		m1 = _mm_add_epi32(m1, _mm_alignr_epi8(m0, m3, 4));	\
+		m1 = _mm_sha256msg2_epu32(m1, m0);			\
+	}								\
+	msg = _mm_shuffle_epi32(msg, 0x0e);				\
+	state0 = _mm_sha256rnds2_epu32(state0, state1, msg);		\
+	if ((i) >= 4 && (i) < 52)					\
+		m3 = _mm_sha256msg1_epu32(m3, m0);			\
+} while (0)
+
+#define SHA256_NI_16ROUNDS(i)						\
+do {									\
+	SHA256_NI_4ROUNDS((i) + 0, m0, m1, m2, m3);			\
+	SHA256_NI_4ROUNDS((i) + 4, m1, m2, m3, m0);			\
+	SHA256_NI_4ROUNDS((i) + 8, m2, m3, m0, m1);			\
+	SHA256_NI_4ROUNDS((i) + 12, m3, m0, m1, m2);			\
+} while (0)
+
+static __attribute__((target("sha,sse4.1"))) void
+sha256_blocks_sha_ni(u32 h[8], const u8 *data, size_t nblocks)
+{
+	const __m128i bswap_mask = _mm_set_epi8(12, 13, 14, 15, 8, 9, 10, 11,
+						4, 5, 6, 7, 0, 1, 2, 3);
+	__m128i state0, state1, tmp;
+	__m128i m0, m1, m2, m3;
+
+	/* Convert the state from {a, b, c, d}, {e, f, g, h} to ABEF, CDGH. */
+	state0 = _mm_loadu_si128((const __m128i *)&h[0]);
+	state1 = _mm_loadu_si128((const __m128i *)&h[4]);
+	tmp = _mm_unpacklo_epi64(state0, state1);
+	state1 = _mm_unpackhi_epi64(state1, state0);
+	state0 = _mm_shuffle_epi32(tmp, 0x1b);
+	state1 = _mm_shuffle_epi32(state1, 0xb1);
+
+	m0 = m1 = m2 = m3 = _mm_setzero_si128();
+	do {
+		const __m128i abef_save = state0;
+		const __m128i cdgh_save = state1;
+
+		SHA256_NI_16ROUNDS(0);
+		SHA256_NI_16ROUNDS(16);
+		SHA256_NI_16ROUNDS(32);
+		SHA256_NI_16ROUNDS(48);
+
+		state0 = _mm_add_epi32(state0, abef_save);
+		state1 = _mm_add_epi32(state1, cdgh_save);
+		data += SHA256_BLOCK_SIZE;
+	} while (--nblocks);
+
+	/* Convert the state back. */
+	state0 = _mm_shuffle_epi32(state0, 0x1b);
+	state1 = _mm_shuffle_epi32(state1, 0xb1);
+	tmp = _mm_blend_epi16(state0, state1, 0xf0);
+	state1 = _mm_alignr_epi8(state1, state0, 8);
+	_mm_storeu_si128((__m128i *)&h[0], tmp);
+	_mm_storeu_si128((__m128i *)&h[4], state1);
+}
+#endif /* x86 */
+
+/* ========== Single-message hashing ========== */
+
+static void sha256_blocks(u32 h[8], const u8 *data, size_t nblocks)
+{
+#if defined(__x86_64__) || defined(__i386__)
+	if (get_x86_cpu_features() & X86_CPU_FEATURE_SHA) {
+		sha256_blocks_sha_ni(h, data, nblocks);
+		return;
+	}
+#endif
+	sha256_blocks_generic(h, data, nblocks);
+}
+
+static void sha512_blocks(u64 h[8], const u8 *data, size_t nblocks)
+{
+	sha512_blocks_generic(h, data, nblocks);
+}
+
+/*
+ * Returns true if the built-in SHA-256 implementation uses dedicated CPU
+ * instructions, making it at least as fast as any other implementation.
+ */
+bool libfsverity_sha256_is_accelerated(void)
+{
+#if defined(__x86_64__) || defined(__i386__)
+	return get_x86_cpu_features() & X86_CPU_FEATURE_SHA;
+#else
+	return false;
+#endif
+}
+
+void libfsverity_sha256_init(struct sha256_state *st)
+{
+	memcpy(st->h, sha256_iv, sizeof(st->h));
+	st->count = 0;
+}
+
+void libfsverity_sha256_update(struct sha256_state *st, const void *data,
+			       size_t size)
+{
+	const u8 *p = data;
+	size_t partial = st->count % SHA256_BLOCK_SIZE;
+
+	if (size == 0)
+		return;
+	st->count += size;
+	if (partial) {
+		size_t n = min(size, SHA256_BLOCK_SIZE - partial);
+
+		memcpy(&st->buf[partial], p, n);
+		if (partial + n < SHA256_BLOCK_SIZE)
+			return;
+		sha256_blocks(st->h, st->buf, 1);
+		p += n;
+		size -= n;
+	}
+	if (size >= SHA256_BLOCK_SIZE) {
+		sha256_blocks(st->h, p, size / SHA256_BLOCK_SIZE);
+		p += size & ~(SHA256_BLOCK_SIZE - 1);
+		size %= SHA256_BLOCK_SIZE;
+	}
+	memcpy(st->buf, p, size);
+}
+
+void libfsverity_sha256_final(struct sha256_state *st, u8 *out)
+{
+	size_t partial = st->count % SHA256_BLOCK_SIZE;
+	int i;
+
+	st->buf[partial++] = 0x80;
+	if (partial > SHA256_BLOCK_SIZE - 8) {
+		memset(&st->buf[partial], 0, SHA256_BLOCK_SIZE - partial);
+		sha256_blocks(st->h, st->buf, 1);
+		partial = 0;
+	}
+	memset(&st->buf[partial], 0, SHA256_BLOCK_SIZE - 8 - partial);
+	put_unaligned_be64(st->count << 3, &st->buf[SHA256_BLOCK_SIZE - 8]);
+	sha256_blocks(st->h, st->buf, 1);
+	for (i = 0; i < 8; i++)
+		put_unaligned_be32(st->h[i], &out[4 * i]);
+}
+
+void libfsverity_sha512_init(struct sha512_state *st)
+{
+	memcpy(st->h, sha512_iv, sizeof(st->h));
+	st->count = 0;
+}
+
+void libfsverity_sha512_update(struct sha512_state *st, const void *data,
+			       size_t size)
+{
+	const u8 *p = data;
+	size_t partial = st->count % SHA512_BLOCK_SIZE;
+
+	if (size == 0)
+		return;
+	st->count += size;
+	if (partial) {
+		size_t n = min(size, SHA512_BLOCK_SIZE - partial);
+
+		memcpy(&st->buf[partial], p, n);
+		if (partial + n < SHA512_BLOCK_SIZE)
+			return;
+		sha512_blocks(st->h, st->buf, 1);
+		p += n;
+		size -= n;
+	}
+	if (size >= SHA512_BLOCK_SIZE) {
+		sha512_blocks(st->h, p, size / SHA512_BLOCK_SIZE);
+		p += size & ~(SHA512_BLOCK_SIZE - 1);
+		size %= SHA512_BLOCK_SIZE;
+	}
+	memcpy(st->buf, p, size);
+}
+
+void libfsverity_sha512_final(struct sha512_state *st, u8 *out)
+{
+	size_t partial = st->count % SHA512_BLOCK_SIZE;
+	int i;
+
+	st->buf[partial++] = 0x80;
+	if (partial > SHA512_BLOCK_SIZE - 16) {
+		memset(&st->buf[partial], 0, SHA512_BLOCK_SIZE - partial);
+		sha512_blocks(st->h, st->buf, 1);
+		partial = 0;
+	}
+	memset(&st->buf[partial], 0, SHA512_BLOCK_SIZE - 16 - partial);
+	put_unaligned_be64(st->count >> 61, &st->buf[SHA512_BLOCK_SIZE - 16]);
+	put_unaligned_be64(st->count << 3, &st->buf[SHA512_BLOCK_SIZE - 8]);
+	sha512_blocks(st->h, st->buf, 1);
+	for (i = 0; i < 8; i++)
+		put_unaligned_be64(st->h[i], &out[8 * i]);
+}
+
+/* ========== Multi-buffer implementations ========== */
+
+/*
+ * The maximum number of messages that any multi-buffer implementation hashes
+ * at once
+ */
+#define SHA2_MB_MAX_LANES	16
+
+struct sha2_mb_impl {
+	void (*func)(const void *prefix_state, size_t prefix_size,
+		     const u8 *const msgs[], size_t size, u8 *const outs[]);
+	unsigned int lanes;
+};
+
+#if defined(__x86_64__) || defined(__i386__)
+#  define FUNCNAME	sha256_mb_avx2
+#  define ATTRIBUTES	__attribute__((target("avx2")))
+#  define VEC_BYTES	32
+#  define SHA512	0
+#  include "sha2_mb_template.h"
+
+#  define FUNCNAME	sha256_mb_avx512
+#  define ATTRIBUTES	__attribute__((target("avx512f,avx512bw")))
+#  define VEC_BYTES	64
+#  define SHA512	0
+#  include "sha2_mb_template.h"
+
+#  define FUNCNAME	sha512_mb_avx2
+#  define ATTRIBUTES	__attribute__((target("avx2")))
+#  define VEC_BYTES	32
+#  define SHA512	1
+#  include "sha2_mb_template.h"
+
+#  define FUNCNAME	sha512_mb_avx512
+#  define ATTRIBUTES	__attribute__((target("avx512f,avx512bw")))
+#  define VEC_BYTES	64
+#  define SHA512	1
+#  include "sha2_mb_template.h"
+
+static const struct sha2_mb_impl sha256_mb_avx512_impl = {
+	sha256_mb_avx512, 16
+};
+static const struct sha2_mb_impl sha256_mb_avx2_impl = { sha256_mb_avx2, 8 };
+static const struct sha2_mb_impl sha512_mb_avx512_impl = {
+	sha512_mb_avx512, 8
+};
+static const struct sha2_mb_impl sha512_mb_avx2_impl = { sha512_mb_avx2, 4 };
+
+static const struct sha2_mb_impl *sha256_mb_impl(void)
+{
+	u32 features = get_x86_cpu_features();
+
+	if (features & X86_CPU_FEATURE_AVX512BW)
+		return &sha256_mb_avx512_impl;
+	/*
+	 * 8-way AVX2 hashing is only about as fast as one-at-a-time hashing
+	 * using the SHA extensions, so it's only worthwhile without them.
+	 */
+	if ((features & X86_CPU_FEATURE_AVX2) &&
+	    !(features & X86_CPU_FEATURE_SHA))
+		return &sha256_mb_avx2_impl;
+	return NULL;
+}
+
+static const struct sha2_mb_impl *sha512_mb_impl(void)
+{
+	u32 features = get_x86_cpu_features();
+
+	if (features & X86_CPU_FEATURE_AVX512BW)
+		return &sha512_mb_avx512_impl;
+	if (features & X86_CPU_FEATURE_AVX2)
+		return &sha512_mb_avx2_impl;
+	return NULL;
+}
+#else
+#define sha256_mb_impl()	NULL
+#define sha512_mb_impl()	NULL
+#endif /* !x86 */
+
+static size_t sha2_mb(const struct sha2_mb_impl *impl,
+		      unsigned int block_size, unsigned int digest_size,
+		      const void *prefix_state, size_t prefix_size,
+		      const u8 *data, size_t size, size_t n, u8 *out)
+{
+	const u8 *msgs[SHA2_MB_MAX_LANES];
+	u8 *outs[SHA2_MB_MAX_LANES];
+	u8 discard[64];
+	size_t done = 0;
+	size_t i;
+
+	if (!impl || prefix_size % block_size || size % block_size)
+		return 0;
+
+	/*
+	 * Hash the messages in groups of impl->lanes.  Hashing a partial group
+	 * costs as much as hashing a full one, so leave a small final group for
+	 * the caller to hash one message at a time instead.
+	 */
+	while (n - done >= (impl->lanes + 1) / 2) {
+		for (i = 0; i < impl->lanes; i++) {
+			if (done + i < n) {
+				msgs[i] = &data[(done + i) * size];
+				outs[i] = &out[(done + i) * digest_size];
+			} else {
+				msgs[i] = msgs[0];
+				outs[i] = discard;
+			}
+		}
+		impl->func(prefix_state, prefix_size, msgs, size, outs);
+		done += min((size_t)impl->lanes, n - done);
+	}
+	return done;
+}
+
+size_t libfsverity_sha256_mb(const void *prefix_state, size_t prefix_size,
+			     const u8 *data, size_t size, size_t n, u8 *out)
+{
+	return sha2_mb(sha256_mb_impl(), 64, 32, prefix_state, prefix_size,
+		       data, size, n, out);
+}
+
+size_t libfsverity_sha512_mb(const void *prefix_state, size_t prefix_size,
+			     const u8 *data, size_t size, size_t n, u8 *out)
+{
+	return sha2_mb(sha512_mb_impl(), 128, 64, prefix_state, prefix_size,
+		       data, size, n, out);
+}
+
+void libfsverity_sha256_mb_prefix_state(const u8 *prefix, size_t size,
+					void *state)
+{
+	struct sha256_state st;
+
+	libfsverity_sha256_init(&st);
+	libfsverity_sha256_update(&st, prefix, size);
+	memcpy(state, st.h, sizeof(st.h));
+}
+
+void libfsverity_sha512_mb_prefix_state(const u8 *prefix, size_t size,
+					void *state)
+{
+	struct sha512_state st;
+
+	libfsverity_sha512_init(&st);
+	libfsverity_sha512_update(&st, prefix, size);
+	memcpy(state, st.h, sizeof(st.h));
+}
@@ -0,0 +1,318 @@
+/* SPDX-License-Identifier: MIT */
+/*
+ * Template for multi-buffer SHA-256 and SHA-512
+ *
+ * Copyright 2026 Google LLC
+ *
+ * Use of this source code is governed by an MIT-style
+ * license that can be found in the LICENSE file or at
+ * https://opensource.org/licenses/MIT.
+ */
+
+/*
+ * This file is #include'd by sha2.c multiple times with different parameters,
+ * to generate multi-buffer implementations for different vector widths and
+ * instruction set extensions.  Each vector lane holds the state of a different
+ * message.  The vector code is written using the compiler's generic vector
+ * extensions, so the parameters just need to specify the vector width and the
+ * target attributes that make the compiler use the desired instructions.
+ *
+ * The following parameters must be defined:
+ *
+ * FUNCNAME: the name of the function to generate
+ * ATTRIBUTES: attributes to apply to the function, e.g. a target attribute
+ * VEC_BYTES: the vector width in bytes
+ * SHA512: 1 to generate SHA-512, or 0 to generate SHA-256
+ *
+ * The generated function computes the digests of LANES messages that each
+ * consist of the same prefix followed by @size bytes at msgs[i], writing the
+ * digests to outs[i].  The prefix isn't hashed again: each lane starts from
+ * @prefix_state, the chaining value after the @prefix_size bytes of the prefix,
+ * or from the IV if @prefix_state is NULL.  @prefix_size and @size must be
+ * multiples of the hash block size.
+ */
+
+#if SHA512
+#  define WORD			u64
+#  define WORD_BYTES		8
+#  define NUM_ROUNDS		80
+#  define IV			sha512_iv
+#  define ROUND_CONSTS		sha512_round_consts
+#  define STORE_BE(v, p)	put_unaligned_be64((v), (p))
+#  define BSIG0(x)		(ROR((x), 28) ^ ROR((x), 34) ^ ROR((x), 39))
+#  define BSIG1(x)		(ROR((x), 14) ^ ROR((x), 18) ^ ROR((x), 41))
+#  define SSIG0(x)		(ROR((x), 1) ^ ROR((x), 8) ^ ((x) >> 7))
+#  define SSIG1(x)		(ROR((x), 19) ^ ROR((x), 61) ^ ((x) >> 6))
+#else
+#  define WORD			u32
+#  define WORD_BYTES		4
+#  define NUM_ROUNDS		64
+#  define IV			sha256_iv
+#  define ROUND_CONSTS		sha256_round_consts
+#  define STORE_BE(v, p)	put_unaligned_be32((v), (p))
+#  define BSIG0(x)		(ROR((x), 2) ^ ROR((x), 13) ^ ROR((x), 22))
+#  define BSIG1(x)		(ROR((x), 6) ^ ROR((x), 11) ^ ROR((x), 25))
+#  define SSIG0(x)		(ROR((x), 7) ^ ROR((x), 18) ^ ((x) >> 3))
+#  define SSIG1(x)		(ROR((x), 17) ^ ROR((x), 19) ^ ((x) >> 10))
+#endif
+
+#define WORD_BITS		(8 * WORD_BYTES)
+#define BLOCK_BYTES		(16 * WORD_BYTES)
+#define LANES			(VEC_BYTES / WORD_BYTES)
+#if LANES == 4
+#  define TRANSPOSE_LO_1 0, 4, 2, 6
+#  define TRANSPOSE_HI_1 1, 5, 3, 7
+#  define TRANSPOSE_LO_2 0, 1, 4, 5
+#  define TRANSPOSE_HI_2 2, 3, 6, 7
+#elif LANES == 8
+#  define TRANSPOSE_LO_1 0, 8, 2, 10, 4, 12, 6, 14
+#  define TRANSPOSE_HI_1 1, 9, 3, 11, 5, 13, 7, 15
+#  define TRANSPOSE_LO_2 0, 1, 8, 9, 4, 5, 12, 13
+#  define TRANSPOSE_HI_2 2, 3, 10, 11, 6, 7, 14, 15
+#  define TRANSPOSE_LO_4 0, 1, 2, 3, 8, 9, 10, 11
+#  define TRANSPOSE_HI_4 4, 5, 6, 7, 12, 13, 14, 15
+#elif LANES == 16
+#  define TRANSPOSE_LO_1 0, 16, 2, 18, 4, 20, 6, 22, 8, 24, 10, 26, 12, \
+				28, 14, 30
+#  define TRANSPOSE_HI_1 1, 17, 3, 19, 5, 21, 7, 23, 9, 25, 11, 27, 13, \
+				29, 15, 31
+#  define TRANSPOSE_LO_2 0, 1, 16, 17, 4, 5, 20, 21, 8, 9, 24, 25, 12, \
+				13, 28, 29
+#  define TRANSPOSE_HI_2 2, 3, 18, 19, 6, 7, 22, 23, 10, 11, 26, 27, 14, \
+				15, 30, 31
+#  define TRANSPOSE_LO_4 0, 1, 2, 3, 16, 17, 18, 19, 8, 9, 10, 11, 24, \
+				25, 26, 27
+#  define TRANSPOSE_HI_4 4, 5, 6, 7, 20, 21, 22, 23, 12, 13, 14, 15, 28, \
+				29, 30, 31
+#  define TRANSPOSE_LO_8 0, 1, 2, 3, 4, 5, 6, 7, 16, 17, 18, 19, 20, 21, \
+				22, 23
+#  define TRANSPOSE_HI_8 8, 9, 10, 11, 12, 13, 14, 15, 24, 25, 26, 27, \
+				28, 29, 30, 31
+#else
+#  error "unsupported number of lanes"
+#endif
+
+#if VEC_BYTES == 32 && WORD_BYTES == 4
+#  define BSWAP_SHUFFLE	3, 2, 1, 0, 7, 6, 5, 4, 11, 10, 9, 8, 15, 14, \
+				13, 12, 19, 18, 17, 16, 23, 22, 21, 20, 27, 26, \
+				25, 24, 31, 30, 29, 28
+#elif VEC_BYTES == 32 && WORD_BYTES == 8
+#  define BSWAP_SHUFFLE	7, 6, 5, 4, 3, 2, 1, 0, 15, 14, 13, 12, 11, 10, \
+				9, 8, 23, 22, 21, 20, 19, 18, 17, 16, 31, 30, \
+				29, 28, 27, 26, 25, 24
+#elif VEC_BYTES == 64 && WORD_BYTES == 4
+#  define BSWAP_SHUFFLE	3, 2, 1, 0, 7, 6, 5, 4, 11, 10, 9, 8, 15, 14, \
+				13, 12, 19, 18, 17, 16, 23, 22, 21, 20, 27, 26, \
+				25, 24, 31, 30, 29, 28, 35, 34, 33, 32, 39, 38, \
+				37, 36, 43, 42, 41, 40, 47, 46, 45, 44, 51, 50, \
+				49, 48, 55, 54, 53, 52, 59, 58, 57, 56, 63, 62, \
+				61, 60
+#elif VEC_BYTES == 64 && WORD_BYTES == 8
+#  define BSWAP_SHUFFLE	7, 6, 5, 4, 3, 2, 1, 0, 15, 14, 13, 12, 11, 10, \
+				9, 8, 23, 22, 21, 20, 19, 18, 17, 16, 31, 30, \
+				29, 28, 27, 26, 25, 24, 39, 38, 37, 36, 35, 34, \
+				33, 32, 47, 46, 45, 44, 43, 42, 41, 40, 55, 54, \
+				53, 52, 51, 50, 49, 48, 63, 62, 61, 60, 59, 58, \
+				57, 56
+#endif
+
+/*
+ * Shuffle the elements of two vectors of the same type according to a constant
+ * list of indices, where the indices of b's elements start after a's.
+ */
+#if defined(__clang__) || __GNUC__ >= 12
+#  define SHUFFLE(a, b, ...)	__builtin_shufflevector((a), (b), __VA_ARGS__)
+#else
+#  define SHUFFLE(a, b, ...)	\
+	__builtin_shuffle((a), (b), (__typeof__(a)){ __VA_ARGS__ })
+#endif
+
+#define ROR(x, n)		(((x) >> (n)) | ((x) << (WORD_BITS - (n))))
+#define CH(x, y, z)		((((y) ^ (z)) & (x)) ^ (z))
+#define MAJ(x, y, z)		(((x) & (y)) | (((x) | (y)) & (z)))
+
+/*
+ * One step of transposing the LANES x LANES matrix of words in rows[]: for each
+ * pair of rows i and i + d where i & d == 0, swap the elements j of row i where
+ * j & d != 0 with the elements j - d of row i + d.  Doing this for each power
+ * of 2 d < LANES transposes the matrix.
+ */
+#define TRANSPOSE_STEP(d)						\
+do {									\
+	for (i = 0; i < LANES; i++) {					\
+		vec_t r0, r1;						\
+									\
+		if (i & (d))						\
+			continue;					\
+		r0 = rows[i];						\
+		r1 = rows[i + (d)];					\
+		rows[i] = SHUFFLE(r0, r1, TRANSPOSE_LO_##d);		\
+		rows[i + (d)] = SHUFFLE(r0, r1, TRANSPOSE_HI_##d);	\
+	}								\
+} while (0)
+
+/*
+ * The message schedule word for round t + i, where t is a multiple of 16.  The
+ * first 16 words are just the message block; the rest are computed in place.
+ */
+#define W_LOAD(i)	w[i]
+#define W_SCHED(i)							\
+	(w[i] += SSIG1(w[((i) + 14) & 15]) + w[((i) + 9) & 15] +	\
+		 SSIG0(w[((i) + 1) & 15]))
+
+#define ROUND(a, b, c, d, e, f, g, h, t, i, W)				\
+do {									\
+	vec_t t1 = h + BSIG1(e) + CH(e, f, g) + ROUND_CONSTS[(t) + (i)] + \
+		   W(i);						\
+	vec_t t2 = BSIG0(a) + MAJ(a, b, c);				\
+									\
+	d += t1;							\
+	h = t1 + t2;							\
+} while (0)
+
+#define ROUNDS_16(t, W)							\
+do {									\
+	ROUND(a, b, c, d, e, f, g, h, t, 0, W);				\
+	ROUND(h, a, b, c, d, e, f, g, t, 1, W);				\
+	ROUND(g, h, a, b, c, d, e, f, t, 2, W);				\
+	ROUND(f, g, h, a, b, c, d, e, t, 3, W);				\
+	ROUND(e, f, g, h, a, b, c, d, t, 4, W);				\
+	ROUND(d, e, f, g, h, a, b, c, t, 5, W);				\
+	ROUND(c, d, e, f, g, h, a, b, t, 6, W);				\
+	ROUND(b, c, d, e, f, g, h, a, t, 7, W);				\
+	ROUND(a, b, c, d, e, f, g, h, t, 8, W);				\
+	ROUND(h, a, b, c, d, e, f, g, t, 9, W);				\
+	ROUND(g, h, a, b, c, d, e, f, t, 10, W);			\
+	ROUND(f, g, h, a, b, c, d, e, t, 11, W);			\
+	ROUND(e, f, g, h, a, b, c, d, t, 12, W);			\
+	ROUND(d, e, f, g, h, a, b, c, t, 13, W);			\
+	ROUND(c, d, e, f, g, h, a, b, t, 14, W);			\
+	ROUND(b, c, d, e, f, g, h, a, t, 15, W);			\
+} while (0)
+
+static ATTRIBUTES void
+FUNCNAME(const void *prefix_state, size_t prefix_size, const u8 *const msgs[],
+	 size_t size, u8 *const outs[])
+{
+	typedef WORD vec_t __attribute__((vector_size(VEC_BYTES)));
+	typedef u8 bytevec_t __attribute__((vector_size(VEC_BYTES)));
+	const size_t prefix_blocks = prefix_size / BLOCK_BYTES;
+	const size_t total_blocks = prefix_blocks + (size / BLOCK_BYTES) + 1;
+	const WORD *init = prefix_state ?: IV;
+	u8 pad[BLOCK_BYTES] = { 0x80 };
+	const u8 *ptrs[LANES];
+	vec_t state[8];
+	vec_t w[16];
+	size_t blk;
+	int i, j;
+
+	/*
+	 * All messages have the same length, which is a multiple of the block
+	 * size, so they all end with the same padding block.
+	 */
+	put_unaligned_be64((u64)(prefix_size + size) << 3,
+			   &pad[BLOCK_BYTES - 8]);
+#if SHA512
+	put_unaligned_be64((u64)(prefix_size + size) >> 61,
+			   &pad[BLOCK_BYTES - 16]);
+#endif
+
+	for (i = 0; i < 8; i++)
+		state[i] = (vec_t){} + init[i];
+
+	for (blk = prefix_blocks; blk < total_blocks; blk++) {
+		vec_t a = state[0], b = state[1], c = state[2], d = state[3];
+		vec_t e = state[4], f = state[5], g = state[6], h = state[7];
+
+		for (i = 0; i < LANES; i++) {
+			if (blk + 1 < total_blocks)
+				ptrs[i] = &msgs[i][(blk - prefix_blocks) *
+						   BLOCK_BYTES];
+			else
+				ptrs[i] = pad;
+		}
+
+		/*
+		 * Load the next block of each message and transpose the blocks,
+		 * so that w[t] holds word t of each message.  Each message block
+		 * spans 16 / LANES vectors, and each group of LANES vectors is
+		 * transposed separately.
+		 */
+		for (j = 0; j < 16; j += LANES) {
+			vec_t rows[LANES];
+
+			for (i = 0; i < LANES; i++) {
+				bytevec_t bytes;
+
+				memcpy(&bytes, &ptrs[i][j * WORD_BYTES],
+				       sizeof(bytes));
+				bytes = SHUFFLE(bytes, bytes, BSWAP_SHUFFLE);
+				rows[i] = (vec_t)bytes;
+			}
+			TRANSPOSE_STEP(1);
+			TRANSPOSE_STEP(2);
+#if LANES >= 8
+			TRANSPOSE_STEP(4);
+#endif
+#if LANES >= 16
+			TRANSPOSE_STEP(8);
+#endif
+			for (i = 0; i < LANES; i++)
+				w[j + i] = rows[i];
+		}
+
+		ROUNDS_16(0, W_LOAD);
+		for (i = 16; i < NUM_ROUNDS; i += 16)
+			ROUNDS_16(i, W_SCHED);
+
+		state[0] += a;
+		state[1] += b;
+		state[2] += c;
+		state[3] += d;
+		state[4] += e;
+		state[5] += f;
+		state[6] += g;
+		state[7] += h;
+	}
+
+	for (i = 0; i < LANES; i++) {
+		for (j = 0; j < 8; j++)
+			STORE_BE(state[j][i], &outs[i][j * WORD_BYTES]);
+	}
+}
+
+#undef FUNCNAME
+#undef ATTRIBUTES
+#undef VEC_BYTES
+#undef SHA512
+#undef WORD
+#undef WORD_BYTES
+#undef NUM_ROUNDS
+#undef IV
+#undef ROUND_CONSTS
+#undef STORE_BE
+#undef BSIG0
+#undef BSIG1
+#undef SSIG0
+#undef SSIG1
+#undef WORD_BITS
+#undef BLOCK_BYTES
+#undef LANES
+#undef ROR
+#undef CH
+#undef MAJ
+#undef SHUFFLE
+#undef BSWAP_SHUFFLE
+#undef TRANSPOSE_HI_1
+#undef TRANSPOSE_HI_2
+#undef TRANSPOSE_HI_4
+#undef TRANSPOSE_HI_8
+#undef TRANSPOSE_LO_1
+#undef TRANSPOSE_LO_2
+#undef TRANSPOSE_LO_4
+#undef TRANSPOSE_LO_8
+#undef TRANSPOSE_STEP
+#undef W_LOAD
+#undef W_SCHED
+#undef ROUND
+#undef ROUNDS_16
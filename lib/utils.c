@@ -15,7 +15,7 @@
 #include <stdlib.h>
 #include <string.h>
 
-static void *xmalloc(size_t size)
+void *libfsverity_malloc(size_t size)
 {
 	void *p = malloc(size);
 
@@ -27,16 +27,26 @@ static void *xmalloc(size_t size)
 
 void *libfsverity_zalloc(size_t size)
 {
-	void *p = xmalloc(size);
+	void *p = libfsverity_malloc(size);
 
 	if (!p)
 		return NULL;
 	return memset(p, 0, size);
 }
 
+void *libfsverity_realloc(void *p, size_t size)
+{
+	void *new_p = realloc(p, size);
+
+	if (!new_p)
+		libfsverity_error_msg("out of memory (tried to allocate %zu bytes)",
+				      size);
+	return new_p;
+}
+
 void *libfsverity_memdup(const void *mem, size_t size)
 {
-	void *p = xmalloc(size);
+	void *p = libfsverity_malloc(size);
 
 	if (!p)
 		return NULL;
@@ -91,11 +101,28 @@ void libfsverity_bug_on(const char *condition, const char *file, int line)
 	abort();
 }
 
+/*
+ * Check whether the given memory is all zeroes.  This is used to detect
+ * all-zero data blocks, so large sizes are handled 64 bytes at a time using
+ * vector types, which the compiler turns into SIMD instructions.
+ */
 bool libfsverity_mem_is_zeroed(const void *mem, size_t size)
 {
+	typedef u64 vec_t __attribute__((vector_size(16)));
 	const u8 *p = mem;
 	size_t i;
 
+	for (; size >= 64; p += 64, size -= 64) {
+		vec_t v0, v1, v2, v3;
+
+		memcpy(&v0, &p[0], 16);
+		memcpy(&v1, &p[16], 16);
+		memcpy(&v2, &p[32], 16);
+		memcpy(&v3, &p[48], 16);
+		v0 |= v1 | v2 | v3;
+		if (v0[0] | v0[1])
+			return false;
+	}
 	for (i = 0; i < size; i++) {
 		if (p[i])
 			return false;
@@ -0,0 +1,255 @@
+// SPDX-License-Identifier: MIT
+/*
+ * Resumable digest computations for 'fsverity digest' and 'fsverity sign'
+ *
+ * Copyright 2026 Google LLC
+ *
+ * Use of this source code is governed by an MIT-style
+ * license that can be found in the LICENSE file or at
+ * https://opensource.org/licenses/MIT.
+ */
+
+#include "fsverity.h"
+
+#include <errno.h>
+#include <fcntl.h>
+#include <sys/stat.h>
+#include <time.h>
+#include <unistd.h>
+
+#define CHECKPOINT_MAGIC	"FSVCKPT1"
+
+/*
+ * A checkpoint file is this header followed by the state saved by
+ * libfsverity_partial_tree_save().  All integers are little endian.  The header
+ * identifies the version of the file that the checkpoint was made for, so that
+ * a checkpoint for a file whose size or modification time has since changed is
+ * recognized as stale.  libfsverity_partial_tree_load() checks the rest.
+ */
+struct checkpoint_header {
+	char magic[8];			/* CHECKPOINT_MAGIC */
+	__le64 file_size;
+	__le64 mtime_sec;
+	__le32 mtime_nsec;
+	__le32 reserved;
+};
+
+/* Get the checkpoint header for the current version of @file. */
+static bool get_checkpoint_header(struct filedes *file,
+				  struct checkpoint_header *hdr)
+{
+	struct stat stbuf;
+
+	if (fstat(file->fd, &stbuf) != 0) {
+		error_msg_errno("can't stat file '%s'", file->name);
+		return false;
+	}
+	memset(hdr, 0, sizeof(*hdr));
+	memcpy(hdr->magic, CHECKPOINT_MAGIC, sizeof(hdr->magic));
+	hdr->file_size = cpu_to_le64(stbuf.st_size);
+	hdr->mtime_sec = cpu_to_le64(stbuf.st_mtime);
+#ifndef _WIN32
+	hdr->mtime_nsec = cpu_to_le32(stbuf.st_mtim.tv_nsec);
+#endif
+	return true;
+}
+
+/*
+ * Read the checkpoint file at @path into memory.  If it doesn't exist, return
+ * true with *@buf_ret set to NULL.
+ */
+static bool read_checkpoint_file(const char *path, u8 **buf_ret,
+				 size_t *size_ret)
+{
+	struct filedes cp = { .fd = -1 };
+	u64 size;
+	bool ok;
+
+	*buf_ret = NULL;
+	if (access(path, F_OK) != 0 && errno == ENOENT)
+		return true;
+	if (!open_file(&cp, path, O_RDONLY, 0))
+		return false;
+	ok = get_file_size(&cp, &size);
+	if (ok && size > (1 << 24)) {
+		error_msg("checkpoint file '%s' is too large", path);
+		ok = false;
+	}
+	if (ok) {
+		*buf_ret = xmalloc(size);
+		*size_ret = size;
+		ok = full_read(&cp, *buf_ret, size);
+	}
+	filedes_close(&cp);
+	if (!ok) {
+		free(*buf_ret);
+		*buf_ret = NULL;
+	}
+	return ok;
+}
+
+/*
+ * Resume from the checkpoint file at @path if it holds the progress of an
+ * earlier computation for the current version of the file and the same Merkle
+ * tree parameters.  Otherwise start from the beginning.
+ */
+static int load_checkpoint(const char *path,
+			   const struct checkpoint_header *expected_hdr,
+			   const struct libfsverity_merkle_tree_params *params,
+			   struct libfsverity_partial_tree **ptree_ret)
+{
+	struct checkpoint_header hdr;
+	u8 *buf;
+	size_t size;
+	int err;
+
+	if (!read_checkpoint_file(path, &buf, &size))
+		return -EIO;
+	/* An empty file is fine, e.g. one that was created by mktemp. */
+	if (buf && size != 0) {
+		if (size < sizeof(hdr) ||
+		    memcmp(buf, CHECKPOINT_MAGIC, sizeof(hdr.magic)) != 0) {
+			/* Don't overwrite some unrelated file. */
+			error_msg("'%s' isn't a checkpoint file", path);
+			free(buf);
+			return -EINVAL;
+		}
+		memcpy(&hdr, buf, sizeof(hdr));
+		if (memcmp(&hdr, expected_hdr, sizeof(hdr)) != 0) {
+			warning_msg("ignoring stale checkpoint '%s', as the file has changed",
+				    path);
+			goto start_over;
+		}
+		err = libfsverity_partial_tree_load(params, &buf[sizeof(hdr)],
+						    size - sizeof(hdr),
+						    ptree_ret);
+		if (err == -EINVAL || err == -EBADMSG) {
+			warning_msg("ignoring unusable checkpoint '%s'", path);
+			goto start_over;
+		}
+		if (err == 0 &&
+		    libfsverity_partial_tree_data_size(*ptree_ret) >
+		    params->file_size) {
+			libfsverity_partial_tree_free(*ptree_ret);
+			warning_msg("ignoring unusable checkpoint '%s'", path);
+			goto start_over;
+		}
+		free(buf);
+		return err;
+	}
+start_over:
+	free(buf);
+	return libfsverity_partial_tree_new(params, ptree_ret);
+}
+
+/*
+ * Save the progress to the checkpoint file at @path.  The checkpoint is written
+ * to a temporary file which then replaces the old one, so that the old one
+ * stays usable if this is interrupted.
+ */
+static int save_checkpoint(const char *path,
+			   const struct checkpoint_header *hdr,
+			   struct libfsverity_partial_tree *ptree)
+{
+	char *tmp_path = xmalloc(strlen(path) + sizeof(".tmp"));
+	struct filedes tmp = { .fd = -1 };
+	u8 *state = NULL;
+	size_t state_size;
+	bool ok;
+	int err;
+
+	err = libfsverity_partial_tree_save(ptree, &state, &state_size);
+	if (err)
+		goto out;
+
+	sprintf(tmp_path, "%s.tmp", path);
+	err = -EIO;
+	if (!open_file(&tmp, tmp_path, O_WRONLY|O_CREAT|O_TRUNC, 0644))
+		goto out;
+	ok = full_write(&tmp, hdr, sizeof(*hdr)) &&
+	     full_write(&tmp, state, state_size);
+#ifndef _WIN32
+	if (ok && fsync(tmp.fd) != 0) {
+		error_msg_errno("can't sync '%s'", tmp_path);
+		ok = false;
+	}
+#endif
+	ok &= filedes_close(&tmp);
+	if (!ok)
+		goto out;
+#ifdef _WIN32
+	/* rename() doesn't replace existing files on Windows. */
+	unlink(path);
+#endif
+	if (rename(tmp_path, path) != 0) {
+		error_msg_errno("can't rename '%s' to '%s'", tmp_path, path);
+		goto out;
+	}
+	err = 0;
+out:
+	free(state);
+	free(tmp_path);
+	return err;
+}
+
+/*
+ * Compute the fs-verity digest of a file, saving the progress to the checkpoint
+ * file at @checkpoint_path every @interval seconds so that the computation can
+ * be resumed if it gets interrupted.  If the checkpoint file already holds the
+ * progress of an interrupted computation, it is resumed, unless the file or the
+ * Merkle tree parameters have changed since then.  The checkpoint file is
+ * deleted once the digest has been computed.
+ *
+ * The data is read sequentially using pread_callback(), and
+ * params->metadata_callbacks aren't supported.
+ */
+int compute_file_digest_checkpointed(struct filedes *file,
+				     const struct libfsverity_merkle_tree_params *params,
+				     const char *checkpoint_path, u32 interval,
+				     struct libfsverity_digest **digest_ret)
+{
+	struct checkpoint_header hdr;
+	struct libfsverity_partial_tree *ptree = NULL;
+	u8 *buf = NULL;
+	u64 offset;
+	time_t last_save;
+	int err;
+
+	if (!get_checkpoint_header(file, &hdr))
+		return -EIO;
+	err = load_checkpoint(checkpoint_path, &hdr, params, &ptree);
+	if (err)
+		return err;
+
+	buf = xmalloc(READ_CHUNK_SIZE);
+	last_save = time(NULL);
+	offset = libfsverity_partial_tree_data_size(ptree);
+	while (offset < params->file_size) {
+		size_t count = min(params->file_size - offset,
+				   (u64)READ_CHUNK_SIZE);
+
+		err = pread_callback(file, buf, count, offset);
+		if (err)
+			goto out;
+		err = libfsverity_partial_tree_append(ptree, buf, count);
+		if (err)
+			goto out;
+		offset += count;
+		if (offset < params->file_size &&
+		    time(NULL) - last_save >= (time_t)interval) {
+			err = save_checkpoint(checkpoint_path, &hdr, ptree);
+			if (err)
+				goto out;
+			last_save = time(NULL);
+		}
+	}
+	err = libfsverity_partial_tree_digest(ptree, digest_ret);
+	if (err)
+		goto out;
+	if (unlink(checkpoint_path) != 0 && errno != ENOENT)
+		warning_msg("can't remove checkpoint '%s'", checkpoint_path);
+out:
+	free(buf);
+	libfsverity_partial_tree_free(ptree);
+	return err;
+}
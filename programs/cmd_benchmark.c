@@ -0,0 +1,114 @@
+// SPDX-License-Identifier: MIT
+/*
+ * The 'fsverity benchmark' command
+ *
+ * Copyright 2026 Google LLC
+ *
+ * Use of this source code is governed by an MIT-style
+ * license that can be found in the LICENSE file or at
+ * https://opensource.org/licenses/MIT.
+ */
+
+#include "fsverity.h"
+
+#include <getopt.h>
+
+static const struct option longopts[] = {
+	{"hash-alg",		required_argument, NULL, OPT_HASH_ALG},
+	{"block-size",		required_argument, NULL, OPT_BLOCK_SIZE},
+	{NULL, 0, NULL, 0}
+};
+
+/* The last error message from libfsverity, while benchmarking */
+static char last_error[256];
+
+static void save_libfsverity_error(const char *msg)
+{
+	snprintf(last_error, sizeof(last_error), "%s", msg);
+}
+
+/*
+ * Measure how fast each hash implementation hashes Merkle tree blocks, so that
+ * the fastest one can be chosen with --hash-impl.
+ */
+int fsverity_cmd_benchmark(const struct fsverity_command *cmd,
+			   int argc, char *argv[])
+{
+	struct libfsverity_merkle_tree_params tree_params = { .version = 1 };
+	u32 alg_num, block_size;
+	const char *name;
+	u32 impl;
+	int status;
+	int c;
+
+	while ((c = getopt_long(argc, argv, "", longopts, NULL)) != -1) {
+		switch (c) {
+		case OPT_HASH_ALG:
+		case OPT_BLOCK_SIZE:
+			if (!parse_tree_param(c, optarg, &tree_params))
+				goto out_usage;
+			break;
+		default:
+			goto out_usage;
+		}
+	}
+
+	if (argc != optind)
+		goto out_usage;
+
+	alg_num = tree_params.hash_algorithm ?: FS_VERITY_HASH_ALG_SHA256;
+	block_size = tree_params.block_size ?: 4096;
+	name = libfsverity_get_hash_name(alg_num);
+	if (!name) {
+		error_msg("unknown hash algorithm: %u", alg_num);
+		goto out_err;
+	}
+	printf("Hashing %u-byte blocks with %s:\n", block_size, name);
+
+	for (impl = 0; (name = libfsverity_get_hash_impl_name(impl)) != NULL;
+	     impl++) {
+		u64 bytes_per_sec;
+		int err;
+
+		/*
+		 * An implementation that is unavailable is expected, so just
+		 * say why on its line of the results instead of as an error.
+		 */
+		last_error[0] = '\0';
+		libfsverity_set_error_callback(save_libfsverity_error);
+		err = libfsverity_benchmark_hash_impl(alg_num, impl, block_size,
+						      &bytes_per_sec);
+		install_libfsverity_error_handler();
+		if (err == -EOPNOTSUPP) {
+			if (last_error[0])
+				printf("    %-10s unavailable (%s)\n", name,
+				       last_error);
+			else
+				printf("    %-10s unavailable\n", name);
+			continue;
+		}
+		if (err) {
+			/* Keep the error messages in order with the results. */
+			fflush(stdout);
+			if (last_error[0])
+				error_msg("%s", last_error);
+			error_msg("failed to benchmark hash implementation %s",
+				  name);
+			goto out_err;
+		}
+		printf("    %-10s %8.1f MB/s\n", name, bytes_per_sec / 1e6);
+	}
+	status = 0;
+out:
+	destroy_tree_params(&tree_params);
+	return status;
+
+out_err:
+	status = 1;
+	goto out;
+
+out_usage:
+	usage(cmd, stderr);
+	status = 2;
+	goto out;
+}
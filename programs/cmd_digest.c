@@ -11,8 +11,17 @@
 
 #include "fsverity.h"
 
+#include <ctype.h>
+#include <errno.h>
 #include <fcntl.h>
 #include <getopt.h>
+#include <pthread.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#ifndef _WIN32
+#  include <dirent.h>
+#  include <sys/mman.h>
+#endif
 
 static const struct option longopts[] = {
 	{"hash-alg",		required_argument, NULL, OPT_HASH_ALG},
@@ -22,9 +31,883 @@ static const struct option longopts[] = {
 	{"out-descriptor",      required_argument, NULL, OPT_OUT_DESCRIPTOR},
 	{"compact",		no_argument,	   NULL, OPT_COMPACT},
 	{"for-builtin-sig",	no_argument,	   NULL, OPT_FOR_BUILTIN_SIG},
+	{"threads",		required_argument, NULL, OPT_THREADS},
+	{"hash-impl",		required_argument, NULL, OPT_HASH_IMPL},
+	{"mmap",		no_argument,	   NULL, OPT_MMAP},
+	{"queue-depth",		required_argument, NULL, OPT_QUEUE_DEPTH},
+	{"io-mode",		required_argument, NULL, OPT_IO_MODE},
+	{"sparse",		no_argument,	   NULL, OPT_SPARSE},
+	{"checkpoint",		required_argument, NULL, OPT_CHECKPOINT},
+	{"checkpoint-interval",	required_argument, NULL, OPT_CHECKPOINT_INTERVAL},
+	{"update-tree",		required_argument, NULL, OPT_UPDATE_TREE},
+	{"changed",		required_argument, NULL, OPT_CHANGED},
+	{"recursive",		no_argument,	   NULL, 'r'},
+	{"jobs",		required_argument, NULL, OPT_JOBS},
+	{"sorted",		no_argument,	   NULL, OPT_SORTED},
+	{"also-flat-hash",	required_argument, NULL, OPT_ALSO_FLAT_HASH},
+	{"memo-size",		required_argument, NULL, OPT_MEMO_SIZE},
+	/* Still allow --hash, which used to be an unambiguous prefix. */
+	{"hash",		required_argument, NULL, OPT_HASH_ALG},
 	{NULL, 0, NULL, 0}
 };
 
+#ifndef _WIN32
+/*
+ * Compute the fs-verity digest of a file by mmap()ing it and hashing its data
+ * directly from the mapping, rather than reading it into a buffer.
+ */
+static int compute_digest_mmap(struct filedes *file,
+			       const struct libfsverity_merkle_tree_params *params,
+			       struct libfsverity_digest **digest_ret)
+{
+	const u64 size = params->file_size;
+	void *map = NULL;
+	int err;
+
+	if (size != 0) {
+		if (size > SIZE_MAX) {
+			error_msg("'%s' is too large to mmap", file->name);
+			return -EFBIG;
+		}
+		map = mmap(NULL, size, PROT_READ, MAP_PRIVATE, file->fd, 0);
+		if (map == MAP_FAILED) {
+			err = -errno;
+			error_msg_errno("can't mmap '%s'", file->name);
+			return err;
+		}
+		/* These are only hints, so ignore any errors. */
+		madvise(map, size, MADV_SEQUENTIAL);
+#ifdef MADV_HUGEPAGE
+		madvise(map, size, MADV_HUGEPAGE);
+#endif
+	}
+	err = libfsverity_compute_digest_buffer(map, params, digest_ret);
+	if (map)
+		munmap(map, size);
+	return err;
+}
+#else /* _WIN32 */
+static int compute_digest_mmap(
+		struct filedes *file __attribute__((unused)),
+		const struct libfsverity_merkle_tree_params *params
+			__attribute__((unused)),
+		struct libfsverity_digest **digest_ret __attribute__((unused)))
+{
+	error_msg("--mmap isn't supported on this platform");
+	return -EOPNOTSUPP;
+}
+#endif /* _WIN32 */
+
+/*
+ * Compute the fs-verity digest of data whose size isn't known in advance, such
+ * as data from a pipe, by reading it until end-of-file.
+ */
+static int compute_digest_stream(struct filedes *file,
+				 const struct libfsverity_merkle_tree_params *params,
+				 struct libfsverity_digest **digest_ret)
+{
+	struct libfsverity_merkle_tree_params stream_params = *params;
+	struct libfsverity_digest_ctx *ctx;
+	u8 *buf;
+	int n;
+	int err;
+
+	stream_params.file_size = LIBFSVERITY_FILE_SIZE_UNKNOWN;
+	err = libfsverity_digest_ctx_new(&stream_params, &ctx);
+	if (err)
+		return err;
+	buf = xmalloc(READ_CHUNK_SIZE);
+	while ((n = read(file->fd, buf, READ_CHUNK_SIZE)) != 0) {
+		if (n < 0) {
+			if (errno == EINTR)
+				continue;
+			err = -errno;
+			error_msg_errno("reading from '%s'", file->name);
+			goto out;
+		}
+		err = libfsverity_digest_ctx_update(ctx, buf, n);
+		if (err)
+			goto out;
+	}
+	err = libfsverity_digest_ctx_final(ctx, digest_ret);
+out:
+	free(buf);
+	libfsverity_digest_ctx_free(ctx);
+	return err;
+}
+
+static bool parse_jobs_option(const char *arg, u32 *num_jobs_ptr)
+{
+	char *end;
+	unsigned long n = strtoul(arg, &end, 10);
+
+	if (n <= 0 || n > 4096 || *end != '\0') {
+		error_msg("Invalid number of jobs: %s", arg);
+		return false;
+	}
+	*num_jobs_ptr = n;
+	return true;
+}
+
+static bool parse_flat_hash_option(const char *arg, u32 *alg_ptr)
+{
+	if (*alg_ptr != 0) {
+		error_msg("--also-flat-hash can only be specified once");
+		return false;
+	}
+	*alg_ptr = libfsverity_find_hash_alg_by_name(arg);
+	if (*alg_ptr == 0) {
+		error_msg("unknown hash algorithm for --also-flat-hash: '%s'",
+			  arg);
+		return false;
+	}
+	return true;
+}
+
+static bool parse_memo_size_option(const char *arg, u64 *memo_size_ptr)
+{
+	char *end;
+	unsigned long long n = strtoull(arg, &end, 10);
+
+	if (n == 0 || *end != '\0' || arg[0] == '-') {
+		error_msg("Invalid memo size: %s", arg);
+		return false;
+	}
+	*memo_size_ptr = n;
+	return true;
+}
+
+/*
+ * Parse the argument of --changed, a comma-separated list of OFFSET:LENGTH
+ * byte ranges.  An empty list is allowed.
+ */
+static bool parse_changed_option(const char *arg,
+				 struct libfsverity_range **ranges_ret,
+				 size_t *num_ranges_ret)
+{
+	struct libfsverity_range *ranges;
+	size_t n = 0;
+	const char *p;
+	char *end;
+
+	ranges = xmalloc((strlen(arg) / 4 + 1) * sizeof(ranges[0]));
+	for (p = arg; *p != '\0'; n++) {
+		if (!isdigit((unsigned char)*p))
+			goto invalid;
+		errno = 0;
+		ranges[n].offset = strtoull(p, &end, 10);
+		if (errno || *end != ':' || !isdigit((unsigned char)end[1]))
+			goto invalid;
+		ranges[n].length = strtoull(end + 1, &end, 10);
+		if (errno || (*end != ',' && *end != '\0'))
+			goto invalid;
+		p = end;
+		if (*p == ',' && *++p == '\0')
+			goto invalid;
+	}
+	*ranges_ret = ranges;
+	*num_ranges_ret = n;
+	return true;
+
+invalid:
+	error_msg("invalid value for --changed: '%s'.  Must be a comma-separated list of OFFSET:LENGTH",
+		  arg);
+	free(ranges);
+	return false;
+}
+
+#ifndef _WIN32
+/*
+ * Update the Merkle tree file at @tree_path, which was produced by
+ * --out-merkle-tree for an earlier version of the file, after the data ranges
+ * @changed of the file were overwritten.  The tree file is mmap()ed so that
+ * only the tree blocks that change are read and written.
+ */
+static int update_merkle_tree_file(struct filedes *file,
+				   const struct libfsverity_merkle_tree_params *params,
+				   const char *tree_path,
+				   const struct libfsverity_range *changed,
+				   size_t num_changed,
+				   struct libfsverity_digest **digest_ret)
+{
+	struct filedes tree_file = { .fd = -1 };
+	u64 size;
+	void *map = NULL;
+	int err;
+
+	if (!open_file(&tree_file, tree_path, O_RDWR, 0))
+		return -EIO;
+	if (!get_file_size(&tree_file, &size)) {
+		err = -EIO;
+		goto out;
+	}
+	if (size > SIZE_MAX) {
+		error_msg("'%s' is too large to mmap", tree_path);
+		err = -EFBIG;
+		goto out;
+	}
+	if (size != 0) {
+		map = mmap(NULL, size, PROT_READ|PROT_WRITE, MAP_SHARED,
+			   tree_file.fd, 0);
+		if (map == MAP_FAILED) {
+			err = -errno;
+			error_msg_errno("can't mmap '%s'", tree_path);
+			map = NULL;
+			goto out;
+		}
+	}
+	err = libfsverity_update_merkle_tree(file, params, changed,
+					     num_changed, map, size,
+					     digest_ret);
+	if (map && munmap(map, size) != 0 && !err) {
+		err = -errno;
+		error_msg_errno("can't unmap '%s'", tree_path);
+	}
+out:
+	filedes_close(&tree_file);
+	return err;
+}
+#else /* _WIN32 */
+static int update_merkle_tree_file(
+		struct filedes *file __attribute__((unused)),
+		const struct libfsverity_merkle_tree_params *params
+			__attribute__((unused)),
+		const char *tree_path __attribute__((unused)),
+		const struct libfsverity_range *changed __attribute__((unused)),
+		size_t num_changed __attribute__((unused)),
+		struct libfsverity_digest **digest_ret __attribute__((unused)))
+{
+	error_msg("--update-tree isn't supported on this platform");
+	return -EOPNOTSUPP;
+}
+#endif /* _WIN32 */
+
+/* Print the digest of the file @name in the format chosen by the options. */
+static void print_digest(const struct libfsverity_digest *digest,
+			 const char *name, bool compact, bool for_builtin_sig)
+{
+	struct fsverity_formatted_digest *d = NULL;
+	char digest_hex[FS_VERITY_MAX_DIGEST_SIZE * 2 + sizeof(*d) * 2 + 1];
+
+	ASSERT(digest->digest_size <= FS_VERITY_MAX_DIGEST_SIZE);
+
+	if (for_builtin_sig) {
+		/*
+		 * Format the digest for use with the built-in signature
+		 * support.
+		 */
+		d = xzalloc(sizeof(*d) + digest->digest_size);
+		memcpy(d->magic, "FSVerity", 8);
+		d->digest_algorithm = cpu_to_le16(digest->digest_algorithm);
+		d->digest_size = cpu_to_le16(digest->digest_size);
+		memcpy(d->digest, digest->digest, digest->digest_size);
+
+		bin2hex((const u8 *)d, sizeof(*d) + digest->digest_size,
+			digest_hex);
+	} else {
+		bin2hex(digest->digest, digest->digest_size, digest_hex);
+	}
+
+	if (compact)
+		printf("%s\n", digest_hex);
+	else if (for_builtin_sig)
+		printf("%s %s\n", digest_hex, name);
+	else
+		printf("%s:%s %s\n",
+		       libfsverity_get_hash_name(digest->digest_algorithm),
+		       digest_hex, name);
+	free(d);
+}
+
+/*
+ * Print the flat hash of the file @name, i.e. the conventional hash of its
+ * contents, on the line after its fs-verity digest.
+ */
+static void print_flat_hash(const u8 *hash, u32 alg, const char *name,
+			    bool compact)
+{
+	char hash_hex[FS_VERITY_MAX_DIGEST_SIZE * 2 + 1];
+
+	bin2hex(hash, libfsverity_get_digest_size(alg), hash_hex);
+	if (compact)
+		printf("%s\n", hash_hex);
+	else
+		printf("flat-%s:%s %s\n", libfsverity_get_hash_name(alg),
+		       hash_hex, name);
+}
+
+/* Print the statistics of --memo-size for the file @name. */
+static void print_memo_stats(const struct libfsverity_memo_stats *stats,
+			     const char *name)
+{
+	fprintf(stderr,
+		"%s: memo: %llu lookups, %llu hits (%.1f%%), %llu mismatches\n",
+		name, (unsigned long long)stats->lookups,
+		(unsigned long long)stats->hits,
+		stats->lookups ? 100.0 * stats->hits / stats->lookups : 0.0,
+		(unsigned long long)stats->mismatches);
+}
+
+/* A file to be digested by digest_files_parallel() */
+struct file_entry {
+	char *path;
+	u64 size;
+	/* With --sorted, the digest is kept here until it is printed. */
+	struct libfsverity_digest *digest;
+};
+
+struct file_list {
+	struct file_entry *files;
+	size_t num_files;
+	size_t capacity;
+};
+
+static void add_file(struct file_list *list, char *path, u64 size)
+{
+	if (list->num_files == list->capacity) {
+		list->capacity = max(2 * list->capacity, (size_t)64);
+		list->files = realloc(list->files,
+				      list->capacity * sizeof(list->files[0]));
+		ASSERT(list->files);
+	}
+	list->files[list->num_files++] = (struct file_entry) {
+		.path = path, .size = size,
+	};
+}
+
+#ifndef _WIN32
+/* Join a directory path and the name of an entry in it. */
+static char *join_path(const char *dir, const char *name)
+{
+	size_t len = strlen(dir);
+	char *path = xmalloc(len + strlen(name) + 2);
+
+	if (len && dir[len - 1] == '/')
+		sprintf(path, "%s%s", dir, name);
+	else
+		sprintf(path, "%s/%s", dir, name);
+	return path;
+}
+
+/*
+ * Add the regular files in the directory @path to @list, and append its
+ * subdirectories to @dirs.  Other types of files, including symlinks, are
+ * skipped.  The entries are looked up relative to the open directory, and the
+ * directory is closed before returning, so that walking a directory tree keeps
+ * only one directory open at a time no matter how deep the tree is.
+ */
+static bool scan_directory(const char *path, struct file_list *list,
+			   char ***dirs, size_t *num_dirs, size_t *dirs_capacity)
+{
+	struct dirent *ent;
+	struct stat stbuf;
+	bool ok = true;
+	DIR *dir;
+	int fd;
+
+	fd = open(path, O_RDONLY | O_DIRECTORY);
+	if (fd < 0 || !(dir = fdopendir(fd))) {
+		error_msg_errno("can't open directory '%s'", path);
+		if (fd >= 0)
+			close(fd);
+		return false;
+	}
+	for (errno = 0; (ent = readdir(dir)) != NULL; errno = 0) {
+		char *child;
+
+		if (!strcmp(ent->d_name, ".") || !strcmp(ent->d_name, ".."))
+			continue;
+		/* Skip what obviously isn't a file or directory without a stat. */
+		if (ent->d_type != DT_UNKNOWN && ent->d_type != DT_REG &&
+		    ent->d_type != DT_DIR)
+			continue;
+		if (fstatat(dirfd(dir), ent->d_name, &stbuf,
+			    AT_SYMLINK_NOFOLLOW) != 0) {
+			error_msg_errno("can't stat '%s/%s'", path,
+					ent->d_name);
+			ok = false;
+			continue;
+		}
+		if (!S_ISREG(stbuf.st_mode) && !S_ISDIR(stbuf.st_mode))
+			continue;
+		child = join_path(path, ent->d_name);
+		if (S_ISREG(stbuf.st_mode)) {
+			add_file(list, child, stbuf.st_size);
+			continue;
+		}
+		if (*num_dirs == *dirs_capacity) {
+			*dirs_capacity = max(2 * *dirs_capacity, (size_t)16);
+			*dirs = realloc(*dirs,
+					*dirs_capacity * sizeof((*dirs)[0]));
+			ASSERT(*dirs);
+		}
+		(*dirs)[(*num_dirs)++] = child;
+	}
+	if (errno) {
+		error_msg_errno("can't read directory '%s'", path);
+		ok = false;
+	}
+	closedir(dir);
+	return ok;
+}
+
+/*
+ * Add the regular files in the directory tree rooted at @root to @list.  The
+ * tree is walked breadth-first, so only one directory is open at a time.
+ */
+static bool walk_directory(const char *root, struct file_list *list)
+{
+	char **dirs = NULL;
+	size_t num_dirs = 0, dirs_capacity = 0;
+	bool ok = true;
+	size_t i;
+
+	dirs = xmalloc(sizeof(dirs[0]));
+	dirs[num_dirs++] = xstrdup(root);
+	dirs_capacity = 1;
+	for (i = 0; i < num_dirs; i++)
+		ok &= scan_directory(dirs[i], list, &dirs, &num_dirs,
+				     &dirs_capacity);
+	for (i = 0; i < num_dirs; i++)
+		free(dirs[i]);
+	free(dirs);
+	return ok;
+}
+#else /* _WIN32 */
+static bool walk_directory(const char *root __attribute__((unused)),
+			   struct file_list *list __attribute__((unused)))
+{
+	error_msg("--recursive isn't supported on this platform");
+	return false;
+}
+#endif /* !_WIN32 */
+
+/*
+ * Build the list of files to digest from the command line.  With @recursive,
+ * the regular files in each directory given are added too.
+ */
+static bool list_files(char *argv[], int argc, bool recursive,
+		       struct file_list *list)
+{
+	struct stat stbuf;
+	bool ok = true;
+
+	for (int i = 0; i < argc; i++) {
+		/* Let a file that can't be stat'ed fail when it's opened. */
+		if (stat(argv[i], &stbuf) != 0) {
+			add_file(list, xstrdup(argv[i]), 0);
+			continue;
+		}
+		if (recursive && S_ISDIR(stbuf.st_mode))
+			ok &= walk_directory(argv[i], list);
+		else
+			add_file(list, xstrdup(argv[i]), stbuf.st_size);
+	}
+	return ok;
+}
+
+/* Sort larger files first, so that a large file doesn't start last. */
+static int cmp_file_size(const void *_a, const void *_b)
+{
+	const struct file_entry *a = _a, *b = _b;
+
+	if (a->size != b->size)
+		return a->size > b->size ? -1 : 1;
+	return strcmp(a->path, b->path);
+}
+
+static int cmp_file_path(const void *_a, const void *_b)
+{
+	const struct file_entry *a = _a, *b = _b;
+
+	return strcmp(a->path, b->path);
+}
+
+/* The state of digest_files_parallel() */
+struct parallel_digest_ctx {
+	struct file_entry *files;
+	size_t num_files;
+	size_t next_file;	/* next file to claim, accessed atomically */
+	const struct libfsverity_merkle_tree_params *params;
+	u32 queue_depth;
+	enum io_mode io_mode;
+	bool use_mmap;
+	bool compact;
+	bool for_builtin_sig;
+	bool sorted;
+	bool failed;		/* accessed atomically */
+};
+
+/* Print or save the digest of a file that was digested successfully. */
+static void file_entry_done(struct parallel_digest_ctx *ctx,
+			    struct file_entry *entry,
+			    struct libfsverity_digest *digest)
+{
+	if (ctx->sorted) {
+		entry->digest = digest;
+	} else {
+		print_digest(digest, entry->path, ctx->compact,
+			     ctx->for_builtin_sig);
+		free(digest);
+	}
+}
+
+static bool digest_file_entry(struct parallel_digest_ctx *ctx,
+			      struct file_entry *entry)
+{
+	struct libfsverity_merkle_tree_params params = *ctx->params;
+	struct filedes file = { .fd = -1 };
+	struct libfsverity_digest *digest = NULL;
+	int err;
+
+	if (!open_file(&file, entry->path, O_RDONLY, 0))
+		return false;
+	if (!set_io_mode(&file, ctx->io_mode) ||
+	    !get_file_size(&file, &params.file_size)) {
+		filedes_close(&file);
+		return false;
+	}
+	if (ctx->use_mmap)
+		err = compute_digest_mmap(&file, &params, &digest);
+	else
+		err = compute_file_digest(&file, &params, ctx->queue_depth,
+					  &digest);
+	filedes_close(&file);
+	if (err) {
+		error_msg("failed to compute digest of '%s'", entry->path);
+		return false;
+	}
+	file_entry_done(ctx, entry, digest);
+	return true;
+}
+
+/*
+ * Files up to this size are read into memory and digested in batches of up to
+ * SMALL_FILE_BATCH files using libfsverity_hasher_digest_buffers(), which
+ * hashes the blocks of different files together.
+ */
+#define SMALL_FILE_MAX_SIZE	(64U << 10)
+#define SMALL_FILE_BATCH	64
+
+/* A worker's batch of small files */
+struct small_file_batch {
+	struct libfsverity_hasher *hasher;
+	u8 *buf;	/* SMALL_FILE_BATCH buffers of SMALL_FILE_MAX_SIZE */
+	struct file_entry *entries[SMALL_FILE_BATCH];
+	const void *data[SMALL_FILE_BATCH];
+	u64 sizes[SMALL_FILE_BATCH];
+	u8 digests[SMALL_FILE_BATCH * FS_VERITY_MAX_DIGEST_SIZE];
+	size_t count;
+};
+
+/* Read a small file into the batch, or digest it directly if it has grown. */
+static bool add_small_file(struct parallel_digest_ctx *ctx,
+			   struct small_file_batch *batch,
+			   struct file_entry *entry)
+{
+	struct filedes file = { .fd = -1 };
+	u8 *buf = &batch->buf[batch->count * SMALL_FILE_MAX_SIZE];
+	u64 size;
+	bool ok;
+
+	if (!open_file(&file, entry->path, O_RDONLY, 0))
+		return false;
+	ok = set_io_mode(&file, ctx->io_mode) && get_file_size(&file, &size);
+	if (ok && size > SMALL_FILE_MAX_SIZE) {
+		filedes_close(&file);
+		return digest_file_entry(ctx, entry);
+	}
+	if (ok && size != 0 && pread_callback(&file, buf, size, 0) != 0) {
+		error_msg("failed to compute digest of '%s'", entry->path);
+		ok = false;
+	}
+	filedes_close(&file);
+	if (!ok)
+		return false;
+	batch->entries[batch->count] = entry;
+	batch->data[batch->count] = buf;
+	batch->sizes[batch->count] = size;
+	batch->count++;
+	return true;
+}
+
+/* Digest the files in the batch. */
+static bool flush_small_files(struct parallel_digest_ctx *ctx,
+			      struct small_file_batch *batch)
+{
+	const u32 alg = ctx->params->hash_algorithm ?:
+			FS_VERITY_HASH_ALG_SHA256;
+	const u32 digest_size = libfsverity_get_digest_size(alg);
+	struct libfsverity_digest *digest;
+	size_t i;
+	bool ok = true;
+
+	if (libfsverity_hasher_digest_buffers(batch->hasher, batch->data,
+					      batch->sizes, batch->count,
+					      batch->digests) != 0) {
+		for (i = 0; i < batch->count; i++)
+			error_msg("failed to compute digest of '%s'",
+				  batch->entries[i]->path);
+		ok = false;
+		goto out;
+	}
+	for (i = 0; i < batch->count; i++) {
+		digest = xzalloc(sizeof(*digest) + digest_size);
+		digest->digest_algorithm = alg;
+		digest->digest_size = digest_size;
+		memcpy(digest->digest, &batch->digests[i * digest_size],
+		       digest_size);
+		file_entry_done(ctx, batch->entries[i], digest);
+	}
+out:
+	batch->count = 0;
+	return ok;
+}
+
+/*
+ * Claim the next files to digest.  Since the files are sorted by decreasing
+ * size, once the next file is small, all the rest are too, and a whole batch of
+ * them is claimed at once.
+ */
+static size_t claim_files(struct parallel_digest_ctx *ctx, size_t *count)
+{
+	size_t i = __atomic_load_n(&ctx->next_file, __ATOMIC_RELAXED);
+
+	*count = 1;
+	if (i < ctx->num_files && ctx->files[i].size <= SMALL_FILE_MAX_SIZE)
+		*count = SMALL_FILE_BATCH;
+	return __atomic_fetch_add(&ctx->next_file, *count, __ATOMIC_RELAXED);
+}
+
+static void *digest_worker(void *_ctx)
+{
+	struct parallel_digest_ctx *ctx = _ctx;
+	struct small_file_batch batch = {};
+	size_t i, end, count;
+	bool ok;
+
+	/* Without a hasher, just digest the small files one at a time. */
+	if (libfsverity_hasher_new(ctx->params, &batch.hasher) != 0)
+		batch.hasher = NULL;
+
+	while ((i = claim_files(ctx, &count)) < ctx->num_files) {
+		end = min(i + count, ctx->num_files);
+		ok = true;
+		for (; i < end; i++) {
+			struct file_entry *entry = &ctx->files[i];
+
+			if (batch.hasher && entry->size <= SMALL_FILE_MAX_SIZE) {
+				if (!batch.buf)
+					batch.buf = xmalloc(SMALL_FILE_BATCH *
+							    SMALL_FILE_MAX_SIZE);
+				ok &= add_small_file(ctx, &batch, entry);
+			} else {
+				ok &= digest_file_entry(ctx, entry);
+			}
+		}
+		if (batch.count)
+			ok &= flush_small_files(ctx, &batch);
+		if (!ok)
+			__atomic_store_n(&ctx->failed, true, __ATOMIC_RELAXED);
+	}
+	free(batch.buf);
+	libfsverity_hasher_free(batch.hasher);
+	return NULL;
+}
+
+/*
+ * Digest the files in @list using @num_jobs threads, each of which digests one
+ * file at a time, or one batch of small files at a time.  The larger files are
+ * started first, to minimize the time until the last file is done.  Each digest
+ * is printed when it is done, or with @ctx->sorted, all digests are printed at
+ * the end in order of path.  A file that fails doesn't stop the others.  Return
+ * false if any file failed.
+ */
+static bool digest_files_parallel(struct parallel_digest_ctx *ctx,
+				  struct file_list *list, u32 num_jobs)
+{
+	pthread_t *threads;
+	u32 num_started = 0;
+	size_t i;
+
+	qsort(list->files, list->num_files, sizeof(list->files[0]),
+	      cmp_file_size);
+	ctx->files = list->files;
+	ctx->num_files = list->num_files;
+
+	/*
+	 * The calling thread is one of the workers.  If some threads can't be
+	 * created, just continue with fewer.
+	 */
+	num_jobs = min((u64)num_jobs, (u64)max(list->num_files, (size_t)1));
+	threads = xzalloc(num_jobs * sizeof(threads[0]));
+	while (num_started + 1 < num_jobs &&
+	       pthread_create(&threads[num_started], NULL, digest_worker,
+			      ctx) == 0)
+		num_started++;
+	digest_worker(ctx);
+	while (num_started)
+		pthread_join(threads[--num_started], NULL);
+	free(threads);
+
+	if (ctx->sorted) {
+		qsort(list->files, list->num_files, sizeof(list->files[0]),
+		      cmp_file_path);
+		for (i = 0; i < list->num_files; i++) {
+			if (list->files[i].digest)
+				print_digest(list->files[i].digest,
+					     list->files[i].path, ctx->compact,
+					     ctx->for_builtin_sig);
+		}
+	}
+	return !ctx->failed;
+}
+
+static void free_file_list(struct file_list *list)
+{
+	for (size_t i = 0; i < list->num_files; i++) {
+		free(list->files[i].path);
+		free(list->files[i].digest);
+	}
+	free(list->files);
+}
+
+/* The maximum number of times that --hash-alg or --block-size can be given */
+#define MAX_MULTI_VALUES	8
+
+/* Parse a --hash-alg or --block-size option, which may be repeated. */
+static bool parse_multi_value(int opt_char, const char *arg, u32 *values,
+			      u32 *num_values)
+{
+	struct libfsverity_merkle_tree_params tmp = {};
+
+	if (*num_values == MAX_MULTI_VALUES) {
+		error_msg("%s can be specified at most %d times",
+			  opt_char == OPT_HASH_ALG ? "--hash-alg" :
+			  "--block-size", MAX_MULTI_VALUES);
+		return false;
+	}
+	if (!parse_tree_param(opt_char, arg, &tmp))
+		return false;
+	values[(*num_values)++] = (opt_char == OPT_HASH_ALG) ?
+				  tmp.hash_algorithm : tmp.block_size;
+	return true;
+}
+
+/*
+ * Check that the option @opt, which needs each file to be digested on its own
+ * in a single pass, isn't combined with standard input or with the options
+ * @incompatible_opts, of which @incompatible tells whether any were given.
+ */
+static bool check_one_file_option(const char *opt, bool incompatible,
+				  const char *incompatible_opts,
+				  char *argv[], int argc)
+{
+	if (incompatible) {
+		error_msg("%s can't be used with %s", opt, incompatible_opts);
+		return false;
+	}
+	for (int i = 0; i < argc; i++) {
+		if (!strcmp(argv[i], "-")) {
+			error_msg("%s can't be used with standard input ('-')",
+				  opt);
+			return false;
+		}
+	}
+	return true;
+}
+
+/*
+ * Compute the digests of @file for each of the @num_sets Merkle tree parameter
+ * sets @param_sets, reading the file just once.
+ */
+static int compute_file_digest_multi(struct filedes *file,
+				     const struct libfsverity_merkle_tree_params *param_sets,
+				     u32 num_sets, u32 queue_depth,
+				     struct libfsverity_digest **digests)
+{
+	struct libfsverity_async_reader *reader;
+	int err;
+
+	/* param_sets[0].pread_fn is pread_callback(). */
+	if (file->io_mode != IO_MODE_BUFFERED)
+		return libfsverity_compute_digest_multi(file, NULL, param_sets,
+							num_sets, digests);
+	if (queue_depth == 0)
+		return libfsverity_compute_digest_multi(file, read_callback,
+							param_sets, num_sets,
+							digests);
+
+	err = libfsverity_async_reader_new(file->fd, param_sets[0].file_size,
+					   queue_depth, READ_CHUNK_SIZE,
+					   &reader);
+	if (err)
+		return err;
+	err = libfsverity_compute_digest_multi(reader, libfsverity_async_read,
+					       param_sets, num_sets, digests);
+	libfsverity_async_reader_free(reader);
+	return err;
+}
+
+/*
+ * Digest each file for every combination of the hash algorithms and block sizes
+ * given.  The digests of each file are printed in order of hash algorithm, then
+ * block size.
+ */
+static bool digest_files_multi(char *argv[], int argc,
+			       const struct libfsverity_merkle_tree_params *params,
+			       const u32 *hash_algs, u32 num_hash_algs,
+			       const u32 *block_sizes, u32 num_block_sizes,
+			       u32 queue_depth, enum io_mode io_mode,
+			       bool compact, bool for_builtin_sig)
+{
+	const u32 num_sets = num_hash_algs * num_block_sizes;
+	struct libfsverity_merkle_tree_params *param_sets;
+	struct libfsverity_digest **digests;
+	struct filedes file = { .fd = -1 };
+	bool ok = true;
+	u32 i;
+
+	param_sets = xmalloc(num_sets * sizeof(param_sets[0]));
+	digests = xzalloc(num_sets * sizeof(digests[0]));
+	for (i = 0; i < num_sets; i++) {
+		param_sets[i] = *params;
+		param_sets[i].hash_algorithm = hash_algs[i / num_block_sizes];
+		param_sets[i].block_size = block_sizes[i % num_block_sizes];
+		/* Use libfsverity's default, which keeps the chunks in cache. */
+		param_sets[i].read_chunk_size = 0;
+	}
+
+	for (int f = 0; f < argc; f++) {
+		u64 file_size;
+
+		ok = open_file(&file, argv[f], O_RDONLY, 0) &&
+		     set_io_mode(&file, io_mode) &&
+		     get_file_size(&file, &file_size);
+		if (ok) {
+			for (i = 0; i < num_sets; i++)
+				param_sets[i].file_size = file_size;
+			if (compute_file_digest_multi(&file, param_sets,
+						      num_sets, queue_depth,
+						      digests) != 0) {
+				error_msg("failed to compute digest");
+				ok = false;
+			}
+		}
+		filedes_close(&file);
+		if (!ok)
+			break;
+		for (i = 0; i < num_sets; i++) {
+			print_digest(digests[i], argv[f], compact,
+				     for_builtin_sig);
+			free(digests[i]);
+		}
+	}
+	free(digests);
+	free(param_sets);
+	return ok;
+}
+
 /*
  * Compute the fs-verity digest of the given file(s), for offline signing.
  */
@@ -32,18 +915,52 @@ int fsverity_cmd_digest(const struct fsverity_command *cmd,
 		      int argc, char *argv[])
 {
 	struct filedes file = { .fd = -1 };
-	struct libfsverity_merkle_tree_params tree_params = { .version = 1 };
-	bool compact = false, for_builtin_sig = false;
+	struct libfsverity_merkle_tree_params tree_params = {
+		.version = 1,
+		.read_chunk_size = READ_CHUNK_SIZE,
+		.pread_fn = pread_callback,
+#ifdef __linux__
+		.splice_fn = splice_callback,
+#endif
+	};
+	bool compact = false, for_builtin_sig = false, use_mmap = false;
+	u32 queue_depth = 0;
+	enum io_mode io_mode = IO_MODE_BUFFERED;
+	const char *checkpoint = NULL;
+	u32 checkpoint_interval = DEFAULT_CHECKPOINT_INTERVAL;
+	const char *update_tree = NULL;
+	struct libfsverity_range *changed = NULL;
+	size_t num_changed = 0;
+	bool changed_specified = false;
+	bool stdin_specified = false;
+	bool recursive = false, sorted = false;
+	u32 num_jobs = 0;
+	u32 hash_algs[MAX_MULTI_VALUES], num_hash_algs = 0;
+	u32 block_sizes[MAX_MULTI_VALUES], num_block_sizes = 0;
+	bool multi;
+	u8 flat_hash[FS_VERITY_MAX_DIGEST_SIZE];
+	struct libfsverity_memo_stats memo_stats;
 	int status;
 	int c;
 
-	while ((c = getopt_long(argc, argv, "", longopts, NULL)) != -1) {
+	while ((c = getopt_long(argc, argv, "r", longopts, NULL)) != -1) {
 		switch (c) {
 		case OPT_HASH_ALG:
+			if (!parse_multi_value(c, optarg, hash_algs,
+					       &num_hash_algs))
+				goto out_usage;
+			break;
 		case OPT_BLOCK_SIZE:
+			if (!parse_multi_value(c, optarg, block_sizes,
+					       &num_block_sizes))
+				goto out_usage;
+			break;
 		case OPT_SALT:
 		case OPT_OUT_MERKLE_TREE:
 		case OPT_OUT_DESCRIPTOR:
+		case OPT_THREADS:
+		case OPT_HASH_IMPL:
+		case OPT_SPARSE:
 			if (!parse_tree_param(c, optarg, &tree_params))
 				goto out_usage;
 			break;
@@ -53,6 +970,60 @@ int fsverity_cmd_digest(const struct fsverity_command *cmd,
 		case OPT_FOR_BUILTIN_SIG:
 			for_builtin_sig = true;
 			break;
+		case OPT_MMAP:
+			use_mmap = true;
+			break;
+		case OPT_QUEUE_DEPTH:
+			if (!parse_queue_depth_option(optarg, &queue_depth))
+				goto out_usage;
+			break;
+		case OPT_IO_MODE:
+			if (!parse_io_mode_option(optarg, &io_mode))
+				goto out_usage;
+			break;
+		case OPT_CHECKPOINT:
+			checkpoint = optarg;
+			break;
+		case OPT_CHECKPOINT_INTERVAL:
+			if (!parse_checkpoint_interval_option(optarg,
+						&checkpoint_interval))
+				goto out_usage;
+			break;
+		case OPT_UPDATE_TREE:
+			update_tree = optarg;
+			break;
+		case OPT_CHANGED:
+			if (changed_specified) {
+				error_msg("--changed can only be specified once");
+				goto out_usage;
+			}
+			if (!parse_changed_option(optarg, &changed,
+						  &num_changed))
+				goto out_usage;
+			changed_specified = true;
+			break;
+		case 'r':
+			recursive = true;
+			break;
+		case OPT_JOBS:
+			if (!parse_jobs_option(optarg, &num_jobs))
+				goto out_usage;
+			break;
+		case OPT_SORTED:
+			sorted = true;
+			break;
+		case OPT_ALSO_FLAT_HASH:
+			if (!parse_flat_hash_option(optarg,
+					&tree_params.flat_hash_algorithm))
+				goto out_usage;
+			tree_params.flat_hash = flat_hash;
+			break;
+		case OPT_MEMO_SIZE:
+			if (!parse_memo_size_option(optarg,
+						    &tree_params.memo_size))
+				goto out_usage;
+			tree_params.memo_stats = &memo_stats;
+			break;
 		default:
 			goto out_usage;
 		}
@@ -64,60 +1035,186 @@ int fsverity_cmd_digest(const struct fsverity_command *cmd,
 	if (argc < 1)
 		goto out_usage;
 
-	for (int i = 0; i < argc; i++) {
-		struct fsverity_formatted_digest *d = NULL;
-		struct libfsverity_digest *digest = NULL;
-		char digest_hex[FS_VERITY_MAX_DIGEST_SIZE * 2 +
-				sizeof(*d) * 2 + 1];
+	/*
+	 * If --hash-alg or --block-size was given more than once, compute the
+	 * digests for all the combinations, reading each file just once.
+	 */
+	multi = num_hash_algs > 1 || num_block_sizes > 1;
+	if (!multi) {
+		if (num_hash_algs)
+			tree_params.hash_algorithm = hash_algs[0];
+		if (num_block_sizes)
+			tree_params.block_size = block_sizes[0];
+	} else {
+		if (num_hash_algs == 0)
+			hash_algs[num_hash_algs++] = FS_VERITY_HASH_ALG_SHA256;
+		if (num_block_sizes == 0)
+			block_sizes[num_block_sizes++] = 4096;
+		if (!check_one_file_option("--hash-alg or --block-size given more than once",
+					   use_mmap || checkpoint ||
+					   update_tree || recursive ||
+					   num_jobs > 1 || sorted ||
+					   tree_params.metadata_callbacks,
+					   "--mmap, --checkpoint, --update-tree, --recursive, --jobs, --sorted, --out-merkle-tree, or --out-descriptor",
+					   argv, argc))
+			goto out_usage;
+	}
 
-		if (!open_file(&file, argv[i], O_RDONLY, 0))
-			goto out_err;
+	if (tree_params.flat_hash_algorithm &&
+	    !check_one_file_option("--also-flat-hash",
+				   multi || checkpoint || update_tree ||
+				   recursive || num_jobs > 1 || sorted,
+				   "--checkpoint, --update-tree, --recursive, --jobs, --sorted, or with --hash-alg or --block-size given more than once",
+				   argv, argc))
+		goto out_usage;
 
-		if (!get_file_size(&file, &tree_params.file_size))
-			goto out_err;
+	if (tree_params.memo_size &&
+	    !check_one_file_option("--memo-size",
+				   multi || checkpoint || update_tree ||
+				   recursive || num_jobs > 1 || sorted,
+				   "--checkpoint, --update-tree, --recursive, --jobs, --sorted, or with --hash-alg or --block-size given more than once",
+				   argv, argc))
+		goto out_usage;
 
-		if (libfsverity_compute_digest(&file, read_callback,
-					       &tree_params, &digest) != 0) {
-			error_msg("failed to compute digest");
-			goto out_err;
+	if (use_mmap && io_mode != IO_MODE_BUFFERED) {
+		error_msg("--mmap can only be used with --io-mode=buffered");
+		goto out_usage;
+	}
+
+	if (checkpoint) {
+		if (argc != 1) {
+			error_msg("--checkpoint can only be used with one file");
+			goto out_usage;
+		}
+		if (use_mmap || tree_params.metadata_callbacks) {
+			error_msg("--checkpoint can't be used with --mmap, --out-merkle-tree, or --out-descriptor");
+			goto out_usage;
 		}
+	}
 
-		ASSERT(digest->digest_size <= FS_VERITY_MAX_DIGEST_SIZE);
+	if (recursive || num_jobs > 1 || sorted) {
+		if (checkpoint || update_tree || tree_params.metadata_callbacks) {
+			error_msg("--recursive, --jobs, and --sorted can't be used with --checkpoint, --update-tree, --out-merkle-tree, or --out-descriptor");
+			goto out_usage;
+		}
+	}
 
-		if (for_builtin_sig) {
-			/*
-			 * Format the digest for use with the built-in signature
-			 * support.
-			 */
-			d = xzalloc(sizeof(*d) + digest->digest_size);
-			memcpy(d->magic, "FSVerity", 8);
-			d->digest_algorithm =
-				cpu_to_le16(digest->digest_algorithm);
-			d->digest_size = cpu_to_le16(digest->digest_size);
-			memcpy(d->digest, digest->digest, digest->digest_size);
+	for (int i = 0; i < argc; i++) {
+		if (strcmp(argv[i], "-"))
+			continue;
+		if (stdin_specified) {
+			error_msg("standard input ('-') can only be given once");
+			goto out_usage;
+		}
+		if (use_mmap || checkpoint || update_tree || recursive ||
+		    num_jobs > 1 || sorted) {
+			error_msg("standard input ('-') can't be used with --mmap, --checkpoint, --update-tree, --recursive, --jobs, or --sorted");
+			goto out_usage;
+		}
+		stdin_specified = true;
+	}
 
-			bin2hex((const u8 *)d, sizeof(*d) + digest->digest_size,
-				digest_hex);
+	if (update_tree || changed_specified) {
+		if (!update_tree || !changed_specified) {
+			error_msg("--update-tree and --changed must be used together");
+			goto out_usage;
+		}
+		if (argc != 1) {
+			error_msg("--update-tree can only be used with one file");
+			goto out_usage;
+		}
+		if (use_mmap || checkpoint ||
+		    (tree_params.metadata_callbacks &&
+		     tree_params.metadata_callbacks->merkle_tree_block)) {
+			error_msg("--update-tree can't be used with --mmap, --checkpoint, or --out-merkle-tree");
+			goto out_usage;
+		}
+	}
+
+	if (multi) {
+		status = digest_files_multi(argv, argc, &tree_params,
+					    hash_algs, num_hash_algs,
+					    block_sizes, num_block_sizes,
+					    queue_depth, io_mode, compact,
+					    for_builtin_sig) ? 0 : 1;
+		goto out;
+	}
+
+	if (recursive || num_jobs > 1 || sorted) {
+		struct parallel_digest_ctx ctx = {
+			.params = &tree_params,
+			.queue_depth = queue_depth,
+			.io_mode = io_mode,
+			.use_mmap = use_mmap,
+			.compact = compact,
+			.for_builtin_sig = for_builtin_sig,
+			.sorted = sorted,
+		};
+		struct file_list list = {};
+		bool ok;
+
+		ok = list_files(argv, argc, recursive, &list);
+		ok &= digest_files_parallel(&ctx, &list, num_jobs);
+		free_file_list(&list);
+		status = ok ? 0 : 1;
+		goto out;
+	}
+
+	for (int i = 0; i < argc; i++) {
+		struct libfsverity_digest *digest = NULL;
+		const bool is_stdin = !strcmp(argv[i], "-");
+		int err;
+
+		if (is_stdin) {
+			if (!open_stdin(&file))
+				goto out_err;
 		} else {
-			bin2hex(digest->digest, digest->digest_size,
-				digest_hex);
+			if (!open_file(&file, argv[i], O_RDONLY, 0))
+				goto out_err;
+
+			if (!set_io_mode(&file, io_mode))
+				goto out_err;
+
+			if (!get_file_size(&file, &tree_params.file_size))
+				goto out_err;
 		}
 
-		if (compact)
-			printf("%s\n", digest_hex);
-		else if (for_builtin_sig)
-			printf("%s %s\n", digest_hex, argv[i]);
+		memset(&memo_stats, 0, sizeof(memo_stats));
+		if (is_stdin)
+			err = compute_digest_stream(&file, &tree_params,
+						    &digest);
+		else if (update_tree)
+			err = update_merkle_tree_file(&file, &tree_params,
+						      update_tree, changed,
+						      num_changed, &digest);
+		else if (checkpoint)
+			err = compute_file_digest_checkpointed(&file,
+					&tree_params, checkpoint,
+					checkpoint_interval, &digest);
+		else if (use_mmap)
+			err = compute_digest_mmap(&file, &tree_params, &digest);
 		else
-			printf("%s:%s %s\n",
-			       libfsverity_get_hash_name(digest->digest_algorithm),
-			       digest_hex, argv[i]);
+			err = compute_file_digest(&file, &tree_params,
+						  queue_depth, &digest);
+		if (err) {
+			error_msg("failed to compute digest");
+			goto out_err;
+		}
+
+		print_digest(digest, argv[i], compact, for_builtin_sig);
+		if (tree_params.flat_hash_algorithm)
+			print_flat_hash(flat_hash,
+					tree_params.flat_hash_algorithm,
+					argv[i], compact);
+		if (tree_params.memo_size)
+			print_memo_stats(&memo_stats, argv[i]);
 
 		filedes_close(&file);
 		free(digest);
-		free(d);
 	}
 	status = 0;
 out:
+	free(changed);
 	if (!destroy_tree_params(&tree_params) && status == 0)
 		status = 1;
 	return status;
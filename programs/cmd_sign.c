@@ -37,6 +37,15 @@ static const struct option longopts[] = {
 	{"salt",	    required_argument, NULL, OPT_SALT},
 	{"out-merkle-tree", required_argument, NULL, OPT_OUT_MERKLE_TREE},
 	{"out-descriptor",  required_argument, NULL, OPT_OUT_DESCRIPTOR},
+	{"threads",	    required_argument, NULL, OPT_THREADS},
+	{"hash-impl",	    required_argument, NULL, OPT_HASH_IMPL},
+	{"queue-depth",	    required_argument, NULL, OPT_QUEUE_DEPTH},
+	{"io-mode",	    required_argument, NULL, OPT_IO_MODE},
+	{"sparse",	    no_argument,	   NULL, OPT_SPARSE},
+	{"checkpoint",	    required_argument, NULL, OPT_CHECKPOINT},
+	{"checkpoint-interval", required_argument, NULL, OPT_CHECKPOINT_INTERVAL},
+	/* Still allow --hash, which used to be an unambiguous prefix. */
+	{"hash",	    required_argument, NULL, OPT_HASH_ALG},
 	{NULL, 0, NULL, 0}
 };
 
@@ -45,13 +54,25 @@ int fsverity_cmd_sign(const struct fsverity_command *cmd,
 		      int argc, char *argv[])
 {
 	struct filedes file = { .fd = -1 };
-	struct libfsverity_merkle_tree_params tree_params = { .version = 1 };
+	struct libfsverity_merkle_tree_params tree_params = {
+		.version = 1,
+		.read_chunk_size = READ_CHUNK_SIZE,
+		.pread_fn = pread_callback,
+#ifdef __linux__
+		.splice_fn = splice_callback,
+#endif
+	};
 	struct libfsverity_signature_params sig_params = {};
 	struct libfsverity_digest *digest = NULL;
 	char digest_hex[FS_VERITY_MAX_DIGEST_SIZE * 2 + 1];
 	u8 *sig = NULL;
 	size_t sig_size;
+	u32 queue_depth = 0;
+	enum io_mode io_mode = IO_MODE_BUFFERED;
+	const char *checkpoint = NULL;
+	u32 checkpoint_interval = DEFAULT_CHECKPOINT_INTERVAL;
 	int status;
+	int err;
 	int c;
 
 	while ((c = getopt_long(argc, argv, "", longopts, NULL)) != -1) {
@@ -96,9 +117,28 @@ int fsverity_cmd_sign(const struct fsverity_command *cmd,
 		case OPT_SALT:
 		case OPT_OUT_MERKLE_TREE:
 		case OPT_OUT_DESCRIPTOR:
+		case OPT_THREADS:
+		case OPT_HASH_IMPL:
+		case OPT_SPARSE:
 			if (!parse_tree_param(c, optarg, &tree_params))
 				goto out_usage;
 			break;
+		case OPT_QUEUE_DEPTH:
+			if (!parse_queue_depth_option(optarg, &queue_depth))
+				goto out_usage;
+			break;
+		case OPT_IO_MODE:
+			if (!parse_io_mode_option(optarg, &io_mode))
+				goto out_usage;
+			break;
+		case OPT_CHECKPOINT:
+			checkpoint = optarg;
+			break;
+		case OPT_CHECKPOINT_INTERVAL:
+			if (!parse_checkpoint_interval_option(optarg,
+						&checkpoint_interval))
+				goto out_usage;
+			break;
 		default:
 			goto out_usage;
 		}
@@ -113,14 +153,29 @@ int fsverity_cmd_sign(const struct fsverity_command *cmd,
 	if (sig_params.certfile == NULL)
 		sig_params.certfile = sig_params.keyfile;
 
+	if (checkpoint && tree_params.metadata_callbacks) {
+		error_msg("--checkpoint can't be used with --out-merkle-tree or --out-descriptor");
+		goto out_usage;
+	}
+
 	if (!open_file(&file, argv[0], O_RDONLY, 0))
 		goto out_err;
 
+	if (!set_io_mode(&file, io_mode))
+		goto out_err;
+
 	if (!get_file_size(&file, &tree_params.file_size))
 		goto out_err;
 
-	if (libfsverity_compute_digest(&file, read_callback,
-				       &tree_params, &digest) != 0) {
+	if (checkpoint)
+		err = compute_file_digest_checkpointed(&file, &tree_params,
+						       checkpoint,
+						       checkpoint_interval,
+						       &digest);
+	else
+		err = compute_file_digest(&file, &tree_params, queue_depth,
+					  &digest);
+	if (err) {
 		error_msg("failed to compute digest");
 		goto out_err;
 	}
@@ -21,6 +21,13 @@ static const struct fsverity_command {
 	const char *usage_str;
 } fsverity_commands[] = {
 	{
+		.name = "benchmark",
+		.func = fsverity_cmd_benchmark,
+		.short_desc =
+"Measure the speed of each available hash implementation",
+		.usage_str =
+"    fsverity benchmark [--hash-alg=HASH_ALG] [--block-size=BLOCK_SIZE]\n"
+	}, {
 		.name = "digest",
 		.func = fsverity_cmd_digest,
 		.short_desc =
@@ -29,7 +36,13 @@ static const struct fsverity_command {
 "    fsverity digest FILE...\n"
 "               [--hash-alg=HASH_ALG] [--block-size=BLOCK_SIZE] [--salt=SALT]\n"
 "               [--out-merkle-tree=FILE] [--out-descriptor=FILE]\n"
-"               [--compact] [--for-builtin-sig]\n"
+"               [--threads=NUM_THREADS] [--hash-impl=HASH_IMPL]\n"
+"               [--queue-depth=QUEUE_DEPTH] [--io-mode=IO_MODE] [--sparse]\n"
+"               [--checkpoint=FILE] [--checkpoint-interval=SECONDS]\n"
+"               [--update-tree=TREE_FILE --changed=OFFSET:LENGTH[,...]]\n"
+"               [--compact] [--for-builtin-sig] [--mmap]\n"
+"               [-r | --recursive] [--jobs=NUM_JOBS] [--sorted]\n"
+"               [--also-flat-hash=HASH_ALG] [--memo-size=BYTES]\n"
 #ifndef _WIN32
 	}, {
 		.name = "dump_metadata",
@@ -63,6 +76,9 @@ static const struct fsverity_command {
 "               [--pkcs11-module=SOFILE] [--pkcs11-keyid=KEYID]\n"
 "               [--hash-alg=HASH_ALG] [--block-size=BLOCK_SIZE] [--salt=SALT]\n"
 "               [--out-merkle-tree=FILE] [--out-descriptor=FILE]\n"
+"               [--threads=NUM_THREADS] [--hash-impl=HASH_IMPL]\n"
+"               [--queue-depth=QUEUE_DEPTH] [--io-mode=IO_MODE] [--sparse]\n"
+"               [--checkpoint=FILE] [--checkpoint-interval=SECONDS]\n"
 	}
 };
 
@@ -77,6 +93,17 @@ static void show_all_hash_algs(FILE *fp)
 	putc('\n', fp);
 }
 
+void show_all_hash_impls(FILE *fp)
+{
+	u32 impl = 0;
+	const char *name;
+
+	fprintf(fp, "Available hash implementations:");
+	while ((name = libfsverity_get_hash_impl_name(impl++)) != NULL)
+		fprintf(fp, " %s", name);
+	putc('\n', fp);
+}
+
 static void usage_all(FILE *fp)
 {
 	int i;
@@ -91,6 +118,7 @@ static void usage_all(FILE *fp)
 "    fsverity --version\n"
 "\n", fp);
 	show_all_hash_algs(fp);
+	show_all_hash_impls(fp);
 }
 
 static void usage_cmd(const struct fsverity_command *cmd, FILE *fp)
@@ -170,6 +198,19 @@ static bool parse_hash_alg_option(const char *arg, u32 *alg_ptr)
 	return false;
 }
 
+static bool parse_hash_impl_option(const char *arg, u32 *impl_ptr)
+{
+	int impl = libfsverity_find_hash_impl_by_name(arg);
+
+	if (impl < 0) {
+		error_msg("unknown hash implementation: '%s'", arg);
+		show_all_hash_impls(stderr);
+		return false;
+	}
+	*impl_ptr = impl;
+	return true;
+}
+
 static bool parse_block_size_option(const char *arg, u32 *size_ptr)
 {
 	char *end;
@@ -204,6 +245,36 @@ static bool parse_salt_option(const char *arg, u8 **salt_ptr,
 	return true;
 }
 
+static bool parse_sparse_option(libfsverity_zero_range_fn_t *zero_range_fn)
+{
+#ifdef SEEK_HOLE
+	*zero_range_fn = zero_range_callback;
+	return true;
+#else
+	(void)zero_range_fn;
+	error_msg("--sparse isn't supported on this platform");
+	return false;
+#endif
+}
+
+static bool parse_threads_option(const char *arg, u32 *num_threads_ptr)
+{
+	char *end;
+	unsigned long n = strtoul(arg, &end, 10);
+
+	if (*num_threads_ptr != 0) {
+		error_msg("--threads can only be specified once");
+		return false;
+	}
+
+	if (n <= 0 || n > 4096 || *end != '\0') {
+		error_msg("Invalid number of threads: %s", arg);
+		return false;
+	}
+	*num_threads_ptr = n;
+	return true;
+}
+
 struct metadata_callback_ctx {
 	struct filedes merkle_tree_file;
 	struct filedes descriptor_file;
@@ -287,6 +358,12 @@ bool parse_tree_param(int opt_char, const char *arg,
 	case OPT_OUT_DESCRIPTOR:
 		return parse_out_metadata_option(opt_char, arg,
 						 &params->metadata_callbacks);
+	case OPT_THREADS:
+		return parse_threads_option(arg, &params->num_threads);
+	case OPT_HASH_IMPL:
+		return parse_hash_impl_option(arg, &params->hash_impl);
+	case OPT_SPARSE:
+		return parse_sparse_option(&params->zero_range_fn);
 	default:
 		ASSERT(0);
 	}
@@ -309,6 +386,95 @@ bool destroy_tree_params(struct libfsverity_merkle_tree_params *params)
 	return ok;
 }
 
+bool parse_queue_depth_option(const char *arg, u32 *queue_depth_ptr)
+{
+	char *end;
+	unsigned long n = strtoul(arg, &end, 10);
+
+	if (n > 256 || *end != '\0' || end == arg) {
+		error_msg("Invalid queue depth: %s.  Must be 0 to 256", arg);
+		return false;
+	}
+	*queue_depth_ptr = n;
+	return true;
+}
+
+bool parse_checkpoint_interval_option(const char *arg, u32 *interval_ptr)
+{
+	char *end;
+	unsigned long n = strtoul(arg, &end, 10);
+
+	if (n > UINT32_MAX || *end != '\0' || end == arg) {
+		error_msg("Invalid checkpoint interval: %s", arg);
+		return false;
+	}
+	*interval_ptr = n;
+	return true;
+}
+
+bool parse_io_mode_option(const char *arg, enum io_mode *io_mode_ptr)
+{
+	if (!strcmp(arg, "buffered")) {
+		*io_mode_ptr = IO_MODE_BUFFERED;
+	} else if (!strcmp(arg, "dontneed")) {
+		*io_mode_ptr = IO_MODE_DONTNEED;
+	} else if (!strcmp(arg, "direct")) {
+		*io_mode_ptr = IO_MODE_DIRECT;
+	} else {
+		error_msg("unknown I/O mode: '%s'.  Must be buffered, dontneed, or direct",
+			  arg);
+		return false;
+	}
+	return true;
+}
+
+/*
+ * Compute the fs-verity digest of a file.  If @queue_depth is nonzero, up to
+ * that many reads are kept in flight ahead of the hashing, using io_uring if
+ * available.  That isn't compatible with multithreaded hashing or with skipping
+ * holes, which read the file out of order, nor with AF_ALG, which splices the
+ * data directly.
+ *
+ * Files that aren't read in IO_MODE_BUFFERED are always read using
+ * pread_callback(), which implements the other modes.
+ */
+int compute_file_digest(struct filedes *file,
+			const struct libfsverity_merkle_tree_params *params,
+			u32 queue_depth, struct libfsverity_digest **digest_ret)
+{
+	struct libfsverity_merkle_tree_params async_params;
+	struct libfsverity_async_reader *reader;
+	int err;
+
+	if (file->io_mode != IO_MODE_BUFFERED) {
+		struct libfsverity_merkle_tree_params pread_params = *params;
+
+		pread_params.pread_fn = pread_callback;
+		pread_params.splice_fn = NULL;
+		return libfsverity_compute_digest(file, NULL, &pread_params,
+						  digest_ret);
+	}
+
+	if (queue_depth == 0 || params->num_threads > 1 ||
+	    params->zero_range_fn ||
+	    params->hash_impl == LIBFSVERITY_HASH_IMPL_AF_ALG)
+		return libfsverity_compute_digest(file, read_callback, params,
+						  digest_ret);
+
+	err = libfsverity_async_reader_new(file->fd, params->file_size,
+					   queue_depth, READ_CHUNK_SIZE,
+					   &reader);
+	if (err)
+		return err;
+	async_params = *params;
+	async_params.pread_fn = NULL;
+	async_params.splice_fn = NULL;
+	err = libfsverity_compute_digest(reader, libfsverity_async_read,
+					 &async_params, digest_ret);
+	libfsverity_async_reader_free(reader);
+	return err;
+}
+
 int main(int argc, char *argv[])
 {
 	const struct fsverity_command *cmd;
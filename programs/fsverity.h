@@ -20,26 +20,59 @@
  */
 #define FS_VERITY_MAX_DIGEST_SIZE	64
 
+/*
+ * The amount of file data to read at a time when computing a Merkle tree.  This
+ * is much larger than the block size so that few system calls are needed.
+ */
+#define READ_CHUNK_SIZE			(1U << 20)
+
 enum {
+	OPT_ALSO_FLAT_HASH,
 	OPT_BLOCK_SIZE,
 	OPT_CERT,
+	OPT_CHANGED,
+	OPT_CHECKPOINT,
+	OPT_CHECKPOINT_INTERVAL,
 	OPT_COMPACT,
 	OPT_FOR_BUILTIN_SIG,
 	OPT_HASH_ALG,
+	OPT_HASH_IMPL,
+	OPT_IO_MODE,
+	OPT_JOBS,
 	OPT_KEY,
 	OPT_LENGTH,
+	OPT_MEMO_SIZE,
+	OPT_MMAP,
 	OPT_OFFSET,
 	OPT_OUT_DESCRIPTOR,
 	OPT_OUT_MERKLE_TREE,
 	OPT_PKCS11_ENGINE,
 	OPT_PKCS11_KEYID,
 	OPT_PKCS11_MODULE,
+	OPT_QUEUE_DEPTH,
 	OPT_SALT,
 	OPT_SIGNATURE,
+	OPT_SORTED,
+	OPT_SPARSE,
+	OPT_THREADS,
+	OPT_UPDATE_TREE,
 };
 
 struct fsverity_command;
 
+/* The default of --checkpoint-interval, in seconds */
+#define DEFAULT_CHECKPOINT_INTERVAL	60
+
+/* checkpoint.c */
+int compute_file_digest_checkpointed(struct filedes *file,
+				     const struct libfsverity_merkle_tree_params *params,
+				     const char *checkpoint_path, u32 interval,
+				     struct libfsverity_digest **digest_ret);
+
+/* cmd_benchmark.c */
+int fsverity_cmd_benchmark(const struct fsverity_command *cmd,
+			   int argc, char *argv[]);
+
 /* cmd_digest.c */
 int fsverity_cmd_digest(const struct fsverity_command *cmd,
 			int argc, char *argv[]);
@@ -62,8 +95,15 @@ int fsverity_cmd_sign(const struct fsverity_command *cmd,
 
 /* fsverity.c */
 void usage(const struct fsverity_command *cmd, FILE *fp);
+void show_all_hash_impls(FILE *fp);
 bool parse_tree_param(int opt_char, const char *arg,
 		      struct libfsverity_merkle_tree_params *params);
 bool destroy_tree_params(struct libfsverity_merkle_tree_params *params);
+bool parse_queue_depth_option(const char *arg, u32 *queue_depth_ptr);
+bool parse_io_mode_option(const char *arg, enum io_mode *io_mode_ptr);
+bool parse_checkpoint_interval_option(const char *arg, u32 *interval_ptr);
+int compute_file_digest(struct filedes *file,
+			const struct libfsverity_merkle_tree_params *params,
+			u32 queue_depth, struct libfsverity_digest **digest_ret);
 
 #endif /* PROGRAMS_FSVERITY_H */
@@ -13,12 +13,22 @@
 
 #include <ctype.h>
 #include <inttypes.h>
+#include <openssl/crypto.h>
+#if OPENSSL_VERSION_NUMBER >= 0x30000000L && !defined(OPENSSL_IS_BORINGSSL)
+#include <openssl/core_dispatch.h>
+#include <openssl/core_names.h>
+#include <openssl/evp.h>
+#include <openssl/params.h>
+#include <openssl/provider.h>
+#endif
 #include <openssl/sha.h>
+#include <unistd.h>
 
 struct mem_file {
 	u8 *data;
 	size_t size;
 	size_t offset;
+	size_t max_read;	/* largest read seen by read_fn() */
 };
 
 static int read_fn(void *fd, void *buf, size_t count)
@@ -26,11 +36,37 @@ static int read_fn(void *fd, void *buf, size_t count)
 	struct mem_file *f = fd;
 
 	ASSERT(count <= f->size - f->offset);
+	f->max_read = max(f->max_read, count);
 	memcpy(buf, &f->data[f->offset], count);
 	f->offset += count;
 	return 0;
 }
 
+static int pread_fn(void *fd, void *buf, size_t count, u64 offset)
+{
+	const struct mem_file *f = fd;
+
+	ASSERT(offset <= f->size && count <= f->size - offset);
+	memcpy(buf, &f->data[offset], count);
+	return 0;
+}
+
+static int splice_fn(void *fd, int pipe_fd, size_t count, u64 offset)
+{
+	const struct mem_file *f = fd;
+
+	ASSERT(offset <= f->size && count <= f->size - offset);
+	while (count) {
+		ssize_t n = write(pipe_fd, &f->data[offset], count);
+
+		if (n <= 0)
+			return -EIO;
+		offset += n;
+		count -= n;
+	}
+	return 0;
+}
+
 static int error_read_fn(void *fd __attribute__((unused)),
 			 void *buf __attribute__((unused)),
 			 size_t count __attribute__((unused)))
@@ -198,6 +234,7 @@ static void test_invalid_params(void)
 	};
 	struct libfsverity_merkle_tree_params params;
 	struct libfsverity_digest *d = NULL;
+	u8 flat_hash[SHA256_DIGEST_LENGTH];
 
 	libfsverity_set_error_callback(NULL);
 
@@ -251,12 +288,787 @@ static void test_invalid_params(void)
 	params.reserved2[ARRAY_SIZE(params.reserved2) - 1] = 1;
 	ASSERT(libfsverity_compute_digest(&f, read_fn, &params, &d) == -EINVAL);
 
+	/* bad flat hash */
+	params = good_params;
+	params.flat_hash_algorithm = 1000;
+	params.flat_hash = flat_hash;
+	ASSERT(libfsverity_compute_digest(&f, read_fn, &params, &d) == -EINVAL);
+	params.flat_hash_algorithm = FS_VERITY_HASH_ALG_SHA256;
+	params.flat_hash = NULL;
+	ASSERT(libfsverity_compute_digest(&f, read_fn, &params, &d) == -EINVAL);
+
+	/* bad hash_impl */
+	params = good_params;
+	params.hash_impl = 1000;
+	ASSERT(libfsverity_compute_digest(&f, read_fn, &params, &d) == -EINVAL);
+
+	/* multiple threads without pread_fn */
+	params = good_params;
+	params.num_threads = 2;
+	ASSERT(libfsverity_compute_digest(&f, read_fn, &params, &d) == -EINVAL);
+
 	/* error reading file */
 	ASSERT(libfsverity_compute_digest(&f, error_read_fn, &good_params, &d) == -EIO);
 
 	ASSERT(d == NULL);
 }
 
+/*
+ * Test that each available hash implementation gives the expected digests, and
+ * that the hash implementations can be benchmarked.
+ */
+static void test_hash_impls(const struct mem_file *file)
+{
+	struct libfsverity_merkle_tree_params params;
+	struct libfsverity_digest *d;
+	u64 bytes_per_sec;
+	size_t i;
+	u32 impl;
+	int err;
+
+	for (impl = LIBFSVERITY_HASH_IMPL_OPENSSL;
+	     libfsverity_get_hash_impl_name(impl) != NULL; impl++) {
+		libfsverity_set_error_callback(NULL);
+		err = libfsverity_benchmark_hash_impl(FS_VERITY_HASH_ALG_SHA256,
+						      impl, 4096,
+						      &bytes_per_sec);
+		install_libfsverity_error_handler();
+		if (err == -EOPNOTSUPP) {
+			printf("Hash implementation %s is unavailable\n",
+			       libfsverity_get_hash_impl_name(impl));
+			continue;
+		}
+		ASSERT(err == 0 && bytes_per_sec > 0);
+
+		for (i = 0; i < ARRAY_SIZE(test_cases); i++) {
+			struct mem_file f = {
+				.data = file->data,
+				.size = test_cases[i].file_size,
+			};
+
+			memset(&params, 0, sizeof(params));
+			params.version = 1;
+			params.hash_algorithm = test_cases[i].hash_algorithm;
+			params.file_size = test_cases[i].file_size;
+			params.block_size = test_cases[i].block_size;
+			if (test_cases[i].salt) {
+				params.salt = (const u8 *)test_cases[i].salt;
+				params.salt_size = strlen(test_cases[i].salt);
+			}
+			params.hash_impl = impl;
+			params.pread_fn = pread_fn;
+			params.splice_fn = splice_fn;
+
+			err = libfsverity_compute_digest(&f, NULL, &params, &d);
+			ASSERT(err == 0);
+			ASSERT(!memcmp(d->digest, test_cases[i].digest,
+				       d->digest_size));
+			free(d);
+		}
+	}
+
+	libfsverity_set_error_callback(NULL);
+	ASSERT(libfsverity_find_hash_impl_by_name("bogus") == -1);
+	ASSERT(libfsverity_get_hash_impl_name(1000) == NULL);
+	ASSERT(libfsverity_benchmark_hash_impl(1000, 0, 4096,
+					       &bytes_per_sec) == -EINVAL);
+	ASSERT(libfsverity_benchmark_hash_impl(FS_VERITY_HASH_ALG_SHA256, 1000,
+					       4096, &bytes_per_sec) == -EINVAL);
+	ASSERT(libfsverity_benchmark_hash_impl(FS_VERITY_HASH_ALG_SHA256, 0,
+					       4097, &bytes_per_sec) == -EINVAL);
+	ASSERT(libfsverity_benchmark_hash_impl(FS_VERITY_HASH_ALG_SHA512, 0,
+					       64, &bytes_per_sec) == -EINVAL);
+	install_libfsverity_error_handler();
+}
+
+/* Test reading the data in chunks larger than a block. */
+static void test_read_chunk_size(const struct mem_file *file)
+{
+	static const u32 chunk_sizes[] = { 1, 3 * 4096 + 1, 1 << 20 };
+	struct libfsverity_merkle_tree_params params;
+	struct libfsverity_digest *d;
+	size_t i, j;
+
+	for (i = 0; i < ARRAY_SIZE(test_cases); i++) {
+		for (j = 0; j < 2 * ARRAY_SIZE(chunk_sizes); j++) {
+			const bool threaded = j >= ARRAY_SIZE(chunk_sizes);
+			struct mem_file f = {
+				.data = file->data,
+				.size = test_cases[i].file_size,
+			};
+			u32 block_size = test_cases[i].block_size ?: 4096;
+
+			memset(&params, 0, sizeof(params));
+			params.version = 1;
+			params.hash_algorithm = test_cases[i].hash_algorithm;
+			params.file_size = test_cases[i].file_size;
+			params.block_size = test_cases[i].block_size;
+			if (test_cases[i].salt) {
+				params.salt = (const u8 *)test_cases[i].salt;
+				params.salt_size = strlen(test_cases[i].salt);
+			}
+			params.read_chunk_size =
+				chunk_sizes[j % ARRAY_SIZE(chunk_sizes)];
+			if (threaded) {
+				params.num_threads = 3;
+				params.pread_fn = pread_fn;
+			}
+
+			ASSERT(libfsverity_compute_digest(&f,
+					threaded ? NULL : read_fn,
+					&params, &d) == 0);
+			ASSERT(!memcmp(d->digest, test_cases[i].digest,
+				       d->digest_size));
+			free(d);
+
+			/* The reads are as large as requested, when possible. */
+			if (!threaded)
+				ASSERT(f.max_read ==
+				       min(f.size,
+					   max(params.read_chunk_size &
+					       ~(block_size - 1), block_size)));
+		}
+	}
+}
+
+/* Test libfsverity_compute_digest_buffer(). */
+static void test_compute_digest_buffer(const struct mem_file *file)
+{
+	struct libfsverity_merkle_tree_params params;
+	struct libfsverity_digest *d = NULL;
+	size_t i;
+	u32 num_threads;
+
+	for (i = 0; i < ARRAY_SIZE(test_cases); i++) {
+		for (num_threads = 1; num_threads <= 4; num_threads += 3) {
+			memset(&params, 0, sizeof(params));
+			params.version = 1;
+			params.hash_algorithm = test_cases[i].hash_algorithm;
+			params.file_size = test_cases[i].file_size;
+			params.block_size = test_cases[i].block_size;
+			if (test_cases[i].salt) {
+				params.salt = (const u8 *)test_cases[i].salt;
+				params.salt_size = strlen(test_cases[i].salt);
+			}
+			params.num_threads = num_threads;
+
+			ASSERT(libfsverity_compute_digest_buffer(file->data,
+								 &params,
+								 &d) == 0);
+			ASSERT(!memcmp(d->digest, test_cases[i].digest,
+				       d->digest_size));
+			free(d);
+			d = NULL;
+		}
+	}
+
+	/* An empty file needn't have a buffer, but other files must. */
+	memset(&params, 0, sizeof(params));
+	params.version = 1;
+	ASSERT(libfsverity_compute_digest_buffer(NULL, &params, &d) == 0);
+	free(d);
+	d = NULL;
+	libfsverity_set_error_callback(NULL);
+	params.file_size = 1;
+	ASSERT(libfsverity_compute_digest_buffer(NULL, &params, &d) == -EINVAL);
+	ASSERT(libfsverity_compute_digest_buffer(file->data, NULL,
+						 &d) == -EINVAL);
+	ASSERT(libfsverity_compute_digest_buffer(file->data, &params,
+						 NULL) == -EINVAL);
+	install_libfsverity_error_handler();
+	ASSERT(d == NULL);
+}
+
+/*
+ * Test libfsverity_partial_tree_*() by appending the data of each test case in
+ * pieces of various sizes, checking the digest of the data so far after each
+ * piece and saving and reloading the partial tree after every other piece.
+ */
+static void test_partial_tree(const struct mem_file *file)
+{
+	static const size_t piece_sizes[] = {
+		0, 1, 4095, 1, 70000, 300000, 13, 65536, 4096, 500000,
+	};
+	struct libfsverity_merkle_tree_params params;
+	struct libfsverity_partial_tree *ptree;
+	struct libfsverity_digest *d, *d2;
+	u8 *state;
+	size_t state_size;
+	size_t i, j;
+	u64 offset;
+
+	for (i = 0; i < ARRAY_SIZE(test_cases); i++) {
+		const u64 file_size = test_cases[i].file_size;
+
+		memset(&params, 0, sizeof(params));
+		params.version = 1;
+		params.hash_algorithm = test_cases[i].hash_algorithm;
+		params.block_size = test_cases[i].block_size;
+		if (test_cases[i].salt) {
+			params.salt = (const u8 *)test_cases[i].salt;
+			params.salt_size = strlen(test_cases[i].salt);
+		}
+		ASSERT(libfsverity_partial_tree_new(&params, &ptree) == 0);
+
+		for (offset = 0, j = 0; ; j++) {
+			size_t n = min(piece_sizes[j % ARRAY_SIZE(piece_sizes)],
+				       file_size - offset);
+
+			ASSERT(libfsverity_partial_tree_append(ptree,
+					&file->data[offset], n) == 0);
+			offset += n;
+			ASSERT(libfsverity_partial_tree_data_size(ptree) ==
+			       offset);
+			if (j % 2) {
+				ASSERT(libfsverity_partial_tree_save(ptree,
+						&state, &state_size) == 0);
+				libfsverity_partial_tree_free(ptree);
+				ptree = NULL;
+				ASSERT(libfsverity_partial_tree_load(&params,
+						state, state_size,
+						&ptree) == 0);
+				free(state);
+			}
+			ASSERT(libfsverity_partial_tree_digest(ptree,
+							       &d) == 0);
+			params.file_size = offset;
+			ASSERT(libfsverity_compute_digest_buffer(file->data,
+								 &params,
+								 &d2) == 0);
+			params.file_size = 0;
+			ASSERT(d->digest_size == d2->digest_size);
+			ASSERT(!memcmp(d->digest, d2->digest, d->digest_size));
+			free(d2);
+			if (offset == file_size) {
+				ASSERT(!memcmp(d->digest, test_cases[i].digest,
+					       d->digest_size));
+				free(d);
+				break;
+			}
+			free(d);
+		}
+		libfsverity_partial_tree_free(ptree);
+	}
+
+	/* Saved states must match the parameters and must be intact. */
+	memset(&params, 0, sizeof(params));
+	params.version = 1;
+	ASSERT(libfsverity_partial_tree_new(&params, &ptree) == 0);
+	ASSERT(libfsverity_partial_tree_append(ptree, file->data, 100000) == 0);
+	ASSERT(libfsverity_partial_tree_save(ptree, &state, &state_size) == 0);
+	libfsverity_partial_tree_free(ptree);
+	libfsverity_set_error_callback(NULL);
+	params.block_size = 1024;
+	ASSERT(libfsverity_partial_tree_load(&params, state, state_size,
+					     &ptree) == -EINVAL);
+	params.block_size = 0;
+	ASSERT(libfsverity_partial_tree_load(&params, state, state_size - 1,
+					     &ptree) == -EBADMSG);
+	for (i = 0; i < state_size; i += 97) {
+		state[i] ^= 1;
+		ASSERT(libfsverity_partial_tree_load(&params, state, state_size,
+						     &ptree) < 0);
+		state[i] ^= 1;
+	}
+	ASSERT(libfsverity_partial_tree_new(NULL, &ptree) == -EINVAL);
+	install_libfsverity_error_handler();
+	ASSERT(libfsverity_partial_tree_data_size(NULL) == 0);
+	ASSERT(libfsverity_partial_tree_load(&params, state, state_size,
+					     &ptree) == 0);
+	libfsverity_partial_tree_free(ptree);
+	free(state);
+}
+
+/*
+ * Test that a libfsverity_hasher gives the same digests as
+ * libfsverity_compute_digest() for successive files of various sizes, including
+ * files that take the single-block path.
+ */
+static void test_hasher(const struct mem_file *file)
+{
+	struct libfsverity_merkle_tree_params params;
+	struct libfsverity_hasher *hasher;
+	struct libfsverity_digest *d;
+	u8 digest[64];
+	struct mem_file f = *file;
+	size_t i, j;
+
+	for (i = 0; i < ARRAY_SIZE(test_cases); i++) {
+		const struct test_case *t = &test_cases[i];
+		const u64 sizes[] = {
+			t->file_size, 0, 1, t->block_size ?: 4096,
+			(t->block_size ?: 4096) + 1, 100, 100000, t->file_size,
+		};
+
+		memset(&params, 0, sizeof(params));
+		params.version = 1;
+		params.hash_algorithm = t->hash_algorithm;
+		params.block_size = t->block_size;
+		if (t->salt) {
+			params.salt = (const u8 *)t->salt;
+			params.salt_size = strlen(t->salt);
+		}
+		if (i % 2)
+			params.read_chunk_size = 65536;
+		ASSERT(libfsverity_hasher_new(&params, &hasher) == 0);
+		for (j = 0; j < ARRAY_SIZE(sizes); j++) {
+			f.size = sizes[j];
+			f.offset = 0;
+			if (j % 2)
+				ASSERT(libfsverity_hasher_digest(hasher, &f,
+						read_fn, sizes[j],
+						digest) == 0);
+			else
+				ASSERT(libfsverity_hasher_digest_buffer(hasher,
+						f.data, sizes[j],
+						digest) == 0);
+			params.file_size = sizes[j];
+			ASSERT(libfsverity_compute_digest_buffer(f.data,
+						&params, &d) == 0);
+			ASSERT(!memcmp(digest, d->digest, d->digest_size));
+			if (sizes[j] == t->file_size)
+				ASSERT(!memcmp(digest, t->digest,
+					       d->digest_size));
+			free(d);
+		}
+		libfsverity_hasher_free(hasher);
+	}
+	libfsverity_set_error_callback(NULL);
+	ASSERT(libfsverity_hasher_new(NULL, &hasher) == -EINVAL);
+	install_libfsverity_error_handler();
+}
+
+/*
+ * Test that libfsverity_hasher_digest_buffers() gives the same digests as
+ * libfsverity_hasher_digest_buffer(), for enough files of various sizes to fill
+ * several groups, including some that are too large to be grouped.
+ */
+static void test_hasher_digest_buffers(const struct mem_file *file)
+{
+	const void *data[200];
+	u64 sizes[ARRAY_SIZE(data)];
+	u8 digests[ARRAY_SIZE(data) * 64];
+	u8 digest[64];
+	struct libfsverity_merkle_tree_params params;
+	struct libfsverity_hasher *hasher;
+	size_t i, j;
+
+	for (i = 0; i < ARRAY_SIZE(test_cases); i++) {
+		const struct test_case *t = &test_cases[i];
+		const u32 block_size = t->block_size ?: 4096;
+		const u32 digest_size =
+			libfsverity_get_digest_size(t->hash_algorithm ?:
+						    FS_VERITY_HASH_ALG_SHA256);
+		const u64 max_grouped = (u64)block_size *
+					(block_size / digest_size);
+
+		memset(&params, 0, sizeof(params));
+		params.version = 1;
+		params.hash_algorithm = t->hash_algorithm;
+		params.block_size = t->block_size;
+		if (t->salt) {
+			params.salt = (const u8 *)t->salt;
+			params.salt_size = strlen(t->salt);
+		}
+		ASSERT(libfsverity_hasher_new(&params, &hasher) == 0);
+		for (j = 0; j < ARRAY_SIZE(data); j++) {
+			switch (j % 8) {
+			case 0:
+				sizes[j] = 0;
+				break;
+			case 1:
+				sizes[j] = block_size;
+				break;
+			case 2:
+				sizes[j] = max_grouped;
+				break;
+			case 3:
+				sizes[j] = max_grouped + 1;
+				break;
+			default:
+				sizes[j] = (j * 7919) % (4 * block_size);
+				break;
+			}
+			sizes[j] = min(sizes[j], (u64)file->size - j);
+			data[j] = sizes[j] ? &file->data[j] : NULL;
+		}
+		ASSERT(libfsverity_hasher_digest_buffers(hasher, data, sizes,
+							 ARRAY_SIZE(data),
+							 digests) == 0);
+		for (j = 0; j < ARRAY_SIZE(data); j++) {
+			ASSERT(libfsverity_hasher_digest_buffer(hasher, data[j],
+						sizes[j], digest) == 0);
+			ASSERT(!memcmp(&digests[j * digest_size], digest,
+				       digest_size));
+		}
+		libfsverity_hasher_free(hasher);
+	}
+	libfsverity_set_error_callback(NULL);
+	ASSERT(libfsverity_hasher_digest_buffers(NULL, data, sizes, 1,
+						 digests) == -EINVAL);
+	install_libfsverity_error_handler();
+}
+
+static const struct zero_test_case {
+	u32 hash_algorithm;
+	u32 block_size;
+	const char *salt;
+	size_t file_size;
+	bool sparse;	/* if false, the data is all zeroes */
+	const u8 *digest;
+} zero_test_cases[] = {
+	{
+		.hash_algorithm = FS_VERITY_HASH_ALG_SHA256,
+		.block_size = 4096,
+		.file_size = 4 << 20,
+		.digest = (const u8 *)"\xc5\xcd\xc3\x51\x3c\xdb\x09\xb6"
+			  "\xe3\x05\x8b\x45\x23\xe7\x5b\x27"
+			  "\x82\x9e\x85\x6b\xbc\x4d\x05\x6c"
+			  "\x7b\x21\x23\xb8\x29\xd1\x0f\xa7",
+	}, {
+		.hash_algorithm = FS_VERITY_HASH_ALG_SHA256,
+		.block_size = 1024,
+		.salt = "abcd",
+		.file_size = 1000000,
+		.sparse = true,
+		.digest = (const u8 *)"\x9f\x86\x7e\x11\x4d\x5f\xb8\x1a"
+			  "\x0d\x2f\xf0\x9f\x0c\xf9\x3a\x85"
+			  "\xdb\x88\x40\x9c\x81\xc4\xee\x8d"
+			  "\x23\xd1\x92\xb3\x02\x92\xe1\xb7",
+	}, {
+		.hash_algorithm = FS_VERITY_HASH_ALG_SHA512,
+		.block_size = 4096,
+		.file_size = 1000000,
+		.sparse = true,
+		.digest = (const u8 *)"\x15\x38\x0a\xde\xed\x59\x45\x15"
+			  "\x2e\xed\x87\xcf\x76\xf3\xaa\x09"
+			  "\x4d\x4e\xa3\x97\xc6\x73\x8a\x3a"
+			  "\xfd\x06\x81\xf2\x04\x42\x5e\x55"
+			  "\xcb\xdc\x3d\xd8\x36\x33\xfb\x0e"
+			  "\xfe\x24\xb1\xf8\xbf\xa4\x32\xda"
+			  "\xd6\x07\x06\xcd\xb9\x17\x4e\x87"
+			  "\x48\xb9\x8e\x8b\x5e\xbd\x95\x9e",
+	}, {
+		.hash_algorithm = FS_VERITY_HASH_ALG_SHA256,
+		.block_size = 4096,
+		.file_size = 1,
+		.digest = (const u8 *)"\xb8\x03\x42\x95\x03\xd9\x59\x15"
+			  "\x82\x9b\x29\xfd\xbc\x8b\xba\xd1"
+			  "\x42\xf3\xab\xfd\x11\xb1\xca\xdf"
+			  "\x55\x26\x58\x2e\x68\x5c\x05\x51",
+	}, {
+		.hash_algorithm = FS_VERITY_HASH_ALG_SHA512,
+		.block_size = 1024,
+		.file_size = (3 << 20) + 5,
+		.digest = (const u8 *)"\xf9\xad\xb6\x44\x61\x85\x54\x8d"
+			  "\xea\x52\xf3\xd4\x12\x9b\xaa\x9c"
+			  "\xd0\x50\x77\x4b\x13\x8f\x7c\x3d"
+			  "\x61\xfc\x31\x3e\xcf\x53\x02\xab"
+			  "\x62\x65\x36\x4b\xf3\x4f\xb3\x4b"
+			  "\x81\x7c\xa3\x53\x59\xf0\xa5\x0e"
+			  "\x49\x31\xeb\x7f\xf9\xa0\xde\xd3"
+			  "\xe2\xe9\xd8\x81\x49\x2e\x77\x3c",
+	},
+};
+
+/*
+ * Test files that contain all-zero blocks and subtrees, whose hashes are cached
+ * rather than recomputed, with each way of supplying the data.
+ */
+static void test_zero_blocks(void)
+{
+	struct libfsverity_merkle_tree_params params;
+	struct libfsverity_digest *d;
+	size_t i, j;
+	int way;
+
+	for (i = 0; i < ARRAY_SIZE(zero_test_cases); i++) {
+		const struct zero_test_case *t = &zero_test_cases[i];
+		struct mem_file f = {
+			.data = xzalloc(t->file_size),
+			.size = t->file_size,
+		};
+
+		if (t->sparse) {
+			for (j = 0; j < t->file_size; j++) {
+				if (j % 131072 == 7 ||
+				    (j >= 600000 && j < 650000))
+					f.data[j] = j * 31 + 1;
+			}
+		}
+		for (way = 0; way < 4; way++) {
+			memset(&params, 0, sizeof(params));
+			params.version = 1;
+			params.hash_algorithm = t->hash_algorithm;
+			params.file_size = t->file_size;
+			params.block_size = t->block_size;
+			if (t->salt) {
+				params.salt = (const u8 *)t->salt;
+				params.salt_size = strlen(t->salt);
+			}
+			f.offset = 0;
+			switch (way) {
+			case 0:
+				ASSERT(libfsverity_compute_digest_buffer(f.data,
+						&params, &d) == 0);
+				break;
+			case 1:
+				ASSERT(libfsverity_compute_digest(&f, read_fn,
+						&params, &d) == 0);
+				break;
+			case 2:
+				params.read_chunk_size = 1 << 20;
+				ASSERT(libfsverity_compute_digest(&f, read_fn,
+						&params, &d) == 0);
+				break;
+			default:
+				params.num_threads = 3;
+				params.pread_fn = pread_fn;
+				ASSERT(libfsverity_compute_digest(&f, NULL,
+						&params, &d) == 0);
+				break;
+			}
+			ASSERT(!memcmp(d->digest, t->digest, d->digest_size));
+			free(d);
+		}
+		free(f.data);
+	}
+}
+
+/* Test computing digests using libfsverity_async_reader. */
+static void test_async_reader(const struct mem_file *file)
+{
+#ifndef _WIN32
+	static const struct {
+		u32 queue_depth;
+		u32 buffer_size;
+	} configs[] = {
+		{ 0, 0 }, { 1, 4096 }, { 3, 5000 }, { 8, 1 << 20 },
+	};
+	struct libfsverity_merkle_tree_params params;
+	struct libfsverity_async_reader *r;
+	struct libfsverity_digest *d;
+	FILE *fp = tmpfile();
+	size_t size = 0;
+	u8 *buf;
+	size_t i, j;
+	int fd;
+
+	for (i = 0; i < ARRAY_SIZE(test_cases); i++)
+		size = max(size, test_cases[i].file_size);
+	ASSERT(fp != NULL);
+	fd = fileno(fp);
+	ASSERT(fwrite(file->data, 1, size, fp) == size);
+	ASSERT(fflush(fp) == 0);
+
+	for (i = 0; i < ARRAY_SIZE(test_cases); i++) {
+		for (j = 0; j < ARRAY_SIZE(configs); j++) {
+			memset(&params, 0, sizeof(params));
+			params.version = 1;
+			params.hash_algorithm = test_cases[i].hash_algorithm;
+			params.file_size = test_cases[i].file_size;
+			params.block_size = test_cases[i].block_size;
+			if (test_cases[i].salt) {
+				params.salt = (const u8 *)test_cases[i].salt;
+				params.salt_size = strlen(test_cases[i].salt);
+			}
+			params.read_chunk_size = 3 * 4096 + 1;
+
+			ASSERT(libfsverity_async_reader_new(fd,
+					params.file_size,
+					configs[j].queue_depth,
+					configs[j].buffer_size, &r) == 0);
+			ASSERT(libfsverity_compute_digest(r,
+					libfsverity_async_read,
+					&params, &d) == 0);
+			ASSERT(!memcmp(d->digest, test_cases[i].digest,
+				       d->digest_size));
+			free(d);
+			libfsverity_async_reader_free(r);
+		}
+	}
+
+	/* Reading past the end of the file is an error. */
+	buf = xmalloc(size + 1);
+	ASSERT(libfsverity_async_reader_new(fd, size + 1, 2, 4096, &r) == 0);
+	ASSERT(libfsverity_async_read(r, buf, size) == 0);
+	ASSERT(!memcmp(buf, file->data, size));
+	libfsverity_set_error_callback(NULL);
+	ASSERT(libfsverity_async_read(r, buf, 1) == -EIO);
+	install_libfsverity_error_handler();
+	libfsverity_async_reader_free(r);
+
+	/* Reading past the requested size is an error too. */
+	ASSERT(libfsverity_async_reader_new(fd, 1, 0, 0, &r) == 0);
+	libfsverity_set_error_callback(NULL);
+	ASSERT(libfsverity_async_read(r, buf, 2) == -EINVAL);
+	install_libfsverity_error_handler();
+	ASSERT(libfsverity_async_read(r, buf, 1) == 0);
+	ASSERT(buf[0] == file->data[0]);
+	libfsverity_async_reader_free(r);
+	free(buf);
+
+	libfsverity_set_error_callback(NULL);
+	ASSERT(libfsverity_async_reader_new(-1, 1, 0, 0, &r) == -EINVAL);
+	ASSERT(libfsverity_async_reader_new(fd, 1, 257, 0, &r) == -EINVAL);
+	install_libfsverity_error_handler();
+	libfsverity_async_reader_free(NULL);
+	fclose(fp);
+#endif /* !_WIN32 */
+}
+
+#if OPENSSL_VERSION_NUMBER >= 0x30000000L && !defined(OPENSSL_IS_BORINGSSL)
+/*
+ * A minimal OpenSSL provider of SHA-256 which counts the digests that it
+ * computes.  The hashing itself is done by the default library context.
+ */
+static u64 num_counted_digests;
+
+static void *counting_newctx(void *provctx __attribute__((unused)))
+{
+	return EVP_MD_CTX_new();
+}
+
+static void counting_freectx(void *ctx)
+{
+	EVP_MD_CTX_free(ctx);
+}
+
+static void *counting_dupctx(void *ctx)
+{
+	EVP_MD_CTX *dup = EVP_MD_CTX_new();
+
+	if (dup && !EVP_MD_CTX_copy_ex(dup, ctx)) {
+		EVP_MD_CTX_free(dup);
+		return NULL;
+	}
+	return dup;
+}
+
+static int counting_init(void *ctx,
+			 const OSSL_PARAM params[] __attribute__((unused)))
+{
+	return EVP_DigestInit_ex(ctx, EVP_sha256(), NULL);
+}
+
+static int counting_update(void *ctx, const unsigned char *data, size_t size)
+{
+	return EVP_DigestUpdate(ctx, data, size);
+}
+
+static int counting_final(void *ctx, unsigned char *out, size_t *outl,
+			  size_t outsz)
+{
+	unsigned int len;
+
+	if (outsz < SHA256_DIGEST_LENGTH || !EVP_DigestFinal_ex(ctx, out, &len))
+		return 0;
+	*outl = len;
+	__atomic_add_fetch(&num_counted_digests, 1, __ATOMIC_RELAXED);
+	return 1;
+}
+
+static int counting_get_params(OSSL_PARAM params[])
+{
+	OSSL_PARAM *p;
+
+	p = OSSL_PARAM_locate(params, OSSL_DIGEST_PARAM_BLOCK_SIZE);
+	if (p && !OSSL_PARAM_set_size_t(p, SHA256_CBLOCK))
+		return 0;
+	p = OSSL_PARAM_locate(params, OSSL_DIGEST_PARAM_SIZE);
+	if (p && !OSSL_PARAM_set_size_t(p, SHA256_DIGEST_LENGTH))
+		return 0;
+	return 1;
+}
+
+static const OSSL_DISPATCH counting_sha256_functions[] = {
+	{ OSSL_FUNC_DIGEST_NEWCTX, (void (*)(void))counting_newctx },
+	{ OSSL_FUNC_DIGEST_FREECTX, (void (*)(void))counting_freectx },
+	{ OSSL_FUNC_DIGEST_DUPCTX, (void (*)(void))counting_dupctx },
+	{ OSSL_FUNC_DIGEST_INIT, (void (*)(void))counting_init },
+	{ OSSL_FUNC_DIGEST_UPDATE, (void (*)(void))counting_update },
+	{ OSSL_FUNC_DIGEST_FINAL, (void (*)(void))counting_final },
+	{ OSSL_FUNC_DIGEST_GET_PARAMS, (void (*)(void))counting_get_params },
+	{ 0, NULL },
+};
+
+static const OSSL_ALGORITHM counting_digests[] = {
+	{ "SHA2-256:SHA-256:SHA256", "provider=counting",
+	  counting_sha256_functions, NULL },
+	{ NULL, NULL, NULL, NULL },
+};
+
+static const OSSL_ALGORITHM *
+counting_query(void *provctx __attribute__((unused)), int operation_id,
+	       int *no_cache)
+{
+	*no_cache = 0;
+	return operation_id == OSSL_OP_DIGEST ? counting_digests : NULL;
+}
+
+static const OSSL_DISPATCH counting_provider_functions[] = {
+	{ OSSL_FUNC_PROVIDER_QUERY_OPERATION, (void (*)(void))counting_query },
+	{ 0, NULL },
+};
+
+static int
+counting_provider_init(const OSSL_CORE_HANDLE *handle __attribute__((unused)),
+		       const OSSL_DISPATCH *in __attribute__((unused)),
+		       const OSSL_DISPATCH **out, void **provctx)
+{
+	*out = counting_provider_functions;
+	*provctx = NULL;
+	return 1;
+}
+#endif
+
+/*
+ * Test computing a digest using a caller-supplied OpenSSL library context, and
+ * that all the blocks are hashed by the context's provider.
+ */
+static void test_openssl_libctx(const struct mem_file *file)
+{
+#if OPENSSL_VERSION_NUMBER >= 0x30000000L && !defined(OPENSSL_IS_BORINGSSL)
+	const struct test_case *t = &test_cases[0];
+	struct mem_file f = { .data = file->data, .size = t->file_size };
+	struct libfsverity_merkle_tree_params params = {
+		.version = 1,
+		.hash_algorithm = t->hash_algorithm,
+		.file_size = t->file_size,
+		.block_size = t->block_size,
+		.num_threads = 2,
+		.pread_fn = pread_fn,
+	};
+	const u64 num_data_blocks = DIV_ROUND_UP(t->file_size, t->block_size);
+	struct libfsverity_digest *d = NULL;
+	OSSL_PROVIDER *prov;
+	int err;
+
+	ASSERT(t->hash_algorithm == FS_VERITY_HASH_ALG_SHA256);
+	params.openssl_libctx = OSSL_LIB_CTX_new();
+	ASSERT(params.openssl_libctx != NULL);
+	ASSERT(OSSL_PROVIDER_add_builtin(params.openssl_libctx, "counting",
+					 counting_provider_init));
+	prov = OSSL_PROVIDER_load(params.openssl_libctx, "counting");
+	ASSERT(prov != NULL);
+
+	/* This fails if libfsverity was built without OpenSSL hashing. */
+	num_counted_digests = 0;
+	libfsverity_set_error_callback(NULL);
+	err = libfsverity_compute_digest(&f, NULL, &params, &d);
+	install_libfsverity_error_handler();
+	ASSERT(err == 0 || err == -EOPNOTSUPP);
+	if (err == 0) {
+		ASSERT(!memcmp(d->digest, t->digest, d->digest_size));
+		/* The data blocks, the tree blocks, and the descriptor */
+		ASSERT(num_counted_digests > num_data_blocks + 1);
+	}
+	free(d);
+	OSSL_PROVIDER_unload(prov);
+	OSSL_LIB_CTX_free(params.openssl_libctx);
+#endif
+}
+
 static struct {
 	u64 merkle_tree_size;
 	u64 merkle_tree_block;
@@ -381,6 +1193,930 @@ static void test_metadata_callbacks(void)
 	free(d);
 }
 
+struct tree_output {
+	u8 *merkle_tree;
+	u64 merkle_tree_size;
+	u8 descriptor[256];
+};
+
+static int save_merkle_tree_size(void *ctx, u64 size)
+{
+	struct tree_output *out = ctx;
+
+	out->merkle_tree = xzalloc(size);
+	out->merkle_tree_size = size;
+	return 0;
+}
+
+static int save_merkle_tree_block(void *ctx, const void *block, size_t size,
+				  u64 offset)
+{
+	struct tree_output *out = ctx;
+
+	ASSERT(offset <= out->merkle_tree_size &&
+	       size <= out->merkle_tree_size - offset);
+	memcpy(&out->merkle_tree[offset], block, size);
+	return 0;
+}
+
+static int save_descriptor(void *ctx, const void *descriptor, size_t size)
+{
+	struct tree_output *out = ctx;
+
+	ASSERT(size == sizeof(out->descriptor));
+	memcpy(out->descriptor, descriptor, size);
+	return 0;
+}
+
+static void compute_tree(struct mem_file *f,
+			 struct libfsverity_merkle_tree_params *params,
+			 struct tree_output *out)
+{
+	struct libfsverity_metadata_callbacks cbs = {
+		.ctx = out,
+		.merkle_tree_size = save_merkle_tree_size,
+		.merkle_tree_block = save_merkle_tree_block,
+		.descriptor = save_descriptor,
+	};
+	struct libfsverity_digest *d;
+
+	memset(out, 0, sizeof(*out));
+	params->metadata_callbacks = &cbs;
+	f->offset = 0;
+	ASSERT(libfsverity_compute_digest(f, read_fn, params, &d) == 0);
+	params->metadata_callbacks = NULL;
+	free(d);
+}
+
+/*
+ * Test that using multiple threads produces exactly the same Merkle tree and
+ * fs-verity descriptor as using one thread.
+ */
+static void test_multithreaded(const struct mem_file *file)
+{
+	static const struct {
+		u32 hash_algorithm;
+		u32 block_size;
+		u64 file_size;
+	} cases[] = {
+		{ FS_VERITY_HASH_ALG_SHA256, 1024, 1000000 },
+		{ FS_VERITY_HASH_ALG_SHA256, 512, 1000000 },
+		{ FS_VERITY_HASH_ALG_SHA512, 1024, 999999 },
+		{ FS_VERITY_HASH_ALG_SHA256, 4096, 1000000 },
+		{ FS_VERITY_HASH_ALG_SHA256, 4096, 100000 },
+		{ FS_VERITY_HASH_ALG_SHA256, 1024, 32 * 1024 + 1 },
+	};
+	struct mem_file f = *file;
+	size_t i;
+
+	for (i = 0; i < ARRAY_SIZE(cases); i++) {
+		struct libfsverity_merkle_tree_params params = {
+			.version = 1,
+			.hash_algorithm = cases[i].hash_algorithm,
+			.block_size = cases[i].block_size,
+			.file_size = cases[i].file_size,
+		};
+		struct tree_output expected, actual;
+		u32 num_threads;
+
+		ASSERT(cases[i].file_size <= file->size);
+		f.size = cases[i].file_size;
+		compute_tree(&f, &params, &expected);
+		params.pread_fn = pread_fn;
+		for (num_threads = 2; num_threads <= 16; num_threads *= 2) {
+			params.num_threads = num_threads;
+			compute_tree(&f, &params, &actual);
+			ASSERT(actual.merkle_tree_size ==
+			       expected.merkle_tree_size);
+			ASSERT(!memcmp(actual.merkle_tree, expected.merkle_tree,
+				       expected.merkle_tree_size));
+			ASSERT(!memcmp(actual.descriptor, expected.descriptor,
+				       sizeof(expected.descriptor)));
+			free(actual.merkle_tree);
+		}
+		free(expected.merkle_tree);
+	}
+}
+
+static int check_merkle_tree_size(void *ctx, u64 size)
+{
+	struct tree_output *out = ctx;
+
+	ASSERT(size == out->merkle_tree_size);
+	return 0;
+}
+
+/*
+ * Test that libfsverity_update_merkle_tree() produces the same Merkle tree and
+ * digest as computing them from scratch, and that the tree blocks it reports to
+ * the metadata callbacks are enough to bring a copy of the old tree up to date.
+ */
+static void test_update_merkle_tree(const struct mem_file *file)
+{
+	static const struct {
+		u32 hash_algorithm;
+		u32 block_size;
+		u64 file_size;
+	} cases[] = {
+		{ FS_VERITY_HASH_ALG_SHA256, 4096, 1000000 },
+		{ FS_VERITY_HASH_ALG_SHA256, 1024, 999999 },
+		{ FS_VERITY_HASH_ALG_SHA512, 1024, 1000000 },
+		{ FS_VERITY_HASH_ALG_SHA256, 4096, 8192 },
+		{ FS_VERITY_HASH_ALG_SHA256, 4096, 100 },
+		{ FS_VERITY_HASH_ALG_SHA256, 4096, 0 },
+	};
+	/* Unsorted, overlapping, adjacent, and empty ranges */
+	static const struct libfsverity_range changes[] = {
+		{ 5000, 1 }, { 0, 1 }, { 300000, 70000 }, { 310000, 10 },
+		{ 999990, 9 }, { 123456, 0 }, { 204800, 4096 },
+		{ 208896, 4096 }, { 4000, 4500 },
+	};
+	struct libfsverity_range changed[ARRAY_SIZE(changes)];
+	size_t i, j, n;
+
+	for (i = 0; i < ARRAY_SIZE(cases); i++) {
+		const u64 file_size = cases[i].file_size;
+		struct libfsverity_merkle_tree_params params = {
+			.version = 1,
+			.hash_algorithm = cases[i].hash_algorithm,
+			.block_size = cases[i].block_size,
+			.file_size = file_size,
+			.salt = (const u8 *)"salt",
+			.salt_size = 4,
+		};
+		struct mem_file f = {
+			.data = xmemdup(file->data, file_size),
+			.size = file_size,
+		};
+		struct tree_output old, expected, reported = {};
+		struct libfsverity_metadata_callbacks cbs = {
+			.ctx = &reported,
+			.merkle_tree_size = check_merkle_tree_size,
+			.merkle_tree_block = save_merkle_tree_block,
+			.descriptor = save_descriptor,
+		};
+		struct libfsverity_digest *d, *d2;
+		u8 *tree;
+
+		ASSERT(file_size <= file->size);
+		compute_tree(&f, &params, &old);
+		for (j = 0, n = 0; j < ARRAY_SIZE(changes); j++) {
+			u64 k;
+
+			if (changes[j].offset >= file_size)
+				continue;
+			changed[n].offset = changes[j].offset;
+			changed[n].length = min(changes[j].length,
+						file_size - changes[j].offset);
+			for (k = 0; k < changed[n].length; k++)
+				f.data[changed[n].offset + k] ^= 0x5a;
+			n++;
+		}
+		compute_tree(&f, &params, &expected);
+		ASSERT(libfsverity_compute_digest_buffer(f.data, &params,
+							 &d2) == 0);
+
+		tree = xmemdup(old.merkle_tree, old.merkle_tree_size);
+		reported.merkle_tree = xmemdup(old.merkle_tree,
+					       old.merkle_tree_size);
+		reported.merkle_tree_size = old.merkle_tree_size;
+		params.pread_fn = pread_fn;
+		params.metadata_callbacks = &cbs;
+		ASSERT(libfsverity_update_merkle_tree(&f, &params, changed, n,
+						      tree,
+						      old.merkle_tree_size,
+						      &d) == 0);
+		ASSERT(!memcmp(tree, expected.merkle_tree,
+			       expected.merkle_tree_size));
+		ASSERT(!memcmp(reported.merkle_tree, expected.merkle_tree,
+			       expected.merkle_tree_size));
+		ASSERT(!memcmp(reported.descriptor, expected.descriptor,
+			       sizeof(expected.descriptor)));
+		ASSERT(d->digest_size == d2->digest_size);
+		ASSERT(!memcmp(d->digest, d2->digest, d->digest_size));
+		free(d);
+
+		/* With nothing changed, the tree and digest stay the same. */
+		params.metadata_callbacks = NULL;
+		ASSERT(libfsverity_update_merkle_tree(&f, &params, NULL, 0,
+						      tree,
+						      old.merkle_tree_size,
+						      &d) == 0);
+		ASSERT(!memcmp(tree, expected.merkle_tree,
+			       expected.merkle_tree_size));
+		ASSERT(!memcmp(d->digest, d2->digest, d->digest_size));
+		free(d);
+
+		/* The tree must match the file size, and so must the ranges. */
+		libfsverity_set_error_callback(NULL);
+		changed[0].offset = file_size;
+		changed[0].length = 1;
+		ASSERT(libfsverity_update_merkle_tree(&f, &params, changed, 1,
+						      tree,
+						      old.merkle_tree_size,
+						      &d) == -EINVAL);
+		params.file_size = (u64)cases[i].block_size * cases[i].block_size;
+		ASSERT(libfsverity_update_merkle_tree(&f, &params, NULL, 0,
+						      tree,
+						      old.merkle_tree_size,
+						      &d) == -EINVAL);
+		params.file_size = file_size;
+		params.pread_fn = NULL;
+		ASSERT(libfsverity_update_merkle_tree(&f, &params, NULL, 0,
+						      tree,
+						      old.merkle_tree_size,
+						      &d) == -EINVAL);
+		install_libfsverity_error_handler();
+
+		free(d2);
+		free(tree);
+		free(reported.merkle_tree);
+		free(expected.merkle_tree);
+		free(old.merkle_tree);
+		free(f.data);
+	}
+}
+
+/*
+ * Test libfsverity_digest_ctx_*() by giving the data of each test case in
+ * pieces of various sizes, both with and without the size being known in
+ * advance, and check that the Merkle tree and descriptor it reports are the
+ * same as those from libfsverity_compute_digest().
+ */
+static void test_digest_ctx(const struct mem_file *file)
+{
+	static const size_t piece_sizes[] = {
+		1, 4095, 0, 70000, 65536, 13, 300000, 4096, 1000000,
+	};
+	struct libfsverity_merkle_tree_params params;
+	struct libfsverity_digest_ctx *ctx;
+	struct libfsverity_digest *d;
+	struct tree_output expected, actual;
+	struct libfsverity_metadata_callbacks cbs = {
+		.ctx = &actual,
+		.merkle_tree_size = save_merkle_tree_size,
+		.merkle_tree_block = save_merkle_tree_block,
+		.descriptor = save_descriptor,
+	};
+	struct mem_file f = *file;
+	size_t i, j;
+	u64 offset;
+
+	for (i = 0; i < 2 * ARRAY_SIZE(test_cases); i++) {
+		const struct test_case *t = &test_cases[i / 2];
+		const bool size_known = (i % 2 == 0);
+
+		memset(&params, 0, sizeof(params));
+		params.version = 1;
+		params.hash_algorithm = t->hash_algorithm;
+		params.block_size = t->block_size;
+		params.file_size = t->file_size;
+		if (t->salt) {
+			params.salt = (const u8 *)t->salt;
+			params.salt_size = strlen(t->salt);
+		}
+		f.size = t->file_size;
+		compute_tree(&f, &params, &expected);
+
+		memset(&actual, 0, sizeof(actual));
+		params.metadata_callbacks = &cbs;
+		if (!size_known)
+			params.file_size = LIBFSVERITY_FILE_SIZE_UNKNOWN;
+		ASSERT(libfsverity_digest_ctx_new(&params, &ctx) == 0);
+		for (offset = 0, j = i; offset < t->file_size; j++) {
+			size_t n = min(piece_sizes[j % ARRAY_SIZE(piece_sizes)],
+				       t->file_size - offset);
+
+			ASSERT(libfsverity_digest_ctx_update(ctx,
+					&file->data[offset], n) == 0);
+			offset += n;
+		}
+		ASSERT(libfsverity_digest_ctx_final(ctx, &d) == 0);
+		libfsverity_digest_ctx_free(ctx);
+
+		ASSERT(!memcmp(d->digest, t->digest, d->digest_size));
+		ASSERT(actual.merkle_tree_size == expected.merkle_tree_size);
+		ASSERT(!memcmp(actual.merkle_tree, expected.merkle_tree,
+			       expected.merkle_tree_size));
+		ASSERT(!memcmp(actual.descriptor, expected.descriptor,
+			       sizeof(expected.descriptor)));
+		free(d);
+		free(actual.merkle_tree);
+		free(expected.merkle_tree);
+	}
+
+	/* Exactly file_size bytes must be given, and only before final. */
+	memset(&params, 0, sizeof(params));
+	params.version = 1;
+	params.file_size = 10000;
+	libfsverity_set_error_callback(NULL);
+	ASSERT(libfsverity_digest_ctx_new(&params, &ctx) == 0);
+	ASSERT(libfsverity_digest_ctx_update(ctx, file->data, 9999) == 0);
+	ASSERT(libfsverity_digest_ctx_final(ctx, &d) == -EINVAL);
+	ASSERT(libfsverity_digest_ctx_update(ctx, file->data, 2) == -EINVAL);
+	ASSERT(libfsverity_digest_ctx_update(ctx, file->data, 1) == 0);
+	ASSERT(libfsverity_digest_ctx_final(ctx, &d) == 0);
+	free(d);
+	ASSERT(libfsverity_digest_ctx_update(ctx, file->data, 0) == -EINVAL);
+	ASSERT(libfsverity_digest_ctx_final(ctx, &d) == -EINVAL);
+	libfsverity_digest_ctx_free(ctx);
+	/* A context that is freed without being finished mustn't leak. */
+	params.file_size = LIBFSVERITY_FILE_SIZE_UNKNOWN;
+	params.metadata_callbacks = &cbs;
+	ASSERT(libfsverity_digest_ctx_new(&params, &ctx) == 0);
+	ASSERT(libfsverity_digest_ctx_update(ctx, file->data, 500000) == 0);
+	libfsverity_digest_ctx_free(ctx);
+	params.metadata_callbacks = NULL;
+	ASSERT(libfsverity_digest_ctx_new(NULL, &ctx) == -EINVAL);
+	install_libfsverity_error_handler();
+}
+
+/*
+ * Test that libfsverity_compute_digest_multi() gives the same digests and
+ * Merkle trees as computing them one parameter set at a time.
+ */
+static void test_compute_digest_multi(const struct mem_file *file)
+{
+	static const struct {
+		u32 hash_algorithm;
+		u32 block_size;
+		const char *salt;
+	} sets[] = {
+		{ FS_VERITY_HASH_ALG_SHA256, 4096, NULL },
+		{ FS_VERITY_HASH_ALG_SHA512, 4096, NULL },
+		{ FS_VERITY_HASH_ALG_SHA256, 65536, NULL },
+		{ FS_VERITY_HASH_ALG_SHA512, 1024, "abcd" },
+	};
+	static const u64 file_sizes[] = { 0, 1, 4096, 65537, 100000 };
+	struct libfsverity_merkle_tree_params params[ARRAY_SIZE(sets)];
+	struct libfsverity_digest *digests[ARRAY_SIZE(sets)];
+	struct tree_output expected, actual;
+	struct libfsverity_metadata_callbacks cbs = {
+		.ctx = &actual,
+		.merkle_tree_size = save_merkle_tree_size,
+		.merkle_tree_block = save_merkle_tree_block,
+		.descriptor = save_descriptor,
+	};
+	struct libfsverity_digest *d;
+	struct mem_file f = *file;
+	size_t i, j;
+
+	for (i = 0; i < ARRAY_SIZE(file_sizes); i++) {
+		ASSERT(file_sizes[i] <= file->size);
+		memset(params, 0, sizeof(params));
+		for (j = 0; j < ARRAY_SIZE(sets); j++) {
+			params[j].version = 1;
+			params[j].hash_algorithm = sets[j].hash_algorithm;
+			params[j].block_size = sets[j].block_size;
+			params[j].file_size = file_sizes[i];
+			if (sets[j].salt) {
+				params[j].salt = (const u8 *)sets[j].salt;
+				params[j].salt_size = strlen(sets[j].salt);
+			}
+		}
+		f.size = file_sizes[i];
+		compute_tree(&f, &params[1], &expected);
+		memset(&actual, 0, sizeof(actual));
+		params[1].metadata_callbacks = &cbs;
+		if (i % 2) {
+			params[0].pread_fn = pread_fn;
+			params[0].read_chunk_size = 10000;
+			ASSERT(libfsverity_compute_digest_multi(&f, NULL,
+					params, ARRAY_SIZE(sets),
+					digests) == 0);
+		} else {
+			f.offset = 0;
+			ASSERT(libfsverity_compute_digest_multi(&f, read_fn,
+					params, ARRAY_SIZE(sets),
+					digests) == 0);
+		}
+		ASSERT(actual.merkle_tree_size == expected.merkle_tree_size);
+		ASSERT(!memcmp(actual.merkle_tree, expected.merkle_tree,
+			       expected.merkle_tree_size));
+		ASSERT(!memcmp(actual.descriptor, expected.descriptor,
+			       sizeof(expected.descriptor)));
+		free(actual.merkle_tree);
+		free(expected.merkle_tree);
+		params[1].metadata_callbacks = NULL;
+
+		for (j = 0; j < ARRAY_SIZE(sets); j++) {
+			ASSERT(libfsverity_compute_digest_buffer(f.data,
+						&params[j], &d) == 0);
+			ASSERT(digests[j]->digest_algorithm ==
+			       d->digest_algorithm);
+			ASSERT(digests[j]->digest_size == d->digest_size);
+			ASSERT(!memcmp(digests[j]->digest, d->digest,
+				       d->digest_size));
+			free(digests[j]);
+			free(d);
+		}
+	}
+
+	/* The file sizes must match. */
+	params[1].file_size = 1;
+	libfsverity_set_error_callback(NULL);
+	ASSERT(libfsverity_compute_digest_multi(&f, read_fn, params,
+						ARRAY_SIZE(sets),
+						digests) == -EINVAL);
+	install_libfsverity_error_handler();
+}
+
+/*
+ * Test that libfsverity_compute_digests() gives the same results as
+ * libfsverity_compute_digest() on each file, including for a file that is
+ * large enough to be split among the workers, for jobs that use a block memo
+ * or compute a flat hash, and for jobs that differ only in read_chunk_size.
+ */
+static void test_compute_digests(const struct mem_file *file)
+{
+	const size_t n = 2 * ARRAY_SIZE(test_cases);
+	struct libfsverity_merkle_tree_params
+		params[2 * ARRAY_SIZE(test_cases) + 4];
+	struct libfsverity_digest_job jobs[ARRAY_SIZE(params)];
+	struct mem_file files[ARRAY_SIZE(params)];
+	u8 flat_hashes[ARRAY_SIZE(params)][SHA256_DIGEST_LENGTH];
+	u8 expected_flat_hash[SHA256_DIGEST_LENGTH];
+	struct tree_output expected, actual;
+	struct libfsverity_metadata_callbacks cbs = {
+		.ctx = &actual,
+		.merkle_tree_size = save_merkle_tree_size,
+		.merkle_tree_block = save_merkle_tree_block,
+		.descriptor = save_descriptor,
+	};
+	struct mem_file big = { .size = 20000000 };
+	struct mem_file chunked = { .size = 1 << 20 };
+	struct libfsverity_digest *d;
+	u32 num_workers;
+	size_t i;
+
+	big.data = xmalloc(big.size);
+	for (i = 0; i < big.size; i++)
+		big.data[i] = (i % 13) + (i % 541);
+	chunked.data = big.data;
+
+	for (num_workers = 0; num_workers <= 4; num_workers += 2) {
+		memset(params, 0, sizeof(params));
+		memset(jobs, 0, sizeof(jobs));
+		for (i = 0; i < n; i++) {
+			const struct test_case *t =
+				&test_cases[i % ARRAY_SIZE(test_cases)];
+
+			params[i].version = 1;
+			params[i].hash_algorithm = t->hash_algorithm;
+			params[i].block_size = t->block_size;
+			params[i].file_size = i < ARRAY_SIZE(test_cases) ?
+					      t->file_size : i * 1000;
+			if (t->salt) {
+				params[i].salt = (const u8 *)t->salt;
+				params[i].salt_size = strlen(t->salt);
+			}
+			files[i] = *file;
+			files[i].size = params[i].file_size;
+			files[i].offset = 0;
+			jobs[i].fd = &files[i];
+			if (i % 2)
+				params[i].pread_fn = pread_fn;
+			else
+				jobs[i].read_fn = read_fn;
+			jobs[i].params = &params[i];
+			if (i % 3 == 1)
+				params[i].memo_size = 65536;
+			if (i % 4 == 2) {
+				params[i].flat_hash_algorithm =
+					FS_VERITY_HASH_ALG_SHA256;
+				params[i].flat_hash = flat_hashes[i];
+			}
+		}
+		/* A file that gets split, with metadata callbacks */
+		params[n].version = 1;
+		params[n].block_size = 1024;
+		params[n].file_size = big.size;
+		compute_tree(&big, &params[n], &expected);
+		params[n].pread_fn = pread_fn;
+		params[n].metadata_callbacks = &cbs;
+		jobs[n].fd = &big;
+		jobs[n].params = &params[n];
+		/* An invalid job */
+		params[n + 1].version = 1;
+		params[n + 1].block_size = 3;
+		jobs[n + 1].fd = &files[0];
+		jobs[n + 1].read_fn = read_fn;
+		jobs[n + 1].params = &params[n + 1];
+		/*
+		 * Jobs that can share a hasher but read larger chunks than the
+		 * one before.  Each worker runs its own jobs last to first.
+		 */
+		for (i = n + 2; i < n + 4; i++) {
+			params[i].version = 1;
+			params[i].file_size = chunked.size;
+			params[i].pread_fn = pread_fn;
+			params[i].read_chunk_size = i == n + 2 ? chunked.size :
+						    4096;
+			jobs[i].fd = &chunked;
+			jobs[i].params = &params[i];
+		}
+
+		memset(&actual, 0, sizeof(actual));
+		libfsverity_set_error_callback(NULL);
+		ASSERT(libfsverity_compute_digests(jobs, ARRAY_SIZE(jobs),
+						   num_workers) == 0);
+		install_libfsverity_error_handler();
+
+		for (i = 0; i < n; i++) {
+			ASSERT(jobs[i].err == 0);
+			params[i].pread_fn = NULL;
+			params[i].flat_hash = expected_flat_hash;
+			ASSERT(libfsverity_compute_digest_buffer(file->data,
+						&params[i], &d) == 0);
+			if (params[i].flat_hash_algorithm)
+				ASSERT(!memcmp(flat_hashes[i],
+					       expected_flat_hash,
+					       sizeof(expected_flat_hash)));
+			ASSERT(jobs[i].digest->digest_size == d->digest_size);
+			ASSERT(!memcmp(jobs[i].digest->digest, d->digest,
+				       d->digest_size));
+			if (i < ARRAY_SIZE(test_cases))
+				ASSERT(!memcmp(d->digest, test_cases[i].digest,
+					       d->digest_size));
+			free(jobs[i].digest);
+			free(d);
+		}
+		ASSERT(jobs[n].err == 0);
+		ASSERT(actual.merkle_tree_size == expected.merkle_tree_size);
+		ASSERT(!memcmp(actual.merkle_tree, expected.merkle_tree,
+			       expected.merkle_tree_size));
+		ASSERT(!memcmp(actual.descriptor, expected.descriptor,
+			       sizeof(expected.descriptor)));
+		free(jobs[n].digest);
+		free(actual.merkle_tree);
+		free(expected.merkle_tree);
+		ASSERT(jobs[n + 1].err == -EINVAL);
+		ASSERT(jobs[n + 1].digest == NULL);
+		ASSERT(libfsverity_compute_digest_buffer(chunked.data,
+							 &params[n + 2],
+							 &d) == 0);
+		for (i = n + 2; i < n + 4; i++) {
+			ASSERT(jobs[i].err == 0);
+			ASSERT(!memcmp(jobs[i].digest->digest, d->digest,
+				       d->digest_size));
+			free(jobs[i].digest);
+		}
+		free(d);
+	}
+	free(big.data);
+
+	ASSERT(libfsverity_compute_digests(NULL, 0, 4) == 0);
+	libfsverity_set_error_callback(NULL);
+	ASSERT(libfsverity_compute_digests(NULL, 1, 4) == -EINVAL);
+	install_libfsverity_error_handler();
+}
+
+struct hole {
+	u64 start;
+	u64 end;
+};
+
+/* A mem_file whose holes are reported by zero_range_fn() */
+struct sparse_file {
+	struct mem_file f;	/* must be first, for read_fn() and pread_fn() */
+	const struct hole *holes;
+	size_t num_holes;
+};
+
+static int zero_range_fn(void *fd, u64 offset, u64 *start_ret, u64 *end_ret)
+{
+	const struct sparse_file *sf = fd;
+	size_t i;
+
+	for (i = 0; i < sf->num_holes; i++) {
+		if (sf->holes[i].end > offset) {
+			*start_ret = max(sf->holes[i].start, offset);
+			*end_ret = sf->holes[i].end;
+			return 0;
+		}
+	}
+	*start_ret = *end_ret = sf->f.size;
+	return 0;
+}
+
+static int bad_zero_range_fn(void *fd __attribute__((unused)), u64 offset,
+			     u64 *start_ret, u64 *end_ret)
+{
+	*start_ret = offset + 2;
+	*end_ret = offset + 1;
+	return 0;
+}
+
+/*
+ * Test computing a flat hash of the data along with the fs-verity digest, in
+ * each of the ways that the data can be read.
+ */
+static void test_flat_hash(const struct mem_file *file)
+{
+	static const u64 file_sizes[] = { 0, 1, 4096, 65537, 100000 };
+	struct mem_file f = *file;
+	size_t i;
+	int variant;
+
+	for (i = 0; i < ARRAY_SIZE(file_sizes); i++) {
+		struct libfsverity_merkle_tree_params params = {
+			.version = 1,
+			.file_size = file_sizes[i],
+			.block_size = 1024,
+		};
+		struct libfsverity_digest *expected, *d;
+		struct libfsverity_digest_ctx *ctx;
+		u8 expected_sha256[SHA256_DIGEST_LENGTH];
+		u8 expected_sha512[SHA512_DIGEST_LENGTH];
+		u8 flat_hash[SHA512_DIGEST_LENGTH];
+
+		ASSERT(file_sizes[i] <= file->size);
+		f.size = file_sizes[i];
+		f.offset = 0;
+		ASSERT(libfsverity_compute_digest(&f, read_fn, &params,
+						  &expected) == 0);
+		SHA256(f.data, f.size, expected_sha256);
+		SHA512(f.data, f.size, expected_sha512);
+
+		for (variant = 0; variant < 8; variant++) {
+			const bool sha512 = variant & 1;
+
+			params.flat_hash_algorithm = sha512 ?
+				FS_VERITY_HASH_ALG_SHA512 :
+				FS_VERITY_HASH_ALG_SHA256;
+			params.flat_hash = flat_hash;
+			params.read_chunk_size = (variant & 2) ? 10000 : 0;
+			/* Multiple threads are ignored, except for buffers. */
+			params.num_threads = (variant & 4) ? 4 : 0;
+			params.pread_fn = (variant & 4) ? pread_fn : NULL;
+			memset(flat_hash, 0, sizeof(flat_hash));
+			f.offset = 0;
+			if (variant == 7)
+				ASSERT(libfsverity_compute_digest_buffer(
+						f.data, &params, &d) == 0);
+			else
+				ASSERT(libfsverity_compute_digest(
+						&f, (variant & 4) ? NULL :
+						read_fn, &params, &d) == 0);
+			ASSERT(d->digest_size == expected->digest_size);
+			ASSERT(!memcmp(d->digest, expected->digest,
+				       d->digest_size));
+			if (sha512)
+				ASSERT(!memcmp(flat_hash, expected_sha512,
+					       SHA512_DIGEST_LENGTH));
+			else
+				ASSERT(!memcmp(flat_hash, expected_sha256,
+					       SHA256_DIGEST_LENGTH));
+			free(d);
+		}
+
+		/* Other functions don't support a flat hash. */
+		libfsverity_set_error_callback(NULL);
+		params.num_threads = 0;
+		params.hash_impl = LIBFSVERITY_HASH_IMPL_AUTO;
+		ASSERT(libfsverity_digest_ctx_new(&params, &ctx) == -EINVAL);
+		install_libfsverity_error_handler();
+		free(expected);
+	}
+}
+
+/*
+ * Test that skipping the holes reported by zero_range_fn produces exactly the
+ * same Merkle tree and fs-verity descriptor as reading them.  The holes that
+ * contain whole blocks are filled with garbage, which must not be read.
+ */
+static void test_zero_range_fn(void)
+{
+	static const struct hole holes_1[] = {
+		{ 0, 8192 }, { 20000, 20001 }, { 65536, 598016 },
+		{ 600000, 600100 }, { 700416, 1000000 },
+	};
+	static const struct hole holes_2[] = {
+		{ 0, 16 << 20 },
+	};
+	static const struct {
+		u32 hash_algorithm;
+		u32 block_size;
+		u64 file_size;
+		const struct hole *holes;
+		size_t num_holes;
+	} cases[] = {
+		{ FS_VERITY_HASH_ALG_SHA256, 4096, 1000000,
+		  holes_1, ARRAY_SIZE(holes_1) },
+		{ FS_VERITY_HASH_ALG_SHA256, 1024, 1000000,
+		  holes_1, ARRAY_SIZE(holes_1) },
+		{ FS_VERITY_HASH_ALG_SHA512, 1024, 1000000,
+		  holes_1, ARRAY_SIZE(holes_1) },
+		{ FS_VERITY_HASH_ALG_SHA256, 1024, 16 << 20,
+		  holes_2, ARRAY_SIZE(holes_2) },
+	};
+	struct libfsverity_digest *d;
+	size_t i, j;
+
+	for (i = 0; i < ARRAY_SIZE(cases); i++) {
+		struct libfsverity_merkle_tree_params params = {
+			.version = 1,
+			.hash_algorithm = cases[i].hash_algorithm,
+			.block_size = cases[i].block_size,
+			.file_size = cases[i].file_size,
+		};
+		struct sparse_file sf = {
+			.f = {
+				.data = xmalloc(cases[i].file_size),
+				.size = cases[i].file_size,
+			},
+			.holes = cases[i].holes,
+			.num_holes = cases[i].num_holes,
+		};
+		struct tree_output expected, actual;
+		u8 expected_flat_hash[SHA256_DIGEST_LENGTH];
+		u8 flat_hash[SHA256_DIGEST_LENGTH];
+		int variant;
+
+		for (j = 0; j < sf.f.size; j++)
+			sf.f.data[j] = (j % 251) + 1;
+		for (j = 0; j < sf.num_holes; j++)
+			memset(&sf.f.data[sf.holes[j].start], 0,
+			       sf.holes[j].end - sf.holes[j].start);
+		compute_tree(&sf.f, &params, &expected);
+		SHA256(sf.f.data, sf.f.size, expected_flat_hash);
+
+		for (j = 0; j < sf.num_holes; j++) {
+			u64 start = roundup(sf.holes[j].start, 4096);
+			u64 end = sf.holes[j].end & ~4095;
+
+			if (sf.holes[j].end == sf.f.size)
+				end = sf.f.size;
+			if (end > start)
+				memset(&sf.f.data[start], 0xff, end - start);
+		}
+		params.pread_fn = pread_fn;
+		params.zero_range_fn = zero_range_fn;
+		for (variant = 0; variant < 4; variant++) {
+			params.num_threads = (variant & 1) ? 3 : 1;
+			params.read_chunk_size = (variant & 2) ? 1 << 20 : 0;
+			compute_tree(&sf.f, &params, &actual);
+			ASSERT(actual.merkle_tree_size ==
+			       expected.merkle_tree_size);
+			ASSERT(!memcmp(actual.merkle_tree, expected.merkle_tree,
+				       expected.merkle_tree_size));
+			ASSERT(!memcmp(actual.descriptor, expected.descriptor,
+				       sizeof(expected.descriptor)));
+			free(actual.merkle_tree);
+		}
+		free(expected.merkle_tree);
+
+		/*
+		 * Without metadata callbacks, the digest is the same too, and
+		 * the holes are included in the flat hash.
+		 */
+		sf.f.offset = 0;
+		params.flat_hash_algorithm = FS_VERITY_HASH_ALG_SHA256;
+		params.flat_hash = flat_hash;
+		ASSERT(libfsverity_compute_digest(&sf, NULL, &params, &d) == 0);
+		ASSERT(!memcmp(flat_hash, expected_flat_hash,
+			       sizeof(flat_hash)));
+		free(d);
+		free(sf.f.data);
+	}
+
+	/* zero_range_fn requires pread_fn, and its ranges must be valid. */
+	{
+		u8 data[4096] = {};
+		struct sparse_file sf = {
+			.f = { .data = data, .size = sizeof(data) },
+		};
+		struct libfsverity_merkle_tree_params params = {
+			.version = 1,
+			.file_size = sizeof(data),
+			.zero_range_fn = zero_range_fn,
+		};
+
+		libfsverity_set_error_callback(NULL);
+		ASSERT(libfsverity_compute_digest(&sf, read_fn, &params,
+						  &d) == -EINVAL);
+		params.pread_fn = pread_fn;
+		params.zero_range_fn = bad_zero_range_fn;
+		ASSERT(libfsverity_compute_digest(&sf, NULL, &params,
+						  &d) == -EINVAL);
+		install_libfsverity_error_handler();
+	}
+}
+
+/*
+ * Test that remembering the hashes of repeated blocks produces exactly the same
+ * Merkle tree and fs-verity descriptor as hashing every block, and that the
+ * statistics of the memo add up.
+ */
+static void test_block_memo(void)
+{
+	static const struct {
+		u32 hash_algorithm;
+		u32 block_size;
+		u64 memo_size;
+	} cases[] = {
+		{ FS_VERITY_HASH_ALG_SHA256, 1024, 1 << 20 },
+		{ FS_VERITY_HASH_ALG_SHA512, 4096, 1 << 20 },
+		/* A memo with few entries, so that blocks evict each other */
+		{ FS_VERITY_HASH_ALG_SHA256, 1024, 20000 },
+		/* Larger than needed, so it's limited to the number of blocks */
+		{ FS_VERITY_HASH_ALG_SHA256, 1024, 1ULL << 40 },
+	};
+	const size_t file_size = 3 << 20;
+	struct mem_file f = { .data = xmalloc(file_size), .size = file_size };
+	struct libfsverity_digest_ctx *ctx;
+	size_t i, j;
+	int variant;
+
+	/*
+	 * Every 7th 1024-byte block is unique, every 13th one is zero, and the
+	 * rest are copies of 3 different blocks.  The last block is partial.
+	 */
+	for (i = 0; i < file_size; i += 1024) {
+		for (j = 0; j < 1024; j++) {
+			if ((i / 1024) % 7 == 0)
+				f.data[i + j] = (i / 1024) * 31 + j;
+			else if ((i / 1024) % 13 == 0)
+				f.data[i + j] = 0;
+			else
+				f.data[i + j] = ((i / 1024) % 3 + 1) * j;
+		}
+	}
+
+	for (i = 0; i < ARRAY_SIZE(cases); i++) {
+		struct libfsverity_merkle_tree_params params = {
+			.version = 1,
+			.hash_algorithm = cases[i].hash_algorithm,
+			.block_size = cases[i].block_size,
+			.file_size = file_size - 100,
+		};
+		struct libfsverity_digest *expected_digest;
+		struct tree_output expected, actual;
+
+		f.size = params.file_size;
+		compute_tree(&f, &params, &expected);
+		ASSERT(libfsverity_compute_digest_buffer(f.data, &params,
+							 &expected_digest) == 0);
+
+		params.memo_size = cases[i].memo_size;
+		for (variant = 0; variant < 3; variant++) {
+			struct libfsverity_memo_stats stats = {};
+			struct libfsverity_digest *d;
+
+			params.memo_stats = &stats;
+			params.num_threads = (variant == 1) ? 3 : 0;
+			params.pread_fn = (variant == 1) ? pread_fn : NULL;
+			if (variant == 2) {
+				ASSERT(libfsverity_compute_digest_buffer(
+						f.data, &params, &d) == 0);
+				ASSERT(!memcmp(d->digest,
+					       expected_digest->digest,
+					       d->digest_size));
+				free(d);
+			} else {
+				compute_tree(&f, &params, &actual);
+				ASSERT(actual.merkle_tree_size ==
+				       expected.merkle_tree_size);
+				ASSERT(!memcmp(actual.merkle_tree,
+					       expected.merkle_tree,
+					       expected.merkle_tree_size));
+				ASSERT(!memcmp(actual.descriptor,
+					       expected.descriptor,
+					       sizeof(expected.descriptor)));
+				free(actual.merkle_tree);
+			}
+			ASSERT(stats.hits > 0);
+			ASSERT(stats.hits <= stats.lookups);
+			ASSERT(stats.mismatches == 0);
+		}
+		free(expected_digest);
+		free(expected.merkle_tree);
+	}
+
+	/* A memo too small for even 2 blocks is silently not used. */
+	{
+		struct libfsverity_merkle_tree_params params = {
+			.version = 1,
+			.file_size = file_size,
+			.memo_size = 4096,
+		};
+		struct libfsverity_memo_stats stats = {};
+		struct libfsverity_digest *d;
+
+		params.memo_stats = &stats;
+		ASSERT(libfsverity_compute_digest_buffer(f.data, &params,
+							 &d) == 0);
+		ASSERT(stats.lookups == 0);
+		free(d);
+
+		/* Other functions don't support the memo. */
+		libfsverity_set_error_callback(NULL);
+		ASSERT(libfsverity_digest_ctx_new(&params, &ctx) == -EINVAL);
+		install_libfsverity_error_handler();
+	}
+	free(f.data);
+}
+
 int main(int argc, char *argv[])
 {
 	const bool update = (argc == 2 && !strcmp(argv[1], "--update"));
@@ -398,6 +2134,8 @@ int main(int argc, char *argv[])
 	f.data = xmalloc(f.size);
 	for (i = 0; i < f.size; i++)
 		f.data[i] = (i % 11) + (i % 439) + (i % 1103);
+	test_multithreaded(&f);
+	test_update_merkle_tree(&f);
 
 	for (i = 0; i < ARRAY_SIZE(test_cases); i++) {
 		u32 expected_alg = test_cases[i].hash_algorithm ?:
@@ -430,14 +2168,30 @@ int main(int argc, char *argv[])
 		free(d);
 		d = NULL;
 	}
-	free(f.data);
 	if (update) {
+		free(f.data);
 		printf("\t}\n");
 		return 1;
 	}
+	test_hash_impls(&f);
+	test_compute_digest_buffer(&f);
+	test_read_chunk_size(&f);
+	test_async_reader(&f);
+	test_openssl_libctx(&f);
+	test_partial_tree(&f);
+	test_digest_ctx(&f);
+	test_hasher(&f);
+	test_hasher_digest_buffers(&f);
+	test_compute_digest_multi(&f);
+	test_flat_hash(&f);
+	test_compute_digests(&f);
+	free(f.data);
 
 	test_invalid_params();
 	test_metadata_callbacks();
+	test_zero_blocks();
+	test_zero_range_fn();
+	test_block_memo();
 	printf("test_compute_digest passed\n");
 	return 0;
 }
@@ -50,9 +50,10 @@ char *xstrdup(const char *s)
 
 /* ========== Error messages and assertions ========== */
 
-static void do_error_msg(const char *format, va_list va, int err)
+static void do_error_msg(const char *prefix, const char *format, va_list va,
+			 int err)
 {
-	fputs("ERROR: ", stderr);
+	fputs(prefix, stderr);
 	vfprintf(stderr, format, va);
 	if (err)
 		fprintf(stderr, ": %s", strerror(err));
@@ -64,7 +65,7 @@ void error_msg(const char *format, ...)
 	va_list va;
 
 	va_start(va, format);
-	do_error_msg(format, va, 0);
+	do_error_msg("ERROR: ", format, va, 0);
 	va_end(va);
 }
 
@@ -73,7 +74,16 @@ void error_msg_errno(const char *format, ...)
 	va_list va;
 
 	va_start(va, format);
-	do_error_msg(format, va, errno);
+	do_error_msg("ERROR: ", format, va, errno);
+	va_end(va);
+}
+
+void warning_msg(const char *format, ...)
+{
+	va_list va;
+
+	va_start(va, format);
+	do_error_msg("WARNING: ", format, va, 0);
 	va_end(va);
 }
 
@@ -82,7 +92,7 @@ __noreturn void fatal_error(const char *format, ...)
 	va_list va;
 
 	va_start(va, format);
-	do_error_msg(format, va, 0);
+	do_error_msg("ERROR: ", format, va, 0);
 	va_end(va);
 	abort();
 }
@@ -118,6 +128,20 @@ bool open_file(struct filedes *file, const char *filename, int flags, int mode)
 	return true;
 }
 
+/* Make @file refer to standard input, for reading binary data from it. */
+bool open_stdin(struct filedes *file)
+{
+	file->fd = STDIN_FILENO;
+#ifdef _WIN32
+	if (_setmode(file->fd, O_BINARY) == -1) {
+		error_msg_errno("can't read binary data from standard input");
+		return false;
+	}
+#endif
+	file->name = xstrdup("standard input");
+	return true;
+}
+
 bool get_file_size(struct filedes *file, u64 *size_ret)
 {
 	struct stat stbuf;
@@ -130,6 +154,46 @@ bool get_file_size(struct filedes *file, u64 *size_ret)
 	return true;
 }
 
+/*
+ * Set how pread_callback() reads @file.  IO_MODE_DONTNEED and IO_MODE_DIRECT
+ * both avoid leaving the file's data in the page cache, where it could evict
+ * data that other programs are using.  If the filesystem doesn't support direct
+ * I/O, IO_MODE_DONTNEED is used instead.
+ */
+bool set_io_mode(struct filedes *file, enum io_mode mode)
+{
+#if defined(O_DIRECT) && !defined(_WIN32)
+	if (mode == IO_MODE_DIRECT) {
+		int flags = fcntl(file->fd, F_GETFL);
+
+		if (flags < 0 ||
+		    fcntl(file->fd, F_SETFL, flags | O_DIRECT) != 0) {
+			if (errno != EINVAL) {
+				error_msg_errno("can't use direct I/O on '%s'",
+						file->name);
+				return false;
+			}
+			mode = IO_MODE_DONTNEED;
+		}
+	}
+#else
+	if (mode == IO_MODE_DIRECT)
+		mode = IO_MODE_DONTNEED;
+#endif
+	if (mode == IO_MODE_DONTNEED) {
+#ifdef POSIX_FADV_DONTNEED
+		/* This is only a hint, so ignore any error. */
+		posix_fadvise(file->fd, 0, 0, POSIX_FADV_SEQUENTIAL);
+#else
+		error_msg("can't avoid caching '%s' on this platform",
+			  file->name);
+		return false;
+#endif
+	}
+	file->io_mode = mode;
+	return true;
+}
+
 bool preallocate_file(struct filedes *file, u64 size)
 {
 	int res;
@@ -184,6 +248,46 @@ bool full_write(struct filedes *file, const void *buf, size_t count)
 	return true;
 }
 
+static int raw_pread(int fd, void *buf, int count, u64 offset)
+{
+#ifdef _WIN32
+	HANDLE h = (HANDLE)_get_osfhandle(fd);
+	OVERLAPPED pos = { .Offset = offset, .OffsetHigh = offset >> 32 };
+	DWORD n = 0;
+
+	/* Not exactly the same as pread(), but good enough... */
+	if (!ReadFile(h, buf, count, &n, &pos)) {
+		if (GetLastError() == ERROR_HANDLE_EOF)
+			return 0;
+		errno = EIO;
+		return -1;
+	}
+	return n;
+#else
+	return pread(fd, buf, count, offset);
+#endif
+}
+
+bool full_pread(struct filedes *file, void *buf, size_t count, u64 offset)
+{
+	while (count) {
+		int n = raw_pread(file->fd, buf, min(count, INT_MAX), offset);
+
+		if (n < 0) {
+			error_msg_errno("reading from '%s'", file->name);
+			return false;
+		}
+		if (n == 0) {
+			error_msg("unexpected end-of-file on '%s'", file->name);
+			return false;
+		}
+		buf += n;
+		count -= n;
+		offset += n;
+	}
+	return true;
+}
+
 static int raw_pwrite(int fd, const void *buf, int count, u64 offset)
 {
 #ifdef _WIN32
@@ -242,6 +346,147 @@ int read_callback(void *file, void *buf, size_t count)
 	return 0;
 }
 
+#if defined(O_DIRECT) && !defined(_WIN32)
+/* The alignment that direct I/O needs, which is the most any device needs */
+#define DIRECT_IO_ALIGNMENT	4096
+
+/*
+ * Read from a file that was opened with O_DIRECT.  The buffer, file offset, and
+ * length must be aligned, so read the aligned region that contains the
+ * requested range into a bounce buffer, then copy out the requested part.
+ */
+static bool direct_pread(struct filedes *file, void *buf, size_t count,
+			 u64 offset)
+{
+	const u64 start = offset & ~(u64)(DIRECT_IO_ALIGNMENT - 1);
+	const size_t head = offset - start;
+	const size_t len = (head + count + DIRECT_IO_ALIGNMENT - 1) &
+			   ~(size_t)(DIRECT_IO_ALIGNMENT - 1);
+	size_t done = 0;
+	void *bounce;
+	bool ok = false;
+
+	if (posix_memalign(&bounce, DIRECT_IO_ALIGNMENT, len) != 0)
+		fatal_error("out of memory");
+	/* At the end of the file, the reads can be short. */
+	while (done < head + count) {
+		int n = pread(file->fd, bounce + done,
+			      min(len - done, (size_t)1 << 30), start + done);
+
+		if (n < 0) {
+			error_msg_errno("reading from '%s'", file->name);
+			goto out;
+		}
+		if (n == 0) {
+			error_msg("unexpected end-of-file on '%s'", file->name);
+			goto out;
+		}
+		done += n;
+	}
+	memcpy(buf, bounce + head, count);
+	ok = true;
+out:
+	free(bounce);
+	return ok;
+}
+#else
+/* set_io_mode() never selects IO_MODE_DIRECT on this platform. */
+static bool direct_pread(struct filedes *file, void *buf, size_t count,
+			 u64 offset)
+{
+	return full_pread(file, buf, count, offset);
+}
+#endif /* !(O_DIRECT && !_WIN32) */
+
+/* The maximum size of the page cache's large folios, on most systems */
+#define DONTNEED_ALIGNMENT	(2U << 20)
+
+int pread_callback(void *_file, void *buf, size_t count, u64 offset)
+{
+	struct filedes *file = _file;
+	bool ok;
+
+	errno = 0;
+	if (file->io_mode == IO_MODE_DIRECT)
+		ok = direct_pread(file, buf, count, offset);
+	else
+		ok = full_pread(file, buf, count, offset);
+	if (!ok)
+		return errno ? -errno : -EIO;
+#ifdef POSIX_FADV_DONTNEED
+	if (file->io_mode == IO_MODE_DONTNEED) {
+		/*
+		 * Pages that straddle the start or end of the range aren't
+		 * dropped.  To drop the ones at the end once the next range has
+		 * been read, extend the range backwards to a boundary that
+		 * large folios don't cross.
+		 */
+		u64 start = offset & ~(u64)(DONTNEED_ALIGNMENT - 1);
+
+		posix_fadvise(file->fd, start, offset + count - start,
+			      POSIX_FADV_DONTNEED);
+	}
+#endif
+	return 0;
+}
+
+#ifdef __linux__
+int splice_callback(void *_file, int pipe_fd, size_t count, u64 offset)
+{
+	struct filedes *file = _file;
+	loff_t off = offset;
+
+	while (count) {
+		ssize_t n = splice(file->fd, &off, pipe_fd, NULL, count,
+				   SPLICE_F_MOVE);
+
+		if (n < 0) {
+			int err = -errno;
+
+			error_msg_errno("reading from '%s'", file->name);
+			return err;
+		}
+		if (n == 0) {
+			error_msg("unexpected end-of-file on '%s'", file->name);
+			return -EIO;
+		}
+		count -= n;
+	}
+	return 0;
+}
+#endif /* __linux__ */
+
+#ifdef SEEK_HOLE
+/* Report the file's holes, which read as zeroes, using SEEK_HOLE/SEEK_DATA */
+int zero_range_callback(void *_file, u64 offset, u64 *start_ret, u64 *end_ret)
+{
+	struct filedes *file = _file;
+	off_t start, end;
+	int err;
+
+	start = lseek(file->fd, offset, SEEK_HOLE);
+	if (start < 0)
+		goto err;
+	end = lseek(file->fd, start, SEEK_DATA);
+	if (end < 0) {
+		if (errno != ENXIO)
+			goto err;
+		/* The hole extends to the end of the file. */
+		end = lseek(file->fd, 0, SEEK_END);
+		if (end < 0)
+			goto err;
+	}
+	*start_ret = start;
+	*end_ret = end;
+	return 0;
+
+err:
+	err = -errno;
+	error_msg_errno("finding holes in '%s'", file->name);
+	return err;
+}
+#endif /* SEEK_HOLE */
+
 /* ========== String utilities ========== */
 
 static int hex2bin_char(char c)
@@ -25,6 +25,7 @@ char *xstrdup(const char *s);
 
 __printf(1, 2) __cold void error_msg(const char *format, ...);
 __printf(1, 2) __cold void error_msg_errno(const char *format, ...);
+__printf(1, 2) __cold void warning_msg(const char *format, ...);
 __printf(1, 2) __cold __noreturn void fatal_error(const char *format, ...);
 __cold __noreturn void assertion_failed(const char *expr,
 					const char *file, int line);
@@ -33,20 +34,38 @@ __cold __noreturn void assertion_failed(const char *expr,
 
 void install_libfsverity_error_handler(void);
 
+/* How the data of a file being hashed is read; see set_io_mode() */
+enum io_mode {
+	IO_MODE_BUFFERED,	/* normal reads through the page cache */
+	IO_MODE_DONTNEED,	/* drop the data from the page cache once read */
+	IO_MODE_DIRECT,		/* bypass the page cache using O_DIRECT */
+};
+
 struct filedes {
 	int fd;
 	char *name;		/* filename, for logging or error messages */
+	enum io_mode io_mode;	/* honored by pread_callback() */
 };
 
 bool open_file(struct filedes *file, const char *filename, int flags, int mode);
+bool open_stdin(struct filedes *file);
 bool get_file_size(struct filedes *file, u64 *size_ret);
+bool set_io_mode(struct filedes *file, enum io_mode mode);
 bool preallocate_file(struct filedes *file, u64 size);
 bool full_read(struct filedes *file, void *buf, size_t count);
+bool full_pread(struct filedes *file, void *buf, size_t count, u64 offset);
 bool full_write(struct filedes *file, const void *buf, size_t count);
 bool full_pwrite(struct filedes *file, const void *buf, size_t count,
 		 u64 offset);
 bool filedes_close(struct filedes *file);
 int read_callback(void *file, void *buf, size_t count);
+int pread_callback(void *file, void *buf, size_t count, u64 offset);
+#ifdef __linux__
+int splice_callback(void *file, int pipe_fd, size_t count, u64 offset);
+#endif
+#ifdef SEEK_HOLE
+int zero_range_callback(void *file, u64 offset, u64 *start_ret, u64 *end_ret);
+#endif
 
 bool hex2bin(const char *hex, u8 *bin, size_t bin_len);
 void bin2hex(const u8 *bin, size_t bin_len, char *hex);
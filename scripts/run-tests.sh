@@ -91,6 +91,39 @@ EOF
 }
 TEST_FUNCS+=(cplusplus_test)
 
+no_openssl_hashing_test()
+{
+	log "Build and test with NO_OPENSSL_HASHING=1"
+	$MAKE CFLAGS="-O2 -Werror" NO_OPENSSL_HASHING=1 check
+
+	log "Check that computing a digest doesn't require libcrypto"
+	cat > "$TMPDIR/test.c" <<EOF
+#include <libfsverity.h>
+#include <string.h>
+static int read_fn(void *fd, void *buf, size_t count)
+{
+	memset(buf, 0, count);
+	return 0;
+}
+int main(void)
+{
+	struct libfsverity_merkle_tree_params params = {
+		.version = 1,
+		.hash_algorithm = FS_VERITY_HASH_ALG_SHA512,
+		.file_size = 1000000,
+	};
+	struct libfsverity_digest *digest;
+
+	return libfsverity_compute_digest(NULL, read_fn, &params, &digest);
+}
+EOF
+	cc -Wall "$TMPDIR/test.c" -Iinclude libfsverity.a -pthread \
+		-o "$TMPDIR/test"
+	"$TMPDIR/test"
+	rm "${TMPDIR:?}"/*
+}
+TEST_FUNCS+=(no_openssl_hashing_test)
+
 untracked_files_test()
 {
 	log "Check that build doesn't produce untracked files"